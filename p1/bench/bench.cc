@@ -0,0 +1,691 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <libgen.h>
+#include <new>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "../common/protocol.h"
+#include "../common/slab.h"
+
+#include "../server/authrecord.h"
+#include "../server/blob_store.h"
+#include "../server/concurrenthashmap.h"
+#include "../server/map_factories.h"
+#include "../server/wal.h"
+
+using namespace std;
+
+/// The auth table type that the benchmarks measure.  They use it directly, so
+/// that they can compare its templated methods to the Map interface.
+typedef ConcurrentHashMap<string, AuthRecord> authtable_t;
+
+/// The number of calls to operator new since the program started.  We count
+/// them so that the benchmark can report allocations per operation.
+static atomic<size_t> num_allocs(0);
+
+// NB: The replacement new/delete operators are noinline, because g++ warns
+//     about mismatched new/free when it inlines them into their callers
+
+/// Count every allocation, and then forward it to malloc
+__attribute__((noinline)) void *operator new(size_t size) {
+  num_allocs.fetch_add(1, memory_order_relaxed);
+  void *p = malloc(size);
+  if (p == nullptr)
+    throw bad_alloc();
+  return p;
+}
+
+/// Forward deallocations to free
+__attribute__((noinline)) void operator delete(void *p) noexcept { free(p); }
+
+/// Forward sized deallocations to free
+__attribute__((noinline)) void operator delete(void *p, size_t) noexcept {
+  free(p);
+}
+
+/// Split a comma-separated list
+///
+/// @param list The list
+///
+/// @return The items of the list
+static vector<string> split_list(const string &list) {
+  vector<string> items;
+  stringstream ss(list);
+  for (string item; getline(ss, item, ',');)
+    if (!item.empty())
+      items.push_back(item);
+  return items;
+}
+
+/// arg_t represents the command-line arguments to the benchmark
+struct arg_t {
+  size_t buckets = 1024; // Number of buckets for the map
+  size_t keys = 65536;   // Number of keys to put in the map
+  size_t ops = 4194304;  // Number of operations to time for each test
+  size_t threads = 0;    // Most threads for YCSB mixes (0: one per core)
+  vector<size_t> key_counts; // Key counts for YCSB mixes (default: keys)
+  vector<string> mixes = {"read", "write", "scan", "insert"}; // YCSB mixes
+  bool zipf = false;      // Use a zipfian key distribution for YCSB
+  bool ycsb_only = false; // Only run the YCSB mixes
+
+  /// Construct an arg_t from the command-line arguments to the program
+  ///
+  /// @param argc The number of command-line arguments passed to the program
+  /// @param argv The list of command-line arguments
+  ///
+  /// @throw An integer exception (1) if an invalid argument is given, or if
+  ///        `-h` is passed in
+  arg_t(int argc, char **argv) {
+    long opt;
+    while ((opt = getopt(argc, argv, "b:k:o:t:m:zyh")) != -1) {
+      switch (opt) {
+      case 'b':
+        buckets = atoi(optarg);
+        break;
+      case 'k':
+        for (auto &k : split_list(optarg))
+          key_counts.push_back(atoi(k.c_str()));
+        if (key_counts.empty())
+          throw 1;
+        keys = key_counts.front();
+        break;
+      case 'o':
+        ops = atoi(optarg);
+        break;
+      case 't':
+        threads = atoi(optarg);
+        break;
+      case 'm':
+        mixes = split_list(optarg);
+        break;
+      case 'z':
+        zipf = true;
+        break;
+      case 'y':
+        ycsb_only = true;
+        break;
+      default: // on any error, print a help message.  This case subsumes `-h`
+        throw 1;
+      }
+    }
+    if (key_counts.empty())
+      key_counts.push_back(keys);
+    if (threads == 0)
+      threads = max(thread::hardware_concurrency(), 1u);
+    for (auto k : key_counts)
+      if (k == 0)
+        throw 1;
+    for (auto &m : mixes)
+      if (m != "read" && m != "write" && m != "scan" && m != "insert")
+        throw 1;
+    if (ops == 0)
+      throw 1;
+  }
+
+  /// Display a help message to explain how the command-line parameters for this
+  /// program work
+  ///
+  /// @progname The name of the program
+  static void usage(char *progname) {
+    cout << basename(progname) << ": auth table microbenchmarks\n"
+         << "  -b [int]  # of buckets in the map\n"
+         << "  -k [list] # of keys to insert before timing (comma-separated;\n"
+         << "            YCSB mixes run once per count, others use the first)\n"
+         << "  -o [int]  # of operations to time for each test\n"
+         << "  -t [int]  Most threads for YCSB mixes (runs 1, 2, 4, ..., -t)\n"
+         << "  -m [list] YCSB mixes to run: read, write, scan, insert\n"
+         << "  -z        Use zipfian (not uniform) keys for the YCSB mixes\n"
+         << "  -y        Only run the YCSB mixes\n"
+         << "  -h        Print help (this message)\n";
+  }
+};
+
+/// Time a loop of operations, and report the time and allocations per
+/// operation
+///
+/// @param name The name to print for this test
+/// @param ops  The number of operations to run
+/// @param op   The operation to run; it receives the iteration number
+/// @param per  The number of keys each operation works on.  Results are
+///             reported per key.
+template <typename F>
+void time_ops(const string &name, size_t ops, F &&op, size_t per = 1) {
+  size_t allocs = num_allocs.load();
+  auto start = chrono::steady_clock::now();
+  for (size_t i = 0; i < ops; ++i)
+    op(i);
+  auto end = chrono::steady_clock::now();
+  allocs = num_allocs.load() - allocs;
+  double ns = chrono::duration<double, nano>(end - start).count();
+  cout << name << ": " << ns / (ops * per) << " ns/op, "
+       << (double)allocs / (ops * per) << " allocs/op\n";
+}
+
+/// Fill an auth table with users named user0, user1, ...
+///
+/// @param table The table to fill
+/// @param keys  The number of users to insert
+///
+/// @return The names of the users
+vector<string> populate(authtable_t &table, size_t keys) {
+  vector<string> names(keys);
+  for (size_t i = 0; i < keys; ++i) {
+    names[i] = "user" + to_string(i);
+    AuthRecord e;
+    e.set_name(names[i]);
+    memset(e.salt, (uint8_t)i, LEN_SALT);
+    memset(e.pass_hash, (uint8_t)i, LEN_PASSHASH);
+    table.insert_with(names[i], move(e), []() {});
+  }
+  return names;
+}
+
+/// Make the entries for users named user0, user1, ...
+///
+/// @param keys The number of users
+///
+/// @return The users' names and entries
+vector<pair<string, AuthRecord>> make_entries(size_t keys) {
+  vector<pair<string, AuthRecord>> entries(keys);
+  for (size_t i = 0; i < keys; ++i) {
+    entries[i].first = "user" + to_string(i);
+    entries[i].second.set_name(entries[i].first);
+    memset(entries[i].second.salt, (uint8_t)i, LEN_SALT);
+    memset(entries[i].second.pass_hash, (uint8_t)i, LEN_PASSHASH);
+  }
+  return entries;
+}
+
+/// Compare bulk inserts (as done by load_file) and bulk lookups done one key
+/// at a time to the same work done with the batch methods.  Lookups visit the
+/// keys in a scattered order, so that most of them miss in the cache.
+///
+/// @param args The command-line arguments
+void bench_batch(const arg_t &args) {
+  const size_t BATCH = 256;
+  size_t batches = (args.keys + BATCH - 1) / BATCH;
+  {
+    authtable_t table(args.buckets);
+    auto entries = make_entries(args.keys);
+    time_ops("authtable_t::insert_with (one key at a time)", args.keys,
+             [&](size_t i) {
+               table.insert_with(move(entries[i].first),
+                                 move(entries[i].second), []() {});
+             });
+  }
+  {
+    authtable_t table(args.buckets);
+    auto entries = make_entries(args.keys);
+    time_ops("authtable_t::insert_batch_with (whole table)", 1, [&](size_t) {
+      table.insert_batch_with(entries, [](const string &) {});
+    }, args.keys);
+  }
+  authtable_t table(args.buckets);
+  vector<string> names = populate(table, args.keys);
+  vector<string_view> order(args.keys);
+  for (size_t i = 0; i < args.keys; ++i)
+    order[i] = names[(i * 2654435761u) % args.keys];
+  size_t found = 0, rounds = max<size_t>(args.ops / args.keys, 1);
+  time_ops("authtable_t::visit_readonly (one key at a time)", rounds * batches,
+           [&](size_t b) {
+             size_t from = (b % batches) * BATCH;
+             size_t to = min(from + BATCH, order.size());
+             for (size_t i = from; i < to; ++i)
+               table.visit_readonly(order[i], [&](const AuthRecord &e) {
+                 found += e.salt[0];
+               });
+           }, BATCH);
+  vector<string_view> batch;
+  time_ops("authtable_t::visit_readonly_many (256 keys)", rounds * batches,
+           [&](size_t b) {
+             size_t from = (b % batches) * BATCH;
+             size_t to = min(from + BATCH, order.size());
+             batch.assign(order.begin() + from, order.begin() + to);
+             table.visit_readonly_many(
+                 batch, [&](size_t, const AuthRecord &e) {
+                   found += e.salt[0];
+                 });
+           }, BATCH);
+  // Keep the compiler from optimizing the loops away
+  if (found == 0)
+    cout << "unreachable\n";
+}
+
+/// Measure concurrent inserts of new users (as done by REG), one thread per
+/// core, and report the slab allocator's allocation rate and fragmentation
+/// afterwards.  Half of the users are then removed, to show how much of the
+/// slab memory is left for reuse.
+///
+/// @param args The command-line arguments
+void bench_alloc(const arg_t &args) {
+  authtable_t table(args.buckets);
+  size_t per_thread = max<size_t>(args.keys / args.threads, 1);
+  vector<vector<pair<string, AuthRecord>>> entries(args.threads);
+  for (size_t t = 0; t < args.threads; ++t) {
+    entries[t] = make_entries(per_thread);
+    for (auto &e : entries[t])
+      e.first += "_" + to_string(t);
+  }
+  slab_stats_t before = slab_stats();
+  auto start = chrono::steady_clock::now();
+  vector<thread> threads;
+  for (size_t t = 0; t < args.threads; ++t)
+    threads.emplace_back([&, t]() {
+      for (auto &e : entries[t])
+        table.insert_with(move(e.first), move(e.second), []() {});
+    });
+  for (auto &t : threads)
+    t.join();
+  auto end = chrono::steady_clock::now();
+  double sec = chrono::duration<double>(end - start).count();
+  auto report = [&](const string &name) {
+    slab_stats_t s = slab_stats();
+    cout << name << ": " << s.live_bytes / 1048576.0 << " MB live, "
+         << s.span_bytes / 1048576.0 << " MB in spans, "
+         << s.fragmentation() * 100 << "% fragmentation, " << s.remote_frees
+         << " remote frees\n";
+  };
+  cout << per_thread * args.threads << " concurrent inserts on "
+       << args.threads << " threads: "
+       << (slab_stats().allocs - before.allocs) / sec / 1e6
+       << " M slab allocs/sec\n";
+  report("slab after the inserts");
+  for (size_t i = 0; i < per_thread * args.threads; i += 2)
+    table.remove_with("user" + to_string(i / args.threads) + "_" +
+                          to_string(i % args.threads),
+                      []() {});
+  report("slab after removing half of them");
+}
+
+/// Compare the virtual, std::function-based Map interface, the virtual
+/// map_ref-based Map interface, and the templated visitor methods of the
+/// concrete auth table type, for the same lookups.
+///
+/// @param args The command-line arguments
+void bench_visit(const arg_t &args) {
+  authtable_t table(args.buckets);
+  Map<string, AuthRecord> *map = &table;
+  vector<string> names = populate(table, args.keys);
+
+  // NB: The lambdas capture three references, like MyStorage::auth() does,
+  //     which is too much state for std::function's small-object buffer
+  size_t found = 0, bytes = 0, mask = args.keys - 1;
+  bool pow2 = (args.keys & mask) == 0;
+  auto key = [&](size_t i) -> const string & {
+    return names[pow2 ? (i & mask) : (i % args.keys)];
+  };
+  time_ops("Map::do_with_readonly (std::function)", args.ops, [&](size_t i) {
+    map->do_with_readonly(key(i), [&](const AuthRecord &e) {
+      found += e.salt[0] == (uint8_t)i;
+      bytes += sizeof(e.pass_hash) + names.size();
+    });
+  });
+  time_ops("Map::do_with_readonly_ref (map_ref)", args.ops, [&](size_t i) {
+    map->do_with_readonly_ref(key(i), [&](const AuthRecord &e) {
+      found += e.salt[0] == (uint8_t)i;
+      bytes += sizeof(e.pass_hash) + names.size();
+    });
+  });
+  time_ops("authtable_t::visit_readonly (template)", args.ops, [&](size_t i) {
+    table.visit_readonly(key(i), [&](const AuthRecord &e) {
+      found += e.salt[0] == (uint8_t)i;
+      bytes += sizeof(e.pass_hash) + names.size();
+    });
+  });
+  time_ops("Map::do_with (std::function)", args.ops, [&](size_t i) {
+    map->do_with(key(i), [&](AuthRecord &e) {
+      e.salt[0] += found & 1;
+      bytes += sizeof(e.pass_hash) + names.size();
+    });
+  });
+  time_ops("Map::do_with_ref (map_ref)", args.ops, [&](size_t i) {
+    map->do_with_ref(key(i), [&](AuthRecord &e) {
+      e.salt[0] += found & 1;
+      bytes += sizeof(e.pass_hash) + names.size();
+      return true;
+    });
+  });
+  time_ops("authtable_t::visit (template)", args.ops, [&](size_t i) {
+    table.visit(key(i), [&](AuthRecord &e) {
+      e.salt[0] += found & 1;
+      bytes += sizeof(e.pass_hash) + names.size();
+    });
+  });
+  // Keep the compiler from optimizing the loops away
+  if (found + bytes == 0)
+    cout << "unreachable\n";
+}
+
+/// Measure the latency of writes (as done by SET) while another thread
+/// repeatedly scans the whole table (as done by ALL and SAV), once with the
+/// 2PL scan and once with the snapshot scan.  Reports latency percentiles for
+/// the writes, and the number of scans that completed during them.
+///
+/// @param args The command-line arguments
+void bench_scan(const arg_t &args) {
+  size_t ops = max<size_t>(args.ops / 16, 1);
+  auto run = [&](const string &name, bool snapshot) {
+    authtable_t table(args.buckets);
+    vector<string> names = populate(table, args.keys);
+    atomic<bool> stop(false);
+    atomic<size_t> scans(0);
+    thread scanner([&]() {
+      size_t bytes = 0;
+      auto f = [&](const string &k, const AuthRecord &e) {
+        bytes += k.size() + content_size(e.content);
+      };
+      while (!stop.load(memory_order_relaxed)) {
+        if (snapshot)
+          table.visit_all_snapshot(f);
+        else
+          table.visit_all_readonly(f, []() {});
+        scans.fetch_add(1, memory_order_relaxed);
+      }
+      if (bytes == 0)
+        cout << "unreachable\n";
+    });
+    vector<double> lat(ops);
+    vector<uint8_t> content(64, 'x');
+    for (size_t i = 0; i < ops; ++i) {
+      auto start = chrono::steady_clock::now();
+      table.visit(names[i % names.size()], [&](AuthRecord &e) {
+        e.content = make_content(content);
+      });
+      auto end = chrono::steady_clock::now();
+      lat[i] = chrono::duration<double, micro>(end - start).count();
+    }
+    stop = true;
+    scanner.join();
+    sort(lat.begin(), lat.end());
+    cout << name << ": p50 " << lat[ops / 2] << " us, p99 "
+         << lat[ops * 99 / 100] << " us, max " << lat[ops - 1] << " us, "
+         << scans.load() << " scans\n";
+  };
+  run("write latency during do_all_readonly scans (2PL)", false);
+  run("write latency during do_all_snapshot scans", true);
+}
+
+/// rng_t is a small, fast per-thread random number generator (splitmix64)
+struct rng_t {
+  uint64_t state; // The generator's state
+
+  /// Construct a generator from a seed
+  ///
+  /// @param seed The seed
+  rng_t(uint64_t seed) : state(seed) {}
+
+  /// Get the next random number
+  ///
+  /// @return A uniformly distributed 64-bit number
+  uint64_t next() {
+    uint64_t z = (state += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+  }
+
+  /// Get a random number in [0, 1)
+  ///
+  /// @return A uniformly distributed double
+  double next_double() { return (next() >> 11) * (1.0 / (uint64_t(1) << 53)); }
+};
+
+/// key_dist_t picks key indices in [0, n), either uniformly or with YCSB's
+/// scrambled zipfian distribution (theta = 0.99), in which a few keys are very
+/// hot, but the hot keys are spread around the table.
+struct key_dist_t {
+  size_t n;                             // The number of keys
+  bool zipf;                            // true for zipfian, false for uniform
+  double theta = 0.99;                  // The zipfian skew
+  double zetan = 0, alpha = 0, eta = 0; // Precomputed zipfian constants
+
+  /// Construct a distribution
+  ///
+  /// @param _n    The number of keys
+  /// @param _zipf true for zipfian, false for uniform
+  key_dist_t(size_t _n, bool _zipf) : n(_n), zipf(_zipf) {
+    if (!zipf)
+      return;
+    for (size_t i = 1; i <= n; ++i)
+      zetan += 1 / pow((double)i, theta);
+    double zeta2 = 1 + 1 / pow(2.0, theta);
+    alpha = 1 / (1 - theta);
+    eta = (1 - pow(2.0 / n, 1 - theta)) / (1 - zeta2 / zetan);
+  }
+
+  /// Pick a key index
+  ///
+  /// @param rng The calling thread's random number generator
+  ///
+  /// @return A key index in [0, n)
+  size_t next(rng_t &rng) const {
+    if (!zipf)
+      return rng.next() % n;
+    double u = rng.next_double(), uz = u * zetan;
+    size_t rank;
+    if (uz < 1)
+      rank = 0;
+    else if (uz < 1 + pow(0.5, theta))
+      rank = 1;
+    else
+      rank = (size_t)(n * pow(eta * u - eta + 1, alpha)) % n;
+    // Scramble, so that popular keys are not neighbors
+    return rng_t(rank).next() % n;
+  }
+};
+
+/// Run one YCSB-style mix against the auth table from authrecord_factory(),
+/// using the Map interface, and print one CSV line with its throughput and
+/// latency percentiles.
+///
+/// The mixes are:
+/// - read:   95% lookups (as done by AUTH), 5% updates (as done by SET)
+/// - write:  50% lookups, 50% updates
+/// - scan:   99% lookups, 1% full-table snapshot scans (as done by ALL)
+/// - insert: 100% inserts of new keys (as done by REG)
+///
+/// @param args    The command-line arguments
+/// @param mix     The name of the mix
+/// @param keys    The number of keys to load before timing
+/// @param threads The number of threads to run
+void run_ycsb(const arg_t &args, const string &mix, size_t keys,
+              size_t threads) {
+  Map<string, AuthRecord> *map = authrecord_factory(args.buckets);
+  vector<string> names(keys);
+  for (size_t i = 0; i < keys; ++i) {
+    names[i] = "user" + to_string(i);
+    AuthRecord e;
+    e.set_name(names[i]);
+    memset(e.salt, (uint8_t)i, LEN_SALT);
+    memset(e.pass_hash, (uint8_t)i, LEN_PASSHASH);
+    map->insert(names[i], move(e), []() {});
+  }
+  key_dist_t dist(keys, args.zipf);
+  unsigned read_pct = mix == "read" ? 95 : mix == "write" ? 50 : 99;
+  size_t per_thread = max<size_t>(args.ops / threads, 1);
+  vector<vector<uint32_t>> lat(threads, vector<uint32_t>(per_thread));
+  atomic<size_t> ready(0);
+  atomic<bool> go(false);
+
+  auto worker = [&](size_t t) {
+    rng_t rng(t + 1);
+    vector<uint8_t> content(64, (uint8_t)t);
+    size_t bytes = 0;
+    auto read = [&](const AuthRecord &e) { bytes += e.pass_hash[0]; };
+    auto scan = [&](const string &, const AuthRecord &e) {
+      bytes += e.pass_hash[0];
+    };
+    auto update = [&](AuthRecord &e) { e.content = make_content(content); };
+    // Build the names for inserts before timing starts
+    vector<string> fresh;
+    if (mix == "insert")
+      for (size_t i = 0; i < per_thread; ++i)
+        fresh.push_back("new" + to_string(t) + "_" + to_string(i));
+    ready.fetch_add(1);
+    while (!go.load())
+      this_thread::yield();
+    for (size_t i = 0; i < per_thread; ++i) {
+      auto start = chrono::steady_clock::now();
+      if (mix == "insert") {
+        AuthRecord e;
+        e.set_name(fresh[i]);
+        map->insert(fresh[i], move(e), []() {});
+      } else if (rng.next() % 100 < read_pct) {
+        map->do_with_readonly(names[dist.next(rng)], read);
+      } else if (mix == "scan") {
+        map->do_all_snapshot(scan);
+      } else {
+        map->do_with(names[dist.next(rng)], update);
+      }
+      auto end = chrono::steady_clock::now();
+      lat[t][i] =
+          chrono::duration_cast<chrono::nanoseconds>(end - start).count();
+    }
+    if (bytes == 1)
+      cout << "unlikely\n";
+  };
+
+  vector<thread> pool;
+  for (size_t t = 0; t < threads; ++t)
+    pool.emplace_back(worker, t);
+  while (ready.load() < threads)
+    this_thread::yield();
+  auto start = chrono::steady_clock::now();
+  go = true;
+  for (auto &th : pool)
+    th.join();
+  auto end = chrono::steady_clock::now();
+  delete map;
+
+  vector<uint32_t> all;
+  for (auto &l : lat)
+    all.insert(all.end(), l.begin(), l.end());
+  sort(all.begin(), all.end());
+  double secs = chrono::duration<double>(end - start).count();
+  auto pct = [&](double p) {
+    return all[min(all.size() - 1, (size_t)(p * all.size()))];
+  };
+  cout << mix << "," << (args.zipf ? "zipfian" : "uniform") << "," << threads
+       << "," << keys << "," << all.size() << ","
+       << (size_t)(all.size() / secs) << "," << pct(0.5) << "," << pct(0.99)
+       << "," << pct(0.999) << endl;
+}
+
+/// Run every requested YCSB mix, for every key count, with 1, 2, 4, ... up to
+/// the requested number of threads.  The results are printed as CSV.
+///
+/// @param args The command-line arguments
+void bench_ycsb(const arg_t &args) {
+  vector<size_t> thread_counts;
+  for (size_t t = 1; t < args.threads; t *= 2)
+    thread_counts.push_back(t);
+  thread_counts.push_back(args.threads);
+  cout << "mix,dist,threads,keys,ops,ops_per_sec,p50_ns,p99_ns,p999_ns\n";
+  for (auto &mix : args.mixes)
+    for (auto keys : args.key_counts)
+      for (auto t : thread_counts)
+        run_ycsb(args, mix, keys, t);
+}
+
+/// Measure reads of profile content through a blob_store whose memory budget
+/// holds a quarter of the content, so that cold content is spilled to a file
+/// and paged back in.  Reads use the YCSB key distribution (-z for zipfian).
+///
+/// @param args The command-line arguments
+void bench_tier(const arg_t &args) {
+  const size_t len = 4096;
+  size_t n = min<size_t>(args.keys, 16384);
+  string spill = "bench.tier";
+  blob_store store(0, n * len / 4, 0, spill);
+  vector<content_ptr> blobs;
+  vector<uint8_t> content(len);
+  for (size_t i = 0; i < n; ++i) {
+    memcpy(content.data(), &i, sizeof(i));
+    blobs.push_back(store.intern(content.data(), len));
+  }
+  // NB: Give the sweeper a chance to bring the store within its budget
+  for (int i = 0; i < 100 && store.stats().resident > n * len / 4; ++i)
+    this_thread::sleep_for(chrono::milliseconds(20));
+  key_dist_t dist(n, args.zipf);
+  rng_t rng(1);
+  size_t bytes = 0;
+  time_ops("blob_store::read (4KB, 1/4 in memory)", args.ops, [&](size_t) {
+    bytes += store.read(blobs[dist.next(rng)])->size();
+  });
+  auto s = store.stats();
+  cout << "tier: " << s.hit_rate() * 100 << "% hits, " << s.misses
+       << " misses, " << s.evictions << " evictions, "
+       << s.resident / 1048576.0 << " MB resident, " << s.spilled / 1048576.0
+       << " MB spilled\n";
+  if (bytes == 0)
+    cout << "unreachable\n";
+  unlink(spill.c_str());
+}
+
+/// Measure logging a change from several threads at once, with each fsync
+/// policy.  With sync_ms == 0, each change waits for the fsync of its group,
+/// so the cost per change falls as more threads share each fsync.
+///
+/// @param args The command-line arguments
+void bench_wal(const arg_t &args) {
+  string base = "bench.dat";
+  vector<uint8_t> rec(128, 'x');
+  for (int sync : {-1, 10, 0}) {
+    // NB: Every group costs an fsync when sync == 0, so do fewer of them
+    size_t ops = min<size_t>(args.ops, sync == 0 ? 20000 : 1000000);
+    size_t per = max<size_t>(ops / args.threads, 1);
+    wal_t log(base, 0, 0, sync);
+    auto start = chrono::steady_clock::now();
+    vector<thread> threads;
+    for (size_t t = 0; t < args.threads; ++t)
+      threads.emplace_back([&]() {
+        for (size_t i = 0; i < per; ++i) {
+          auto ticket = log.append(rec);
+          ticket.release();
+          log.sync(ticket);
+        }
+      });
+    for (auto &t : threads)
+      t.join();
+    auto end = chrono::steady_clock::now();
+    log.close_log();
+    double ns = chrono::duration<double, nano>(end - start).count();
+    cout << "wal_t::append (128B, fsync " << sync << ", " << args.threads
+         << " threads): " << ns / (per * args.threads) << " ns/op\n";
+    unlink(wal_t::name(base, 0).c_str());
+  }
+}
+
+int main(int argc, char **argv) {
+  // Parse the command-line arguments
+  //
+  // NB: It would be better not to put the arg_t on the heap, but then we'd need
+  //     an extra level of nesting for the body of the rest of this function.
+  arg_t *args;
+  try {
+    args = new arg_t(argc, argv);
+  } catch (int i) {
+    arg_t::usage(argv[0]);
+    return 1;
+  }
+  if (!args->ycsb_only) {
+    bench_visit(*args);
+    bench_scan(*args);
+    bench_batch(*args);
+    bench_alloc(*args);
+    bench_tier(*args);
+    bench_wal(*args);
+  }
+  bench_ycsb(*args);
+  delete args;
+}
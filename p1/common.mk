@@ -6,7 +6,7 @@ CXX       = g++
 LD        = g++
 # in the next two line, remove -m$(BITS) if you are running on an M1 Mac
 CXXFLAGS  = -MMD -O3 -m$(BITS) -ggdb -std=c++17 -Wall -Wextra -fPIC $(CXXEXTRA)
-LDFLAGS   = -m$(BITS) -lpthread -lcrypto -ldl $(LDEXTRA)
+LDFLAGS   = -m$(BITS) -lpthread -lcrypto -ldl -lz $(LDEXTRA)
 
 # Hard-coded name of the solutions folder
 SDIR = solutions
@@ -26,9 +26,23 @@ SERVER_O  = $(patsubst %, $(ODIR)/%.o, $(SERVER_CXX))
 SERVER_O += $(patsubst %, $(ODIR)/%.o, $(SERVER_COMMON))
 SERVER_O += $(patsubst %, $(SDIR)/%.o, $(SERVER_PROVIDED))
 
+# Names of all the .o files needed to create the benchmark executable
+BENCH_O  = $(patsubst %, $(ODIR)/%.o, $(BENCH_CXX))
+BENCH_O += $(patsubst %, $(ODIR)/%.o, $(BENCH_COMMON))
+
+# Names of all the .o files that every test executable needs, besides its own
+# main .o file
+TEST_O  = $(patsubst %, $(ODIR)/%.o, $(TEST_CXX))
+TEST_O += $(patsubst %, $(ODIR)/%.o, $(TEST_COMMON))
+
+# Names of the test executables
+TEST_EXE = $(patsubst %, $(ODIR)/%.$(EXESUFFIX), $(TEST_MAIN))
+
 # Names of all the .o and .exe files to build
-OFILES   = $(CLIENT_O) $(SERVER_O)
-EXEFILES = $(patsubst %, $(ODIR)/%.$(EXESUFFIX), $(CLIENT_MAIN) $(SERVER_MAIN))
+OFILES   = $(CLIENT_O) $(SERVER_O) $(BENCH_O) $(TEST_O) \
+           $(patsubst %, $(ODIR)/%.o, $(TEST_MAIN))
+EXEFILES = $(patsubst %, $(ODIR)/%.$(EXESUFFIX), $(CLIENT_MAIN) $(SERVER_MAIN) \
+                                                 $(BENCH_MAIN) $(TEST_MAIN))
 
 # Names of all .d files, so we can get dependencies right
 DFILES     = $(patsubst %.o, %.d, $(OFILES))
@@ -36,11 +50,16 @@ DFILES     = $(patsubst %.o, %.d, $(OFILES))
 # Build 'all' by default, and don't clobber .o files after each build
 .DEFAULT_GOAL = all
 .PRECIOUS: $(OFILES)
-.PHONY: all clean
+.PHONY: all clean test
 
 # Typing 'make' should build all the .exe files
 all: $(EXEFILES)
 
+# Typing 'make test' should build and run the test executables, if there are
+# any, and stop at the first one that fails
+test: $(TEST_EXE)
+	@$(foreach t, $^, $(t) &&) true
+
 # Typing 'make clean' should clean up by removing $(OUTFOLDER)
 clean:
 	@echo Cleaning up...
@@ -56,6 +75,12 @@ $(ODIR)/%.o: server/%.cc
 $(ODIR)/%.o: common/%.cc
 	@echo "[CXX] $< --> $@"
 	@$(CXX) $< -o $@ -c $(CXXFLAGS)
+$(ODIR)/%.o: bench/%.cc
+	@echo "[CXX] $< --> $@"
+	@$(CXX) $< -o $@ -c $(CXXFLAGS)
+$(ODIR)/%.o: test/%.cc
+	@echo "[CXX] $< --> $@"
+	@$(CXX) $< -o $@ -c $(CXXFLAGS)
 
 # Rules for building executables
 $(ODIR)/$(CLIENT_MAIN).$(EXESUFFIX): $(CLIENT_O)
@@ -64,6 +89,16 @@ $(ODIR)/$(CLIENT_MAIN).$(EXESUFFIX): $(CLIENT_O)
 $(ODIR)/$(SERVER_MAIN).$(EXESUFFIX): $(SERVER_O)
 	@echo "[LD] $^ --> $@"
 	@$(CXX) $^ -o $@ $(LDFLAGS)
+ifneq ($(strip $(BENCH_MAIN)),)
+$(ODIR)/$(BENCH_MAIN).$(EXESUFFIX): $(BENCH_O)
+	@echo "[LD] $^ --> $@"
+	@$(CXX) $^ -o $@ $(LDFLAGS)
+endif
+ifneq ($(strip $(TEST_MAIN)),)
+$(TEST_EXE): $(ODIR)/%.$(EXESUFFIX): $(ODIR)/%.o $(TEST_O)
+	@echo "[LD] $^ --> $@"
+	@$(CXX) $^ -o $@ $(LDFLAGS)
+endif
 
 # Include any dependencies we generated previously
 -include $(DFILES)
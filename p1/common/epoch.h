@@ -0,0 +1,227 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+/// Epoch-based reclamation (EBR) lets readers traverse a linked structure
+/// without taking locks, while writers unlink nodes from it concurrently.  A
+/// reader brackets its traversal with an epoch_guard.  A writer that unlinks a
+/// node hands it to epoch_retire() instead of deleting it, and the node is only
+/// freed after every reader that might still hold a pointer to it has left its
+/// critical section (a "grace period").
+///
+/// There is one global epoch counter.  Each thread has a record, on its own
+/// cache line, in which it announces the epoch it observed when it entered a
+/// critical section (or 0 when it is not in one).  The global epoch can only
+/// advance when every active thread has observed the current epoch, so once it
+/// has advanced twice past the epoch in which a node was retired, no reader can
+/// still see that node.
+///
+/// Entering and leaving a critical section only writes the thread's own
+/// record, so readers never write to a cache line that another thread reads in
+/// the common case.  The epoch is advanced, and retired nodes are freed, by
+/// writers, in batches of EPOCH_BATCH retirements.
+///
+/// NB: Unlike the rest of the server, this is all header-only, so that the map
+///     templates that use it can be included without adding a new object file
+///     to every build.
+
+/// The number of retirements a thread accumulates before it tries to advance
+/// the epoch and free old nodes
+const size_t EPOCH_BATCH = 64;
+
+/// epoch_record_t is one thread's announcement of its current epoch.  Records
+/// are never freed: when a thread exits, its record is released for reuse by a
+/// later thread.
+struct alignas(64) epoch_record_t {
+  /// The epoch this thread observed on entry to its critical section, or 0 if
+  /// it is not in one
+  std::atomic<uint64_t> local{0};
+
+  /// true if a live thread owns this record
+  std::atomic<bool> in_use{false};
+
+  /// The next record in the global list of records
+  epoch_record_t *next = nullptr;
+};
+
+/// epoch_retired_t is a node that has been unlinked, but not yet freed
+struct epoch_retired_t {
+  /// The node to free
+  void *ptr;
+
+  /// The function that frees it
+  void (*deleter)(void *);
+
+  /// The global epoch at the time the node was retired
+  uint64_t epoch;
+};
+
+/// epoch_global_t holds the state that is shared by all threads
+struct epoch_global_t {
+  /// The global epoch.  It starts at 1, because 0 means "quiescent".
+  std::atomic<uint64_t> epoch{1};
+
+  /// The list of all thread records.  Records are only ever pushed.
+  std::atomic<epoch_record_t *> records{nullptr};
+
+  /// Nodes retired by threads that have since exited
+  std::vector<epoch_retired_t> orphans;
+
+  /// A lock protecting orphans
+  std::mutex orphan_lock;
+
+  /// Free every orphan.  By the time static objects are destroyed, there are
+  /// no readers left.
+  ~epoch_global_t() {
+    for (auto &r : orphans)
+      r.deleter(r.ptr);
+  }
+
+  /// Try to advance the global epoch.  This succeeds only if every thread that
+  /// is in a critical section has observed the current epoch.
+  void try_advance() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    uint64_t e = epoch.load(std::memory_order_relaxed);
+    for (auto *r = records.load(std::memory_order_acquire); r; r = r->next) {
+      if (!r->in_use.load(std::memory_order_relaxed))
+        continue;
+      uint64_t l = r->local.load(std::memory_order_acquire);
+      if (l != 0 && l != e)
+        return;
+    }
+    epoch.compare_exchange_strong(e, e + 1, std::memory_order_acq_rel);
+  }
+
+  /// Free the entries of a list of retired nodes whose grace period has
+  /// ended, and remove them from the list
+  ///
+  /// @param list The list to scan
+  void reclaim(std::vector<epoch_retired_t> &list) {
+    uint64_t e = epoch.load(std::memory_order_acquire);
+    size_t keep = 0;
+    for (size_t i = 0; i < list.size(); ++i) {
+      if (list[i].epoch + 2 <= e)
+        list[i].deleter(list[i].ptr);
+      else
+        list[keep++] = list[i];
+    }
+    list.resize(keep);
+  }
+};
+
+/// The global EBR state
+inline epoch_global_t epoch_global;
+
+/// epoch_thread_t is the per-thread EBR state: the thread's record, its
+/// critical section nesting depth, and the nodes it has retired
+struct epoch_thread_t {
+  /// This thread's record, or nullptr until the thread first uses EBR
+  epoch_record_t *rec = nullptr;
+
+  /// The depth of nested epoch_guards
+  unsigned depth = 0;
+
+  /// The nodes this thread has retired, oldest first
+  std::vector<epoch_retired_t> limbo;
+
+  /// The number of retirements since the last reclamation attempt
+  size_t pending = 0;
+
+  /// On thread exit, hand any unfreed nodes to the global orphan list and
+  /// release the record
+  ~epoch_thread_t() {
+    if (rec == nullptr)
+      return;
+    if (!limbo.empty()) {
+      std::lock_guard<std::mutex> g(epoch_global.orphan_lock);
+      epoch_global.orphans.insert(epoch_global.orphans.end(), limbo.begin(),
+                                  limbo.end());
+    }
+    rec->local.store(0, std::memory_order_release);
+    rec->in_use.store(false, std::memory_order_release);
+  }
+
+  /// Get this thread's record, claiming or creating one if needed
+  ///
+  /// @return The thread's record
+  epoch_record_t *record() {
+    if (rec != nullptr)
+      return rec;
+    auto &head = epoch_global.records;
+    for (auto *r = head.load(std::memory_order_acquire); r; r = r->next) {
+      bool expect = false;
+      if (r->in_use.compare_exchange_strong(expect, true))
+        return rec = r;
+    }
+    rec = new epoch_record_t();
+    rec->in_use.store(true, std::memory_order_relaxed);
+    rec->next = head.load(std::memory_order_relaxed);
+    while (!head.compare_exchange_weak(rec->next, rec,
+                                       std::memory_order_release))
+      ;
+    return rec;
+  }
+};
+
+/// The calling thread's EBR state
+inline thread_local epoch_thread_t epoch_self;
+
+/// epoch_guard is an RAII object that marks a read-side critical section.
+/// While it is alive, no node that the thread can reach will be freed.  Guards
+/// may be nested.
+class epoch_guard {
+public:
+  /// Enter a critical section
+  epoch_guard() {
+    if (epoch_self.depth++ > 0)
+      return;
+    // NB: The store is a release so that a writer that sees this epoch also
+    //     sees that our earlier critical sections have finished
+    epoch_self.record()->local.store(
+        epoch_global.epoch.load(std::memory_order_relaxed),
+        std::memory_order_release);
+    // NB: The announcement must be visible before we load any pointer from the
+    //     structure, or a writer could advance past us and free the node
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+  }
+
+  /// Leave the critical section
+  ~epoch_guard() {
+    if (--epoch_self.depth == 0)
+      epoch_self.rec->local.store(0, std::memory_order_release);
+  }
+
+  epoch_guard(const epoch_guard &) = delete;
+  epoch_guard &operator=(const epoch_guard &) = delete;
+};
+
+/// Schedule a node for deletion once every current reader has finished.  The
+/// node must already be unreachable for new readers.
+///
+/// @param ptr     The node to free
+/// @param deleter The function that frees it
+inline void epoch_retire(void *ptr, void (*deleter)(void *)) {
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  epoch_self.record();
+  epoch_self.limbo.push_back(
+      {ptr, deleter, epoch_global.epoch.load(std::memory_order_relaxed)});
+  if (++epoch_self.pending < EPOCH_BATCH)
+    return;
+  epoch_self.pending = 0;
+  epoch_global.try_advance();
+  epoch_global.reclaim(epoch_self.limbo);
+  std::unique_lock<std::mutex> g(epoch_global.orphan_lock, std::try_to_lock);
+  if (g.owns_lock() && !epoch_global.orphans.empty())
+    epoch_global.reclaim(epoch_global.orphans);
+}
+
+/// Schedule an object that was allocated with new for deletion once every
+/// current reader has finished
+///
+/// @param ptr The object to delete
+template <typename T> void epoch_retire(T *ptr) {
+  epoch_retire(ptr, [](void *p) { delete static_cast<T *>(p); });
+}
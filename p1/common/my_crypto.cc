@@ -1,4 +1,3 @@
-#include <cassert>
 #include <iostream>
 #include <openssl/err.h>
 #include <openssl/pem.h>
@@ -20,12 +19,14 @@ using namespace std;
 ///         vector if there was an error
 vector<uint8_t> aes_crypt_msg(EVP_CIPHER_CTX *ctx, const unsigned char *start,
                               int count) {
-  cout << "my_crypto.cc::aes_crypt_msg() is not implemented\n";
-
-  // These asserts are just for preventing compiler warnings:
-  assert(ctx);
-  assert(start);
-  assert(count != -100);
-
-  return {};
+  // NB: The output can be up to one cipher block longer than the input, for
+  //     padding
+  vector<uint8_t> res(count + EVP_CIPHER_CTX_block_size(ctx));
+  int len = 0, fin = 0;
+  if (!EVP_CipherUpdate(ctx, res.data(), &len, start, count) ||
+      !EVP_CipherFinal_ex(ctx, res.data() + len, &fin))
+    return err(vector<uint8_t>(), "Error: OpenSSL couldn't crypt message: ",
+               ERR_error_string(ERR_get_error(), 0));
+  res.resize(len + fin);
+  return res;
 }
@@ -30,6 +30,24 @@
 /// When there is an AES block, its length will be given as part of the RSA
 /// block.  Note that this is the length of the *encrypted* @ablock.
 ///
+/// RSA decryption is far more expensive than the rest of a small request, so a
+/// client may open a session (see SESSION_), and then send requests that start
+/// with an unencrypted session block (@sblock) instead of an @rblock.  An
+/// @sblock is also LEN_RKBLOCK bytes, padded with '\0' characters:
+///
+/// @sblock   pad0("SESSREQ_".@sid.@iv.len(@ablock))
+/// @ablock   enc(sessionkey.@iv, @cmd.@fields)
+///
+/// @sid is the session's id, and @iv is a new random AES initialization vector
+/// (AES_IVSIZE bytes) for each request.  @cmd is the 8-byte name of a request
+/// other than PUB_KEY_ or SESSION_, and @fields is the unencrypted @ablock of
+/// that request, which is answered exactly as if it had been sent with an
+/// @rblock whose aeskey was sessionkey.@iv.  A session belongs to the user who
+/// opened it, so the user in @fields must be that user, or the response is
+/// enc(sessionkey.@iv, ERR_LOGIN).<EOF>.  If the session does not exist, or has
+/// expired, the response is ERR_SESSION.<EOF>, and the client should open a new
+/// session.
+///
 /// In describing message formats, we use the dot ('.') to indicate
 /// concatenation.  So "ABC"."DEF" will consist of 6 bytes, and will be the
 /// characters "ABCDEF".  When 'len()' appears in a description, this indicates
@@ -76,6 +94,9 @@ static inline constexpr auto LEN_RBLOCK_CONTENT{128};
 /// Length of salt
 static inline constexpr auto LEN_SALT{16};
 
+/// Length of a session id
+static inline constexpr auto LEN_SESSION_ID{16};
+
 //
 // Request Messages
 //
@@ -125,7 +146,11 @@ static inline constexpr std::string_view REQ_REG{"REGISTER"};
 static inline constexpr std::string_view REQ_BYE{"EXIT____"};
 
 /// Force the server to send all its data to disk.  @u and @p represent a valid
-/// user's username and password.
+/// user's username and password.  The data is written in the background, from
+/// a snapshot taken when the request is handled, so the response comes as soon
+/// as the save has been scheduled.  The number of the checkpoint is the "last
+/// checkpoint requested" that a SAVSTAT_ request reports, and it is durable once
+/// SAVSTAT_ reports it as such.
 ///
 /// The user name (@u) and user password (@p) must conform to LEN_UNAME and
 /// LEN_PASSWORD.
@@ -145,6 +170,26 @@ static inline constexpr std::string_view REQ_BYE{"EXIT____"};
 ///           ERR_CRYPTO      -- Server could not decrypt @ablock
 static inline constexpr std::string_view REQ_SAV{"PERSIST_"};
 
+/// Ask the server about the progress of its background checkpoints (see
+/// PERSIST_).  @u and @p represent a valid user's username and password.  @s is
+/// four 8-byte binary integers: the number of the last checkpoint requested,
+/// the number of the last one that is durable, the number of saves that have
+/// failed, and 1 if a save is running (or 0 if not).
+///
+/// The user name (@u) and user password (@p) must conform to LEN_UNAME and
+/// LEN_PASSWORD.
+///
+/// @rblock   enc(pubkey, padR("SAVSTAT_".aeskey.len(@ablock)))
+/// @ablock   enc(aeskey, len(@u).@u.len(@p).@p)
+/// @response enc(aeskey, "OK".len(@s).@s).<EOF> -- Success
+///           enc(aeskey, error_code).<EOF>       -- Error (see @errors)
+///           ERR_CRYPTO.<EOF>                    -- Error (see @errors)
+/// @errors   ERR_LOGIN       -- @u is not a valid user
+///           ERR_LOGIN       -- @p is not @u's password
+///           ERR_REQUEST_FMT -- Server unable to extract @u or @p from request
+///           ERR_CRYPTO      -- Server could not decrypt @ablock
+static inline constexpr std::string_view REQ_SST{"SAVSTAT_"};
+
 /// Allow user @u (with password @p) to set her profile content to the byte
 /// stream @b.
 ///
@@ -201,6 +246,53 @@ static inline constexpr std::string_view REQ_GET{"GETPFILE"};
 ///           ERR_CRYPTO      -- Server could not decrypt @ablock
 static inline constexpr std::string_view REQ_ALL{"ALLUSERS"};
 
+/// Allow user @u (with password @p) to get a sorted, newline-separated list
+/// (@l) of the names of the users that are not less than @f and are less than
+/// @t.  An empty @t means there is no upper bound.  To list the users whose
+/// names start with a prefix, @f is the prefix and @t is the prefix with its
+/// last byte incremented (after dropping any trailing 0xff bytes).  @l will not
+/// have a trailing newline.
+///
+/// The user name (@u) and user password (@p) must conform to LEN_UNAME and
+/// LEN_PASSWORD.  @f and @t must be no more than LEN_UNAME bytes.
+///
+/// @rblock   enc(pubkey, padR("USRRANGE".aeskey.len(@ablock)))
+/// @ablock   enc(aeskey, len(@u).@u.len(@p).@p.len(@f).@f.len(@t).@t)
+/// @response enc(aeskey, "OK".len(@l).@l).<EOF>    -- Success
+///           enc(aeskey, error_code).<EOF>         -- Error (see @errors)
+///           ERR_CRYPTO.<EOF>                      -- Error (see @errors)
+/// @errors   ERR_LOGIN       -- @u is not a valid user
+///           ERR_LOGIN       -- @p is not @u's password
+///           ERR_REQUEST_FMT -- Server unable to extract @u or @p or @f or @t
+///                              from request
+///           ERR_CRYPTO      -- Server could not decrypt @ablock
+static inline constexpr std::string_view REQ_RNG{"USRRANGE"};
+
+/// Open a session, so that later requests can be sent without RSA encryption
+/// (see @sblock, above).  @u and @p represent a valid user's username and
+/// password.  @s is the session's id (LEN_SESSION_ID bytes), its AES key
+/// (AES_KEYSIZE bytes), and the number of seconds for which it lasts (an 8-byte
+/// binary integer).  The server holds a bounded number of sessions, so a
+/// session may end before then, when newer sessions push it out.
+///
+/// The user name (@u) and user password (@p) must conform to LEN_UNAME and
+/// LEN_PASSWORD.
+///
+/// @rblock   enc(pubkey, padR("SESSION_".aeskey.len(@ablock)))
+/// @ablock   enc(aeskey, len(@u).@u.len(@p).@p)
+/// @response enc(aeskey, "OK".len(@s).@s).<EOF> -- Success
+///           enc(aeskey, error_code).<EOF>       -- Error (see @errors)
+///           ERR_CRYPTO.<EOF>                    -- Error (see @errors)
+/// @errors   ERR_LOGIN       -- @u is not a valid user
+///           ERR_LOGIN       -- @p is not @u's password
+///           ERR_SESSION     -- The server does not allow sessions
+///           ERR_REQUEST_FMT -- Server unable to extract @u or @p from request
+///           ERR_CRYPTO      -- Server could not decrypt @ablock
+static inline constexpr std::string_view REQ_SES{"SESSION_"};
+
+/// The code that starts an @sblock (see above)
+static inline constexpr std::string_view REQ_SRQ{"SESSREQ_"};
+
 //
 // Response Messages
 //
@@ -234,6 +326,10 @@ static inline constexpr std::string_view RES_ERR_XMIT{"ERR_XMIT"};
 /// provided AES key
 static inline constexpr std::string_view RES_ERR_CRYPTO{"ERR_CRYPTO"};
 
+/// Response code to indicate that a session does not exist, or has expired, or
+/// that the server does not allow sessions
+static inline constexpr std::string_view RES_ERR_SESSION{"ERR_SESSION"};
+
 /// Response code to indicate that the server had an internal error, such as a
 /// bad read from a file, error creating a salt, or failure to fork()
 static inline constexpr std::string_view RES_ERR_SERVER{"ERR_SERVER"};
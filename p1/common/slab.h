@@ -0,0 +1,344 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <sys/mman.h>
+
+/// The slab allocator serves the small, fixed-size objects that the maps
+/// allocate on every insert (i.e., hash table nodes, which hold the
+/// AuthRecord inline, and skip list nodes), so that concurrent inserts do
+/// not contend in the system allocator.
+///
+/// Requests are rounded up to one of SLAB_CLASSES size classes.  Each thread
+/// has its own heap, with a free list per class, so allocating and freeing
+/// take no locks and touch no shared cache lines in the common case.  A heap
+/// gets memory in SLAB_SPAN-byte spans, which it carves into objects of one
+/// class; spans are cut from SLAB_ARENA-byte arenas that are mapped from the
+/// OS (optionally backed by transparent huge pages).  Memory is never returned
+/// to the OS: freed objects are reused by later allocations of the same class.
+///
+/// Objects are often freed by a different thread than the one that allocated
+/// them (i.e., by epoch reclamation).  Every span starts with a pointer to the
+/// heap that carved it, so a remote free is pushed onto a lock-free list in
+/// the owning heap, which the owner drains when its own list runs dry.  When a
+/// thread exits, its heap (with its free lists) is released for reuse by a
+/// later thread, in the same way as epoch records (see epoch.h).
+///
+/// Objects are 16-byte aligned.  Requests larger than the largest class go to
+/// the global operator new.  The caller must pass the same size to
+/// slab_free() that it passed to slab_alloc().
+///
+/// NB: Like epoch.h, this is header-only, so that the map templates that use
+///     it do not add a new object file to every build.
+
+/// Under ASan and TSan, slab_alloc() and slab_free() forward to the global
+/// allocator, so that the sanitizer can see when each object's life begins and
+/// ends.  (TSan cannot follow the fences that make epoch reclamation safe, so
+/// it would report every reuse of a reclaimed node as a race.)
+#if defined(__SANITIZE_ADDRESS__) || defined(__SANITIZE_THREAD__)
+#define SLAB_PASSTHROUGH 1
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer) || __has_feature(thread_sanitizer)
+#define SLAB_PASSTHROUGH 1
+#endif
+#endif
+
+/// The number of size classes
+const size_t SLAB_CLASSES = 21;
+
+/// The object size of each class.  Classes are 16 bytes apart up to 128, and
+/// then at most 25% apart, so that rounding wastes little space.
+const size_t SLAB_CLASS_SIZE[SLAB_CLASSES] = {
+    16,  32,  48,  64,  80,  96,  112, 128,  160,  192, 224,
+    256, 320, 384, 448, 512, 640, 768, 1024, 1536, 2048};
+
+/// The size (and alignment) of a span.  One span holds objects of one class.
+const size_t SLAB_SPAN = 64 * 1024;
+
+/// The size (and alignment) of an arena, from which spans are cut.  This is
+/// the size of an x86 huge page.
+const size_t SLAB_ARENA = 2 * 1024 * 1024;
+
+/// The space reserved for the header at the start of each span
+const size_t SLAB_HEADER = 64;
+
+/// slab_stats_t is a summary of the allocator's counters, across all threads
+struct slab_stats_t {
+  uint64_t allocs = 0;       // Objects allocated since startup
+  uint64_t frees = 0;        // Objects freed since startup
+  uint64_t remote_frees = 0; // Frees by a thread that did not own the object
+  size_t live_bytes = 0;     // Bytes in live objects (rounded to their class)
+  size_t span_bytes = 0;     // Bytes in spans that heaps have carved
+  size_t arena_bytes = 0;    // Bytes mapped from the OS
+
+  /// Get the fraction of carved span memory that does not hold a live object
+  /// (freed objects awaiting reuse, rounding to size classes, and headers)
+  ///
+  /// @return A number between 0 and 1
+  double fragmentation() const {
+    return span_bytes == 0 ? 0 : 1 - (double)live_bytes / span_bytes;
+  }
+};
+
+/// slab_free_t is the link stored in a free object
+struct slab_free_t {
+  slab_free_t *next;
+};
+
+/// slab_heap_t is one thread's heap.  Heaps are never freed.
+struct alignas(64) slab_heap_t {
+  /// The free list of each class.  Only the owner touches these.
+  slab_free_t *free[SLAB_CLASSES] = {};
+
+  /// The unused part of the span that each class is carving
+  char *bump[SLAB_CLASSES] = {};
+  char *bump_end[SLAB_CLASSES] = {};
+
+  /// Objects freed by other threads, per class
+  alignas(64) std::atomic<slab_free_t *> remote[SLAB_CLASSES] = {};
+
+  /// Counters.  Each is only written by the thread that owns this heap, so
+  /// they are updated without read-modify-write instructions.
+  alignas(64) std::atomic<uint64_t> allocs[SLAB_CLASSES] = {};
+  std::atomic<uint64_t> frees[SLAB_CLASSES] = {};
+  std::atomic<uint64_t> remote_frees{0};
+  std::atomic<size_t> spans{0};
+
+  /// true if a live thread owns this heap
+  std::atomic<bool> in_use{false};
+
+  /// The next heap in the global list of heaps
+  slab_heap_t *next = nullptr;
+};
+
+/// slab_global_t holds the state that is shared by all threads.  It has no
+/// destructor, since objects may be freed during static destruction.
+struct slab_global_t {
+  /// The list of all heaps.  Heaps are only ever pushed.
+  std::atomic<slab_heap_t *> heaps{nullptr};
+
+  /// A spin lock protecting the arena fields below.  Spans are carved rarely,
+  /// so this is not contended.
+  std::atomic_flag arena_lock = ATOMIC_FLAG_INIT;
+
+  /// The unused part of the current arena
+  char *arena = nullptr;
+  char *arena_end = nullptr;
+
+  /// The bytes mapped from the OS so far
+  std::atomic<size_t> arena_bytes{0};
+
+  /// Whether to ask for transparent huge pages when mapping arenas
+  std::atomic<bool> huge_pages{false};
+
+  /// Map a new arena, aligned to SLAB_ARENA.  The caller must hold arena_lock.
+  ///
+  /// @return true on success, false if the OS is out of memory
+  bool map_arena() {
+    // NB: mmap only promises page alignment, so we map twice the size and
+    //     trim the ends
+    size_t len = 2 * SLAB_ARENA;
+    void *m = mmap(nullptr, len, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (m == MAP_FAILED)
+      return false;
+    uintptr_t start = reinterpret_cast<uintptr_t>(m);
+    uintptr_t aligned = (start + SLAB_ARENA - 1) & ~(SLAB_ARENA - 1);
+    if (aligned > start)
+      munmap(m, aligned - start);
+    if (aligned + SLAB_ARENA < start + len)
+      munmap(reinterpret_cast<void *>(aligned + SLAB_ARENA),
+             start + len - aligned - SLAB_ARENA);
+    arena = reinterpret_cast<char *>(aligned);
+    arena_end = arena + SLAB_ARENA;
+    if (huge_pages.load(std::memory_order_relaxed))
+      madvise(arena, SLAB_ARENA, MADV_HUGEPAGE);
+    arena_bytes.fetch_add(SLAB_ARENA, std::memory_order_relaxed);
+    return true;
+  }
+
+  /// Cut a span from the current arena, mapping a new arena if needed
+  ///
+  /// @return The span, or nullptr if the OS is out of memory
+  char *take_span() {
+    while (arena_lock.test_and_set(std::memory_order_acquire))
+      ;
+    char *span = nullptr;
+    if (arena != arena_end || map_arena()) {
+      span = arena;
+      arena += SLAB_SPAN;
+    }
+    arena_lock.clear(std::memory_order_release);
+    return span;
+  }
+};
+
+/// The global slab state
+inline slab_global_t slab_global;
+
+/// The calling thread's heap, or nullptr until it first uses the allocator.
+/// This is a plain pointer (with no destructor), so that it can still be used
+/// while other thread-local objects are being destroyed.
+inline thread_local slab_heap_t *slab_self = nullptr;
+
+/// slab_releaser_t releases the calling thread's heap when the thread exits
+struct slab_releaser_t {
+  ~slab_releaser_t() {
+    if (slab_self == nullptr)
+      return;
+    slab_self->in_use.store(false, std::memory_order_release);
+    slab_self = nullptr;
+  }
+};
+
+/// The calling thread's releaser
+inline thread_local slab_releaser_t slab_releaser;
+
+/// Get the calling thread's heap, claiming or creating one if needed
+///
+/// @return The thread's heap
+inline slab_heap_t *slab_heap() {
+  if (slab_self != nullptr)
+    return slab_self;
+  // NB: Touching the releaser registers its destructor for this thread
+  (void)&slab_releaser;
+  auto &head = slab_global.heaps;
+  for (auto *h = head.load(std::memory_order_acquire); h; h = h->next) {
+    bool expect = false;
+    if (h->in_use.compare_exchange_strong(expect, true))
+      return slab_self = h;
+  }
+  auto *h = new slab_heap_t();
+  h->in_use.store(true, std::memory_order_relaxed);
+  h->next = head.load(std::memory_order_relaxed);
+  while (!head.compare_exchange_weak(h->next, h, std::memory_order_release))
+    ;
+  return slab_self = h;
+}
+
+/// Find the size class for a request
+///
+/// @param size The number of bytes requested
+///
+/// @return The index of the smallest class that fits, or SLAB_CLASSES if the
+///         request is too large for any class
+inline size_t slab_class_of(size_t size) {
+  if (size <= 128)
+    return size <= 16 ? 0 : (size - 1) / 16;
+  size_t c = 8;
+  while (c < SLAB_CLASSES && SLAB_CLASS_SIZE[c] < size)
+    ++c;
+  return c;
+}
+
+/// Ask for arenas to be backed by transparent huge pages.  This only affects
+/// arenas that are mapped after it is called, so it should be called at
+/// startup, before anything is allocated.
+///
+/// @param on true to use huge pages, false otherwise
+inline void slab_set_huge_pages(bool on) {
+  slab_global.huge_pages.store(on, std::memory_order_relaxed);
+}
+
+/// Increment a counter that only the calling thread writes
+///
+/// @param c The counter
+inline void slab_count(std::atomic<uint64_t> &c) {
+  c.store(c.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+/// Allocate memory from the calling thread's heap
+///
+/// @param size The number of bytes to allocate
+///
+/// @return The memory.  Throws std::bad_alloc if the OS is out of memory, like
+///         operator new.
+inline void *slab_alloc(size_t size) {
+  size_t c = slab_class_of(size);
+#ifdef SLAB_PASSTHROUGH
+  c = SLAB_CLASSES;
+#endif
+  if (c == SLAB_CLASSES)
+    return ::operator new(size);
+  slab_heap_t *h = slab_heap();
+  slab_free_t *obj = h->free[c];
+  if (obj == nullptr)
+    obj = h->remote[c].exchange(nullptr, std::memory_order_acquire);
+  if (obj != nullptr) {
+    h->free[c] = obj->next;
+  } else {
+    size_t sz = SLAB_CLASS_SIZE[c];
+    if (h->bump_end[c] - h->bump[c] < (ptrdiff_t)sz) {
+      char *span = slab_global.take_span();
+      if (span == nullptr)
+        throw std::bad_alloc();
+      *reinterpret_cast<slab_heap_t **>(span) = h;
+      h->bump[c] = span + SLAB_HEADER;
+      h->bump_end[c] = span + SLAB_SPAN;
+      h->spans.store(h->spans.load(std::memory_order_relaxed) + 1,
+                     std::memory_order_relaxed);
+    }
+    obj = reinterpret_cast<slab_free_t *>(h->bump[c]);
+    h->bump[c] += sz;
+  }
+  slab_count(h->allocs[c]);
+  return obj;
+}
+
+/// Return memory that was allocated by slab_alloc()
+///
+/// @param ptr  The memory
+/// @param size The size that was passed to slab_alloc()
+inline void slab_free(void *ptr, size_t size) {
+  size_t c = slab_class_of(size);
+#ifdef SLAB_PASSTHROUGH
+  c = SLAB_CLASSES;
+#endif
+  if (c == SLAB_CLASSES) {
+    ::operator delete(ptr);
+    return;
+  }
+  slab_heap_t *h = slab_heap();
+  auto *obj = static_cast<slab_free_t *>(ptr);
+  auto *owner = *reinterpret_cast<slab_heap_t **>(
+      reinterpret_cast<uintptr_t>(ptr) & ~(SLAB_SPAN - 1));
+  if (owner == h) {
+    obj->next = h->free[c];
+    h->free[c] = obj;
+  } else {
+    obj->next = owner->remote[c].load(std::memory_order_relaxed);
+    while (!owner->remote[c].compare_exchange_weak(
+        obj->next, obj, std::memory_order_release, std::memory_order_relaxed))
+      ;
+    slab_count(h->remote_frees);
+  }
+  slab_count(h->frees[c]);
+}
+
+/// Sum the counters of every heap.  The result is approximate while other
+/// threads are allocating.
+///
+/// @return The allocator's statistics
+inline slab_stats_t slab_stats() {
+  slab_stats_t s;
+  int64_t live[SLAB_CLASSES] = {};
+  for (auto *h = slab_global.heaps.load(std::memory_order_acquire); h;
+       h = h->next) {
+    for (size_t c = 0; c < SLAB_CLASSES; ++c) {
+      uint64_t a = h->allocs[c].load(std::memory_order_relaxed);
+      uint64_t f = h->frees[c].load(std::memory_order_relaxed);
+      s.allocs += a;
+      s.frees += f;
+      live[c] += (int64_t)a - (int64_t)f;
+    }
+    s.remote_frees += h->remote_frees.load(std::memory_order_relaxed);
+    s.span_bytes += h->spans.load(std::memory_order_relaxed) * SLAB_SPAN;
+  }
+  for (size_t c = 0; c < SLAB_CLASSES; ++c)
+    if (live[c] > 0)
+      s.live_bytes += live[c] * SLAB_CLASS_SIZE[c];
+  s.arena_bytes = slab_global.arena_bytes.load(std::memory_order_relaxed);
+  return s;
+}
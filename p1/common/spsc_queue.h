@@ -0,0 +1,82 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+
+/// spsc_queue is a bounded, lock-free, single-producer/single-consumer queue.
+/// Exactly one thread may call push(), and exactly one (other) thread may call
+/// pop().
+///
+/// The producer's index and the consumer's index live on separate cache lines.
+/// Each side also keeps a private copy of the other side's index, and only
+/// re-reads the shared one when its copy says the queue is full (or empty), so
+/// in the common case neither side reads a line that the other side writes.
+///
+/// @param T The type of the elements (should be cheap to copy, i.e., a pointer)
+/// @param N The capacity of the queue, which must be a power of two
+template <typename T, size_t N> class spsc_queue {
+  static_assert(N > 0 && (N & (N - 1)) == 0, "capacity must be a power of 2");
+
+  /// The size of a cache line
+  static const size_t CACHE_LINE = 64;
+
+  /// The index of the next slot the consumer will read
+  alignas(CACHE_LINE) std::atomic<size_t> head{0};
+
+  /// The consumer's copy of tail
+  size_t tail_cache = 0;
+
+  /// The index of the next slot the producer will write
+  alignas(CACHE_LINE) std::atomic<size_t> tail{0};
+
+  /// The producer's copy of head
+  size_t head_cache = 0;
+
+  /// The elements
+  alignas(CACHE_LINE) T slots[N];
+
+public:
+  /// Add an element to the queue.  Only the producer may call this.
+  ///
+  /// @param val The element to add
+  ///
+  /// @return true if the element was added, false if the queue was full
+  bool push(const T &val) {
+    size_t t = tail.load(std::memory_order_relaxed);
+    if (t - head_cache == N) {
+      head_cache = head.load(std::memory_order_acquire);
+      if (t - head_cache == N)
+        return false;
+    }
+    slots[t & (N - 1)] = val;
+    tail.store(t + 1, std::memory_order_release);
+    return true;
+  }
+
+  /// Remove the oldest element from the queue.  Only the consumer may call
+  /// this.
+  ///
+  /// @param val Set to the element, if there is one
+  ///
+  /// @return true if an element was removed, false if the queue was empty
+  bool pop(T &val) {
+    size_t h = head.load(std::memory_order_relaxed);
+    if (h == tail_cache) {
+      tail_cache = tail.load(std::memory_order_acquire);
+      if (h == tail_cache)
+        return false;
+    }
+    val = slots[h & (N - 1)];
+    head.store(h + 1, std::memory_order_release);
+    return true;
+  }
+
+  /// Check if the queue looks empty.  This may be called by either side, but
+  /// the answer may be stale by the time it is returned.
+  ///
+  /// @return true if the queue was empty when checked
+  bool empty() const {
+    return head.load(std::memory_order_acquire) ==
+           tail.load(std::memory_order_acquire);
+  }
+};
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+#include "../common/protocol.h"
+
+#include "content.h"
+#include "map.h"
+
+/// AuthRecord represents one user stored in the authentication table, in the
+/// compact form that the new maps (ConcurrentHashMap and FlatMap) hold.  It is
+/// not AuthTableEntry, whose layout code that was compiled against the original
+/// authtableentry.h still depends on.
+///
+/// The salt and hashed password have fixed sizes, and the username has a
+/// fixed bound, so they are stored inline rather than in their own heap
+/// allocations.  The fields that authentication reads (salt and pass_hash) come
+/// first, and fit in one cache line, so an AUTH does not touch the username or
+/// the (cold) content.  The content is a shared, immutable buffer (see
+/// content.h), so copying a record does not copy it.
+struct AuthRecord {
+  uint8_t salt[LEN_SALT] = {};          // The salt to use with the password
+  uint8_t pass_hash[LEN_PASSHASH] = {}; // The hashed password
+  uint8_t name_len = 0;                 // The length of username
+  char username[LEN_UNAME];             // The name of the user
+  content_ptr content;                  // The user's content, or nullptr
+
+  /// Get the name of the user
+  ///
+  /// @return A view of the username
+  std::string_view name() const { return {username, name_len}; }
+
+  /// Set the name of the user
+  ///
+  /// @param n The new name
+  ///
+  /// @return false if the name is empty or longer than LEN_UNAME, true
+  ///         otherwise
+  bool set_name(std::string_view n) {
+    if (n.empty() || n.size() > LEN_UNAME)
+      return false;
+    memcpy(username, n.data(), n.size());
+    name_len = n.size();
+    return true;
+  }
+};
+
+/// AuthRecord holds its own key, the username, so a map that supports it (see
+/// map.h) does not store a second copy of the name
+template <> struct map_key_of<AuthRecord> {
+  static constexpr bool embedded = true;
+
+  /// Get the key of a record
+  ///
+  /// @param e The record
+  ///
+  /// @return A view of the username
+  static std::string_view get(const AuthRecord &e) { return e.name(); }
+};
@@ -0,0 +1,504 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <openssl/sha.h>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+#include "content.h"
+#include "crc32c.h"
+
+/// blob_store is a content-addressed set of content buffers.  Each buffer is
+/// keyed by the SHA-256 digest of its bytes, so when many users store the same
+/// bytes (e.g., a template profile), they all share one buffer.
+///
+/// The store does not keep buffers alive: it holds weak references, and a
+/// buffer's deleter removes it from the store when its last user lets go of
+/// it.  The deleter also holds the buffer's digest, so that digest_of() can
+/// find it without rehashing (e.g., when the buffer is written to a file).
+///
+/// The set is split into stripes, each with its own lock, so that concurrent
+/// SETs of different content rarely contend.  The digest is computed, and a new
+/// buffer is compressed (see content.h), without holding a lock.
+///
+/// NB: Digests are of the raw content, so that the same bytes map to the same
+///     buffer whether or not it is compressed.
+///
+/// A store may also have a memory tier: given a spill file, and a memory budget
+/// and/or a window of time, a background thread drops the stored bytes of
+/// buffers that have not been read within the window, and of the least
+/// recently read buffers while the store is over its budget.  Before its bytes
+/// are first dropped, a buffer is appended to the spill file.  (Buffers never
+/// change, so it is written at most once.)  A read of a dropped buffer pages
+/// it back in.  Only the sweeper thread drops bytes or writes the file, so
+/// readers need no lock: they swap the bytes in with an atomic
+/// compare-and-swap.
+///
+/// A buffer whose bytes are in a data file (see content_t) is paged in the same
+/// way, from that file, whether or not the store has a memory tier.  Its bytes
+/// are checked against their CRC32C when they are read, and are never written
+/// to the spill file, since they can be dropped and read back from the data
+/// file.
+///
+/// The spill file is a cache, not a copy of the data: it is truncated when the
+/// store is made, removed when the store is destroyed, and space for buffers
+/// that die is not reused.  The budget is enforced by the sweeper, which is
+/// woken whenever a new or paged-in buffer takes the store over budget, so the
+/// store may briefly hold more than its budget.
+class blob_store {
+public:
+  /// digest_t is the SHA-256 digest of a buffer
+  struct digest_t {
+    uint8_t bytes[SHA256_DIGEST_LENGTH];
+
+    bool operator==(const digest_t &o) const {
+      return memcmp(bytes, o.bytes, sizeof(bytes)) == 0;
+    }
+  };
+
+  /// Compute the digest of some bytes
+  ///
+  /// @param data The bytes
+  /// @param len  The number of bytes
+  ///
+  /// @return The SHA-256 digest of the bytes
+  static digest_t digest(const uint8_t *data, size_t len) {
+    digest_t d;
+    SHA256(data, len, d.bytes);
+    return d;
+  }
+
+  /// digest_hash hashes a digest for unordered containers.  The digest is
+  /// already uniformly distributed, so its first word is a fine hash.
+  struct digest_hash {
+    size_t operator()(const digest_t &d) const {
+      size_t h;
+      memcpy(&h, d.bytes, sizeof(h));
+      return h;
+    }
+  };
+
+  /// stats_t describes the work of the memory tier
+  struct stats_t {
+    size_t hits;      // Reads of buffers whose bytes were in memory
+    size_t misses;    // Reads that paged a buffer in from a file
+    size_t evictions; // Times a buffer's bytes were dropped from memory
+    size_t resident;  // Stored bytes of live buffers that are in memory
+    size_t spilled;   // Bytes written to the spill file
+
+    /// Get the fraction of reads that did not touch the spill file
+    ///
+    /// @return The hit rate, between 0 and 1
+    double hit_rate() const {
+      return hits + misses == 0 ? 1 : (double)hits / (hits + misses);
+    }
+  };
+
+private:
+  /// The number of stripes
+  static const size_t STRIPES = 64;
+
+  /// stripe_t is one lock and the part of the set that it protects
+  struct alignas(64) stripe_t {
+    std::mutex lock;
+    std::unordered_map<digest_t, std::weak_ptr<const content_t>, digest_hash>
+        blobs;
+  };
+
+  /// state_t is the set itself.  It is shared with every buffer's deleter, so
+  /// that it outlives the store if a buffer does.
+  struct state_t {
+    stripe_t stripes[STRIPES];
+
+    /// The stored bytes of live buffers that are in memory
+    std::atomic<size_t> resident{0};
+
+    /// Find the stripe that holds a digest
+    ///
+    /// @param d The digest
+    ///
+    /// @return The stripe
+    stripe_t &stripe(const digest_t &d) {
+      // NB: digest_hash uses the first word, so we use the last byte
+      return stripes[d.bytes[SHA256_DIGEST_LENGTH - 1] % STRIPES];
+    }
+  };
+
+  /// deleter_t frees a buffer when its last reference is dropped, and removes
+  /// it from the store
+  struct deleter_t {
+    std::shared_ptr<state_t> state; // The store's set
+    digest_t digest;                // The buffer's digest
+
+    void operator()(const content_t *buf) const {
+      stripe_t &s = state->stripe(digest);
+      {
+        std::lock_guard<std::mutex> g(s.lock);
+        // NB: Another thread may have replaced the entry with a new buffer
+        //     holding the same bytes, after ours expired but before we locked
+        auto it = s.blobs.find(digest);
+        if (it != s.blobs.end() && it->second.expired())
+          s.blobs.erase(it);
+      }
+      if (buf->stored())
+        state->resident.fetch_sub(buf->stored_size);
+      delete buf;
+    }
+  };
+
+  /// The set
+  std::shared_ptr<state_t> state = std::make_shared<state_t>();
+
+  /// The smallest content to compress, or 0 to never compress
+  const size_t compress_min;
+
+  /// The most stored bytes to keep in memory, or 0 for no limit
+  const size_t budget;
+
+  /// The number of seconds after which an unread buffer is spilled, or 0 to
+  /// only spill when over budget
+  const uint32_t window;
+
+  /// The spill file, or -1 if the store has no memory tier
+  int fd = -1;
+
+  /// The name of the spill file
+  const std::string spill_name;
+
+  /// The size of the spill file.  Only the sweeper thread uses it.
+  size_t file_end = 0;
+
+  /// When the store was made.  Clock ticks are seconds since then.
+  const std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+
+  /// Counters for stats()
+  std::atomic<size_t> hits{0}, misses{0}, evictions{0}, spilled{0};
+
+  /// The sweeper thread, and what it needs to sleep and to stop
+  std::thread sweeper;
+  std::mutex sweep_lock;
+  std::condition_variable wake;
+  bool stopping = false;
+
+  /// Get the current time
+  ///
+  /// @return The number of clock ticks since the store was made
+  uint32_t now() const {
+    return std::chrono::duration_cast<std::chrono::seconds>(
+               std::chrono::steady_clock::now() - start)
+        .count();
+  }
+
+  /// Wake the sweeper if the store is over its budget
+  void check_budget() {
+    if (budget > 0 && state->resident.load(std::memory_order_relaxed) > budget)
+      wake.notify_one();
+  }
+
+  /// Find the live buffer with a digest
+  ///
+  /// @param d The digest
+  ///
+  /// @return The buffer, or nullptr if there is none
+  content_ptr find(const digest_t &d) {
+    stripe_t &s = state->stripe(d);
+    std::lock_guard<std::mutex> g(s.lock);
+    auto it = s.blobs.find(d);
+    return it == s.blobs.end() ? nullptr : it->second.lock();
+  }
+
+  /// Add a new buffer to the set, unless another thread has added one with the
+  /// same digest
+  ///
+  /// @param c The new buffer
+  /// @param d The digest of its content
+  ///
+  /// @return The buffer that is in the set
+  content_ptr insert(std::unique_ptr<content_t> c, const digest_t &d) {
+    content_ptr fresh;
+    {
+      stripe_t &s = state->stripe(d);
+      std::lock_guard<std::mutex> g(s.lock);
+      auto &slot = s.blobs[d];
+      if (content_ptr live = slot.lock())
+        return live;
+      c->last_use.store(now(), std::memory_order_relaxed);
+      if (c->stored())
+        state->resident.fetch_add(c->stored_size);
+      fresh = content_ptr(c.release(), deleter_t{state, d});
+      slot = fresh;
+    }
+    check_budget();
+    return fresh;
+  }
+
+  /// Read a buffer's stored bytes from its data file, or from the spill file
+  ///
+  /// @param c The buffer
+  ///
+  /// @return The stored bytes, or nullptr on an I/O error or a bad checksum
+  bytes_ptr load(const content_t &c) const {
+    int64_t off = c.offset.load(std::memory_order_acquire);
+    int f = c.file ? c.file->fd : fd;
+    if (off < 0 || f < 0)
+      return nullptr;
+    auto b = std::make_shared<std::vector<uint8_t>>(c.stored_size);
+    for (size_t done = 0; done < b->size();) {
+      ssize_t n = pread(f, b->data() + done, b->size() - done, off + done);
+      if (n == 0 || (n < 0 && errno != EINTR))
+        return nullptr;
+      done += n > 0 ? n : 0;
+    }
+    if (c.file && crc32c(b->data(), b->size()) != c.crc) {
+      std::cout << "Bad checksum for content at offset " << off << "\n";
+      return nullptr;
+    }
+    return b;
+  }
+
+  /// Bring a spilled buffer's stored bytes back into memory
+  ///
+  /// @param c The buffer
+  ///
+  /// @return The stored bytes, or nullptr on an I/O error
+  bytes_ptr page_in(const content_t &c) {
+    bytes_ptr b = load(c);
+    if (!b)
+      return nullptr;
+    // NB: If another reader paged the buffer in first, we use its copy
+    bytes_ptr none;
+    if (!std::atomic_compare_exchange_strong(&c.bytes, &none, b))
+      return none;
+    state->resident.fetch_add(c.stored_size);
+    check_budget();
+    return b;
+  }
+
+  /// Drop a buffer's stored bytes from memory, first writing them to the
+  /// spill file if they are not there yet.  Only the sweeper calls this.
+  ///
+  /// @param c The buffer
+  ///
+  /// @return false on an I/O error, true otherwise
+  bool evict(const content_t &c) {
+    if (c.offset.load(std::memory_order_relaxed) < 0) {
+      bytes_ptr b = c.stored();
+      if (!b)
+        return true;
+      for (size_t done = 0; done < b->size();) {
+        ssize_t n = pwrite(fd, b->data() + done, b->size() - done,
+                           file_end + done);
+        if (n <= 0 && errno != EINTR)
+          return false;
+        done += n > 0 ? n : 0;
+      }
+      // NB: The release pairs with load(), so a reader that sees the offset
+      //     finds the bytes in the file
+      c.offset.store(file_end, std::memory_order_release);
+      file_end += b->size();
+      spilled.store(file_end, std::memory_order_relaxed);
+    }
+    if (std::atomic_exchange(&c.bytes, bytes_ptr())) {
+      state->resident.fetch_sub(c.stored_size);
+      evictions.fetch_add(1, std::memory_order_relaxed);
+    }
+    return true;
+  }
+
+  /// Spill every buffer that is cold, and then the least recently read
+  /// buffers, until the store is within its budget
+  void sweep() {
+    // NB: References are collected under the stripe locks, but only dropped
+    //     after, since dropping the last one runs the deleter, which locks
+    std::vector<content_ptr> live;
+    for (auto &s : state->stripes) {
+      std::lock_guard<std::mutex> g(s.lock);
+      for (auto &b : s.blobs)
+        if (content_ptr c = b.second.lock())
+          live.push_back(std::move(c));
+    }
+    auto out = [](const content_ptr &c) { return !c->stored(); };
+    live.erase(std::remove_if(live.begin(), live.end(), out), live.end());
+    auto used = [](const content_ptr &c) {
+      return c->last_use.load(std::memory_order_relaxed);
+    };
+    std::sort(live.begin(), live.end(),
+              [&](const content_ptr &a, const content_ptr &b) {
+                return used(a) < used(b);
+              });
+    uint32_t t = now();
+    for (auto &c : live) {
+      bool cold = window > 0 && t - used(c) >= window;
+      bool over = budget > 0 && state->resident.load() > budget;
+      if ((!cold && !over) || !evict(*c))
+        break;
+    }
+  }
+
+  /// The main loop of the sweeper thread
+  void run_sweeper() {
+    auto period = std::chrono::seconds(std::max<uint32_t>(window / 4, 1));
+    std::unique_lock<std::mutex> g(sweep_lock);
+    while (!stopping) {
+      wake.wait_for(g, period);
+      if (stopping)
+        return;
+      g.unlock();
+      sweep();
+      g.lock();
+    }
+  }
+
+public:
+  /// Construct an empty store
+  ///
+  /// @param min    The smallest content to compress, or 0 to never compress
+  /// @param budget The most stored bytes to keep in memory, or 0 for no limit
+  /// @param window The number of seconds after which an unread buffer is
+  ///               spilled, or 0 for no limit
+  /// @param spill  The name of the spill file.  It is only used (and created)
+  ///               if budget or window is set.
+  blob_store(size_t min = 0, size_t budget = 0, uint32_t window = 0,
+             const std::string &spill = "")
+      : compress_min(min), budget(budget), window(window), spill_name(spill) {
+    if (budget == 0 && window == 0)
+      return;
+    fd = open(spill.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+      std::cout << "Could not open " << spill << ": " << strerror(errno)
+                << "; keeping all content in memory\n";
+      return;
+    }
+    sweeper = std::thread([this]() { run_sweeper(); });
+  }
+
+  /// Stop the sweeper, and close and remove the spill file
+  ~blob_store() {
+    if (fd < 0)
+      return;
+    {
+      std::lock_guard<std::mutex> g(sweep_lock);
+      stopping = true;
+    }
+    wake.notify_one();
+    sweeper.join();
+    close(fd);
+    unlink(spill_name.c_str());
+  }
+
+  /// Get the buffer that holds some bytes, making it if no buffer does
+  ///
+  /// @param data The bytes
+  /// @param len  The number of bytes
+  ///
+  /// @return A reference to the buffer, or nullptr if len is 0
+  content_ptr intern(const uint8_t *data, size_t len) {
+    if (len == 0)
+      return nullptr;
+    digest_t d = digest(data, len);
+    if (content_ptr c = find(d))
+      return c;
+    return insert(pack_content(data, len, compress_min), d);
+  }
+
+  /// Get the buffer that holds some content, using the given buffer if no
+  /// buffer does.  This is for content that was stored in a file along with
+  /// its digest.
+  ///
+  /// @param c A new buffer for the content
+  /// @param d The digest of the content
+  ///
+  /// @return A reference to the buffer, or nullptr if the content is empty
+  content_ptr intern(std::unique_ptr<content_t> c, const digest_t &d) {
+    if (c->raw_size == 0)
+      return nullptr;
+    if (content_ptr live = find(d))
+      return live;
+    // NB: Content that is still in a data file is not read just to compress
+    //     it
+    if (!c->compressed && compress_min > 0 && c->raw_size >= compress_min &&
+        c->stored())
+      c = pack_content(c->stored()->data(), c->raw_size, compress_min);
+    return insert(std::move(c), d);
+  }
+
+  /// Read the content of a buffer, paging it in if it is not in memory
+  ///
+  /// @param c The buffer, or nullptr
+  ///
+  /// @return The raw bytes, or nullptr if c is null or cannot be read
+  bytes_ptr read(const content_ptr &c) {
+    if (!c)
+      return nullptr;
+    bytes_ptr b = c->stored();
+    if (fd >= 0) {
+      // NB: Skipping the store when the tick has not changed keeps hot
+      //     buffers' cache lines shared
+      uint32_t t = now();
+      if (c->last_use.load(std::memory_order_relaxed) != t)
+        c->last_use.store(t, std::memory_order_relaxed);
+      if (b)
+        hits.fetch_add(1, std::memory_order_relaxed);
+    }
+    if (!b) {
+      misses.fetch_add(1, std::memory_order_relaxed);
+      b = page_in(*c);
+    }
+    return b ? unpack_content(*c, b) : nullptr;
+  }
+
+  /// Get the stored bytes of a buffer, without paging it in (e.g., to write
+  /// them to a file)
+  ///
+  /// @param c The buffer
+  ///
+  /// @return The stored bytes, or nullptr on an I/O error
+  bytes_ptr stored(const content_t &c) const {
+    bytes_ptr b = c.stored();
+    return b ? b : load(c);
+  }
+
+  /// Get the digest of a buffer that was made by a blob_store
+  ///
+  /// @param c The buffer
+  ///
+  /// @return The buffer's digest, or nullptr if c was not made by a blob_store
+  static const digest_t *digest_of(const content_ptr &c) {
+    auto *d = std::get_deleter<deleter_t>(c);
+    return d ? &d->digest : nullptr;
+  }
+
+  /// Count the distinct buffers in the store
+  ///
+  /// @return The number of buffers that are currently in use
+  size_t size() const {
+    size_t n = 0;
+    for (auto &s : state->stripes) {
+      std::lock_guard<std::mutex> g(s.lock);
+      n += s.blobs.size();
+    }
+    return n;
+  }
+
+  /// Get the memory tier's counters
+  ///
+  /// @return A snapshot of the counters
+  stats_t stats() const {
+    return {hits.load(), misses.load(), evictions.load(),
+            state->resident.load(), spilled.load()};
+  }
+};
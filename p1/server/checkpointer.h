@@ -0,0 +1,111 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <thread>
+#include <unistd.h>
+
+/// checkpointer runs a save function on a background thread, so that a request
+/// to persist the data can be acknowledged as soon as it has been scheduled.
+///
+/// Requests are numbered.  Request n is durable once a save that started after
+/// it was made has succeeded, so requests that arrive while a save is running
+/// are all satisfied by the next one, and a burst of requests costs at most two
+/// saves.
+///
+/// The thread runs at a lower CPU priority than the threads that serve
+/// requests, so that a long save does not take cores away from them.
+class checkpointer {
+  /// The function that saves the data.  It returns false on an error.
+  const std::function<bool()> save;
+
+  /// The background thread.  It is started by the first request.
+  std::thread worker;
+
+  /// The state shared with the thread, which is protected by lock
+  std::mutex lock;
+  std::condition_variable wake;
+  uint64_t requested = 0; // The number of the last request
+  uint64_t attempted = 0; // The last request covered by a save that finished
+  uint64_t durable = 0;   // The last request covered by a save that succeeded
+  uint64_t failed = 0;    // The number of saves that failed
+  bool running = false;   // true while a save is running
+  bool stopping = false;
+
+  /// The main loop of the background thread
+  void run() {
+    // NB: On Linux, the nice value is per thread
+    setpriority(PRIO_PROCESS, syscall(SYS_gettid), 10);
+    std::unique_lock<std::mutex> g(lock);
+    while (true) {
+      wake.wait(g, [&]() { return stopping || requested > attempted; });
+      // NB: A request that has been acknowledged is saved, even if we are
+      //     stopping
+      if (requested == attempted)
+        return;
+      uint64_t target = requested;
+      running = true;
+      g.unlock();
+      bool ok = save();
+      g.lock();
+      running = false;
+      attempted = target;
+      if (ok)
+        durable = target;
+      else
+        ++failed;
+    }
+  }
+
+public:
+  /// status_t reports the progress of the checkpoints
+  struct status_t {
+    uint64_t requested; // The number of the last request
+    uint64_t durable;   // The last request whose data is durable
+    uint64_t failed;    // The number of saves that have failed
+    bool running;       // true if a save is running
+  };
+
+  /// Construct a checkpointer
+  ///
+  /// @param save The function that saves the data.  It returns false on an
+  ///             error.
+  checkpointer(std::function<bool()> save) : save(std::move(save)) {}
+
+  /// Finish any requested save, and stop the thread
+  ~checkpointer() { stop(); }
+
+  /// Request a save
+  ///
+  /// @return The number of the request
+  uint64_t request() {
+    std::lock_guard<std::mutex> g(lock);
+    if (!worker.joinable())
+      worker = std::thread([this]() { run(); });
+    wake.notify_one();
+    return ++requested;
+  }
+
+  /// Report the progress of the checkpoints
+  status_t status() {
+    std::lock_guard<std::mutex> g(lock);
+    return {requested, durable, failed, running};
+  }
+
+  /// Finish any requested save, and stop the thread.  No requests may be made
+  /// while this runs, or after.
+  void stop() {
+    {
+      std::lock_guard<std::mutex> g(lock);
+      if (!worker.joinable())
+        return;
+      stopping = true;
+    }
+    wake.notify_one();
+    worker.join();
+  }
+};
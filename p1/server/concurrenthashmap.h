@@ -0,0 +1,1311 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "../common/epoch.h"
+#include "../common/slab.h"
+
+#include "map.h"
+
+/// ConcurrentHashMap is a concurrent implementation of the Map interface (a
+/// Key/Value store).  It is implemented as an array of buckets, with one
+/// reader/writer lock per bucket.  Each bucket is a singly-linked chain of
+/// nodes, so operations are O(1) as long as the number of buckets is
+/// proportional to the number of keys.
+///
+/// The table grows and shrinks online using linear hashing.  The number of
+/// buckets passed to the constructor is the minimum size of the table.  When
+/// the load factor rises above MAX_LOAD, each mutating operation splits up to
+/// RESIZE_STEPS buckets (moving about half of the entries of one old bucket
+/// into one new bucket) after it releases its own lock.  When the load factor
+/// falls below MIN_LOAD, buckets are merged back in the same way.  There is
+/// never a stop-the-world rehash: a split only holds the locks of the two
+/// buckets it touches.
+///
+/// Buckets live in fixed-size chunks that are never moved, so a bucket's
+/// address is stable for the life of the map.  Chunks are found through a
+/// directory of segments whose sizes double, so the directory itself never
+/// needs to be reallocated either.
+///
+/// The ConcurrentHashMap is templated on the Key and Value types.
+///
+/// This map uses map_hash to map keys to positions in the array, so lookups
+/// can be done with any key type that map_hash<K> accepts and that K can be
+/// compared to (e.g., std::string_view when K is std::string).
+///
+/// This map provides strong consistency guarantees: every mutating operation
+/// and do_all_readonly use two-phase locking (2PL), and the lambda parameters
+/// to methods enable nesting of 2PL operations across maps.
+///
+/// Point reads (do_with_readonly) take no locks at all.  Once a node is linked
+/// into a chain, its key and value never change: writers that update a value
+/// link in a new node in place of the old one, and hand the old one to
+/// epoch_retire(), which frees it after every reader that might still see it
+/// has finished (see common/epoch.h).  A reader only writes its own epoch
+/// record, so concurrent readers of a hot key never bounce a cache line between
+/// cores.  Splits and merges relink nodes between chains, so readers validate
+/// each lookup against resize_seq, a sequence lock that is odd while a resize
+/// is in progress, and retry if it changed.  The cost is that do_with runs its
+/// function on a copy of the value, so that readers of the old version are not
+/// disturbed.  A function that reports that it changed nothing costs no
+/// allocation.
+///
+/// Batch operations (insert_batch, upsert_batch) hash every key first, then
+/// sort the keys by bucket, so that each bucket is locked once per batch no
+/// matter how many of the batch's keys it holds.  They hold resize_lock, so
+/// that keys stay in their buckets while the batch runs, and grow the table to
+/// fit the batch up front instead of splitting as they go.  While one group of
+/// keys is being processed, the buckets of later groups are prefetched, so
+/// that their cache misses overlap with useful work.  Batched reads
+/// (do_with_readonly_many) take no locks, but prefetch in the same way.
+///
+/// Full scans come in two forms.  do_all_readonly uses 2PL, so it blocks every
+/// writer for the whole scan.  do_all_snapshot instead gives a consistent
+/// point-in-time view while writers keep running: while a snapshot is open,
+/// each write is stamped from a snapshot clock, and the version it replaces
+/// (or a tombstone, for a remove) stays reachable from the new node.  The
+/// scanner only ever holds one bucket lock (shared) at a time, and reports the
+/// newest version of each key that is no newer than its snapshot.  Any number
+/// of snapshots may be open at once.  While one is, the table does not resize
+/// (it may grow past MAX_LOAD until the last one closes), so that every
+/// snapshot sees the same buckets, but nothing else waits for the scans.  When
+/// the last snapshot closes, the old versions are pruned.
+///
+/// @param K The type of the keys in this map
+/// @param V The type of the values in this map
+template <typename K, typename V> class ConcurrentHashMap : public Map<K, V> {
+  /// The size of a cache line.  Buckets are aligned to this, so that two
+  /// threads working on neighboring buckets do not false-share a line.
+  static const size_t CACHE_LINE = 64;
+
+  /// Grow the table when there are more than this many entries per bucket
+  static constexpr double MAX_LOAD = 2.0;
+
+  /// Shrink the table when there are fewer than this many entries per bucket
+  static constexpr double MIN_LOAD = 0.5;
+
+  /// The most buckets that one operation will split or merge before returning
+  static const size_t RESIZE_STEPS = 2;
+
+  /// The number of buckets in a chunk
+  static const size_t CHUNK_SIZE = 1024;
+
+  /// The number of chunk pointers in the first directory segment.  Segment s
+  /// (s > 0) holds SEG0_CHUNKS << (s - 1) chunk pointers.
+  static const size_t SEG0_CHUNKS = 64;
+
+  /// The number of directory segments.  This is enough for 2^64 buckets.
+  static const size_t NUM_SEGS = 64;
+
+  /// The number of bits of the packed state word that hold the split pointer
+  static const size_t SPLIT_BITS = 58;
+
+  /// How many buckets ahead of the current one a batch operation prefetches.
+  /// The first node of a bucket's chain is prefetched half as far ahead, by
+  /// which time the bucket itself should be in the cache.
+  static const size_t PREFETCH_DIST = 8;
+
+  /// Whether values hold their own keys (see map_key_of in map.h)
+  static constexpr bool EMBEDDED_KEY = map_key_of<V>::embedded;
+
+  /// no_key_t takes the place of a node's key when its value holds the key
+  struct no_key_t {
+    template <typename Q> no_key_t(Q &&) {}
+  };
+
+  /// node_t is one key/value pair in a bucket's chain.  Only next and older
+  /// may change after the node is published.  Nodes come from the calling
+  /// thread's slab heap (see common/slab.h), not the global allocator.
+  ///
+  /// The value comes first, so that the fields at the front of the value (for
+  /// an AuthRecord, the salt and hashed password) share a cache line with
+  /// the start of the node.  If the value holds its own key, the node does not
+  /// store another copy of it.
+  struct node_t {
+    /// The value
+    V val;
+
+    /// The next node in the chain
+    std::atomic<node_t *> next{nullptr};
+
+    /// The snapshot clock when this version was written, or 0 if no snapshot
+    /// was open at the time
+    uint64_t born = 0;
+
+    /// true if this version is a tombstone, recording that the key was removed
+    /// while a snapshot was open
+    bool dead = false;
+
+    /// The key, unless the value holds it
+    const std::conditional_t<EMBEDDED_KEY, no_key_t, K> stored_key;
+
+    /// The version that this one replaced, if a snapshot might still need it.
+    /// Only accessed while holding the bucket's lock.
+    node_t *older = nullptr;
+
+    /// Construct a node that is not yet in any chain
+    ///
+    /// @param k The key (a K, or the key of the node that this one replaces).
+    ///          If the value holds its key, this is ignored.
+    /// @param v The value
+    template <typename Q>
+    node_t(Q &&k, V v) : val(std::move(v)), stored_key(std::forward<Q>(k)) {}
+
+    /// Get the key
+    ///
+    /// @return A reference to the key, or a view of the key in the value
+    decltype(auto) key() const {
+      if constexpr (EMBEDDED_KEY)
+        return map_key_of<V>::get(val);
+      else
+        return (stored_key);
+    }
+
+    /// Allocate memory for a node from the slab allocator
+    ///
+    /// @param size The size of the node
+    static void *operator new(size_t size) { return slab_alloc(size); }
+
+    /// Return a node's memory to the slab allocator
+    ///
+    /// @param ptr  The node
+    /// @param size The size of the node
+    static void operator delete(void *ptr, size_t size) {
+      slab_free(ptr, size);
+    }
+
+    /// Free the older versions of this node (iteratively, since a hot key can
+    /// build up a long history during a long scan)
+    ~node_t() {
+      for (node_t *o = older; o != nullptr;) {
+        node_t *next_older = o->older;
+        o->older = nullptr;
+        delete o;
+        o = next_older;
+      }
+    }
+  };
+
+  /// bucket_t is one bucket of the table: a reader/writer lock and the chain of
+  /// key/value pairs that hash to this bucket.  Each bucket starts on its own
+  /// cache line.
+  struct alignas(CACHE_LINE) bucket_t {
+    /// The lock protecting this bucket.  Writers take it exclusive, and
+    /// do_all_readonly takes it shared.  Point reads do not take it.
+    std::shared_mutex lock;
+
+    /// The first node in this bucket's chain
+    std::atomic<node_t *> head{nullptr};
+
+    /// Free the chain.  No reader may be using the map.
+    ~bucket_t() {
+      for (node_t *n = head.load(std::memory_order_relaxed); n != nullptr;) {
+        node_t *next = n->next.load(std::memory_order_relaxed);
+        delete n;
+        n = next;
+      }
+    }
+  };
+
+  /// The directory: each segment is an array of pointers to chunks of buckets.
+  /// Segments and chunks are allocated while holding resize_lock, and published
+  /// with release stores before any key can hash to them.
+  std::atomic<std::atomic<bucket_t *> *> segments[NUM_SEGS];
+
+  /// The number of buckets the table started with.  It never shrinks below
+  /// this.
+  const size_t base_buckets;
+
+  /// The linear hashing state, packed into one word so it can be read
+  /// atomically: the level L is in the high bits and the split pointer p is in
+  /// the low SPLIT_BITS bits.  The table has (base_buckets << L) + p buckets.
+  /// It is only changed while holding resize_lock and the locks of every
+  /// bucket whose keys it moves.
+  std::atomic<uint64_t> state{0};
+
+  /// A sequence lock for lock-free readers: it is odd while a split, merge, or
+  /// clear is moving nodes between chains, and is incremented again when the
+  /// move is done.
+  std::atomic<uint64_t> resize_seq{0};
+
+  /// The number of open snapshots.  Writers only keep old versions, and the
+  /// table only stays the same size, while this is nonzero.  It is only
+  /// incremented while holding resize_lock, so an operation that holds
+  /// resize_lock and sees it at zero knows that no snapshot can open until it
+  /// is done.
+  std::atomic<size_t> snapshots{0};
+
+  /// The snapshot clock.  It only advances while a snapshot is open.
+  std::atomic<uint64_t> snap_clock{0};
+
+  /// The number of entries in the table.  Only mutating operations touch it.
+  std::atomic<size_t> count{0};
+
+  /// Serializes splits, merges, and whole-table operations
+  std::mutex resize_lock;
+
+  /// The hash function to use for mapping keys to buckets.  It accepts
+  /// lookup keys (i.e., std::string_view) as well as K.
+  map_hash<K> hasher;
+
+  /// Get the number of buckets described by a state word
+  ///
+  /// @param s The state word
+  ///
+  /// @return The number of buckets in use
+  size_t buckets_in(uint64_t s) const {
+    return (base_buckets << (s >> SPLIT_BITS)) +
+           (s & ((uint64_t(1) << SPLIT_BITS) - 1));
+  }
+
+  /// Map a hash to a bucket index, using linear hashing
+  ///
+  /// @param h The hash of a key
+  /// @param s The state word to use
+  ///
+  /// @return The index of the bucket that holds keys with this hash
+  size_t index_of(size_t h, uint64_t s) const {
+    size_t n = base_buckets << (s >> SPLIT_BITS);
+    size_t i = h % n;
+    if (i < (s & ((uint64_t(1) << SPLIT_BITS) - 1)))
+      i = h % (n << 1);
+    return i;
+  }
+
+  /// Find the directory slot for the chunk that holds a bucket
+  ///
+  /// @param idx The index of the bucket
+  ///
+  /// @return A reference to the chunk pointer, or nullptr if its directory
+  ///         segment has not been allocated
+  std::atomic<bucket_t *> *chunk_slot(size_t idx) const {
+    size_t c = idx / CHUNK_SIZE;
+    size_t seg = 0, off = c;
+    if (c >= SEG0_CHUNKS) {
+      seg = 64 - __builtin_clzll(c / SEG0_CHUNKS);
+      off = c - (SEG0_CHUNKS << (seg - 1));
+    }
+    auto *s = segments[seg].load(std::memory_order_acquire);
+    return s == nullptr ? nullptr : &s[off];
+  }
+
+  /// Get the bucket at an index.  The bucket must have been allocated.
+  ///
+  /// @param idx The index of the bucket
+  ///
+  /// @return A reference to the bucket
+  bucket_t &bucket_at(size_t idx) const {
+    return chunk_slot(idx)->load(std::memory_order_acquire)[idx % CHUNK_SIZE];
+  }
+
+  /// Make sure the bucket at an index is allocated.  The caller must hold
+  /// resize_lock, or be the constructor.
+  ///
+  /// @param idx The index of the bucket
+  void ensure_bucket(size_t idx) {
+    size_t c = idx / CHUNK_SIZE;
+    size_t seg = 0, len = SEG0_CHUNKS;
+    if (c >= SEG0_CHUNKS) {
+      seg = 64 - __builtin_clzll(c / SEG0_CHUNKS);
+      len = SEG0_CHUNKS << (seg - 1);
+    }
+    if (segments[seg].load(std::memory_order_relaxed) == nullptr)
+      segments[seg].store(new std::atomic<bucket_t *>[len](),
+                          std::memory_order_release);
+    auto *slot = chunk_slot(idx);
+    if (slot->load(std::memory_order_relaxed) == nullptr)
+      slot->store(new bucket_t[CHUNK_SIZE], std::memory_order_release);
+  }
+
+  /// Start loading a bucket into the cache
+  ///
+  /// @param idx The index of the bucket
+  void prefetch_bucket(size_t idx) const {
+    __builtin_prefetch(&bucket_at(idx), 1);
+  }
+
+  /// Start loading the first node of a bucket's chain into the cache.  The
+  /// caller must be in an epoch_guard, or hold resize_lock.
+  ///
+  /// @param idx The index of the bucket
+  void prefetch_chain(size_t idx) const {
+    __builtin_prefetch(bucket_at(idx).head.load(std::memory_order_relaxed));
+  }
+
+  /// Lock the bucket that holds a hash.  The state is re-checked after the lock
+  /// is acquired, in case a split or merge moved the hash to another bucket
+  /// while we were waiting.
+  ///
+  /// @param h    The hash of the key
+  /// @param lock An (unlocked) lock object, which will hold the bucket's lock
+  ///             on return
+  ///
+  /// @return A reference to the locked bucket
+  template <typename L> bucket_t &lock_bucket(size_t h, L &lock) {
+    while (true) {
+      size_t idx = index_of(h, state.load(std::memory_order_acquire));
+      bucket_t &b = bucket_at(idx);
+      lock = L(b.lock);
+      if (index_of(h, state.load(std::memory_order_acquire)) == idx)
+        return b;
+      lock.unlock();
+    }
+  }
+
+  /// Find the entry with a given key in a bucket.  The caller must hold the
+  /// bucket's lock.
+  ///
+  /// @param b   The bucket to search
+  /// @param key The key to find (a K, or any type that K can be compared to)
+  ///
+  /// @return The link that points to the entry's node.  If the key is not
+  ///         found, this is the (null) link at the end of the chain.
+  template <typename Q>
+  static std::atomic<node_t *> *find(bucket_t &b, const Q &key) {
+    std::atomic<node_t *> *link = &b.head;
+    for (node_t *n; (n = link->load(std::memory_order_relaxed)) != nullptr;
+         link = &n->next)
+      if (n->key() == key)
+        return link;
+    return link;
+  }
+
+  /// Find the node for a key without taking any locks.  The caller must be in
+  /// an epoch_guard, which keeps the result alive.
+  ///
+  /// @param h   The hash of the key
+  /// @param key The key to find
+  ///
+  /// @return The key's node, or nullptr if it is not in the table
+  template <typename Q> node_t *lookup(size_t h, const Q &key) const {
+    while (true) {
+      uint64_t seq = resize_seq.load(std::memory_order_acquire);
+      if (seq & 1) {
+        std::this_thread::yield();
+        continue;
+      }
+      size_t idx = index_of(h, state.load(std::memory_order_acquire));
+      node_t *n = bucket_at(idx).head.load(std::memory_order_acquire);
+      while (n != nullptr && !(n->key() == key))
+        n = n->next.load(std::memory_order_acquire);
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (resize_seq.load(std::memory_order_relaxed) == seq)
+        return n;
+    }
+  }
+
+  /// Get a node's key as a K, for callbacks that take one.  If values hold
+  /// their own keys, this makes a copy.
+  ///
+  /// @param n The node
+  ///
+  /// @return The key
+  static decltype(auto) key_of(const node_t *n) {
+    if constexpr (EMBEDDED_KEY)
+      return K(n->key());
+    else
+      return n->key();
+  }
+
+  /// Make the value of a tombstone that replaces a node.  If values hold their
+  /// own keys, the tombstone needs a copy of the old value, so that it still
+  /// has the key.
+  ///
+  /// @param n The node that is being removed
+  ///
+  /// @return The value for the tombstone
+  static V tombstone_val(const node_t *n) {
+    if constexpr (EMBEDDED_KEY)
+      return n->val;
+    else
+      return V();
+  }
+
+  /// Check if a node holds a live (not removed) value
+  ///
+  /// @param n The node, or nullptr
+  ///
+  /// @return true if n is a live node
+  static bool live(const node_t *n) { return n != nullptr && !n->dead; }
+
+  /// Link a new version of a key in place of the node that a link points to,
+  /// or at the end of the chain if the link is null.  If a snapshot is open,
+  /// the new node is stamped and keeps the old one as its older version;
+  /// otherwise the old one is retired.  The caller must hold the bucket's lock.
+  ///
+  /// @param link The link to the old node
+  /// @param n    The new node
+  void install(std::atomic<node_t *> *link, node_t *n) {
+    node_t *old = link->load(std::memory_order_relaxed);
+    // NB: A snapshot counts itself before it reads snap_clock, so if we see no
+    //     snapshots, the snapshot will reach this bucket after we unlock it,
+    //     and will see n
+    bool keep = snapshots.load(std::memory_order_seq_cst) != 0;
+    if (keep) {
+      n->born = snap_clock.fetch_add(1, std::memory_order_seq_cst) + 1;
+      n->older = old;
+    }
+    if (old != nullptr)
+      n->next.store(old->next.load(std::memory_order_relaxed),
+                    std::memory_order_relaxed);
+    link->store(n, std::memory_order_release);
+    if (old != nullptr && !keep)
+      epoch_retire(old);
+  }
+
+  /// Find the version of a key that a snapshot should see
+  ///
+  /// @param n    The newest version of the key
+  /// @param snap The snapshot's clock value
+  ///
+  /// @return The newest version no newer than the snapshot, or nullptr
+  static const node_t *version_at(const node_t *n, uint64_t snap) {
+    while (n != nullptr && n->born > snap)
+      n = n->older;
+    return n;
+  }
+
+  /// Drop the old versions and tombstones that the last snapshot needed.  This
+  /// takes no lock but the lock of each bucket in turn, and it stops early if
+  /// a new snapshot opens, since that snapshot may need the versions that are
+  /// kept from then on.  Whatever it leaves behind is pruned when that
+  /// snapshot closes.
+  void prune() {
+    for (size_t i = 0; i < buckets_in(state.load(std::memory_order_acquire));
+         ++i) {
+      bucket_t &b = bucket_at(i);
+      std::unique_lock<std::shared_mutex> g(b.lock);
+      // NB: Once a new snapshot is open, writers keep old versions for it,
+      //     and we cannot tell those from the ones we are meant to drop
+      if (snapshots.load(std::memory_order_seq_cst) != 0)
+        return;
+      std::atomic<node_t *> *link = &b.head;
+      for (node_t *e; (e = link->load(std::memory_order_relaxed)) != nullptr;) {
+        // NB: Old versions were once in the chain, so a lock-free reader may
+        //     still be looking at one
+        for (node_t *o = e->older; o != nullptr;) {
+          node_t *next_older = o->older;
+          o->older = nullptr;
+          epoch_retire(o);
+          o = next_older;
+        }
+        e->older = nullptr;
+        if (e->dead) {
+          link->store(e->next.load(std::memory_order_relaxed),
+                      std::memory_order_release);
+          epoch_retire(e);
+        } else {
+          link = &e->next;
+        }
+      }
+    }
+  }
+
+  /// Mark the start of a resize for lock-free readers.  The caller must hold
+  /// resize_lock.
+  void begin_resize() {
+    resize_seq.store(resize_seq.load(std::memory_order_relaxed) + 1,
+                     std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+  }
+
+  /// Mark the end of a resize for lock-free readers.  The caller must hold
+  /// resize_lock.
+  void end_resize() {
+    resize_seq.store(resize_seq.load(std::memory_order_relaxed) + 1,
+                     std::memory_order_release);
+  }
+
+  /// Split the bucket at the split pointer, moving the entries that now hash
+  /// to the new bucket at the end of the table.  The caller must hold
+  /// resize_lock.
+  void split() {
+    uint64_t s = state.load(std::memory_order_relaxed);
+    uint64_t level = s >> SPLIT_BITS, p = s & ((uint64_t(1) << SPLIT_BITS) - 1);
+    size_t n = base_buckets << level;
+    ensure_bucket(p + n);
+    bucket_t &from = bucket_at(p), &to = bucket_at(p + n);
+    std::unique_lock<std::shared_mutex> g1(from.lock), g2(to.lock);
+    uint64_t next = (p + 1 == n) ? ((level + 1) << SPLIT_BITS) : s + 1;
+    // NB: Nodes keep their relative order, so every link we write points
+    //     forward in the old chain.  A reader that races with us may miss
+    //     nodes, but it cannot loop, and it will retry when it sees resize_seq
+    //     change.
+    begin_resize();
+    std::atomic<node_t *> *stay = &from.head, *move = &to.head;
+    for (node_t *e = from.head.load(std::memory_order_relaxed); e != nullptr;) {
+      node_t *after = e->next.load(std::memory_order_relaxed);
+      auto *&tail = index_of(hasher(e->key()), next) != p ? move : stay;
+      tail->store(e, std::memory_order_release);
+      tail = &e->next;
+      e = after;
+    }
+    stay->store(nullptr, std::memory_order_release);
+    move->store(nullptr, std::memory_order_release);
+    state.store(next, std::memory_order_release);
+    end_resize();
+  }
+
+  /// Merge the last bucket of the table back into the bucket it was split
+  /// from.  The caller must hold resize_lock, and the table must be larger
+  /// than base_buckets.
+  void merge() {
+    uint64_t s = state.load(std::memory_order_relaxed);
+    uint64_t level = s >> SPLIT_BITS, p = s & ((uint64_t(1) << SPLIT_BITS) - 1);
+    uint64_t prev = s - 1;
+    if (p == 0)
+      prev = ((level - 1) << SPLIT_BITS) | ((base_buckets << (level - 1)) - 1);
+    size_t into = prev & ((uint64_t(1) << SPLIT_BITS) - 1);
+    size_t last = into + (base_buckets << (prev >> SPLIT_BITS));
+    bucket_t &to = bucket_at(into), &from = bucket_at(last);
+    std::unique_lock<std::shared_mutex> g1(to.lock), g2(from.lock);
+    begin_resize();
+    std::atomic<node_t *> *tail = &to.head;
+    for (node_t *e; (e = tail->load(std::memory_order_relaxed)) != nullptr;)
+      tail = &e->next;
+    tail->store(from.head.load(std::memory_order_relaxed),
+                std::memory_order_release);
+    from.head.store(nullptr, std::memory_order_release);
+    state.store(prev, std::memory_order_release);
+    end_resize();
+  }
+
+  /// Check the load factor, and if it is out of range, do a few steps of
+  /// splitting or merging.  This must be called without holding any bucket
+  /// locks.  If another thread is already resizing, or a snapshot is open,
+  /// this returns immediately.
+  void rebalance() {
+    size_t n = buckets_in(state.load(std::memory_order_relaxed));
+    size_t c = count.load(std::memory_order_relaxed);
+    bool grow = c > MAX_LOAD * n;
+    bool shrink = n > base_buckets && c < MIN_LOAD * n;
+    if (!(grow || shrink))
+      return;
+    std::unique_lock<std::mutex> g(resize_lock, std::try_to_lock);
+    if (!g.owns_lock() || snapshots.load(std::memory_order_seq_cst) != 0)
+      return;
+    for (size_t i = 0; i < RESIZE_STEPS; ++i) {
+      n = buckets_in(state.load(std::memory_order_relaxed));
+      c = count.load(std::memory_order_relaxed);
+      if (c > MAX_LOAD * n)
+        split();
+      else if (n > base_buckets && c < MIN_LOAD * n)
+        merge();
+      else
+        break;
+    }
+  }
+
+  /// Split buckets until the table can take some number of new entries without
+  /// going over MAX_LOAD.  The caller must hold resize_lock.  While a snapshot
+  /// is open, this does nothing, and the batch overfills the table instead.
+  ///
+  /// @param extra The number of entries that are about to be added
+  void reserve(size_t extra) {
+    if (snapshots.load(std::memory_order_seq_cst) != 0)
+      return;
+    size_t want = count.load(std::memory_order_relaxed) + extra;
+    while (want > MAX_LOAD * buckets_in(state.load(std::memory_order_relaxed)))
+      split();
+  }
+
+  /// Run an operation on each key of a batch, with the keys grouped by bucket.
+  /// Each bucket is locked (exclusively) once, for all of its keys, and the
+  /// buckets are visited in increasing order, prefetching ahead.  Within a
+  /// bucket, keys are visited in the order they appear in the batch.  The
+  /// caller must hold resize_lock, so that keys cannot move between buckets.
+  ///
+  /// @param hashes The hash of each key in the batch
+  /// @param op     The operation.  It receives the locked bucket and the
+  ///               position of a key in the batch.
+  template <typename F>
+  void for_each_in_batch(const std::vector<size_t> &hashes, F &&op) {
+    uint64_t s = state.load(std::memory_order_relaxed);
+    std::vector<std::pair<size_t, size_t>> order(hashes.size());
+    for (size_t i = 0; i < hashes.size(); ++i)
+      order[i] = {index_of(hashes[i], s), i};
+    std::sort(order.begin(), order.end());
+    std::vector<size_t> groups;
+    for (size_t i = 0; i < order.size(); ++i)
+      if (i == 0 || order[i].first != order[i - 1].first)
+        groups.push_back(i);
+    groups.push_back(order.size());
+    size_t num_groups = groups.size() - 1;
+    for (size_t g = 0; g < num_groups; ++g) {
+      if (g + PREFETCH_DIST < num_groups)
+        prefetch_bucket(order[groups[g + PREFETCH_DIST]].first);
+      if (g + PREFETCH_DIST / 2 < num_groups)
+        prefetch_chain(order[groups[g + PREFETCH_DIST / 2]].first);
+      bucket_t &b = bucket_at(order[groups[g]].first);
+      std::unique_lock<std::shared_mutex> l(b.lock);
+      for (size_t i = groups[g]; i < groups[g + 1]; ++i)
+        op(b, order[i].second);
+    }
+  }
+
+  /// Lock every bucket in the table, in increasing order.  The caller must
+  /// hold resize_lock, so that the table does not change size.
+  ///
+  /// @param shared true to take the locks in shared mode, false for exclusive
+  ///
+  /// @return The number of buckets that were locked
+  size_t lock_all(bool shared) {
+    size_t n = buckets_in(state.load(std::memory_order_relaxed));
+    for (size_t i = 0; i < n; ++i)
+      shared ? bucket_at(i).lock.lock_shared() : bucket_at(i).lock.lock();
+    return n;
+  }
+
+  /// Unlock the first n buckets in the table, in decreasing order
+  ///
+  /// @param n      The number of buckets to unlock
+  /// @param shared true if the locks were taken in shared mode
+  void unlock_all(size_t n, bool shared) {
+    for (size_t i = n; i > 0; --i)
+      shared ? bucket_at(i - 1).lock.unlock_shared()
+             : bucket_at(i - 1).lock.unlock();
+  }
+
+public:
+  /// Construct by specifying the number of buckets it should have
+  ///
+  /// @param _buckets The initial (and minimum) number of buckets
+  ConcurrentHashMap(size_t _buckets)
+      : base_buckets(_buckets > 0 ? _buckets : 1) {
+    for (auto &s : segments)
+      s.store(nullptr, std::memory_order_relaxed);
+    for (size_t i = 0; i < base_buckets; i += CHUNK_SIZE)
+      ensure_bucket(i);
+  }
+
+  /// Destruct the ConcurrentHashMap
+  virtual ~ConcurrentHashMap() {
+    for (size_t seg = 0; seg < NUM_SEGS; ++seg) {
+      auto *s = segments[seg].load(std::memory_order_relaxed);
+      if (s == nullptr)
+        continue;
+      size_t len = seg == 0 ? SEG0_CHUNKS : SEG0_CHUNKS << (seg - 1);
+      for (size_t i = 0; i < len; ++i)
+        delete[] s[i].load(std::memory_order_relaxed);
+      delete[] s;
+    }
+  }
+
+  /// Clear the map.  This operation needs to use 2pl.  While a snapshot is
+  /// open, each entry is replaced by a tombstone instead, and the table keeps
+  /// its size.
+  virtual void clear() {
+    std::lock_guard<std::mutex> g(resize_lock);
+    size_t n = lock_all(false);
+    if (snapshots.load(std::memory_order_seq_cst) != 0) {
+      for (size_t i = 0; i < n; ++i) {
+        std::atomic<node_t *> *link = &bucket_at(i).head;
+        for (node_t *e; (e = link->load(std::memory_order_relaxed)) != nullptr;
+             link = &link->load(std::memory_order_relaxed)->next) {
+          if (e->dead)
+            continue;
+          node_t *t = new node_t(e->key(), tombstone_val(e));
+          t->dead = true;
+          install(link, t);
+        }
+      }
+      count.store(0, std::memory_order_relaxed);
+      unlock_all(n, false);
+      return;
+    }
+    begin_resize();
+    for (size_t i = 0; i < n; ++i) {
+      node_t *e =
+          bucket_at(i).head.exchange(nullptr, std::memory_order_acq_rel);
+      while (e != nullptr) {
+        node_t *next = e->next.load(std::memory_order_relaxed);
+        epoch_retire(e);
+        e = next;
+      }
+    }
+    count.store(0, std::memory_order_relaxed);
+    // Every bucket is empty, so we can drop back to the minimum size at once
+    state.store(0, std::memory_order_release);
+    end_resize();
+    unlock_all(n, false);
+  }
+
+  /// Insert the provided key/value pair only if there is no mapping for the key
+  /// yet.  This is the templated form of insert(): the callback is inlined,
+  /// and is never copied into a std::function.
+  ///
+  /// @param key        The key to insert
+  /// @param val        The value to insert
+  /// @param on_success Code to run if the insertion succeeds
+  ///
+  /// @return true if the key/value was inserted, false if the key already
+  ///         existed in the table
+  template <typename F> bool insert_with(K key, V val, F &&on_success) {
+    std::unique_lock<std::shared_mutex> g;
+    bucket_t &b = lock_bucket(hasher(key), g);
+    auto *link = find(b, key);
+    if (live(link->load(std::memory_order_relaxed)))
+      return false;
+    install(link, new node_t(std::move(key), std::move(val)));
+    count.fetch_add(1, std::memory_order_relaxed);
+    on_success();
+    g.unlock();
+    rebalance();
+    return true;
+  }
+
+  /// Insert the provided key/value pair if there is no mapping for the key yet.
+  /// If there is a key, then update the mapping by replacing the old value with
+  /// the provided value.  This is the templated form of upsert().
+  ///
+  /// @param key    The key to upsert
+  /// @param val    The value to upsert
+  /// @param on_ins Code to run if the upsert succeeds as an insert
+  /// @param on_upd Code to run if the upsert succeeds as an update
+  ///
+  /// @return true if the key/value was inserted, false if the key already
+  ///         existed in the table and was thus updated instead
+  template <typename FI, typename FU>
+  bool upsert_with(K key, V val, FI &&on_ins, FU &&on_upd) {
+    std::unique_lock<std::shared_mutex> g;
+    bucket_t &b = lock_bucket(hasher(key), g);
+    auto *link = find(b, key);
+    bool found = live(link->load(std::memory_order_relaxed));
+    install(link, new node_t(std::move(key), std::move(val)));
+    if (found) {
+      on_upd();
+      return false;
+    }
+    count.fetch_add(1, std::memory_order_relaxed);
+    on_ins();
+    g.unlock();
+    rebalance();
+    return true;
+  }
+
+  /// Apply a function to the value associated with a given key.  The function
+  /// is allowed to modify the value.  This is the templated form of do_with().
+  ///
+  /// The function runs on a copy of the value, which replaces the old value
+  /// when the function returns, so that concurrent lock-free readers always see
+  /// a complete version.  If the function returns a bool, it should be false
+  /// when it did not change the value, and then the old value is kept, and
+  /// nothing is allocated.
+  ///
+  /// @param key The key whose value will be modified
+  /// @param f   The function to apply to the key's value
+  ///
+  /// @return true if the key existed and the function was applied, false
+  ///         otherwise
+  template <typename Q, typename F> bool visit(const Q &key, F &&f) {
+    std::unique_lock<std::shared_mutex> g;
+    bucket_t &b = lock_bucket(hasher(key), g);
+    auto *link = find(b, key);
+    node_t *old = link->load(std::memory_order_relaxed);
+    if (!live(old))
+      return false;
+    V val(old->val);
+    if constexpr (std::is_same_v<decltype(f(val)), bool>) {
+      if (!f(val))
+        return true;
+    } else {
+      f(val);
+    }
+    install(link, new node_t(old->key(), std::move(val)));
+    return true;
+  }
+
+  /// Apply a function to the value associated with a given key.  The function
+  /// is not allowed to modify the value.  This is the templated form of
+  /// do_with_readonly().
+  ///
+  /// This takes no locks.  The function sees the version of the value that was
+  /// current when the key was found, even if a writer replaces it while the
+  /// function runs.
+  ///
+  /// @param key The key whose value will be read
+  /// @param f   The function to apply to the key's value
+  ///
+  /// @return true if the key existed and the function was applied, false
+  ///         otherwise
+  template <typename Q, typename F> bool visit_readonly(const Q &key, F &&f) {
+    epoch_guard eg;
+    node_t *n = lookup(hasher(key), key);
+    // NB: f only runs once the lookup is known to be valid, so it never runs
+    //     twice, and the epoch guard keeps n alive until we return
+    if (!live(n))
+      return false;
+    f(static_cast<const V &>(n->val));
+    return true;
+  }
+
+  /// Insert a batch of key/value pairs, skipping any whose key is already
+  /// mapped.  This is the templated form of insert_batch().
+  ///
+  /// @param entries    The key/value pairs to insert.  They are moved from.
+  /// @param on_success Code to run for each key that is inserted.  It runs
+  ///                   while the key's bucket is locked.
+  ///
+  /// @return The number of pairs that were inserted
+  template <typename F>
+  size_t insert_batch_with(std::vector<std::pair<K, V>> &entries,
+                           F &&on_success) {
+    std::vector<size_t> hashes(entries.size());
+    for (size_t i = 0; i < entries.size(); ++i)
+      hashes[i] = hasher(entries[i].first);
+    size_t added = 0;
+    {
+      std::lock_guard<std::mutex> g(resize_lock);
+      reserve(entries.size());
+      for_each_in_batch(hashes, [&](bucket_t &b, size_t i) {
+        auto *link = find(b, entries[i].first);
+        if (live(link->load(std::memory_order_relaxed)))
+          return;
+        node_t *n = new node_t(std::move(entries[i].first),
+                               std::move(entries[i].second));
+        install(link, n);
+        ++added;
+        on_success(key_of(n));
+      });
+      count.fetch_add(added, std::memory_order_relaxed);
+    }
+    rebalance();
+    return added;
+  }
+
+  /// Upsert a batch of key/value pairs.  This is the templated form of
+  /// upsert_batch().
+  ///
+  /// @param entries The key/value pairs to upsert.  They are moved from.
+  /// @param on_ins  Code to run for each key that is inserted
+  /// @param on_upd  Code to run for each key that is updated
+  ///
+  /// @return The number of pairs that were inserted (rather than updated)
+  template <typename FI, typename FU>
+  size_t upsert_batch_with(std::vector<std::pair<K, V>> &entries, FI &&on_ins,
+                           FU &&on_upd) {
+    std::vector<size_t> hashes(entries.size());
+    for (size_t i = 0; i < entries.size(); ++i)
+      hashes[i] = hasher(entries[i].first);
+    size_t added = 0;
+    {
+      std::lock_guard<std::mutex> g(resize_lock);
+      reserve(entries.size());
+      for_each_in_batch(hashes, [&](bucket_t &b, size_t i) {
+        auto *link = find(b, entries[i].first);
+        bool found = live(link->load(std::memory_order_relaxed));
+        node_t *n = new node_t(std::move(entries[i].first),
+                               std::move(entries[i].second));
+        install(link, n);
+        if (found) {
+          on_upd(key_of(n));
+        } else {
+          ++added;
+          on_ins(key_of(n));
+        }
+      });
+      count.fetch_add(added, std::memory_order_relaxed);
+    }
+    rebalance();
+    return added;
+  }
+
+  /// Apply a function to the values associated with a batch of keys.  The
+  /// function is not allowed to modify the values.  This is the templated form
+  /// of do_with_readonly_many().
+  ///
+  /// Like visit_readonly(), this takes no locks.  The whole batch runs in one
+  /// epoch_guard, so f should not block.
+  ///
+  /// @param keys The keys whose values will be read
+  /// @param f    The function to apply to each value that is found.  It
+  ///             receives the position of the key in `keys`, and the value.
+  ///
+  /// @return The number of keys that were found
+  template <typename Q, typename F>
+  size_t visit_readonly_many(const std::vector<Q> &keys, F &&f) {
+    size_t num = keys.size(), found = 0;
+    std::vector<size_t> hashes(num);
+    for (size_t i = 0; i < num; ++i)
+      hashes[i] = hasher(keys[i]);
+    epoch_guard eg;
+    for (size_t i = 0; i < num; ++i) {
+      // NB: A resize may move a key after we prefetch its bucket, which only
+      //     costs us the prefetch
+      uint64_t s = state.load(std::memory_order_relaxed);
+      if (i + PREFETCH_DIST < num)
+        prefetch_bucket(index_of(hashes[i + PREFETCH_DIST], s));
+      if (i + PREFETCH_DIST / 2 < num)
+        prefetch_chain(index_of(hashes[i + PREFETCH_DIST / 2], s));
+      node_t *n = lookup(hashes[i], keys[i]);
+      if (!live(n))
+        continue;
+      f(i, static_cast<const V &>(n->val));
+      ++found;
+    }
+    return found;
+  }
+
+  /// Remove the mapping from a key to its value.  This is the templated form of
+  /// remove().
+  ///
+  /// @param key        The key whose mapping should be removed
+  /// @param on_success Code to run if the remove succeeds
+  ///
+  /// @return true if the key was found and the value unmapped, false otherwise
+  template <typename Q, typename F>
+  bool remove_with(const Q &key, F &&on_success) {
+    std::unique_lock<std::shared_mutex> g;
+    bucket_t &b = lock_bucket(hasher(key), g);
+    auto *link = find(b, key);
+    node_t *old = link->load(std::memory_order_relaxed);
+    if (!live(old))
+      return false;
+    if (snapshots.load(std::memory_order_seq_cst) != 0) {
+      node_t *t = new node_t(old->key(), tombstone_val(old));
+      t->dead = true;
+      install(link, t);
+    } else {
+      link->store(old->next.load(std::memory_order_relaxed),
+                  std::memory_order_release);
+      epoch_retire(old);
+    }
+    count.fetch_sub(1, std::memory_order_relaxed);
+    on_success();
+    g.unlock();
+    rebalance();
+    return true;
+  }
+
+  /// Apply a function to every key/value pair in the map.  Note that the
+  /// function is not allowed to modify keys or values.  This is the templated
+  /// form of do_all_readonly().
+  ///
+  /// @param f    The function to apply to each key/value pair
+  /// @param then A function to run when this is done, but before unlocking...
+  ///             useful for 2pl
+  template <typename F, typename T> void visit_all_readonly(F &&f, T &&then) {
+    // NB: Holding resize_lock keeps the table from changing size, and bucket
+    //     locks are always acquired in increasing order, so two concurrent
+    //     do_all_readonly/clear calls cannot deadlock
+    std::lock_guard<std::mutex> g(resize_lock);
+    size_t n = lock_all(true);
+    for (size_t i = 0; i < n; ++i)
+      for (node_t *e = bucket_at(i).head.load(std::memory_order_acquire);
+           e != nullptr; e = e->next.load(std::memory_order_acquire))
+        if (!e->dead)
+          f(key_of(e), static_cast<const V &>(e->val));
+    then();
+    unlock_all(n, true);
+  }
+
+  /// snapshot_t is a consistent point-in-time view of the map.  Several threads
+  /// may scan one snapshot at once, each covering a range of its buckets (see
+  /// visit_snapshot()), and several snapshots may be open at once.  While any
+  /// snapshot exists, writers keep the old versions that it needs, and the
+  /// table does not resize.
+  class snapshot_t : public Map<K, V>::snapshot {
+    friend class ConcurrentHashMap;
+
+    ConcurrentHashMap &map;
+    uint64_t snap; // The version of the map that the snapshot sees
+    size_t n;      // The number of buckets
+
+    snapshot_t(ConcurrentHashMap &m) : map(m) {
+      // NB: resize_lock is only held while the snapshot is counted, so that no
+      //     resize is half done when we read the size.  From then on, resizes
+      //     see the count and skip.
+      std::lock_guard<std::mutex> g(map.resize_lock);
+      map.snapshots.fetch_add(1, std::memory_order_seq_cst);
+      snap = map.snap_clock.load(std::memory_order_seq_cst);
+      n = map.buckets_in(map.state.load(std::memory_order_relaxed));
+    }
+
+  public:
+    snapshot_t(const snapshot_t &) = delete;
+
+    virtual ~snapshot_t() {
+      if (map.snapshots.fetch_sub(1, std::memory_order_seq_cst) == 1)
+        map.prune();
+    }
+
+    /// Get the number of buckets that the snapshot covers
+    size_t buckets() const { return n; }
+
+    /// Get the number of parts of the snapshot, which are its buckets
+    virtual size_t parts() const { return n; }
+
+    /// Apply a function to every key/value pair in a range of the buckets of
+    /// the snapshot
+    ///
+    /// @param from The first bucket
+    /// @param to   The bucket after the last one
+    /// @param f    The function to apply to each key/value pair
+    virtual void scan(size_t from, size_t to,
+                      map_ref<void(typename Map<K, V>::key_view, const V &)> f)
+        const {
+      map.visit_snapshot(*this, from, to, f);
+    }
+  };
+
+  /// Take a snapshot of the map, to scan with visit_snapshot()
+  ///
+  /// @return The snapshot
+  snapshot_t snapshot() { return snapshot_t(*this); }
+
+  /// Apply a function to every key/value pair in a range of the buckets of a
+  /// snapshot.  Writers are not blocked while this runs.
+  ///
+  /// @param s    The snapshot
+  /// @param from The first bucket
+  /// @param to   The bucket after the last one
+  /// @param f    The function to apply to each key/value pair.  It runs while a
+  ///             bucket is locked, so it must not access this map.
+  template <typename F>
+  void visit_snapshot(const snapshot_t &s, size_t from, size_t to, F &&f) {
+    for (size_t i = from; i < to && i < s.n; ++i) {
+      bucket_t &b = bucket_at(i);
+      std::shared_lock<std::shared_mutex> l(b.lock);
+      for (node_t *e = b.head.load(std::memory_order_relaxed); e != nullptr;
+           e = e->next.load(std::memory_order_relaxed)) {
+        const node_t *v = version_at(e, s.snap);
+        if (live(v))
+          f(e->key(), static_cast<const V &>(v->val));
+      }
+    }
+  }
+
+  /// Apply a function to every key/value pair in a consistent point-in-time
+  /// snapshot of the map, without blocking writers for the whole scan.  This
+  /// is the templated form of do_all_snapshot().
+  ///
+  /// @param f The function to apply to each key/value pair.  It runs while a
+  ///          bucket is locked, so it must not access this map.
+  template <typename F> void visit_all_snapshot(F &&f) {
+    snapshot_t s = snapshot();
+    visit_snapshot(s, 0, s.buckets(), [&](const auto &k, const V &v) {
+      if constexpr (EMBEDDED_KEY)
+        f(K(k), v);
+      else
+        f(k, v);
+    });
+  }
+
+  // NB: The virtual methods below implement the Map interface by forwarding to
+  //     the templated methods above.  Code that knows the concrete type of the
+  //     map may call the templated methods directly; other code should prefer
+  //     the *_ref methods, which do not box their callbacks.
+
+  /// Insert the provided key/value pair only if there is no mapping for the key
+  /// yet.
+  ///
+  /// @param key        The key to insert
+  /// @param val        The value to insert
+  /// @param on_success Code to run if the insertion succeeds
+  ///
+  /// @return true if the key/value was inserted, false if the key already
+  ///         existed in the table
+  virtual bool insert(K key, V val, std::function<void()> on_success) {
+    return insert_with(std::move(key), std::move(val), on_success);
+  }
+
+  /// Insert the provided key/value pair if there is no mapping for the key yet.
+  /// If there is a key, then update the mapping by replacing the old value with
+  /// the provided value
+  ///
+  /// @param key    The key to upsert
+  /// @param val    The value to upsert
+  /// @param on_ins Code to run if the upsert succeeds as an insert
+  /// @param on_upd Code to run if the upsert succeeds as an update
+  ///
+  /// @return true if the key/value was inserted, false if the key already
+  ///         existed in the table and was thus updated instead
+  virtual bool upsert(K key, V val, std::function<void()> on_ins,
+                      std::function<void()> on_upd) {
+    return upsert_with(std::move(key), std::move(val), on_ins, on_upd);
+  }
+
+  /// Apply a function to the value associated with a given key.  The function
+  /// is allowed to modify the value.
+  ///
+  /// @param key The key whose value will be modified
+  /// @param f   The function to apply to the key's value
+  ///
+  /// @return true if the key existed and the function was applied, false
+  ///         otherwise
+  virtual bool do_with(K key, std::function<void(V &)> f) {
+    return visit(key, f);
+  }
+
+  /// Apply a function to the value associated with a given key.  The function
+  /// is not allowed to modify the value.
+  ///
+  /// @param key The key whose value will be modified
+  /// @param f   The function to apply to the key's value
+  ///
+  /// @return true if the key existed and the function was applied, false
+  ///         otherwise
+  virtual bool do_with_readonly(K key, std::function<void(const V &)> f) {
+    return visit_readonly(key, f);
+  }
+
+  /// Remove the mapping from a key to its value
+  ///
+  /// @param key        The key whose mapping should be removed
+  /// @param on_success Code to run if the remove succeeds
+  ///
+  /// @return true if the key was found and the value unmapped, false otherwise
+  virtual bool remove(K key, std::function<void()> on_success) {
+    return remove_with(key, on_success);
+  }
+
+  /// Insert a batch of key/value pairs, skipping any whose key is already
+  /// mapped
+  ///
+  /// @param entries    The key/value pairs to insert
+  /// @param on_success Code to run for each key that is inserted
+  ///
+  /// @return The number of pairs that were inserted
+  virtual size_t insert_batch(std::vector<std::pair<K, V>> entries,
+                              std::function<void(const K &)> on_success) {
+    return insert_batch_with(entries, on_success);
+  }
+
+  /// Upsert a batch of key/value pairs
+  ///
+  /// @param entries The key/value pairs to upsert
+  /// @param on_ins  Code to run for each key that is inserted
+  /// @param on_upd  Code to run for each key that is updated
+  ///
+  /// @return The number of pairs that were inserted (rather than updated)
+  virtual size_t upsert_batch(std::vector<std::pair<K, V>> entries,
+                              std::function<void(const K &)> on_ins,
+                              std::function<void(const K &)> on_upd) {
+    return upsert_batch_with(entries, on_ins, on_upd);
+  }
+
+  /// Apply a function to the values associated with a batch of keys
+  ///
+  /// @param keys The keys whose values will be read
+  /// @param f    The function to apply to each value that is found
+  ///
+  /// @return The number of keys that were found
+  virtual size_t do_with_readonly_many(
+      const std::vector<typename Map<K, V>::batch_key> &keys,
+      std::function<void(size_t, const V &)> f) {
+    return visit_readonly_many(keys, f);
+  }
+
+  /// Apply a function to every key/value pair in the map.  Note that the
+  /// function is not allowed to modify keys or values.
+  ///
+  /// @param f    The function to apply to each key/value pair
+  /// @param then A function to run when this is done, but before unlocking...
+  ///             useful for 2pl
+  virtual void do_all_readonly(std::function<void(const K, const V &)> f,
+                               std::function<void()> then) {
+    visit_all_readonly(f, then);
+  }
+
+  /// Apply a function to every key/value pair in a consistent point-in-time
+  /// snapshot of the map.  Writers are not blocked for the duration of the
+  /// scan.
+  ///
+  /// @param f The function to apply to each key/value pair
+  virtual void do_all_snapshot(std::function<void(const K &, const V &)> f) {
+    visit_all_snapshot(f);
+  }
+
+  /// Apply a function to the value associated with a given key.  The function
+  /// is allowed to modify the value, and returns true if it did.
+  ///
+  /// @param key The key whose value will be modified
+  /// @param f   The function to apply to the key's value
+  ///
+  /// @return true if the key existed and the function was applied, false
+  ///         otherwise
+  virtual bool do_with_ref(typename Map<K, V>::key_view key,
+                           map_ref<bool(V &)> f) {
+    return visit(key, f);
+  }
+
+  /// Apply a function to the value associated with a given key.  The function
+  /// is not allowed to modify the value.
+  ///
+  /// @param key The key whose value will be read
+  /// @param f   The function to apply to the key's value
+  ///
+  /// @return true if the key existed and the function was applied, false
+  ///         otherwise
+  virtual bool do_with_readonly_ref(typename Map<K, V>::key_view key,
+                                    map_ref<void(const V &)> f) {
+    return visit_readonly(key, f);
+  }
+
+  /// Insert the provided key/value pair only if there is no mapping for the key
+  /// yet.
+  ///
+  /// @param key        The key to insert
+  /// @param val        The value to insert
+  /// @param on_success Code to run if the insertion succeeds
+  ///
+  /// @return true if the key/value was inserted, false if the key already
+  ///         existed in the table
+  virtual bool insert_ref(K key, V val, map_ref<void()> on_success) {
+    return insert_with(std::move(key), std::move(val), on_success);
+  }
+
+  /// Take a snapshot of the map, whose parts are its buckets
+  ///
+  /// @return The snapshot
+  virtual std::unique_ptr<typename Map<K, V>::snapshot> take_snapshot() {
+    return std::unique_ptr<snapshot_t>(new snapshot_t(*this));
+  }
+
+  /// Apply a function to the value associated with a given key.  The function
+  /// is allowed to modify the value.
+  ///
+  /// @param key The key whose value will be modified
+  /// @param f   The function to apply to the key's value
+  ///
+  /// @return true if the key existed and the function was applied, false
+  ///         otherwise
+  virtual bool do_with_view(typename Map<K, V>::key_view key,
+                            std::function<void(V &)> f) {
+    return visit(key, f);
+  }
+
+  /// Apply a function to the value associated with a given key.  The function
+  /// is not allowed to modify the value.
+  ///
+  /// @param key The key whose value will be read
+  /// @param f   The function to apply to the key's value
+  ///
+  /// @return true if the key existed and the function was applied, false
+  ///         otherwise
+  virtual bool do_with_readonly_view(typename Map<K, V>::key_view key,
+                                     std::function<void(const V &)> f) {
+    return visit_readonly(key, f);
+  }
+
+  /// Remove the mapping from a key to its value
+  ///
+  /// @param key        The key whose mapping should be removed
+  /// @param on_success Code to run if the remove succeeds
+  ///
+  /// @return true if the key was found and the value unmapped, false otherwise
+  virtual bool remove_view(typename Map<K, V>::key_view key,
+                           std::function<void()> on_success) {
+    return remove_with(key, on_success);
+  }
+};
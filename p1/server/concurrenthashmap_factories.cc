@@ -0,0 +1,22 @@
+#include <string>
+
+#include "authrecord.h"
+#include "authtableentry.h"
+#include "concurrenthashmap.h"
+
+using namespace std;
+
+/// Create an instance of ConcurrentHashMap that can be used as an
+/// authentication table
+///
+/// @param _buckets The number of buckets in the table
+Map<string, AuthTableEntry> *authtable_factory(size_t _buckets) {
+  return new ConcurrentHashMap<string, AuthTableEntry>(_buckets);
+}
+
+/// Create an instance of ConcurrentHashMap that holds users as AuthRecords
+///
+/// @param _buckets The number of buckets in the table
+Map<string, AuthRecord> *authrecord_factory(size_t _buckets) {
+  return new ConcurrentHashMap<string, AuthRecord>(_buckets);
+}
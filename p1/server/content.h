@@ -0,0 +1,180 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <unistd.h>
+#include <vector>
+#include <zlib.h>
+
+/// bytes_ptr is a shared reference to an immutable vector of bytes
+typedef std::shared_ptr<const std::vector<uint8_t>> bytes_ptr;
+
+/// content_file is an open file that holds the stored bytes of some content
+/// that has not been read into memory (e.g., a data file that was loaded
+/// lazily).  It is closed when the last buffer that refers to it is freed, so
+/// the file may be replaced or removed in the meantime.
+struct content_file {
+  const int fd; // The file
+
+  explicit content_file(int fd) : fd(fd) {}
+  content_file(const content_file &) = delete;
+  ~content_file() { close(fd); }
+};
+
+/// content_t is one buffer of a user's content, as it is stored.  Content that
+/// is big enough, and compresses well enough, is stored as a zlib stream, which
+/// is only decompressed when the content is read (e.g., by a GET, after the
+/// user's entry has been unlocked).  Small content is always stored raw, so it
+/// costs no extra CPU.
+///
+/// The content of a buffer never changes, but where its bytes are may: a
+/// blob_store with a memory budget can spill the stored bytes to a file, and
+/// read them back in when they are needed (see blob_store.h).  That is why the
+/// stored bytes are behind a pointer that is swapped atomically.  A buffer may
+/// also start out with its bytes in a data file, which are read in when the
+/// content is first read.
+struct content_t {
+  const size_t raw_size;    // The size of the content, uncompressed
+  const bool compressed;    // true if the stored bytes are a zlib stream
+  const size_t stored_size; // The number of stored bytes
+
+  /// The file that holds the stored bytes at offset, or nullptr if they are in
+  /// a blob_store's spill file (if anywhere)
+  const std::shared_ptr<const content_file> file;
+
+  /// The CRC32C of the stored bytes, which is checked when they are read from
+  /// file
+  const uint32_t crc = 0;
+
+  /// The stored bytes, or nullptr while they are spilled to a file
+  ///
+  /// NB: Use std::atomic_load and std::atomic_store (or stored()), since a
+  ///     blob_store may drop or restore the bytes while others read them
+  mutable bytes_ptr bytes;
+
+  /// The offset of the stored bytes in file, or in a blob_store's spill file,
+  /// or -1 if they have not been written to either
+  mutable std::atomic<int64_t> offset{-1};
+
+  /// When the content was last read, in a blob_store's clock ticks
+  mutable std::atomic<uint32_t> last_use{0};
+
+  /// Construct a buffer
+  ///
+  /// @param b   The stored bytes.  They are moved into the buffer.
+  /// @param raw The size of the content, uncompressed
+  /// @param z   true if b is a zlib stream
+  content_t(std::vector<uint8_t> b, size_t raw, bool z)
+      : raw_size(raw), compressed(z), stored_size(b.size()),
+        bytes(std::make_shared<const std::vector<uint8_t>>(std::move(b))) {}
+
+  /// Construct a buffer whose stored bytes are in a file.  They are read in
+  /// when the content is first read.
+  ///
+  /// @param raw    The size of the content, uncompressed
+  /// @param z      true if the stored bytes are a zlib stream
+  /// @param stored The number of stored bytes
+  /// @param f      The file
+  /// @param off    The offset of the stored bytes in f
+  /// @param crc    The CRC32C of the stored bytes
+  content_t(size_t raw, bool z, size_t stored,
+            std::shared_ptr<const content_file> f, int64_t off, uint32_t crc)
+      : raw_size(raw), compressed(z), stored_size(stored), file(std::move(f)),
+        crc(crc), offset(off) {}
+
+  /// Get the stored bytes, if they are in memory
+  ///
+  /// @return The stored bytes, or nullptr if they are spilled
+  bytes_ptr stored() const { return std::atomic_load(&bytes); }
+};
+
+/// content_ptr is a shared reference to an immutable content buffer.  A SET
+/// makes a new buffer and swaps it into the user's entry.  That lets a GET take
+/// a reference while the entry is locked, and read the bytes after unlocking,
+/// without copying them, and it makes a copy of an entry (e.g., in a
+/// copy-on-write update) cost one reference count instead of a copy of up to
+/// LEN_PROFILE_FILE bytes.
+///
+/// An empty content is a null pointer, so that users without content do not
+/// need an allocation.
+typedef std::shared_ptr<const content_t> content_ptr;
+
+/// Compressed content must be at most this fraction (in eighths) of the raw
+/// size, or it is not worth decompressing on every read
+const size_t CONTENT_MAX_RATIO = 7;
+
+/// Make a stored form of some content: compressed if it is at least min bytes
+/// and compresses well, or raw otherwise
+///
+/// @param data The raw bytes
+/// @param len  The number of bytes
+/// @param min  The smallest size to compress, or 0 to never compress
+///
+/// @return The new buffer
+inline std::unique_ptr<content_t> pack_content(const uint8_t *data, size_t len,
+                                               size_t min) {
+  if (min > 0 && len >= min) {
+    uLongf out = compressBound(len);
+    std::vector<uint8_t> z(out);
+    if (compress2(z.data(), &out, data, len, Z_BEST_SPEED) == Z_OK &&
+        out <= len / 8 * CONTENT_MAX_RATIO) {
+      z.resize(out);
+      z.shrink_to_fit();
+      return std::make_unique<content_t>(std::move(z), len, true);
+    }
+  }
+  return std::make_unique<content_t>(
+      std::vector<uint8_t>(data, data + len), len, false);
+}
+
+/// Make a raw content buffer
+///
+/// @param bytes The bytes of the content.  They are moved into the buffer.
+///
+/// @return A reference to the new buffer, or nullptr if bytes is empty
+inline content_ptr make_content(std::vector<uint8_t> bytes) {
+  if (bytes.empty())
+    return nullptr;
+  size_t len = bytes.size();
+  return std::make_shared<const content_t>(std::move(bytes), len, false);
+}
+
+/// Get the raw bytes of some content, given its stored bytes.  Raw content is
+/// shared, not copied; compressed content is decompressed into a new vector.
+///
+/// @param c      The buffer
+/// @param stored The buffer's stored bytes
+///
+/// @return The raw bytes, or nullptr if they do not decompress
+inline bytes_ptr unpack_content(const content_t &c, const bytes_ptr &stored) {
+  if (!c.compressed)
+    return stored;
+  auto out = std::make_shared<std::vector<uint8_t>>(c.raw_size);
+  uLongf len = c.raw_size;
+  if (uncompress(out->data(), &len, stored->data(), stored->size()) != Z_OK ||
+      len != c.raw_size)
+    return nullptr;
+  return out;
+}
+
+/// Get the raw bytes of a content buffer whose bytes are in memory
+///
+/// @param c The buffer, or nullptr
+///
+/// @return The bytes, or nullptr if c is null, is spilled, or does not
+///         decompress
+inline bytes_ptr content_bytes(const content_ptr &c) {
+  bytes_ptr stored = c ? c->stored() : nullptr;
+  return stored ? unpack_content(*c, stored) : nullptr;
+}
+
+/// Get the size of a content buffer, uncompressed
+///
+/// @param c The buffer, or nullptr
+///
+/// @return The number of bytes of content in c
+inline size_t content_size(const content_ptr &c) {
+  return c ? c->raw_size : 0;
+}
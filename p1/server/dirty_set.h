@@ -0,0 +1,73 @@
+#pragma once
+
+#include <functional>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+#include <vector>
+
+/// dirty_set is the set of names of the users whose entries have changed since
+/// they were last saved, so that a save can write only those users (see
+/// MyStorage::save()).
+///
+/// The set is split into stripes, each with its own lock, so that concurrent
+/// changes to different users rarely contend.  A user who changes many times
+/// between saves is in the set once.
+class dirty_set {
+  /// The number of stripes
+  static const size_t STRIPES = 64;
+
+  /// stripe_t is one lock and the part of the set that it protects
+  struct alignas(64) stripe_t {
+    std::mutex lock;
+    std::unordered_set<std::string> names;
+  };
+
+  /// The stripes
+  stripe_t stripes[STRIPES];
+
+  /// Find the stripe that holds a name
+  ///
+  /// @param name The name
+  ///
+  /// @return The stripe
+  stripe_t &stripe(std::string_view name) {
+    return stripes[std::hash<std::string_view>()(name) % STRIPES];
+  }
+
+public:
+  /// Add a user to the set
+  ///
+  /// @param name The name of the user
+  void add(std::string_view name) {
+    stripe_t &s = stripe(name);
+    std::lock_guard<std::mutex> g(s.lock);
+    s.names.emplace(name);
+  }
+
+  /// Take every user out of the set
+  ///
+  /// @return The names of the users
+  std::vector<std::string> take() {
+    std::vector<std::string> out;
+    for (auto &s : stripes) {
+      std::unordered_set<std::string> names;
+      {
+        std::lock_guard<std::mutex> g(s.lock);
+        names.swap(s.names);
+      }
+      while (!names.empty())
+        out.push_back(std::move(names.extract(names.begin()).value()));
+    }
+    return out;
+  }
+
+  /// Put back users that were taken by a save that failed
+  ///
+  /// @param names The names of the users
+  void restore(const std::vector<std::string> &names) {
+    for (auto &n : names)
+      add(n);
+  }
+};
@@ -0,0 +1,694 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "map.h"
+
+/// flat_key is the form in which a FlatMap stores a key inside a slot.  The
+/// generic version just holds the key.
+///
+/// @param K The type of the key
+template <typename K> struct flat_key {
+  /// The key
+  K key;
+
+  /// Construct from a key
+  ///
+  /// @param k The key to store
+  flat_key(const K &k) : key(k) {}
+
+  /// Compute the hash of the stored key
+  size_t hash() const { return map_hash<K>()(key); }
+
+  /// Check if the stored key equals another key
+  ///
+  /// @param k The key to compare against
+  bool equals(const K &k) const { return key == k; }
+
+  /// Get the stored key
+  const K &get() const { return key; }
+};
+
+/// flat_key for std::string keys.  Keys of up to INLINE_LEN bytes (which covers
+/// every legal username; see LEN_UNAME) are stored directly in the slot, so
+/// comparing a key never chases a pointer.  Longer keys go on the heap.
+template <> struct flat_key<std::string> {
+  /// The longest key that is stored inline
+  static const size_t INLINE_LEN = 64;
+
+  /// The length of the key
+  uint32_t len;
+
+  /// The bytes of the key, if len <= INLINE_LEN, or a pointer to them otherwise
+  union {
+    char inl[INLINE_LEN];
+    char *ext;
+  };
+
+  /// Construct from a key, by copying its bytes
+  ///
+  /// @param k The key to store
+  flat_key(const std::string &k) : len(k.length()) {
+    char *dst = (len <= INLINE_LEN) ? inl : (ext = new char[len]);
+    memcpy(dst, k.data(), len);
+  }
+
+  /// Move construct, by copying inline bytes or stealing the heap pointer
+  ///
+  /// @param o The flat_key to move from.  It becomes an empty key.
+  flat_key(flat_key &&o) noexcept : len(o.len) {
+    if (len <= INLINE_LEN)
+      memcpy(inl, o.inl, len);
+    else
+      ext = o.ext;
+    o.len = 0;
+  }
+
+  /// Release the heap copy of the key, if there is one
+  ~flat_key() {
+    if (len > INLINE_LEN)
+      delete[] ext;
+  }
+
+  flat_key(const flat_key &) = delete;
+  flat_key &operator=(const flat_key &) = delete;
+
+  /// Get a view of the bytes of the key
+  std::string_view view() const {
+    return std::string_view(len <= INLINE_LEN ? inl : ext, len);
+  }
+
+  /// Compute the hash of the stored key
+  size_t hash() const { return map_hash<std::string>()(view()); }
+
+  /// Check if the stored key equals another key
+  ///
+  /// @param k The key to compare against
+  bool equals(std::string_view k) const { return view() == k; }
+
+  /// Get a copy of the stored key
+  std::string get() const { return std::string(view()); }
+};
+
+/// FlatMap is a concurrent implementation of the Map interface (a Key/Value
+/// store), based on open addressing with per-slot control bytes (a "Swiss
+/// table").  Each slot has one control byte, which says whether the slot is
+/// empty, deleted, or full, and if it is full, holds 7 bits of the key's hash.
+/// A lookup loads a group of 16 control bytes and compares them all to the
+/// key's hash bits at once (with SSE2, when it is available), so it usually
+/// touches one line of control bytes and then only the one slot that holds the
+/// key.  Keys and values live in the slots themselves; there are no per-entry
+/// nodes or pointers to chase.
+///
+/// For concurrency, the map is split into NUM_SHARDS shards by the high bits of
+/// the hash.  Each shard is an independent table with its own reader/writer
+/// lock, padded to a cache line.  When a shard fills up, it is rehashed while
+/// holding only its own lock.
+///
+/// Keys are hashed with map_hash, so lookups can be done with any key type that
+/// map_hash<K> accepts and that K can be compared to (e.g., std::string_view
+/// when K is std::string).
+///
+/// The FlatMap is templated on the Key and Value types.
+///
+/// This map provides strong consistency guarantees: every operation uses
+/// two-phase locking (2PL), and the lambda parameters to methods enable nesting
+/// of 2PL operations across maps.
+///
+/// @param K The type of the keys in this map
+/// @param V The type of the values in this map
+template <typename K, typename V> class FlatMap : public Map<K, V> {
+  /// The size of a cache line.  Shards are aligned to this, so that two
+  /// threads working on neighboring shards do not false-share a line.
+  static const size_t CACHE_LINE = 64;
+
+  /// The number of control bytes in a group.  This is the width of an SSE2
+  /// register.
+  static const size_t GROUP_SIZE = 16;
+
+  /// The number of shards is 2^SHARD_BITS
+  static const size_t SHARD_BITS = 6;
+
+  /// The number of shards
+  static const size_t NUM_SHARDS = size_t(1) << SHARD_BITS;
+
+  /// The control byte for a slot that has never been used
+  static const int8_t CTRL_EMPTY = -128;
+
+  /// The control byte for a slot whose entry was removed
+  static const int8_t CTRL_DELETED = -2;
+
+  /// A group of control bytes, aligned so it can be loaded with one aligned
+  /// SSE2 load.  Full slots have a non-negative control byte (7 hash bits), and
+  /// empty/deleted slots have a negative one.
+  struct alignas(GROUP_SIZE) group_t {
+    int8_t ctrl[GROUP_SIZE];
+  };
+
+  /// slot_t is the storage for one key/value pair
+  struct slot_t {
+    flat_key<K> key; // The key
+    V val;           // The value
+  };
+
+  /// shard_t is one independent open-addressed table, and its lock
+  struct alignas(CACHE_LINE) shard_t {
+    /// The lock protecting this shard.  Readers take it shared, writers take
+    /// it exclusive.
+    std::shared_mutex lock;
+
+    /// The control bytes, in groups of GROUP_SIZE
+    group_t *groups = nullptr;
+
+    /// The slots.  Only slots with a non-negative control byte are constructed.
+    slot_t *slots = nullptr;
+
+    /// The number of slots (a power of two, and at least GROUP_SIZE)
+    size_t cap = 0;
+
+    /// The number of full slots
+    size_t size = 0;
+
+    /// The number of empty slots that can be filled before the shard must be
+    /// rehashed.  This keeps the load (including deleted slots) at or below
+    /// 7/8, so that every probe sequence ends at an empty slot.
+    size_t growth_left = 0;
+  };
+
+  /// The shards of the table
+  std::unique_ptr<shard_t[]> shards;
+
+  /// The number of slots that each shard starts with
+  size_t initial_cap;
+
+  /// Get a bitmask of the slots in a group whose control byte equals c
+  ///
+  /// @param g The group
+  /// @param c The control byte to look for
+  ///
+  /// @return A mask with bit i set if slot i of the group matches
+  static uint32_t match(const group_t &g, int8_t c) {
+#ifdef __SSE2__
+    __m128i ctrl = _mm_load_si128(reinterpret_cast<const __m128i *>(g.ctrl));
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(c), ctrl));
+#else
+    uint32_t mask = 0;
+    for (size_t i = 0; i < GROUP_SIZE; ++i)
+      mask |= uint32_t(g.ctrl[i] == c) << i;
+    return mask;
+#endif
+  }
+
+  /// Get a bitmask of the slots in a group that are empty or deleted
+  ///
+  /// @param g The group
+  ///
+  /// @return A mask with bit i set if slot i of the group is not full
+  static uint32_t match_free(const group_t &g) {
+#ifdef __SSE2__
+    // The sign bit of each control byte is set exactly when it is not full
+    return _mm_movemask_epi8(
+        _mm_load_si128(reinterpret_cast<const __m128i *>(g.ctrl)));
+#else
+    uint32_t mask = 0;
+    for (size_t i = 0; i < GROUP_SIZE; ++i)
+      mask |= uint32_t(g.ctrl[i] < 0) << i;
+    return mask;
+#endif
+  }
+
+  /// Get the shard that a hash belongs to
+  ///
+  /// @param h The hash of a key
+  shard_t &shard_for(size_t h) {
+    return shards[h >> (sizeof(size_t) * 8 - SHARD_BITS)];
+  }
+
+  /// Get the 7 bits of a hash that are stored in a control byte
+  ///
+  /// @param h The hash of a key
+  static int8_t h2(size_t h) { return int8_t(h & 0x7F); }
+
+  /// Set up an empty shard with a given capacity.  Any old arrays must already
+  /// have been released.
+  ///
+  /// @param s   The shard
+  /// @param cap The number of slots (a power of two, at least GROUP_SIZE)
+  static void init_shard(shard_t &s, size_t cap) {
+    s.groups = new group_t[cap / GROUP_SIZE];
+    memset(static_cast<void *>(s.groups), CTRL_EMPTY, cap);
+    s.slots = std::allocator<slot_t>().allocate(cap);
+    s.cap = cap;
+    s.size = 0;
+    s.growth_left = cap - cap / 8;
+  }
+
+  /// Destroy every entry in a shard and release its arrays
+  ///
+  /// @param s The shard
+  static void free_shard(shard_t &s) {
+    for (size_t i = 0; i < s.cap; ++i)
+      if (s.groups[i / GROUP_SIZE].ctrl[i % GROUP_SIZE] >= 0)
+        s.slots[i].~slot_t();
+    std::allocator<slot_t>().deallocate(s.slots, s.cap);
+    delete[] s.groups;
+    s.groups = nullptr;
+    s.slots = nullptr;
+  }
+
+  /// Find the slot holding a key.  The caller must hold the shard's lock.
+  ///
+  /// @param s   The shard
+  /// @param h   The hash of the key
+  /// @param key The key (a K, or any type that K can be compared to)
+  ///
+  /// @return The index of the slot, or s.cap if the key is not present
+  template <typename Q>
+  static size_t find(const shard_t &s, size_t h, const Q &key) {
+    size_t mask = s.cap / GROUP_SIZE - 1, g = (h >> 7) & mask;
+    for (size_t step = 1;; ++step) {
+      const group_t &grp = s.groups[g];
+      for (uint32_t m = match(grp, h2(h)); m != 0; m &= m - 1) {
+        size_t i = g * GROUP_SIZE + __builtin_ctz(m);
+        if (s.slots[i].key.equals(key))
+          return i;
+      }
+      // An empty slot in the group means the key was never pushed past it
+      if (match(grp, CTRL_EMPTY) != 0)
+        return s.cap;
+      g = (g + step) & mask; // triangular probing visits every group
+    }
+  }
+
+  /// Find the first empty or deleted slot on a hash's probe sequence.  The
+  /// caller must hold the shard's lock.
+  ///
+  /// @param s The shard
+  /// @param h The hash of the key
+  ///
+  /// @return The index of the slot
+  static size_t find_free(const shard_t &s, size_t h) {
+    size_t mask = s.cap / GROUP_SIZE - 1, g = (h >> 7) & mask;
+    for (size_t step = 1;; ++step) {
+      uint32_t m = match_free(s.groups[g]);
+      if (m != 0)
+        return g * GROUP_SIZE + __builtin_ctz(m);
+      g = (g + step) & mask;
+    }
+  }
+
+  /// Set the control byte of a slot
+  ///
+  /// @param s The shard
+  /// @param i The index of the slot
+  /// @param c The new control byte
+  static void set_ctrl(shard_t &s, size_t i, int8_t c) {
+    s.groups[i / GROUP_SIZE].ctrl[i % GROUP_SIZE] = c;
+  }
+
+  /// Rebuild a shard with a new capacity, moving every entry into a new array.
+  /// This also discards all deleted slots.  The caller must hold the shard's
+  /// lock exclusively.
+  ///
+  /// @param s   The shard
+  /// @param cap The new capacity
+  static void rehash(shard_t &s, size_t cap) {
+    shard_t old;
+    old.groups = s.groups;
+    old.slots = s.slots;
+    old.cap = s.cap;
+    size_t size = s.size;
+    init_shard(s, cap);
+    for (size_t i = 0; i < old.cap; ++i) {
+      if (old.groups[i / GROUP_SIZE].ctrl[i % GROUP_SIZE] < 0)
+        continue;
+      size_t h = old.slots[i].key.hash(), j = find_free(s, h);
+      new (&s.slots[j]) slot_t(std::move(old.slots[i]));
+      set_ctrl(s, j, h2(h));
+    }
+    s.size = size;
+    s.growth_left -= size;
+    free_shard(old);
+  }
+
+  /// Insert a new entry into a shard, growing it first if it is full.  The key
+  /// must not already be present, and the caller must hold the shard's lock
+  /// exclusively.
+  ///
+  /// @param s   The shard
+  /// @param h   The hash of the key
+  /// @param key The key
+  /// @param val The value
+  static void insert_new(shard_t &s, size_t h, const K &key, V &&val) {
+    if (s.growth_left == 0)
+      // If most of the used slots are deleted, rebuilding at the same size is
+      // enough; otherwise double.
+      rehash(s, (s.size * 2 < s.cap - s.cap / 8) ? s.cap : s.cap * 2);
+    size_t i = find_free(s, h);
+    if (s.groups[i / GROUP_SIZE].ctrl[i % GROUP_SIZE] == CTRL_EMPTY)
+      --s.growth_left;
+    new (&s.slots[i]) slot_t{flat_key<K>(key), std::move(val)};
+    set_ctrl(s, i, h2(h));
+    ++s.size;
+  }
+
+  /// Remove the entry in a slot.  The caller must hold the shard's lock
+  /// exclusively.
+  ///
+  /// @param s The shard
+  /// @param i The index of the slot
+  static void erase(shard_t &s, size_t i) {
+    s.slots[i].~slot_t();
+    --s.size;
+    // If the group still has an empty slot, then no probe sequence ever went
+    // past this group, so this slot can become empty instead of deleted.
+    if (match(s.groups[i / GROUP_SIZE], CTRL_EMPTY) != 0) {
+      set_ctrl(s, i, CTRL_EMPTY);
+      ++s.growth_left;
+    } else {
+      set_ctrl(s, i, CTRL_DELETED);
+    }
+  }
+
+public:
+  /// Construct by specifying the number of buckets it should have
+  ///
+  /// @param _buckets The number of entries to size the table for, initially
+  FlatMap(size_t _buckets) : shards(new shard_t[NUM_SHARDS]) {
+    initial_cap = GROUP_SIZE;
+    while (initial_cap * NUM_SHARDS < _buckets)
+      initial_cap *= 2;
+    for (size_t i = 0; i < NUM_SHARDS; ++i)
+      init_shard(shards[i], initial_cap);
+  }
+
+  /// Destruct the FlatMap
+  virtual ~FlatMap() {
+    for (size_t i = 0; i < NUM_SHARDS; ++i)
+      free_shard(shards[i]);
+  }
+
+  /// Clear the map.  This operation needs to use 2pl
+  virtual void clear() {
+    for (size_t i = 0; i < NUM_SHARDS; ++i)
+      shards[i].lock.lock();
+    for (size_t i = 0; i < NUM_SHARDS; ++i) {
+      free_shard(shards[i]);
+      init_shard(shards[i], initial_cap);
+    }
+    for (size_t i = NUM_SHARDS; i > 0; --i)
+      shards[i - 1].lock.unlock();
+  }
+
+  /// Insert the provided key/value pair only if there is no mapping for the key
+  /// yet.  This is the templated form of insert().
+  ///
+  /// @param key        The key to insert
+  /// @param val        The value to insert
+  /// @param on_success Code to run if the insertion succeeds
+  ///
+  /// @return true if the key/value was inserted, false if the key already
+  ///         existed in the table
+  template <typename F> bool insert_with(const K &key, V val, F &&on_success) {
+    size_t h = map_hash<K>()(key);
+    shard_t &s = shard_for(h);
+    std::unique_lock<std::shared_mutex> g(s.lock);
+    if (find(s, h, key) != s.cap)
+      return false;
+    insert_new(s, h, key, std::move(val));
+    on_success();
+    return true;
+  }
+
+  /// Insert the provided key/value pair if there is no mapping for the key yet.
+  /// If there is a key, then update the mapping by replacing the old value with
+  /// the provided value.  This is the templated form of upsert().
+  ///
+  /// @param key    The key to upsert
+  /// @param val    The value to upsert
+  /// @param on_ins Code to run if the upsert succeeds as an insert
+  /// @param on_upd Code to run if the upsert succeeds as an update
+  ///
+  /// @return true if the key/value was inserted, false if the key already
+  ///         existed in the table and was thus updated instead
+  template <typename FI, typename FU>
+  bool upsert_with(const K &key, V val, FI &&on_ins, FU &&on_upd) {
+    size_t h = map_hash<K>()(key);
+    shard_t &s = shard_for(h);
+    std::unique_lock<std::shared_mutex> g(s.lock);
+    size_t i = find(s, h, key);
+    if (i != s.cap) {
+      s.slots[i].val = std::move(val);
+      on_upd();
+      return false;
+    }
+    insert_new(s, h, key, std::move(val));
+    on_ins();
+    return true;
+  }
+
+  /// Apply a function to the value associated with a given key.  The function
+  /// is allowed to modify the value.  This is the templated form of do_with().
+  ///
+  /// @param key The key whose value will be modified
+  /// @param f   The function to apply to the key's value
+  ///
+  /// @return true if the key existed and the function was applied, false
+  ///         otherwise
+  template <typename Q, typename F> bool visit(const Q &key, F &&f) {
+    size_t h = map_hash<K>()(key);
+    shard_t &s = shard_for(h);
+    std::unique_lock<std::shared_mutex> g(s.lock);
+    size_t i = find(s, h, key);
+    if (i == s.cap)
+      return false;
+    f(s.slots[i].val);
+    return true;
+  }
+
+  /// Apply a function to the value associated with a given key.  The function
+  /// is not allowed to modify the value.  This is the templated form of
+  /// do_with_readonly().
+  ///
+  /// @param key The key whose value will be read
+  /// @param f   The function to apply to the key's value
+  ///
+  /// @return true if the key existed and the function was applied, false
+  ///         otherwise
+  template <typename Q, typename F> bool visit_readonly(const Q &key, F &&f) {
+    size_t h = map_hash<K>()(key);
+    shard_t &s = shard_for(h);
+    std::shared_lock<std::shared_mutex> g(s.lock);
+    size_t i = find(s, h, key);
+    if (i == s.cap)
+      return false;
+    f(static_cast<const V &>(s.slots[i].val));
+    return true;
+  }
+
+  /// Remove the mapping from a key to its value.  This is the templated form of
+  /// remove().
+  ///
+  /// @param key        The key whose mapping should be removed
+  /// @param on_success Code to run if the remove succeeds
+  ///
+  /// @return true if the key was found and the value unmapped, false otherwise
+  template <typename Q, typename F>
+  bool remove_with(const Q &key, F &&on_success) {
+    size_t h = map_hash<K>()(key);
+    shard_t &s = shard_for(h);
+    std::unique_lock<std::shared_mutex> g(s.lock);
+    size_t i = find(s, h, key);
+    if (i == s.cap)
+      return false;
+    erase(s, i);
+    on_success();
+    return true;
+  }
+
+  /// Apply a function to every key/value pair in the map.  Note that the
+  /// function is not allowed to modify keys or values.  This is the templated
+  /// form of do_all_readonly().
+  ///
+  /// @param f    The function to apply to each key/value pair
+  /// @param then A function to run when this is done, but before unlocking...
+  ///             useful for 2pl
+  template <typename F, typename T> void visit_all_readonly(F &&f, T &&then) {
+    for (size_t i = 0; i < NUM_SHARDS; ++i)
+      shards[i].lock.lock_shared();
+    for (size_t i = 0; i < NUM_SHARDS; ++i) {
+      shard_t &s = shards[i];
+      for (size_t j = 0; j < s.cap; ++j)
+        if (s.groups[j / GROUP_SIZE].ctrl[j % GROUP_SIZE] >= 0)
+          f(s.slots[j].key.get(), static_cast<const V &>(s.slots[j].val));
+    }
+    then();
+    for (size_t i = NUM_SHARDS; i > 0; --i)
+      shards[i - 1].lock.unlock_shared();
+  }
+
+  // NB: The virtual methods below implement the Map interface by forwarding to
+  //     the templated methods above.
+
+  /// Insert the provided key/value pair only if there is no mapping for the key
+  /// yet.
+  ///
+  /// @param key        The key to insert
+  /// @param val        The value to insert
+  /// @param on_success Code to run if the insertion succeeds
+  ///
+  /// @return true if the key/value was inserted, false if the key already
+  ///         existed in the table
+  virtual bool insert(K key, V val, std::function<void()> on_success) {
+    return insert_with(key, std::move(val), on_success);
+  }
+
+  /// Insert the provided key/value pair if there is no mapping for the key yet.
+  /// If there is a key, then update the mapping by replacing the old value with
+  /// the provided value
+  ///
+  /// @param key    The key to upsert
+  /// @param val    The value to upsert
+  /// @param on_ins Code to run if the upsert succeeds as an insert
+  /// @param on_upd Code to run if the upsert succeeds as an update
+  ///
+  /// @return true if the key/value was inserted, false if the key already
+  ///         existed in the table and was thus updated instead
+  virtual bool upsert(K key, V val, std::function<void()> on_ins,
+                      std::function<void()> on_upd) {
+    return upsert_with(key, std::move(val), on_ins, on_upd);
+  }
+
+  /// Apply a function to the value associated with a given key.  The function
+  /// is allowed to modify the value.
+  ///
+  /// @param key The key whose value will be modified
+  /// @param f   The function to apply to the key's value
+  ///
+  /// @return true if the key existed and the function was applied, false
+  ///         otherwise
+  virtual bool do_with(K key, std::function<void(V &)> f) {
+    return visit(key, f);
+  }
+
+  /// Apply a function to the value associated with a given key.  The function
+  /// is not allowed to modify the value.
+  ///
+  /// @param key The key whose value will be modified
+  /// @param f   The function to apply to the key's value
+  ///
+  /// @return true if the key existed and the function was applied, false
+  ///         otherwise
+  virtual bool do_with_readonly(K key, std::function<void(const V &)> f) {
+    return visit_readonly(key, f);
+  }
+
+  /// Remove the mapping from a key to its value
+  ///
+  /// @param key        The key whose mapping should be removed
+  /// @param on_success Code to run if the remove succeeds
+  ///
+  /// @return true if the key was found and the value unmapped, false otherwise
+  virtual bool remove(K key, std::function<void()> on_success) {
+    return remove_with(key, on_success);
+  }
+
+  /// Apply a function to every key/value pair in the map.  Note that the
+  /// function is not allowed to modify keys or values.
+  ///
+  /// @param f    The function to apply to each key/value pair
+  /// @param then A function to run when this is done, but before unlocking...
+  ///             useful for 2pl
+  virtual void do_all_readonly(std::function<void(const K, const V &)> f,
+                               std::function<void()> then) {
+    visit_all_readonly(f, then);
+  }
+
+  /// Apply a function to the value associated with a given key.  The function
+  /// is allowed to modify the value, and returns true if it did.
+  ///
+  /// @param key The key whose value will be modified
+  /// @param f   The function to apply to the key's value
+  ///
+  /// @return true if the key existed and the function was applied, false
+  ///         otherwise
+  virtual bool do_with_ref(typename Map<K, V>::key_view key,
+                           map_ref<bool(V &)> f) {
+    return visit(key, f);
+  }
+
+  /// Apply a function to the value associated with a given key.  The function
+  /// is not allowed to modify the value.
+  ///
+  /// @param key The key whose value will be read
+  /// @param f   The function to apply to the key's value
+  ///
+  /// @return true if the key existed and the function was applied, false
+  ///         otherwise
+  virtual bool do_with_readonly_ref(typename Map<K, V>::key_view key,
+                                    map_ref<void(const V &)> f) {
+    return visit_readonly(key, f);
+  }
+
+  /// Insert the provided key/value pair only if there is no mapping for the key
+  /// yet.
+  ///
+  /// @param key        The key to insert
+  /// @param val        The value to insert
+  /// @param on_success Code to run if the insertion succeeds
+  ///
+  /// @return true if the key/value was inserted, false if the key already
+  ///         existed in the table
+  virtual bool insert_ref(K key, V val, map_ref<void()> on_success) {
+    return insert_with(key, std::move(val), on_success);
+  }
+
+  /// Apply a function to the value associated with a given key.  The function
+  /// is allowed to modify the value.
+  ///
+  /// @param key The key whose value will be modified
+  /// @param f   The function to apply to the key's value
+  ///
+  /// @return true if the key existed and the function was applied, false
+  ///         otherwise
+  virtual bool do_with_view(typename Map<K, V>::key_view key,
+                            std::function<void(V &)> f) {
+    return visit(key, f);
+  }
+
+  /// Apply a function to the value associated with a given key.  The function
+  /// is not allowed to modify the value.
+  ///
+  /// @param key The key whose value will be read
+  /// @param f   The function to apply to the key's value
+  ///
+  /// @return true if the key existed and the function was applied, false
+  ///         otherwise
+  virtual bool do_with_readonly_view(typename Map<K, V>::key_view key,
+                                     std::function<void(const V &)> f) {
+    return visit_readonly(key, f);
+  }
+
+  /// Remove the mapping from a key to its value
+  ///
+  /// @param key        The key whose mapping should be removed
+  /// @param on_success Code to run if the remove succeeds
+  ///
+  /// @return true if the key was found and the value unmapped, false otherwise
+  virtual bool remove_view(typename Map<K, V>::key_view key,
+                           std::function<void()> on_success) {
+    return remove_with(key, on_success);
+  }
+};
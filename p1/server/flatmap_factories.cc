@@ -0,0 +1,21 @@
+#include <string>
+
+#include "authrecord.h"
+#include "authtableentry.h"
+#include "flatmap.h"
+
+using namespace std;
+
+/// Create an instance of FlatMap that can be used as an authentication table
+///
+/// @param _buckets The number of entries to size the table for, initially
+Map<string, AuthTableEntry> *authtable_factory(size_t _buckets) {
+  return new FlatMap<string, AuthTableEntry>(_buckets);
+}
+
+/// Create an instance of FlatMap that holds users as AuthRecords
+///
+/// @param _buckets The number of entries to size the table for, initially
+Map<string, AuthRecord> *authrecord_factory(size_t _buckets) {
+  return new FlatMap<string, AuthRecord>(_buckets);
+}
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstdint>
 #include <string>
 
 /// format.h defines the file format used by the server.  Note that the format
@@ -26,6 +27,11 @@
 /// - Binary write of some bytes of padding, to ensure that the next entry will
 ///   be aligned on an 8-byte boundary.
 ///
+/// If the high bit (CONTENT_COMPRESSED) of the length of a profile file is set,
+/// the profile file is compressed.  The rest of the length then counts an
+/// 8-byte binary write of the uncompressed length of the profile file, followed
+/// by a zlib stream of its bytes.
+///
 /// Note that there are no newline or other delimiters required by the format.
 /// The 8-byte constant, coupled with the *binary* writes of the lengths of the
 /// fields, suffice to unambiguously represent the file contents.  Note that the
@@ -34,3 +40,138 @@
 /// A unique 8-byte code to use as a prefix each time an AuthTable Entry is
 /// written to disk.
 const std::string AUTHENTRY = "AUTHAUTH";
+
+/// The flag in the length of a profile file that says it is compressed
+const uint64_t CONTENT_COMPRESSED = uint64_t(1) << 63;
+
+/// When several users have identical profile files, the bytes are written once,
+/// as a blob, and each of those users' entries refers to the blob by its
+/// SHA-256 digest.  Blobs and entries may appear in any order in the file.
+///
+/// Blob format:
+/// - 8-byte constant BLOBBLOB
+/// - 8-byte binary write of the length of the digest (32)
+/// - Binary write of the bytes of the SHA-256 digest of the profile file
+/// - 8-byte binary write of the length of the profile file (which may be
+///   compressed, as above)
+/// - Binary write of the bytes of the profile file
+/// - Binary write of some bytes of padding, to ensure that the next entry will
+///   be aligned on an 8-byte boundary.
+///
+/// Shared-content authentication entry format:
+/// - 8-byte constant AUTHBLOB
+/// - The username, salt, and hashed password, as in an AUTHAUTH entry
+/// - 8-byte binary write of the length of the digest (32)
+/// - Binary write of the bytes of the digest of a blob in the same file
+/// - Binary write of some bytes of padding, as above
+
+/// A unique 8-byte code to use as a prefix each time a shared profile file is
+/// written to disk
+const std::string BLOBENTRY = "BLOBBLOB";
+
+/// A unique 8-byte code to use as a prefix each time an AuthTable Entry whose
+/// profile file is a blob is written to disk
+const std::string AUTHREFENTRY = "AUTHBLOB";
+
+/// If the server keeps a log (see wal.h), each REG and SET is also appended to
+/// a log file as soon as it happens.  A log file is a series of entries, in the
+/// order in which the changes were made, and is replayed on top of the data
+/// file when the server starts.  A REG is logged as an AUTHAUTH entry (with an
+/// empty profile file), and a SET is logged as an update entry.
+///
+/// Update entry format:
+/// - 8-byte constant AUTHDIFF
+/// - 8-byte binary write of the length of the username
+/// - Binary write of the bytes of the username
+/// - 8-byte binary write of the length of the profile file (which may be
+///   compressed, as above)
+/// - Binary write of the bytes of the profile file
+/// - Binary write of some bytes of padding, as above
+
+/// A unique 8-byte code to use as a prefix each time a change to a user's
+/// profile file is written to the log
+const std::string DIFFENTRY = "AUTHDIFF";
+
+/// By default, a SAV writes the data file as a single series of entries and
+/// blobs, as described above.  This is version 1 of the format.  If segmented
+/// saves are on (the server's -S option), a SAV instead writes the data file
+/// as a manifest plus a set of segment files, which are written in parallel.
+/// The loader accepts either, whichever option the server was started with.
+/// Each segment file is either in version 1, exactly like a data file without
+/// a manifest (in which case an entry may refer to a blob in any segment of the
+/// same save), or in version 2, as described below.  A segment is named after
+/// the data file, the number of the save, and its index (e.g., "data.seg.4.0"),
+/// so that the segments of the previous save remain valid until the new
+/// manifest replaces the old one.  Once the new manifest is in place, the
+/// segments that it does not list are removed, as are all segments once a
+/// single-file save replaces a manifest.
+///
+/// Manifest format:
+/// - 8-byte constant MANIFEST
+/// - 8-byte binary write of the number of the save
+/// - 8-byte binary write of the number of segments
+/// - For each segment:
+///   - 8-byte binary write of the length of the segment file's name
+///   - Binary write of the bytes of the name, which is relative to the
+///     directory of the data file
+///   - 8-byte binary write of the size of the segment file
+///   - Binary write of some bytes of padding, as above
+///
+/// A data file that does not start with MANIFEST is a single segment.
+
+/// Version 2 of the format, the indexed segment, is only written by segmented
+/// saves (-S), and only ever as a segment that a manifest lists.  Where version
+/// 1 interleaves the users with their profile files, version 2 puts the
+/// profile files first, and an index of the users at the end, so that the
+/// users can be loaded without reading the profile files, which can then be
+/// read when they are first needed.  Every index entry, and every profile file,
+/// has a CRC32C checksum, which version 1 does not have.
+///
+/// Indexed segment (version 2) format:
+/// - 8-byte constant AUTHDAT2
+/// - The stored bytes of each distinct profile file in the segment (which may
+///   be compressed), each followed by some bytes of padding, as above
+/// - For each user, an index entry:
+///   - 8-byte constant AUTHIDX2
+///   - The username, salt, and hashed password, as in an AUTHAUTH entry
+///   - 8-byte binary write of the offset of the user's profile file in the
+///     segment, or 0 if it is empty
+///   - 8-byte binary write of the number of stored bytes of the profile file,
+///     with CONTENT_COMPRESSED set if they are a zlib stream
+///   - 8-byte binary write of the length of the profile file, uncompressed
+///   - 32-byte binary write of the SHA-256 digest of the profile file,
+///     uncompressed (zeros if it is empty)
+///   - 4-byte binary write of the CRC32C of the stored bytes of the profile
+///     file
+///   - 4-byte binary write of the CRC32C of the index entry, up to here
+///   - Binary write of some bytes of padding, as above
+/// - A 32-byte footer:
+///   - 8-byte binary write of the offset of the first index entry
+///   - 8-byte binary write of the number of index entries
+///   - 4-byte binary write of the CRC32C of the footer, up to here
+///   - 4 bytes of padding
+///   - 8-byte constant AUTHEND2
+
+/// A unique 8-byte code to use as the first bytes of a version 2 (indexed)
+/// segment
+const std::string INDEXEDHEADER = "AUTHDAT2";
+
+/// A segmented save (-S) may write only the users who changed since the last
+/// save, as delta segments, which the manifest lists after the segments that
+/// they change.  A single-file save never writes deltas, since it always writes
+/// every user.  A delta segment is an indexed segment whose first bytes are
+/// AUTHDLT2 instead of AUTHDAT2.  When a user is in more than one segment, the
+/// entry in the segment that is listed last is the one that is loaded.
+
+/// A unique 8-byte code to use as the first bytes of a delta segment
+const std::string DELTAHEADER = "AUTHDLT2";
+
+/// A unique 8-byte code to use as a prefix of each index entry of an indexed
+/// segment
+const std::string INDEXENTRY = "AUTHIDX2";
+
+/// A unique 8-byte code to use as the last bytes of an indexed segment
+const std::string INDEXEDFOOTER = "AUTHEND2";
+
+/// A unique 8-byte code to use as a prefix of a manifest
+const std::string MANIFESTENTRY = "MANIFEST";
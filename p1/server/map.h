@@ -1,8 +1,92 @@
 #pragma once
 
 #include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
+/// map_key_view is the type that Map uses to look up keys of type K.  For most
+/// key types it is just `const K &`, but for std::string it is
+/// std::string_view, so that a caller can look up a key that lives in some
+/// other buffer (i.e., a decrypted request) without first copying it into a
+/// new std::string.
+///
+/// @param K The type of the keys in a map
+template <typename K> struct map_key_view {
+  typedef const K &type;
+};
+
+/// map_key_view for std::string keys
+template <> struct map_key_view<std::string> {
+  typedef std::string_view type;
+};
+
+/// map_hash is the hash function that Map implementations use for keys of
+/// type K.  It is std::hash<K>, except that for std::string it also accepts
+/// std::string_view (and gives the same hash for the same characters), so that
+/// lookups by view never need to build a std::string.
+///
+/// @param K The type of the keys in a map
+template <typename K> struct map_hash {
+  size_t operator()(const K &key) const { return std::hash<K>()(key); }
+};
+
+/// map_hash for std::string keys
+template <> struct map_hash<std::string> {
+  typedef void is_transparent;
+  size_t operator()(std::string_view key) const {
+    return std::hash<std::string_view>()(key);
+  }
+};
+
+/// map_key_of tells a map whether its values hold their own keys.  For most
+/// value types they do not, and a map stores each key next to its value.  A
+/// value type whose key is one of its fields (i.e., AuthRecord, whose key
+/// is its username) can specialize this, with `embedded` set to true and a
+/// static `get()` that returns a view of the key in a value, so that a map can
+/// store the key once, in the value.  A map that does so only uses the key that
+/// it is given to find where a value goes, so that key must be the one that
+/// the value holds.
+///
+/// @param V The type of the values in a map
+template <typename V> struct map_key_of {
+  static constexpr bool embedded = false;
+};
+
+/// map_ref is a reference to a callable, which Map's *_ref methods take instead
+/// of a std::function.  Making one never allocates, and it is small enough to
+/// be stored in a std::function without allocating, so a Map that has no
+/// faster path can forward a map_ref to its std::function methods.  A map_ref
+/// must not outlive the callable it refers to.
+///
+/// @param Sig The signature of the callable
+template <typename Sig> class map_ref;
+
+/// map_ref for a callable that takes A... and returns R
+template <typename R, typename... A> class map_ref<R(A...)> {
+  void *obj;                 // The callable
+  R (*call)(void *, A...);   // A function that calls obj as its real type
+
+public:
+  /// Refer to a callable
+  ///
+  /// @param f The callable
+  template <typename F, typename = std::enable_if_t<
+                            !std::is_same_v<std::decay_t<F>, map_ref>>>
+  map_ref(F &&f)
+      : obj(const_cast<void *>(static_cast<const void *>(&f))),
+        call([](void *o, A... a) -> R {
+          return (*static_cast<std::remove_reference_t<F> *>(o))(
+              std::forward<A>(a)...);
+        }) {}
+
+  /// Call the callable
+  R operator()(A... a) const { return call(obj, std::forward<A>(a)...); }
+};
+
 /// Map is an interface for a collection of key/value pairs.  It is templated on
 /// both the key and value types.
 ///
@@ -13,6 +97,13 @@
 /// @param V The type of the values in this map
 template <typename K, typename V> class Map {
 public:
+  /// The type of key that lookups accept
+  typedef typename map_key_view<K>::type key_view;
+
+  /// The type of key that batched lookups accept.  It is key_view without the
+  /// reference, so that it can be stored in a vector.
+  typedef std::decay_t<key_view> batch_key;
+
   /// Destruct the Map
   virtual ~Map() {}
 
@@ -80,4 +171,196 @@ public:
   ///             useful for 2pl
   virtual void do_all_readonly(std::function<void(const K, const V &)> f,
                                std::function<void()> then) = 0;
+
+  // NB: The methods below are not part of the original interface.  They come
+  //     after the original methods, so that code that was compiled against the
+  //     original interface still finds each of those at the same place in the
+  //     vtable.  Each has a default that is built from the original methods.
+
+  /// Insert a batch of key/value pairs, skipping any whose key is already
+  /// mapped.  If a key appears more than once, its first pair is the one that
+  /// is inserted.  The default is to call insert() once per pair;
+  /// implementations should override this to lock each bucket once per batch.
+  ///
+  /// @param entries    The key/value pairs to insert
+  /// @param on_success Code to run for each key that is inserted
+  ///
+  /// @return The number of pairs that were inserted
+  virtual size_t insert_batch(std::vector<std::pair<K, V>> entries,
+                              std::function<void(const K &)> on_success) {
+    size_t added = 0;
+    for (auto &e : entries) {
+      K key = e.first;
+      if (insert(std::move(e.first), std::move(e.second),
+                 [&]() { on_success(key); }))
+        ++added;
+    }
+    return added;
+  }
+
+  /// Upsert a batch of key/value pairs.  If a key appears more than once, its
+  /// last pair is the one that remains.  The default is to call upsert() once
+  /// per pair.
+  ///
+  /// @param entries The key/value pairs to upsert
+  /// @param on_ins  Code to run for each key that is inserted
+  /// @param on_upd  Code to run for each key that is updated
+  ///
+  /// @return The number of pairs that were inserted (rather than updated)
+  virtual size_t upsert_batch(std::vector<std::pair<K, V>> entries,
+                              std::function<void(const K &)> on_ins,
+                              std::function<void(const K &)> on_upd) {
+    size_t added = 0;
+    for (auto &e : entries) {
+      K key = e.first;
+      if (upsert(std::move(e.first), std::move(e.second),
+                 [&]() { on_ins(key); }, [&]() { on_upd(key); }))
+        ++added;
+    }
+    return added;
+  }
+
+  /// Apply a function to the values associated with a batch of keys (a
+  /// "multi-get").  The function is not allowed to modify the values.  The
+  /// default is to call do_with_readonly() once per key.
+  ///
+  /// @param keys The keys whose values will be read
+  /// @param f    The function to apply to each value that is found.  It
+  ///             receives the position of the key in `keys`, and the value.
+  ///
+  /// @return The number of keys that were found
+  virtual size_t
+  do_with_readonly_many(const std::vector<batch_key> &keys,
+                        std::function<void(size_t, const V &)> f) {
+    size_t found = 0;
+    for (size_t i = 0; i < keys.size(); ++i)
+      if (do_with_readonly_view(keys[i], [&](const V &v) { f(i, v); }))
+        ++found;
+    return found;
+  }
+
+  /// Apply a function to every key/value pair in a consistent point-in-time
+  /// snapshot of the map.  Unlike do_all_readonly, this need not block writers
+  /// for the whole scan, so it is the right choice for long scans that do not
+  /// need to nest 2pl operations.  The default is to fall back to
+  /// do_all_readonly.
+  ///
+  /// @param f The function to apply to each key/value pair
+  virtual void do_all_snapshot(std::function<void(const K &, const V &)> f) {
+    do_all_readonly([&](const K k, const V &v) { f(k, v); }, []() {});
+  }
+
+  // NB: The *_ref methods below are the same as the original methods, but take
+  //     their keys as key_views and their callbacks as map_refs.
+  //     Implementations should override them to call their callbacks directly,
+  //     so that callers that make many small calls (i.e., Storage) pay for
+  //     neither a std::function nor an allocation.
+
+  /// Apply a function to the value associated with a given key.  The function
+  /// is allowed to modify the value, and returns true if it did, so that a map
+  /// that copies values on write can skip the copy when nothing changed.
+  ///
+  /// @param key The key whose value will be modified
+  /// @param f   The function to apply to the key's value
+  ///
+  /// @return true if the key existed and the function was applied, false
+  ///         otherwise
+  virtual bool do_with_ref(key_view key, map_ref<bool(V &)> f) {
+    return do_with_view(key, [&](V &v) { f(v); });
+  }
+
+  /// Apply a function to the value associated with a given key.  The function
+  /// is not allowed to modify the value.
+  ///
+  /// @param key The key whose value will be read
+  /// @param f   The function to apply to the key's value
+  ///
+  /// @return true if the key existed and the function was applied, false
+  ///         otherwise
+  virtual bool do_with_readonly_ref(key_view key,
+                                    map_ref<void(const V &)> f) {
+    return do_with_readonly_view(key, f);
+  }
+
+  /// Insert the provided key/value pair only if there is no mapping for the key
+  /// yet.
+  ///
+  /// @param key        The key to insert
+  /// @param val        The value to insert
+  /// @param on_success Code to run if the insertion succeeds
+  ///
+  /// @return true if the key/value was inserted, false if the key already
+  ///         existed in the table
+  virtual bool insert_ref(K key, V val, map_ref<void()> on_success) {
+    return insert(std::move(key), std::move(val), on_success);
+  }
+
+  /// snapshot is a consistent point-in-time view of a Map, split into parts
+  /// that several threads may scan at once
+  class snapshot {
+  public:
+    virtual ~snapshot() {}
+
+    /// Get the number of parts of the snapshot
+    virtual size_t parts() const = 0;
+
+    /// Apply a function to every key/value pair in a range of the parts of
+    /// the snapshot
+    ///
+    /// @param from The first part
+    /// @param to   The part after the last one
+    /// @param f    The function to apply to each key/value pair.  It must not
+    ///             access the map.  The key is passed as a key_view, so that a
+    ///             map whose values hold their keys need not copy them.
+    virtual void scan(size_t from, size_t to,
+                      map_ref<void(key_view, const V &)> f) const = 0;
+  };
+
+  /// Take a snapshot of the map, to scan in parallel.  Any thread may destroy
+  /// it, and several snapshots may be open at once.  While one is open, the map
+  /// keeps old versions of the values that change, and does not resize.
+  ///
+  /// @return The snapshot, or nullptr if this map cannot split a snapshot, in
+  ///         which case do_all_snapshot() should be used instead
+  virtual std::unique_ptr<snapshot> take_snapshot() { return nullptr; }
+
+  // NB: The *_view methods below are the same as the original methods, but
+  //     take their keys as key_views, so that a caller can look up a key that
+  //     lives in some other buffer without first copying it into a new K.  The
+  //     defaults make that copy and call the original methods.
+
+  /// Apply a function to the value associated with a given key.  The function
+  /// is allowed to modify the value.
+  ///
+  /// @param key The key whose value will be modified
+  /// @param f   The function to apply to the key's value
+  ///
+  /// @return true if the key existed and the function was applied, false
+  ///         otherwise
+  virtual bool do_with_view(key_view key, std::function<void(V &)> f) {
+    return do_with(K(key), f);
+  }
+
+  /// Apply a function to the value associated with a given key.  The function
+  /// is not allowed to modify the value.
+  ///
+  /// @param key The key whose value will be read
+  /// @param f   The function to apply to the key's value
+  ///
+  /// @return true if the key existed and the function was applied, false
+  ///         otherwise
+  virtual bool do_with_readonly_view(key_view key,
+                                     std::function<void(const V &)> f) {
+    return do_with_readonly(K(key), f);
+  }
+
+  /// Remove the mapping from a key to its value
+  ///
+  /// @param key        The key whose mapping should be removed
+  /// @param on_success Code to run if the remove succeeds
+  ///
+  /// @return true if the key was found and the value unmapped, false otherwise
+  virtual bool remove_view(key_view key, std::function<void()> on_success) {
+    return remove(K(key), on_success);
+  }
 };
@@ -3,6 +3,7 @@
 #include <string>
 #include <vector>
 
+#include "authrecord.h"
 #include "authtableentry.h"
 #include "map.h"
 
@@ -10,3 +11,13 @@
 ///
 /// @param _buckets The number of buckets in the table
 Map<std::string, AuthTableEntry> *authtable_factory(size_t _buckets);
+
+/// Create an instance of HashTable that holds users as AuthRecords, the compact
+/// form that only the new maps support
+///
+/// NB: This is a weak symbol, since a map that was built against the original
+///     interface does not define it.  If it is nullptr, use authtable_factory().
+///
+/// @param _buckets The number of buckets in the table
+Map<std::string, AuthRecord> *authrecord_factory(size_t _buckets)
+    __attribute__((weak));
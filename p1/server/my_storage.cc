@@ -1,29 +1,1788 @@
+#include <atomic>
 #include <cassert>
+#include <cerrno>
+#include <chrono>
 #include <cstring>
+#include <deque>
+#include <dirent.h>
+#include <fcntl.h>
 #include <iostream>
+#include <mutex>
+#include <openssl/crypto.h>
 #include <openssl/rand.h>
+#include <openssl/sha.h>
+#include <sstream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <tuple>
+#include <unistd.h>
+#include <unordered_map>
+#include <unordered_set>
 
 #include "../common/contextmanager.h"
 #include "../common/err.h"
+#include "../common/file.h"
 #include "../common/protocol.h"
 
+#include "authrecord.h"
 #include "authtableentry.h"
+#include "blob_store.h"
+#include "checkpointer.h"
+#include "crc32c.h"
+#include "dirty_set.h"
 #include "format.h"
 #include "map.h"
 #include "map_factories.h"
+#include "shard_pool.h"
+#include "skiplist.h"
 #include "storage.h"
+#include "uring.h"
+#include "wal.h"
 
 using namespace std;
 
+/// Hash a password with a salt, as SHA-256(pass.salt).  The input is assembled
+/// on the stack, so this does not allocate.
+///
+/// @param pass The password
+/// @param salt The salt (LEN_SALT bytes)
+/// @param out  Where to write the hash (LEN_PASSHASH bytes)
+///
+/// @return false if the password is longer than LEN_PASSWORD, true otherwise
+static bool hash_pass(string_view pass, const uint8_t *salt, uint8_t *out) {
+  if (pass.length() > LEN_PASSWORD)
+    return false;
+  uint8_t buf[LEN_PASSWORD + LEN_SALT];
+  memcpy(buf, pass.data(), pass.length());
+  memcpy(buf + pass.length(), salt, LEN_SALT);
+  SHA256(buf, pass.length() + LEN_SALT, out);
+  return true;
+}
+
+/// Check if a password matches the one stored in an AuthRecord
+///
+/// @param e    The entry for the user
+/// @param pass The password to check
+///
+/// @return true if the password is correct, false otherwise
+static bool check_pass(const AuthRecord &e, string_view pass) {
+  uint8_t hash[LEN_PASSHASH];
+  if (!hash_pass(pass, e.salt, hash))
+    return false;
+  return CRYPTO_memcmp(hash, e.pass_hash, LEN_PASSHASH) == 0;
+}
+
+/// Append a length-prefixed field to a buffer, as described in format.h
+///
+/// @param buf  The buffer
+/// @param data The bytes of the field
+/// @param len  The number of bytes in the field
+static void append_field(vector<uint8_t> &buf, const void *data, size_t len) {
+  uint64_t n = len;
+  auto *p = reinterpret_cast<const uint8_t *>(&n);
+  auto *d = static_cast<const uint8_t *>(data);
+  buf.insert(buf.end(), p, p + sizeof(n));
+  buf.insert(buf.end(), d, d + len);
+}
+
+/// Append a profile file to a buffer, as a length-prefixed field in the format
+/// described in format.h.  Compressed content is written as it is stored, and
+/// flagged in the length.
+///
+/// @param buf   The buffer
+/// @param c     The content, or nullptr
+/// @param blobs The store that holds the content (in case it is spilled)
+///
+/// @return false if the content could not be read, true otherwise
+static bool append_content(vector<uint8_t> &buf, const content_ptr &c,
+                           const blob_store &blobs) {
+  if (!c) {
+    append_field(buf, nullptr, 0);
+    return true;
+  }
+  bytes_ptr b = blobs.stored(*c);
+  if (!b)
+    return false;
+  if (!c->compressed) {
+    append_field(buf, b->data(), b->size());
+    return true;
+  }
+  uint64_t raw = c->raw_size;
+  uint64_t n = (sizeof(raw) + b->size()) | CONTENT_COMPRESSED;
+  buf.insert(buf.end(), (uint8_t *)&n, (uint8_t *)&n + sizeof(n));
+  buf.insert(buf.end(), (uint8_t *)&raw, (uint8_t *)&raw + sizeof(raw));
+  buf.insert(buf.end(), b->begin(), b->end());
+  return true;
+}
+
+/// Append an AuthRecord to a buffer, in the format described in format.h
+///
+/// @param buf   The buffer
+/// @param e     The entry to append
+/// @param ref   The digest of a blob that holds the entry's content, or nullptr
+///              to write the content in the entry
+/// @param blobs The store that holds the entry's content
+///
+/// @return false if the content could not be read, true otherwise
+static bool append_entry(vector<uint8_t> &buf, const AuthRecord &e,
+                         const blob_store::digest_t *ref,
+                         const blob_store &blobs) {
+  auto &code = ref ? AUTHREFENTRY : AUTHENTRY;
+  buf.insert(buf.end(), code.begin(), code.end());
+  append_field(buf, e.username, e.name_len);
+  append_field(buf, e.salt, LEN_SALT);
+  append_field(buf, e.pass_hash, LEN_PASSHASH);
+  if (ref)
+    append_field(buf, ref->bytes, sizeof(ref->bytes));
+  else if (!append_content(buf, e.content, blobs))
+    return false;
+  buf.resize((buf.size() + 7) & ~size_t(7), 0);
+  return true;
+}
+
+/// Append a blob to a buffer, in the format described in format.h
+///
+/// @param buf   The buffer
+/// @param d     The digest of the blob's content
+/// @param c     The content
+/// @param blobs The store that holds the content
+///
+/// @return false if the content could not be read, true otherwise
+static bool append_blob(vector<uint8_t> &buf, const blob_store::digest_t &d,
+                        const content_ptr &c, const blob_store &blobs) {
+  buf.insert(buf.end(), BLOBENTRY.begin(), BLOBENTRY.end());
+  append_field(buf, d.bytes, sizeof(d.bytes));
+  if (!append_content(buf, c, blobs))
+    return false;
+  buf.resize((buf.size() + 7) & ~size_t(7), 0);
+  return true;
+}
+
+/// Append a change to a user's profile file to a buffer, in the format
+/// described in format.h
+///
+/// @param buf   The buffer
+/// @param user  The name of the user
+/// @param c     The new content, or nullptr
+/// @param blobs The store that holds the content
+///
+/// @return false if the content could not be read, true otherwise
+static bool append_diff(vector<uint8_t> &buf, string_view user,
+                        const content_ptr &c, const blob_store &blobs) {
+  buf.insert(buf.end(), DIFFENTRY.begin(), DIFFENTRY.end());
+  append_field(buf, user.data(), user.size());
+  if (!append_content(buf, c, blobs))
+    return false;
+  buf.resize((buf.size() + 7) & ~size_t(7), 0);
+  return true;
+}
+
+/// byte_view is a read-only view of a buffer of bytes, such as a vector or a
+/// file that has been mapped into memory
+struct byte_view {
+  const uint8_t *ptr; // The first byte
+  size_t len;         // The number of bytes
+
+  byte_view(const uint8_t *p, size_t n) : ptr(p), len(n) {}
+  byte_view(const vector<uint8_t> &v) : ptr(v.data()), len(v.size()) {}
+  const uint8_t *data() const { return ptr; }
+  size_t size() const { return len; }
+};
+
+/// Check if the record at some offset in a buffer starts with a given code
+///
+/// @param buf  The buffer
+/// @param pos  The offset of the record
+/// @param code The 8-byte code
+///
+/// @return true if the record starts with code
+static bool has_code(byte_view buf, size_t pos, const string &code) {
+  return buf.size() - pos >= code.size() &&
+         memcmp(buf.data() + pos, code.data(), code.size()) == 0;
+}
+
+/// Read a length-prefixed field from a buffer, as described in format.h
+///
+/// @param buf  The buffer
+/// @param pos  The offset of the field.  On success, it is advanced past the
+///             field.
+/// @param data Set to the address of the field's bytes, within buf
+/// @param len  Set to the number of bytes in the field
+///
+/// @return false if the field runs past the end of the buffer, true otherwise
+static bool read_field(byte_view buf, size_t &pos, const uint8_t *&data,
+                       uint64_t &len) {
+  if (buf.size() - pos < sizeof(len))
+    return false;
+  memcpy(&len, buf.data() + pos, sizeof(len));
+  pos += sizeof(len);
+  if (buf.size() - pos < len)
+    return false;
+  data = buf.data() + pos;
+  pos += len;
+  return true;
+}
+
+/// Read a profile file from a buffer, as a length-prefixed field in the format
+/// described in format.h
+///
+/// @param buf  The buffer
+/// @param pos  The offset of the field.  On success, it is advanced past the
+///             field.
+/// @param data Set to the address of the stored bytes, within buf
+/// @param len  Set to the number of stored bytes
+/// @param raw  Set to the uncompressed size of the profile file, if it is
+///             compressed, or 0 if it is not
+///
+/// @return false if the field is malformed, true otherwise
+static bool read_content(byte_view buf, size_t &pos, const uint8_t *&data,
+                         uint64_t &len, uint64_t &raw) {
+  if (buf.size() - pos < sizeof(len))
+    return false;
+  memcpy(&len, buf.data() + pos, sizeof(len));
+  pos += sizeof(len);
+  bool compressed = len & CONTENT_COMPRESSED;
+  len &= ~CONTENT_COMPRESSED;
+  if (buf.size() - pos < len)
+    return false;
+  data = buf.data() + pos;
+  pos += len;
+  raw = 0;
+  if (!compressed)
+    return true;
+  // NB: The size bound keeps a corrupt file from making a GET allocate a huge
+  //     buffer
+  if (len < sizeof(raw))
+    return false;
+  memcpy(&raw, data, sizeof(raw));
+  data += sizeof(raw);
+  len -= sizeof(raw);
+  return raw > 0 && raw <= (uint64_t)LEN_PROFILE_FILE;
+}
+
+/// Intern a profile file that was read from a buffer in a blob_store, so that
+/// users with the same content share it.  (Compressed content is decompressed
+/// to find its digest, but it is stored as it was read.)
+///
+/// @param blobs The store in which to intern the content
+/// @param data  The stored bytes
+/// @param len   The number of stored bytes
+/// @param raw   The uncompressed size, or 0 if the bytes are not compressed
+/// @param c     Set to the interned content
+///
+/// @return false if the content does not decompress, true otherwise
+static bool intern_content(blob_store &blobs, const uint8_t *data,
+                           uint64_t len, uint64_t raw, content_ptr &c) {
+  if (raw == 0) {
+    c = blobs.intern(data, len);
+    return true;
+  }
+  auto z = make_unique<content_t>(vector<uint8_t>(data, data + len), raw, true);
+  bytes_ptr b = unpack_content(*z, z->stored());
+  if (!b)
+    return false;
+  c = blobs.intern(move(z), blob_store::digest(b->data(), b->size()));
+  return true;
+}
+
+/// Read an AuthRecord from a buffer, in the format described in format.h.
+/// Content that is in the entry is interned in a blob_store (see
+/// intern_content()).
+///
+/// @param buf   The buffer
+/// @param pos   The offset of the entry.  On success, it is advanced to the
+///              next entry.
+/// @param e     The entry to fill
+/// @param blobs The store in which to intern the entry's content
+/// @param ref   Set to the digest of the blob that holds the entry's content,
+///              if it is an AUTHBLOB entry
+/// @param byref Set to true if it is an AUTHBLOB entry, in which case the
+///              caller must fill in e.content from the blob
+///
+/// @return false if the entry is malformed, true otherwise
+static bool read_entry(byte_view buf, size_t &pos, AuthRecord &e,
+                       blob_store &blobs, blob_store::digest_t &ref,
+                       bool &byref) {
+  byref = has_code(buf, pos, AUTHREFENTRY);
+  if (!byref && !has_code(buf, pos, AUTHENTRY))
+    return false;
+  pos += AUTHENTRY.size();
+  const uint8_t *name, *salt, *hash, *content;
+  uint64_t name_len, salt_len, hash_len, content_len, raw;
+  if (!read_field(buf, pos, name, name_len) ||
+      !read_field(buf, pos, salt, salt_len) ||
+      !read_field(buf, pos, hash, hash_len))
+    return false;
+  if (salt_len != LEN_SALT || hash_len != LEN_PASSHASH ||
+      !e.set_name({reinterpret_cast<const char *>(name), name_len}))
+    return false;
+  memcpy(e.salt, salt, LEN_SALT);
+  memcpy(e.pass_hash, hash, LEN_PASSHASH);
+  if (byref) {
+    if (!read_field(buf, pos, content, content_len) ||
+        content_len != sizeof(ref.bytes))
+      return false;
+    memcpy(ref.bytes, content, sizeof(ref.bytes));
+  } else {
+    if (!read_content(buf, pos, content, content_len, raw) ||
+        !intern_content(blobs, content, content_len, raw, e.content))
+      return false;
+  }
+  pos = min(buf.size(), (pos + 7) & ~size_t(7));
+  return true;
+}
+
+/// Read a blob from a buffer, in the format described in format.h, and intern
+/// it in a blob_store
+///
+/// @param buf   The buffer
+/// @param pos   The offset of the blob.  On success, it is advanced to the next
+///              entry.
+/// @param blobs The store in which to intern the blob
+/// @param d     Set to the digest of the blob
+/// @param c     Set to the blob's content
+///
+/// @return false if the blob is malformed, true otherwise
+static bool read_blob(byte_view buf, size_t &pos, blob_store &blobs,
+                      blob_store::digest_t &d, content_ptr &c) {
+  if (!has_code(buf, pos, BLOBENTRY))
+    return false;
+  pos += BLOBENTRY.size();
+  const uint8_t *digest, *content;
+  uint64_t digest_len, content_len, raw;
+  if (!read_field(buf, pos, digest, digest_len) ||
+      !read_content(buf, pos, content, content_len, raw) ||
+      digest_len != sizeof(d.bytes) || content_len == 0)
+    return false;
+  memcpy(d.bytes, digest, sizeof(d.bytes));
+  c = blobs.intern(
+      make_unique<content_t>(vector<uint8_t>(content, content + content_len),
+                             raw ? raw : content_len, raw != 0),
+      d);
+  pos = min(buf.size(), (pos + 7) & ~size_t(7));
+  return true;
+}
+
+/// Read a change to a user's profile file from a buffer, in the format
+/// described in format.h
+///
+/// @param buf   The buffer
+/// @param pos   The offset of the change.  On success, it is advanced to the
+///              next entry.
+/// @param user  Set to the name of the user
+/// @param c     Set to the new content, interned in blobs
+/// @param blobs The store in which to intern the content
+///
+/// @return false if the change is malformed, true otherwise
+static bool read_diff(byte_view buf, size_t &pos, string &user,
+                      content_ptr &c, blob_store &blobs) {
+  if (!has_code(buf, pos, DIFFENTRY))
+    return false;
+  pos += DIFFENTRY.size();
+  const uint8_t *name, *content;
+  uint64_t name_len, content_len, raw;
+  if (!read_field(buf, pos, name, name_len) || name_len == 0 ||
+      name_len > (uint64_t)LEN_UNAME ||
+      !read_content(buf, pos, content, content_len, raw) ||
+      !intern_content(blobs, content, content_len, raw, c))
+    return false;
+  user.assign(reinterpret_cast<const char *>(name), name_len);
+  pos = min(buf.size(), (pos + 7) & ~size_t(7));
+  return true;
+}
+
+/// Find the first offset in a range of a buffer that is 8-byte aligned and
+/// starts with the code of a data file record (see format.h).  This is a
+/// guess: a profile file may hold a code at an aligned offset.
+///
+/// @param buf  The buffer
+/// @param from The start of the range
+/// @param to   The end of the range
+///
+/// @return The offset, or `to` if there is none
+static size_t find_record(byte_view buf, size_t from, size_t to) {
+  for (size_t pos = (from + 7) & ~size_t(7); pos < to; pos += 8)
+    if (has_code(buf, pos, AUTHENTRY) || has_code(buf, pos, AUTHREFENTRY) ||
+        has_code(buf, pos, BLOBENTRY))
+      return pos;
+  return to;
+}
+
+/// The size of the footer of an indexed segment (see format.h)
+static const size_t INDEXED_FOOTER_SIZE = 32;
+
+/// Append the bytes of a value to a buffer, as a binary write
+///
+/// @param buf The buffer
+/// @param v   The value
+template <typename T>
+static void append_bytes(vector<uint8_t> &buf, const T &v) {
+  auto *p = reinterpret_cast<const uint8_t *>(&v);
+  buf.insert(buf.end(), p, p + sizeof(v));
+}
+
+/// Append an index entry of an indexed segment to a buffer, in the format
+/// described in format.h
+///
+/// @param buf The buffer
+/// @param e   The user's entry
+/// @param off The offset of the user's profile file in the segment, or 0
+/// @param d   The digest of the profile file
+/// @param crc The CRC32C of the stored bytes of the profile file
+static void append_index(vector<uint8_t> &buf, const AuthRecord &e,
+                         uint64_t off, const blob_store::digest_t &d,
+                         uint32_t crc) {
+  size_t start = buf.size();
+  const content_t *c = e.content.get();
+  uint64_t len = c ? c->stored_size : 0, raw = c ? c->raw_size : 0;
+  if (c && c->compressed)
+    len |= CONTENT_COMPRESSED;
+  buf.insert(buf.end(), INDEXENTRY.begin(), INDEXENTRY.end());
+  append_field(buf, e.username, e.name_len);
+  append_field(buf, e.salt, LEN_SALT);
+  append_field(buf, e.pass_hash, LEN_PASSHASH);
+  append_bytes(buf, off);
+  append_bytes(buf, len);
+  append_bytes(buf, raw);
+  append_bytes(buf, d.bytes);
+  append_bytes(buf, crc);
+  append_bytes(buf, crc32c(buf.data() + start, buf.size() - start));
+  buf.resize((buf.size() + 7) & ~size_t(7), 0);
+}
+
+/// index_entry_t is where an index entry of an indexed segment says a user's
+/// profile file is
+struct index_entry_t {
+  uint64_t off;           // The offset of the stored bytes, or 0
+  uint64_t len;           // The number of stored bytes
+  uint64_t raw;           // The size of the profile file, uncompressed
+  bool compressed;        // true if the stored bytes are a zlib stream
+  blob_store::digest_t d; // The digest of the profile file
+  uint32_t crc;           // The CRC32C of the stored bytes
+};
+
+/// Read an index entry of an indexed segment from a buffer, in the format
+/// described in format.h, and check its CRC32C
+///
+/// @param buf The buffer
+/// @param pos The offset of the entry.  On success, it is advanced to the next
+///            entry.
+/// @param e   The entry to fill, except for its content
+/// @param ix  Set to where the entry's profile file is
+///
+/// @return false if the entry is malformed, true otherwise
+static bool read_index(byte_view buf, size_t &pos, AuthRecord &e,
+                       index_entry_t &ix) {
+  size_t start = pos;
+  if (!has_code(buf, pos, INDEXENTRY))
+    return false;
+  pos += INDEXENTRY.size();
+  const uint8_t *name, *salt, *hash;
+  uint64_t name_len, salt_len, hash_len;
+  if (!read_field(buf, pos, name, name_len) ||
+      !read_field(buf, pos, salt, salt_len) ||
+      !read_field(buf, pos, hash, hash_len))
+    return false;
+  const size_t rest = 3 * sizeof(uint64_t) + sizeof(ix.d.bytes) + 8;
+  if (buf.size() - pos < rest || salt_len != LEN_SALT ||
+      hash_len != LEN_PASSHASH ||
+      !e.set_name({reinterpret_cast<const char *>(name), name_len}))
+    return false;
+  const uint8_t *p = buf.data() + pos;
+  uint32_t crc;
+  memcpy(&ix.off, p, 8);
+  memcpy(&ix.len, p + 8, 8);
+  memcpy(&ix.raw, p + 16, 8);
+  memcpy(ix.d.bytes, p + 24, sizeof(ix.d.bytes));
+  memcpy(&ix.crc, p + 24 + sizeof(ix.d.bytes), 4);
+  memcpy(&crc, p + 28 + sizeof(ix.d.bytes), 4);
+  pos += rest;
+  if (crc != crc32c(buf.data() + start, pos - 4 - start))
+    return false;
+  memcpy(e.salt, salt, LEN_SALT);
+  memcpy(e.pass_hash, hash, LEN_PASSHASH);
+  ix.compressed = ix.len & CONTENT_COMPRESSED;
+  ix.len &= ~CONTENT_COMPRESSED;
+  pos = min(buf.size(), (pos + 7) & ~size_t(7));
+  // NB: The size bound keeps a corrupt file from making a GET allocate a huge
+  //     buffer
+  return ix.compressed ? ix.raw > 0 && ix.raw <= (uint64_t)LEN_PROFILE_FILE
+                       : ix.raw == ix.len;
+}
+
+/// Advise the kernel that the rest of a mapped file will be read soon, from
+/// some offset on, so that it reads ahead
+///
+/// @param buf  The mapped file
+/// @param from The offset
+static void will_need(byte_view buf, size_t from) {
+  if (from >= buf.size())
+    return;
+  uintptr_t page = sysconf(_SC_PAGESIZE);
+  uintptr_t p = reinterpret_cast<uintptr_t>(buf.data() + from) & ~(page - 1);
+  uintptr_t end = reinterpret_cast<uintptr_t>(buf.data() + buf.size());
+  madvise(reinterpret_cast<void *>(p), end - p, MADV_WILLNEED);
+}
+
+/// segment_t describes one segment file of a data file (see format.h)
+struct segment_t {
+  string name;   // The name of the file, relative to the data file's directory
+  uint64_t size; // The size of the file
+};
+
+/// Make a manifest, in the format described in format.h
+///
+/// @param id   The number of the save
+/// @param segs The segments
+///
+/// @return The manifest
+static vector<uint8_t> make_manifest(uint64_t id,
+                                     const vector<segment_t> &segs) {
+  vector<uint8_t> buf(MANIFESTENTRY.begin(), MANIFESTENTRY.end());
+  uint64_t n = segs.size();
+  buf.insert(buf.end(), (uint8_t *)&id, (uint8_t *)&id + sizeof(id));
+  buf.insert(buf.end(), (uint8_t *)&n, (uint8_t *)&n + sizeof(n));
+  for (auto &s : segs) {
+    append_field(buf, s.name.data(), s.name.size());
+    buf.insert(buf.end(), (uint8_t *)&s.size, (uint8_t *)&s.size + 8);
+    buf.resize((buf.size() + 7) & ~size_t(7), 0);
+  }
+  return buf;
+}
+
+/// Read a manifest, in the format described in format.h
+///
+/// @param buf  The manifest
+/// @param id   Set to the number of the save
+/// @param segs Set to the segments
+///
+/// @return false if the manifest is malformed, true otherwise
+static bool read_manifest(byte_view buf, uint64_t &id,
+                          vector<segment_t> &segs) {
+  uint64_t n;
+  size_t pos = MANIFESTENTRY.size();
+  if (!has_code(buf, 0, MANIFESTENTRY) || buf.size() - pos < 2 * sizeof(n))
+    return false;
+  memcpy(&id, buf.data() + pos, sizeof(id));
+  memcpy(&n, buf.data() + pos + sizeof(id), sizeof(n));
+  pos += 2 * sizeof(n);
+  segs.clear();
+  for (uint64_t i = 0; i < n; ++i) {
+    const uint8_t *name;
+    uint64_t len, size;
+    if (!read_field(buf, pos, name, len) || len == 0 ||
+        buf.size() - pos < sizeof(size))
+      return false;
+    memcpy(&size, buf.data() + pos, sizeof(size));
+    pos = (pos + sizeof(size) + 7) & ~size_t(7);
+    string s((const char *)name, len);
+    // NB: A segment must be in the data file's directory
+    if (s.find('/') != string::npos || s == "." || s == "..")
+      return false;
+    segs.push_back({move(s), size});
+  }
+  return true;
+}
+
+/// Remove the segment files of a data file, except those that a manifest
+/// lists
+///
+/// @param base The name of the data file
+/// @param keep The segments that are kept
+static void remove_segments(const string &base, const vector<segment_t> &keep) {
+  size_t slash = base.rfind('/');
+  string dir = slash == string::npos ? "." : base.substr(0, slash + 1);
+  string prefix = (slash == string::npos ? base : base.substr(slash + 1)) +
+                  ".seg.";
+  unordered_set<string> mine;
+  for (auto &s : keep)
+    mine.insert(s.name);
+  vector<string> stale;
+  DIR *d = opendir(dir.c_str());
+  if (!d)
+    return;
+  while (dirent *ent = readdir(d)) {
+    string n = ent->d_name;
+    if (n.compare(0, prefix.size(), prefix) == 0 && !mine.count(n))
+      stale.push_back(n);
+  }
+  closedir(d);
+  for (auto &n : stale)
+    unlink((slash == string::npos ? n : dir + n).c_str());
+}
+
+/// segment_writer writes a file through a large buffer.  Until the file is
+/// finished, only whole blocks are written, so that the disk sees a few large
+/// writes, each at an offset that is a multiple of the block size.
+///
+/// When io_uring is available (see uring.h), a block is copied into one of
+/// QUEUE_DEPTH registered buffers and written asynchronously, so the thread
+/// keeps scanning while up to QUEUE_DEPTH writes are in flight, which is what
+/// it takes to keep a fast SSD busy.  Otherwise, each write blocks.
+class segment_writer {
+  /// The most writes in flight at once, with io_uring
+  static const unsigned QUEUE_DEPTH = 4;
+
+  int fd;                     // The file
+  size_t block;               // The size of a block
+  size_t written = 0;         // The number of bytes written so far
+  bool good;                  // false once a write has failed
+  vector<uint8_t> buf;        // The bytes that have not been written yet
+  unique_ptr<uint8_t[]> pool; // The buffers of the slots, or nullptr
+  iovec slots[QUEUE_DEPTH];   // The bytes of each slot's write
+  vector<unsigned> idle;      // The slots that are not in flight
+  bool fixed = false;         // true if the slots' buffers are registered
+
+  /// The ring.  It is declared last, so that it is destroyed first, which
+  /// waits for the writes in flight before their buffers are freed.
+  uring_t ring{QUEUE_DEPTH};
+
+  /// Wait for a write to finish, and free its slot
+  void reap() {
+    io_uring_cqe c;
+    if (!ring.wait(c)) {
+      good = false;
+      return;
+    }
+    good = good && c.res >= 0 && size_t(c.res) == slots[c.user_data].iov_len;
+    idle.push_back(c.user_data);
+  }
+
+  /// Start writing the first len bytes of the buffer, through the ring
+  void submit_out(size_t len) {
+    for (size_t pos = 0; good && pos < len; pos += block) {
+      while (good && idle.empty())
+        reap();
+      if (!good)
+        return;
+      unsigned i = idle.back();
+      idle.pop_back();
+      slots[i].iov_len = min(block, len - pos);
+      memcpy(slots[i].iov_base, buf.data() + pos, slots[i].iov_len);
+      io_uring_sqe *e =
+          fixed ? ring.prepare(IORING_OP_WRITE_FIXED, fd, slots[i].iov_base,
+                               slots[i].iov_len, written + pos, i)
+                : ring.prepare(IORING_OP_WRITEV, fd, &slots[i], 1,
+                               written + pos, i);
+      if (e && fixed)
+        e->buf_index = i;
+      good = e && ring.submit();
+    }
+  }
+
+  /// Write the first len bytes of the buffer, and drop them from it
+  void write_out(size_t len) {
+    if (pool)
+      submit_out(len);
+    else
+      for (size_t pos = 0; good && pos < len;) {
+        ssize_t n = write(fd, buf.data() + pos, len - pos);
+        if (n < 0 && errno == EINTR)
+          continue;
+        good = n > 0;
+        pos += good ? n : 0;
+      }
+    written += len;
+    buf.erase(buf.begin(), buf.begin() + len);
+  }
+
+public:
+  /// Create a file, truncating it if it exists
+  ///
+  /// @param name  The name of the file
+  /// @param block The size of a write
+  segment_writer(const string &name, size_t block)
+      : fd(open(name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644)),
+        block(block), good(fd >= 0) {
+    buf.reserve(2 * block);
+    if (!good || !ring.ok())
+      return;
+    pool.reset(new uint8_t[QUEUE_DEPTH * block]);
+    for (unsigned i = 0; i < QUEUE_DEPTH; ++i) {
+      slots[i] = {pool.get() + i * block, block};
+      idle.push_back(i);
+    }
+    // NB: If the buffers cannot be pinned, they are written with WRITEV
+    fixed = ring.register_buffers(slots, QUEUE_DEPTH);
+  }
+
+  ~segment_writer() {
+    if (fd >= 0)
+      close(fd);
+  }
+
+  /// Get the buffer, to append to.  Call flush() after appending.
+  vector<uint8_t> &out() { return buf; }
+
+  /// Write the whole blocks in the buffer
+  void flush() {
+    if (buf.size() >= block)
+      write_out(buf.size() - buf.size() % block);
+  }
+
+  /// Get the offset in the file of the end of the buffer
+  size_t offset() const { return written + buf.size(); }
+
+  /// Write the rest of the buffer, and flush the file to disk
+  ///
+  /// @return The size of the file, or -1 on an error
+  int64_t finish() {
+    write_out(buf.size());
+    while (good && ring.busy() > 0)
+      reap();
+    if (!good || fsync(fd) != 0)
+      return -1;
+    return written;
+  }
+};
+
+/// Replace a file durably: write its new contents to a temporary file, flush
+/// that to disk, and rename it over the file.  With io_uring, the three steps
+/// are linked, and start with one system call.
+///
+/// @param name  The name of the file
+/// @param bytes The new contents of the file
+///
+/// @return false on an error, true otherwise
+static bool replace_file(const string &name, const vector<uint8_t> &bytes) {
+  string tmp = name + ".tmp";
+  int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    return false;
+  ContextManager cfd([&]() { close(fd); });
+  uring_t ring(4);
+  iovec iov = {const_cast<uint8_t *>(bytes.data()), bytes.size()};
+  int res[] = {-1, -1, -1};
+  if (ring.ok()) {
+    io_uring_sqe *w = ring.prepare(IORING_OP_WRITEV, fd, &iov, 1, 0, 0);
+    io_uring_sqe *f = ring.prepare(IORING_OP_FSYNC, fd, nullptr, 0, 0, 1);
+    ring.prepare(IORING_OP_RENAMEAT, AT_FDCWD, tmp.c_str(), AT_FDCWD,
+                 reinterpret_cast<uint64_t>(name.c_str()), 2);
+    w->flags = f->flags = IOSQE_IO_LINK;
+    io_uring_cqe c;
+    if (ring.submit())
+      while (ring.wait(c))
+        res[c.user_data] = c.res;
+    if (res[2] == 0)
+      return true;
+  }
+  // NB: A kernel before 5.3 cannot link, and one before 5.11 cannot rename,
+  //     so whatever the ring did not do is done with ordinary system calls
+  bool wrote = res[0] == int(bytes.size()), synced = wrote && res[1] == 0;
+  for (size_t pos = 0; !wrote && pos < bytes.size();) {
+    ssize_t n = pwrite(fd, bytes.data() + pos, bytes.size() - pos, pos);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    pos += n;
+  }
+  if (!synced && fsync(fd) != 0)
+    return false;
+  return rename(tmp.c_str(), name.c_str()) == 0;
+}
+
+/// mapped_file is a whole file, mapped into memory read-only
+class mapped_file {
+  void *map = nullptr; // The mapping, or nullptr if the file is empty
+  size_t len = 0;      // The size of the file
+
+public:
+  mapped_file() = default;
+  mapped_file(const mapped_file &) = delete;
+
+  ~mapped_file() {
+    if (map)
+      munmap(map, len);
+  }
+
+  /// Map a file
+  ///
+  /// @param name The name of the file
+  ///
+  /// @return false on an error, true otherwise
+  bool open(const string &name) {
+    int fd = ::open(name.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+      if (fd >= 0)
+        close(fd);
+      return false;
+    }
+    len = st.st_size;
+    map = len > 0 ? mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, 0) : nullptr;
+    close(fd);
+    if (map == MAP_FAILED) {
+      map = nullptr;
+      return false;
+    }
+    return true;
+  }
+
+  /// Get the bytes of the file
+  byte_view bytes() const { return {static_cast<const uint8_t *>(map), len}; }
+};
+
+/// legacy_table presents a map of AuthTableEntries, from authtable_factory(), as
+/// a map of AuthRecords.  It is only used when the map implementation that is
+/// linked in does not provide authrecord_factory() (e.g., a SequentialMap that
+/// was compiled against the original map.h).  Such a map's vtable only has the
+/// original methods, so legacy_table only ever calls those, and converts each
+/// entry on the way in and out.  The other methods use Map's defaults, which
+/// are built from the original methods.
+///
+/// NB: Each conversion copies the entry's content, and the content that comes
+///     back out of the map is a new raw buffer, so deduplication, compression
+///     and tiering do not apply to the content in a legacy table
+class legacy_table : public Map<string, AuthRecord> {
+  /// The map of AuthTableEntries
+  Map<string, AuthTableEntry> *const table;
+
+  /// The store that holds the content of the records that are given to us
+  blob_store &blobs;
+
+  /// Make a record from an entry
+  ///
+  /// @param e The entry
+  /// @param r The record to fill
+  static void to_record(const AuthTableEntry &e, AuthRecord &r) {
+    r.set_name(e.username);
+    memcpy(r.salt, e.salt.data(), min(e.salt.size(), sizeof(r.salt)));
+    memcpy(r.pass_hash, e.pass_hash.data(),
+           min(e.pass_hash.size(), sizeof(r.pass_hash)));
+    r.content = make_content(e.content);
+  }
+
+  /// Make an entry from a record
+  ///
+  /// @param r The record
+  /// @param e The entry to fill
+  void to_entry(const AuthRecord &r, AuthTableEntry &e) {
+    e.username = string(r.name());
+    e.salt.assign(r.salt, r.salt + LEN_SALT);
+    e.pass_hash.assign(r.pass_hash, r.pass_hash + LEN_PASSHASH);
+    set_content(r.content, e);
+  }
+
+  /// Give an entry the content of a record
+  ///
+  /// @param c The record's content
+  /// @param e The entry
+  void set_content(const content_ptr &c, AuthTableEntry &e) {
+    bytes_ptr b = blobs.read(c);
+    if (b)
+      e.content = *b;
+    else
+      e.content.clear();
+  }
+
+  /// Apply a function to a record made from an entry, and copy any changes
+  /// back into the entry
+  ///
+  /// @param e The entry
+  /// @param f The function, which returns true if it changed the record
+  template <typename F> void update(AuthTableEntry &e, F &&f) {
+    AuthRecord r;
+    to_record(e, r);
+    content_ptr before = r.content;
+    if (!f(r))
+      return;
+    e.salt.assign(r.salt, r.salt + LEN_SALT);
+    e.pass_hash.assign(r.pass_hash, r.pass_hash + LEN_PASSHASH);
+    if (r.content != before)
+      set_content(r.content, e);
+  }
+
+public:
+  /// Construct a legacy_table
+  ///
+  /// @param t The map of AuthTableEntries.  It is deleted with the
+  ///          legacy_table.
+  /// @param b The store that holds the content of the records
+  legacy_table(Map<string, AuthTableEntry> *t, blob_store &b)
+      : table(t), blobs(b) {}
+
+  /// Destruct the legacy_table and its map
+  virtual ~legacy_table() { delete table; }
+
+  /// Clear the map.  This operation needs to use 2pl
+  virtual void clear() { table->clear(); }
+
+  /// Insert the provided key/value pair only if there is no mapping for the key
+  /// yet.
+  ///
+  /// @param key        The key to insert
+  /// @param val        The value to insert
+  /// @param on_success Code to run if the insertion succeeds
+  ///
+  /// @return true if the key/value was inserted, false if the key already
+  ///         existed in the table
+  virtual bool insert(string key, AuthRecord val,
+                      std::function<void()> on_success) {
+    AuthTableEntry e;
+    to_entry(val, e);
+    return table->insert(key, move(e), on_success);
+  }
+
+  /// Insert the provided key/value pair if there is no mapping for the key yet.
+  /// If there is a key, then update the mapping with a new value
+  ///
+  /// @param key    The key to upsert
+  /// @param val    The value to upsert
+  /// @param on_ins Code to run if the upsert succeeds as an insert
+  /// @param on_upd Code to run if the upsert succeeds as an update
+  ///
+  /// @return true if the value was inserted, false if the key already existed
+  ///         in the table and the value was updated
+  virtual bool upsert(string key, AuthRecord val, std::function<void()> on_ins,
+                      std::function<void()> on_upd) {
+    AuthTableEntry e;
+    to_entry(val, e);
+    return table->upsert(key, move(e), on_ins, on_upd);
+  }
+
+  /// Apply a function to the value associated with a given key.  The function
+  /// is allowed to modify the value.
+  ///
+  /// @param key The key whose value will be modified
+  /// @param f   The function to apply to the key's value
+  ///
+  /// @return true if the key existed and the function was applied, false
+  ///         otherwise
+  virtual bool do_with(string key, std::function<void(AuthRecord &)> f) {
+    return table->do_with(key, [&](AuthTableEntry &e) {
+      update(e, [&](AuthRecord &r) {
+        f(r);
+        return true;
+      });
+    });
+  }
+
+  /// Apply a function to the value associated with a given key.  The function
+  /// is not allowed to modify the value.
+  ///
+  /// @param key The key whose value will be read
+  /// @param f   The function to apply to the key's value
+  ///
+  /// @return true if the key existed and the function was applied, false
+  ///         otherwise
+  virtual bool do_with_readonly(string key,
+                                std::function<void(const AuthRecord &)> f) {
+    return table->do_with_readonly(key, [&](const AuthTableEntry &e) {
+      AuthRecord r;
+      to_record(e, r);
+      f(r);
+    });
+  }
+
+  /// Remove the mapping from a key to its value
+  ///
+  /// @param key        The key whose mapping should be removed
+  /// @param on_success Code to run if the remove succeeds
+  ///
+  /// @return true if the key was found and the value unmapped, false otherwise
+  virtual bool remove(string key, std::function<void()> on_success) {
+    return table->remove(key, on_success);
+  }
+
+  /// Apply a function to every key/value pair in the map.  Note that the
+  /// function is not allowed to modify keys or values.
+  ///
+  /// @param f    The function to apply to each key/value pair
+  /// @param then A function to run when this is done, but before unlocking...
+  ///             useful for 2pl
+  virtual void
+  do_all_readonly(std::function<void(const string, const AuthRecord &)> f,
+                  std::function<void()> then) {
+    table->do_all_readonly(
+        [&](const string key, const AuthTableEntry &e) {
+          AuthRecord r;
+          to_record(e, r);
+          f(key, r);
+        },
+        then);
+  }
+
+  /// Apply a function to the value associated with a given key, and copy the
+  /// value back into the map only if the function changed it
+  ///
+  /// @param key The key whose value will be modified
+  /// @param f   The function to apply to the key's value
+  ///
+  /// @return true if the key existed and the function was applied, false
+  ///         otherwise
+  virtual bool do_with_ref(key_view key, map_ref<bool(AuthRecord &)> f) {
+    return table->do_with(string(key),
+                          [&](AuthTableEntry &e) { update(e, f); });
+  }
+};
+
 /// MyStorage is the student implementation of the Storage class
+///
+/// MyStorage has two modes.  By default, there is one auth table, shared by
+/// all threads.  In shard-per-core mode, users are partitioned by hash into N
+/// auth tables, each owned by one shard thread of a shard_pool.  Every request
+/// for a user's entry runs on the thread that owns the user's table, so a
+/// table's locks are rarely contended.  Background saves still scan the tables
+/// from their own thread, so each table is still a concurrent map.  Operations
+/// on all users (ALL, SAV) are scattered to every shard in parallel, and their
+/// results are gathered.
 class MyStorage : public Storage {
-  /// The map of authentication information, indexed by username
-  Map<string, AuthTableEntry> *auth_table;
+  /// The maps of authentication information, indexed by username: one, or one
+  /// per shard.  We call their *_ref methods, so that our lambdas are never
+  /// wrapped in std::functions.
+  vector<Map<string, AuthRecord> *> tables;
+
+  /// The shard threads, or nullptr if there is one shared table
+  shard_pool *shards = nullptr;
+
+  /// The users' content, deduplicated by digest.  It is shared by all shards.
+  /// If it has a memory budget or window, cold content is spilled to
+  /// filename + ".tier".
+  blob_store blobs;
+
+  /// An ordered index of the usernames in the auth tables, for range queries.
+  /// A name is added to it while the new user's bucket is still locked, so a
+  /// user is in the index by the time add_user() returns.  There is one index
+  /// for all shards, since it is lock-free.
+  SkipList<string> user_index;
 
   /// The name of the file from which the Storage object was loaded, and to
   /// which we persist the Storage object every time it changes
   string filename = "";
 
+  /// The fsync policy of the log (see wal.h), or -2 if there is no log
+  int wal_sync;
+
+  /// true if load_file() should leave the profile files of indexed segments on
+  /// disk, to be read when they are first needed
+  bool lazy;
+
+  /// true if a save writes a manifest plus segment files, or false if it
+  /// writes a single file of entries (see format.h)
+  bool segmented;
+
+  /// The log of REG and SET requests since the last SAV, or nullptr if there
+  /// is no log.  It is started by load_file().
+  unique_ptr<wal_t> wal;
+
+  /// Held while the file is being saved, so that two saves (e.g., a SAV and a
+  /// background checkpoint) do not write the temporary file at once
+  mutex save_lock;
+
+  /// The thread that saves the file in the background, for PERSIST requests
+  checkpointer checkpoints{[this]() { return save(true, false); }};
+
+  /// The thread that folds the delta segments into a new base in the
+  /// background, once they are big enough
+  checkpointer compactor{[this]() { return save(true, true); }};
+
+  /// The users who have changed since the last save.  It is only kept when
+  /// segmented saves are on (see mark_dirty()).
+  dirty_set dirty;
+
+  /// The segments that the manifest lists, as of the last save or load: a
+  /// base, and then the deltas that were written since.  It is empty if the
+  /// data file is not a manifest, in which case the next save writes a base.
+  vector<segment_t> saved;
+
+  /// The size of the base segments of saved, and of its delta segments
+  size_t base_bytes = 0, delta_bytes = 0;
+
+  /// The number of delta segments in saved
+  size_t deltas = 0;
+
+  /// The deltas are compacted once their size is this many eighths of the
+  /// base's size, or once there are more than MAX_DELTAS of them
+  static const size_t COMPACT_RATIO = 4;
+  static const size_t MAX_DELTAS = 16;
+
+  /// The number of the last save, which names its segment files
+  uint64_t save_id = 0;
+
+  /// The size of the writes of a SAV's segment files.  With io_uring, several
+  /// are in flight at once (see segment_writer).
+  static const size_t SEGMENT_BLOCK = 1 << 20;
+
+  /// The size of the buffer of a background checkpoint
+  static const size_t SAVE_BUFFER = 256 << 10;
+
+  /// The fewest buckets of the shared table that a SAV gives to a thread
+  static const size_t MIN_SEGMENT_BUCKETS = 4096;
+
+  /// The number of buckets (or dirty users) whose entries a save copies out of
+  /// a table at a time, before it writes them
+  static const size_t SAVE_BATCH = 256;
+
+  /// The smallest range of a data file that load_file() gives to a thread
+  static const size_t MIN_LOAD_RANGE = 4 << 20;
+
+  /// Find the table that holds a user
+  ///
+  /// @param user The name of the user
+  ///
+  /// @return The index of the user's table
+  size_t table_of(string_view user) const {
+    if (tables.size() == 1)
+      return 0;
+    // NB: The tables hash the same key to pick a bucket, so we mix the hash
+    //     before picking a shard, to keep each shard's buckets evenly loaded
+    uint64_t h = map_hash<string>()(user) * 0x9e3779b97f4a7c15ull;
+    return (h >> 32) % tables.size();
+  }
+
+  /// Run a function on the thread that owns a table.  In the shared mode, this
+  /// is the calling thread.
+  ///
+  /// @param t The index of the table
+  /// @param f The function to run
+  template <typename F> void on_table(size_t t, F &&f) {
+    if (shards)
+      shards->run(t, f);
+    else
+      f();
+  }
+
+  /// Run a function on every table, each on the thread that owns it.  In
+  /// shard-per-core mode, the tables are processed in parallel.
+  ///
+  /// @param f The function to run.  It receives the index of a table.
+  template <typename F> void on_all_tables(F &&f) {
+    if (shards)
+      shards->run_all(f);
+    else
+      f(0);
+  }
+
+  /// Note that a user changed, so that the next segmented save writes them in a
+  /// delta segment.  A single-file save writes every user, so without segmented
+  /// saves nothing is kept.
+  ///
+  /// @param user The name of the user
+  void mark_dirty(string_view user) {
+    if (segmented)
+      dirty.add(user);
+  }
+
+  /// Run a function on a user's entry, allowing the function to modify it
+  ///
+  /// @param user The name of the user
+  /// @param f    The function to run on the user's entry.  It returns true if
+  ///             it changed the entry, so that the table only stores a new
+  ///             version of the entry when it has to.
+  ///
+  /// @return true if the user exists and f was run, false otherwise
+  template <typename F> bool with_user(string_view user, F &&f) {
+    size_t t = table_of(user);
+    bool found = false;
+    on_table(t, [&]() {
+      found = tables[t]->do_with_ref(user, f);
+    });
+    return found;
+  }
+
+  /// Run a function on a user's entry, without modifying it
+  ///
+  /// @param user The name of the user
+  /// @param f    The function to run on the user's entry
+  ///
+  /// @return true if the user exists and f was run, false otherwise
+  template <typename F> bool with_user_readonly(string_view user, F &&f) {
+    size_t t = table_of(user);
+    bool found = false;
+    on_table(t, [&]() {
+      found = tables[t]->do_with_readonly_ref(user, f);
+    });
+    return found;
+  }
+
+  /// Insert a new user's entry
+  ///
+  /// @param e          The entry
+  /// @param on_success Code to run if the insertion succeeds
+  ///
+  /// @return true if the user was inserted, false if the user already existed
+  template <typename F> bool insert_user(AuthRecord e, F &&on_success) {
+    size_t t = table_of(e.name());
+    bool ins = false;
+    on_table(t, [&]() {
+      string key(e.name());
+      ins = tables[t]->insert_ref(move(key), move(e), on_success);
+    });
+    return ins;
+  }
+
+  /// Run a function on every user's entry in a consistent snapshot of one
+  /// table, without modifying them.  Writers are not blocked while this runs.
+  /// The caller should be running on the table's thread (see on_all_tables()).
+  /// The tables are safe to scan from any thread, though, which a background
+  /// checkpoint does, so that it does not hold up the shards.
+  ///
+  /// @param t The index of the table
+  /// @param f The function to run on each user's name and entry
+  template <typename F> void with_all_users(size_t t, F &&f) {
+    tables[t]->do_all_snapshot(f);
+  }
+
+  /// Gather the output of a function that runs on every table in parallel
+  ///
+  /// @param f The function to run.  It receives the index of a table and a
+  ///          buffer to append to.
+  ///
+  /// @return The concatenation of the buffers, in table order
+  template <typename F> vector<uint8_t> gather(F &&f) {
+    vector<vector<uint8_t>> parts(tables.size());
+    on_all_tables([&](size_t t) { f(t, parts[t]); });
+    if (parts.size() == 1)
+      return move(parts[0]);
+    vector<uint8_t> all;
+    size_t len = 0;
+    for (auto &p : parts)
+      len += p.size();
+    all.reserve(len);
+    for (auto &p : parts)
+      all.insert(all.end(), p.begin(), p.end());
+    return all;
+  }
+
+  /// batch_t is a batch of users' entries, to be inserted into a table
+  typedef vector<pair<string, AuthRecord>> batch_t;
+
+  /// load_part_t is what load_file() gets from parsing one range of a file
+  struct load_part_t {
+    size_t start = 0;      // The offset of the first record
+    size_t end = 0;        // The offset after the last record
+    bool ok = true;        // false if a record did not parse
+    vector<batch_t> users; // The entries, by table
+    vector<pair<blob_store::digest_t, content_ptr>> blobs; // The blobs
+
+    /// The entries whose content is a blob: their table, their index in the
+    /// table's batch, and the blob's digest
+    vector<tuple<size_t, size_t, blob_store::digest_t>> refs;
+  };
+
+  /// Parse the records of a data file that start in a range.  The last record
+  /// may run past the end of the range.
+  ///
+  /// @param buf    The contents of the file
+  /// @param from   The offset of the first record, or of where to start
+  ///               looking for it
+  /// @param to     The end of the range
+  /// @param search true if from may not be the offset of a record, in which
+  ///               case we start at the first offset that looks like one
+  /// @param part   The part to fill
+  void parse_range(byte_view buf, size_t from, size_t to, bool search,
+                   load_part_t &part) {
+    part = load_part_t();
+    part.users.resize(tables.size());
+    size_t pos = search ? find_record(buf, from, to) : from;
+    part.start = pos;
+    while (pos < to) {
+      blob_store::digest_t d;
+      if (has_code(buf, pos, BLOBENTRY)) {
+        content_ptr c;
+        if (!read_blob(buf, pos, blobs, d, c)) {
+          part.ok = false;
+          break;
+        }
+        part.blobs.emplace_back(d, move(c));
+        continue;
+      }
+      AuthRecord e;
+      bool byref;
+      if (!read_entry(buf, pos, e, blobs, d, byref)) {
+        part.ok = false;
+        break;
+      }
+      string key(e.name());
+      size_t t = table_of(key);
+      if (byref)
+        part.refs.emplace_back(t, part.users[t].size(), d);
+      part.users[t].emplace_back(move(key), move(e));
+    }
+    part.end = pos;
+  }
+
+  /// Parse an indexed segment, or a delta segment (see format.h).  In lazy
+  /// mode, only the index is read: each profile file becomes a buffer whose
+  /// bytes are still in the segment, which blobs reads in (and checks) when it
+  /// is first needed.
+  ///
+  /// @param buf  The contents of the segment
+  /// @param name The name of the segment file
+  /// @param part The part to fill
+  void parse_indexed(byte_view buf, const string &name, load_part_t &part) {
+    part = load_part_t();
+    part.users.resize(tables.size());
+    part.end = buf.size();
+    part.ok = false;
+    size_t size = buf.size();
+    if (size < INDEXEDHEADER.size() + INDEXED_FOOTER_SIZE ||
+        !has_code(buf, size - INDEXEDFOOTER.size(), INDEXEDFOOTER))
+      return;
+    const uint8_t *footer = buf.data() + size - INDEXED_FOOTER_SIZE;
+    uint64_t at, count;
+    uint32_t crc;
+    memcpy(&at, footer, sizeof(at));
+    memcpy(&count, footer + 8, sizeof(count));
+    memcpy(&crc, footer + 16, sizeof(crc));
+    if (crc != crc32c(footer, 16) || at < INDEXEDHEADER.size() ||
+        at > size - INDEXED_FOOTER_SIZE)
+      return;
+    shared_ptr<const content_file> file;
+    if (lazy) {
+      int fd = open(name.c_str(), O_RDONLY);
+      if (fd < 0)
+        return;
+      file = make_shared<const content_file>(fd);
+    }
+    will_need(buf, lazy ? at : 0);
+    // NB: Users who share a profile file share its offset, so it is only made
+    //     into a buffer once
+    unordered_map<uint64_t, content_ptr> found;
+    byte_view index(buf.data(), size - INDEXED_FOOTER_SIZE);
+    size_t pos = at;
+    for (uint64_t i = 0; i < count; ++i) {
+      AuthRecord e;
+      index_entry_t ix;
+      if (!read_index(index, pos, e, ix))
+        return;
+      if (ix.len > 0) {
+        if (ix.off < INDEXEDHEADER.size() || ix.off > at ||
+            at - ix.off < ix.len)
+          return;
+        auto it = found.find(ix.off);
+        if (it == found.end()) {
+          unique_ptr<content_t> c;
+          if (file) {
+            c = make_unique<content_t>(ix.raw, ix.compressed, ix.len, file,
+                                       ix.off, ix.crc);
+          } else {
+            const uint8_t *data = buf.data() + ix.off;
+            if (crc32c(data, ix.len) != ix.crc)
+              return;
+            c = make_unique<content_t>(
+                vector<uint8_t>(data, data + ix.len), ix.raw, ix.compressed);
+          }
+          it = found.emplace(ix.off, blobs.intern(move(c), ix.d)).first;
+        }
+        e.content = it->second;
+      }
+      string key(e.name());
+      part.users[table_of(key)].emplace_back(move(key), move(e));
+    }
+    part.ok = pos == index.size();
+  }
+
+  /// Apply delta segments to the entries that were parsed from the segments
+  /// before them: when a user has more than one entry, the last one replaces
+  /// the first, and the others are dropped.
+  ///
+  /// @param parts The parsed entries, in the order of the manifest
+  void merge(vector<load_part_t> &parts) {
+    unordered_map<string_view, pair<batch_t *, size_t>> where;
+    for (auto &p : parts)
+      for (auto &b : p.users)
+        for (size_t i = 0; i < b.size(); ++i) {
+          auto [it, fresh] = where.emplace(b[i].first, make_pair(&b, i));
+          if (fresh)
+            continue;
+          (*it->second.first)[it->second.second].second = move(b[i].second);
+          b[i].first.clear();
+        }
+    // NB: Names are never empty, so an empty name marks a dropped entry
+    for (auto &p : parts)
+      for (auto &b : p.users)
+        b.erase(remove_if(b.begin(), b.end(),
+                          [](auto &u) { return u.first.empty(); }),
+                b.end());
+  }
+
+  /// Replay the log on top of the entries that were loaded from the data file.
+  /// A crash may leave a partial record at the end of a log file, so each file
+  /// is replayed up to its first record that does not parse.
+  ///
+  /// @param gens  The generations of the log, in order
+  /// @param parts The loaded entries.  Changes are applied to them, and new
+  ///              users are added in one more part.
+  ///
+  /// @return The number of changes that were replayed
+  size_t replay(const vector<uint64_t> &gens, vector<load_part_t> &parts) {
+    if (gens.empty())
+      return 0;
+    // NB: A batch's address does not change when parts grows, since the parts
+    //     own their vectors of batches
+    parts.emplace_back();
+    parts.back().users.resize(tables.size());
+    unordered_map<string, pair<batch_t *, size_t>> where;
+    for (auto &p : parts)
+      for (auto &b : p.users)
+        for (size_t i = 0; i < b.size(); ++i)
+          where[b[i].first] = {&b, i};
+    size_t changes = 0;
+    for (auto g : gens) {
+      auto log = load_entire_file(wal_t::name(filename, g));
+      for (size_t pos = 0; pos < log.size(); ++changes) {
+        if (has_code(log, pos, DIFFENTRY)) {
+          string user;
+          content_ptr c;
+          if (!read_diff(log, pos, user, c, blobs))
+            break;
+          auto it = where.find(user);
+          if (it != where.end())
+            (*it->second.first)[it->second.second].second.content = c;
+          mark_dirty(user);
+          continue;
+        }
+        AuthRecord e;
+        blob_store::digest_t d;
+        bool byref;
+        if (!read_entry(log, pos, e, blobs, d, byref) || byref)
+          break;
+        // NB: A change that is already in the data file may be replayed, so a
+        //     user who already exists is not an error
+        string key(e.name());
+        if (where.count(key))
+          continue;
+        mark_dirty(key);
+        batch_t &b = parts.back().users[table_of(key)];
+        where[key] = {&b, b.size()};
+        b.emplace_back(move(key), move(e));
+      }
+    }
+    return changes;
+  }
+
+  /// Start a new generation of the log, after the existing ones, if the log is
+  /// enabled
+  ///
+  /// @param gens The generations of the log that exist, in order
+  ///
+  /// @return false if the log file could not be opened, true otherwise
+  bool start_log(const vector<uint64_t> &gens) {
+    if (wal_sync < -1)
+      return true;
+    uint64_t next = gens.empty() ? 0 : gens.back() + 1;
+    wal = make_unique<wal_t>(filename, next, gens.empty() ? next : gens[0],
+                             wal_sync);
+    return wal->ok();
+  }
+
+  /// Get the name of a segment file, relative to the data file's directory
+  ///
+  /// @param id The number of the save
+  /// @param k  The index of the segment
+  string segment_name(uint64_t id, size_t k) const {
+    size_t slash = filename.rfind('/');
+    return filename.substr(slash == string::npos ? 0 : slash + 1) + ".seg." +
+           to_string(id) + "." + to_string(k);
+  }
+
+  /// Get the path of a file in the data file's directory
+  ///
+  /// @param name The name of the file, relative to that directory
+  string in_data_dir(const string &name) const {
+    size_t slash = filename.rfind('/');
+    return slash == string::npos ? name : filename.substr(0, slash + 1) + name;
+  }
+
+  /// Copy the entries in buckets [from, to) of a snapshot out of the table,
+  /// SAVE_BATCH buckets at a time, and run a function on each batch once its
+  /// buckets are unlocked.  Only the entries are copied, not their content.
+  ///
+  /// @param snap The snapshot
+  /// @param from The first bucket
+  /// @param to   The bucket past the last one
+  /// @param f    The function to run on each batch
+  template <typename F>
+  static void scan_snapshot(const Map<string, AuthRecord>::snapshot &snap,
+                            size_t from, size_t to, F &&f) {
+    vector<AuthRecord> batch;
+    for (size_t i = from; i < min(to, snap.parts()); i += SAVE_BATCH) {
+      snap.scan(i, min(i + SAVE_BATCH, to),
+                [&](string_view, const AuthRecord &e) { batch.push_back(e); });
+      f(batch);
+      batch.clear();
+    }
+  }
+
+  /// Copy the entries of one table out of a snapshot, in batches, as
+  /// scan_snapshot() does.  A map that cannot take a snapshot to scan in parts
+  /// is copied all at once.
+  ///
+  /// @param t The index of the table
+  /// @param f The function to run on each batch
+  template <typename F> void scan_table(size_t t, F &&f) {
+    if (auto snap = tables[t]->take_snapshot()) {
+      scan_snapshot(*snap, 0, snap->parts(), f);
+      return;
+    }
+    vector<AuthRecord> batch;
+    with_all_users(t, [&](const string &, const AuthRecord &e) {
+      batch.push_back(e);
+    });
+    f(batch);
+  }
+
+  /// Save the tables to this.filename as a single file of entries (see
+  /// format.h), through this.filename.tmp.  Every table is copied out of a
+  /// snapshot first, so that a profile file that several users share can be
+  /// found, and written once, as a blob.
+  ///
+  /// @return false on an error, true otherwise
+  bool save_whole() {
+    vector<AuthRecord> all;
+    for (size_t t = 0; t < tables.size(); ++t)
+      scan_table(t, [&](const vector<AuthRecord> &batch) {
+        all.insert(all.end(), batch.begin(), batch.end());
+      });
+    // NB: Content is shared in memory by pointer (see blob_store.h), so the
+    //     pointers say which profile files more than one user has
+    unordered_map<const content_t *, size_t> refs;
+    for (auto &e : all)
+      if (e.content)
+        ++refs[e.content.get()];
+    string tmp = filename + ".tmp";
+    segment_writer w(tmp, SEGMENT_BLOCK);
+    vector<uint8_t> &out = w.out();
+    unordered_set<blob_store::digest_t, blob_store::digest_hash> written;
+    for (auto &e : all) {
+      const blob_store::digest_t *d = nullptr;
+      if (e.content && refs[e.content.get()] > 1)
+        d = blob_store::digest_of(e.content);
+      if (d && written.insert(*d).second &&
+          !append_blob(out, *d, e.content, blobs))
+        return false;
+      if (!append_entry(out, e, d, blobs))
+        return false;
+      w.flush();
+    }
+    if (w.finish() < 0 || rename(tmp.c_str(), filename.c_str()) != 0)
+      return false;
+    // NB: The segments of a segmented save that came before this one are
+    //     removed once the rename is durable
+    wal_t::sync_file(in_data_dir("."));
+    remove_segments(filename, {});
+    saved.clear();
+    return true;
+  }
+
+  /// Save the tables to this.filename, as a manifest plus segment files (see
+  /// format.h).
+  ///
+  /// Usually, only the users who changed since the last save are written, as
+  /// delta segments that the new manifest lists after the old segments, so the
+  /// cost of a save is proportional to the rate of change.  Once the deltas
+  /// grow too big, a compaction is scheduled in the background, which writes a
+  /// new base from a snapshot of every table.
+  ///
+  /// A base is written in parallel: a SAV has every shard write its own table,
+  /// or splits the shared table's buckets into ranges, each written by its own
+  /// thread.  A background save writes one segment per table, one at a time,
+  /// on its own thread, so that it does not delay the shards.
+  ///
+  /// The segments are flushed to disk first, and then the manifest is written
+  /// to this.filename.tmp and renamed over this.filename, so a crash at any
+  /// point leaves either the old save or the new one.
+  ///
+  /// @param background true to scan and write from the calling thread
+  /// @param full       true to write a new base, even if there is one
+  ///
+  /// @return false on an error, true otherwise
+  bool save_segments(bool background, bool full) {
+    // NB: A base is written from snapshots, so SET and REG requests keep
+    //     running while we write the files.  Each segment writes each distinct
+    //     profile file once, as it finds it, and the index last.  Segments do
+    //     not share profile files, so that they can be written without
+    //     coordinating, and loaded without one another.
+    vector<string> names = dirty.take();
+    full = full || saved.empty();
+    uint64_t id = ++save_id;
+    atomic<bool> ok(true);
+    vector<segment_t> segs;
+    // Write segment k from a scan, which copies the entries out of the table
+    // in batches, and calls its argument on each batch after it unlocks them
+    auto write_segment = [&](size_t k, size_t block, const string &header,
+                             auto &&scan) {
+      segs[k].name = segment_name(id, k);
+      segment_writer w(in_data_dir(segs[k].name), block);
+      vector<uint8_t> &out = w.out(), index;
+      out.insert(out.end(), header.begin(), header.end());
+      unordered_map<blob_store::digest_t, pair<uint64_t, uint32_t>,
+                    blob_store::digest_hash>
+          written;
+      uint64_t users = 0;
+      // NB: Reading spilled content, and writing, can block, so they are only
+      //     done once the batch's entries are copied and their buckets are
+      //     unlocked.  The copies share the content buffers.
+      scan([&](const vector<AuthRecord> &batch) {
+        for (auto &e : batch) {
+          blob_store::digest_t d{};
+          uint64_t off = 0;
+          uint32_t crc = 0;
+          if (e.content) {
+            bytes_ptr b;
+            if (auto *known = blob_store::digest_of(e.content)) {
+              d = *known;
+            } else if ((b = blobs.stored(*e.content))) {
+              bytes_ptr raw = unpack_content(*e.content, b);
+              d = raw ? blob_store::digest(raw->data(), raw->size()) : d;
+            }
+            auto it = written.find(d);
+            if (it == written.end()) {
+              if (!b)
+                b = blobs.stored(*e.content);
+              if (!b) {
+                ok = false;
+                continue;
+              }
+              it = written.emplace(d, make_pair(w.offset(), 0)).first;
+              it->second.second = crc32c(b->data(), b->size());
+              out.insert(out.end(), b->begin(), b->end());
+              out.resize((out.size() + 7) & ~size_t(7), 0);
+            }
+            off = it->second.first;
+            crc = it->second.second;
+          }
+          append_index(index, e, off, d, crc);
+          ++users;
+          w.flush();
+        }
+      });
+      uint64_t at = w.offset();
+      out.insert(out.end(), index.begin(), index.end());
+      vector<uint8_t> footer;
+      append_bytes(footer, at);
+      append_bytes(footer, users);
+      append_bytes(footer, crc32c(footer.data(), footer.size()));
+      footer.resize(INDEXED_FOOTER_SIZE - INDEXEDFOOTER.size(), 0);
+      footer.insert(footer.end(), INDEXEDFOOTER.begin(), INDEXEDFOOTER.end());
+      out.insert(out.end(), footer.begin(), footer.end());
+      int64_t size = w.finish();
+      if (size < 0)
+        ok = false;
+      segs[k].size = size;
+    };
+    // Scan buckets [from, to) of a snapshot, or a whole table
+    auto snapshot_range = [&](const Map<string, AuthRecord>::snapshot &snap,
+                              size_t from, size_t to) {
+      return [&snap, from, to](auto &&f) { scan_snapshot(snap, from, to, f); };
+    };
+    auto whole_table = [&](size_t t) {
+      return [&, t](auto &&f) { scan_table(t, f); };
+    };
+    // NB: A delta is written from the tables as they are now, not from a
+    //     snapshot.  A user who changes again while we write is still dirty
+    //     for the next save, so writing the newer entry is harmless.
+    auto dirty_users = [&](const vector<const string *> &users, size_t t) {
+      return [&, t](auto &&f) {
+        vector<AuthRecord> batch;
+        auto copy = [&](const AuthRecord &x) { batch.push_back(x); };
+        for (auto *u : users) {
+          tables[t]->do_with_readonly_ref(*u, copy);
+          if (batch.size() == SAVE_BATCH) {
+            f(batch);
+            batch.clear();
+          }
+        }
+        f(batch);
+      };
+    };
+    if (!full) {
+      vector<vector<const string *>> users(tables.size());
+      for (auto &n : names)
+        users[table_of(n)].push_back(&n);
+      for (size_t t = 0; t < tables.size(); ++t) {
+        if (users[t].empty())
+          continue;
+        segs.emplace_back();
+        write_segment(segs.size() - 1, SAVE_BUFFER, DELTAHEADER,
+                      dirty_users(users[t], t));
+      }
+    } else if (background) {
+      segs.resize(tables.size());
+      for (size_t t = 0; t < tables.size(); ++t)
+        write_segment(t, SAVE_BUFFER, INDEXEDHEADER, whole_table(t));
+    } else if (shards) {
+      segs.resize(tables.size());
+      on_all_tables([&](size_t t) {
+        write_segment(t, SEGMENT_BLOCK, INDEXEDHEADER, whole_table(t));
+      });
+    } else if (auto snap = tables[0]->take_snapshot()) {
+      size_t n = min<size_t>(max(thread::hardware_concurrency(), 1u),
+                             max<size_t>(snap->parts() / MIN_SEGMENT_BUCKETS,
+                                         1));
+      size_t range = (snap->parts() + n - 1) / n;
+      segs.resize(n);
+      auto write_range = [&](size_t k) {
+        write_segment(k, SEGMENT_BLOCK, INDEXEDHEADER,
+                      snapshot_range(*snap, k * range, (k + 1) * range));
+      };
+      vector<thread> workers;
+      for (size_t k = 1; k < n; ++k)
+        workers.emplace_back(write_range, k);
+      write_range(0);
+      for (auto &w : workers)
+        w.join();
+    } else {
+      segs.resize(1);
+      write_segment(0, SEGMENT_BLOCK, INDEXEDHEADER, whole_table(0));
+    }
+    size_t bytes = 0;
+    for (auto &seg : segs)
+      bytes += seg.size;
+    vector<segment_t> all = full ? segs : saved;
+    if (!full)
+      all.insert(all.end(), segs.begin(), segs.end());
+    // NB: A delta with no users changes nothing, so the manifest is kept
+    bool changed = full || !segs.empty();
+    if (!ok || (changed && !replace_file(filename, make_manifest(id, all)))) {
+      dirty.restore(names);
+      return false;
+    }
+    // NB: The rename is only durable once the directory is flushed, and the
+    //     old segments and log are only removed after that
+    wal_t::sync_file(in_data_dir("."));
+    remove_segments(filename, all);
+    saved = move(all);
+    base_bytes = full ? bytes : base_bytes;
+    delta_bytes = full ? 0 : delta_bytes + bytes;
+    deltas = full ? 0 : deltas + segs.size();
+    if (delta_bytes * 8 > base_bytes * COMPACT_RATIO || deltas > MAX_DELTAS)
+      compactor.request();
+    return true;
+  }
+
+  /// Save the tables to this.filename: as a manifest plus segment files if
+  /// segmented saves are on, or as a single file of entries otherwise
+  ///
+  /// @param background true to scan and write from the calling thread
+  /// @param full       true to write every user, even if the last save was
+  ///                   segmented (and so could be followed by a delta)
+  ///
+  /// @return false on an error, true otherwise
+  bool save(bool background, bool full) {
+    // NB: With a log, a new generation is started first.  Every change in the
+    //     older generations has been made, and marked dirty, by then, so it is
+    //     in the snapshot (or the dirty set that a segmented save takes next),
+    //     and they can be removed once the new file is in place.  Changes in
+    //     the new generation may be in the file too, but replaying a change
+    //     that has already been made is harmless.
+    lock_guard<mutex> sg(save_lock);
+    uint64_t gen = wal ? wal->rotate() : 0;
+    if (!(segmented ? save_segments(background, full) : save_whole()))
+      return false;
+    // NB: Without a log, any generations that were replayed by load_file() are
+    //     in the new file, and must not be replayed over it again
+    if (wal)
+      wal->remove_through(gen);
+    else
+      for (auto g : wal_t::generations(filename))
+        unlink(wal_t::name(filename, g).c_str());
+    return true;
+  }
+
 public:
   /// Construct an empty object and specify the file from which it should be
   /// loaded.  To avoid exceptions and errors in the constructor, the act of
@@ -37,12 +1796,49 @@ public:
   /// @param qd      The quota duration
   /// @param top     The size of the "top keys" cache
   /// @param admin   The administrator's username
+  /// @param nshards The number of shards, or 0 to share one table between all
+  ///                threads
+  /// @param workers The number of threads that will call into the storage
+  /// @param zmin    The smallest profile file to compress, or 0 for none
+  /// @param budget  The most bytes of profile files to keep in memory, or 0
+  ///                for no limit
+  /// @param window  The seconds after which an unread profile file is spilled
+  ///                to disk, or 0 for no limit
+  /// @param wal     The fsync policy of the log (see wal.h), or -2 to keep no
+  ///                log
+  /// @param lazy    true to read profile files when they are first needed,
+  ///                instead of when the file is loaded
+  /// @param seg     true to save as a manifest plus segment files, instead of
+  ///                as a single file
   MyStorage(const std::string &fname, size_t buckets, size_t, size_t, size_t,
-            double, size_t, const std::string &)
-      : auth_table(authtable_factory(buckets)), filename(fname) {}
+            double, size_t, const std::string &, size_t nshards,
+            size_t workers, size_t zmin, size_t budget, size_t window, int wal,
+            bool lazy, bool seg)
+      : blobs(zmin, budget, window, fname + ".tier"), filename(fname),
+        wal_sync(wal), lazy(lazy), segmented(seg) {
+    size_t n = nshards > 0 ? nshards : 1;
+    for (size_t i = 0; i < n; ++i) {
+      // NB: Each shard gets its share of the buckets.  If the map that is
+      //     linked in only has the original interface, it is wrapped.
+      size_t b = max<size_t>(buckets / n, 1);
+      if (authrecord_factory != nullptr)
+        tables.push_back(authrecord_factory(b));
+      else
+        tables.push_back(new legacy_table(authtable_factory(b), blobs));
+    }
+    if (nshards > 0)
+      shards = new shard_pool(nshards, workers);
+  }
 
   /// Destructor for the storage object.
-  virtual ~MyStorage() {}
+  virtual ~MyStorage() {
+    checkpoints.stop();
+    compactor.stop();
+    wal.reset();
+    delete shards;
+    for (auto *t : tables)
+      delete t;
+  }
 
   /// Create a new entry in the Auth table.  If the user already exists, return
   /// an error.  Otherwise, create a salt, hash the password, and then save an
@@ -52,12 +1848,32 @@ public:
   /// @param pass The password to associate with that user name
   ///
   /// @return A result tuple, as described in storage.h
-  virtual result_t add_user(const string &user, const string &pass) {
-    cout << "my_storage.cc::add_user() is not implemented\n";
-    // NB: These asserts are to prevent compiler warnings
-    assert(user.length() > 0);
-    assert(pass.length() > 0);
-    return {false, RES_ERR_UNIMPLEMENTED, {}};
+  virtual result_t add_user_view(string_view user, string_view pass) {
+    AuthRecord e;
+    if (!e.set_name(user))
+      return {false, string(RES_ERR_REQ_FMT), {}};
+    if (!RAND_bytes(e.salt, LEN_SALT))
+      return {false, string(RES_ERR_SERVER), {}};
+    if (!hash_pass(pass, e.salt, e.pass_hash))
+      return {false, string(RES_ERR_REQ_FMT), {}};
+    vector<uint8_t> rec;
+    if (wal)
+      append_entry(rec, e, nullptr, blobs);
+    // NB: The new entry is in the table by the time on_success runs, so the
+    //     ticket can be released as soon as the record is in the log
+    wal_t::ticket_t ticket;
+    if (!insert_user(move(e), [&]() {
+          user_index.insert(string(user));
+          mark_dirty(user);
+          if (wal) {
+            ticket = wal->append(rec);
+            ticket.release();
+          }
+        }))
+      return {false, string(RES_ERR_USER_EXISTS), {}};
+    if (wal && !wal->sync(ticket))
+      return {false, string(RES_ERR_SERVER), {}};
+    return {true, string(RES_OK), {}};
   }
 
   /// Set the data bytes for a user, but do so if and only if the password
@@ -68,14 +1884,41 @@ public:
   /// @param content The data to set for this user
   ///
   /// @return A result tuple, as described in storage.h
-  virtual result_t set_user_data(const string &user, const string &pass,
-                                 const vector<uint8_t> &content) {
-    cout << "my_storage.cc::set_user_data() is not implemented\n";
-    // NB: These asserts are to prevent compiler warnings
-    assert(user.length() > 0);
-    assert(pass.length() > 0);
-    assert(content.size() > 0);
-    return {false, RES_ERR_UNIMPLEMENTED, {}};
+  virtual result_t set_user_data_view(string_view user, string_view pass,
+                                      const vector<uint8_t> &content) {
+    // NB: The buffer is found (or made) before locking, so that the lock is
+    //     only held long enough to swap it in.  Authenticating and updating
+    //     under the same lock avoids a TOCTOU race with a concurrent change to
+    //     the user's entry.
+    content_ptr buf = blobs.intern(content.data(), content.size());
+    vector<uint8_t> rec;
+    if (wal && (!append_diff(rec, user, buf, blobs) ||
+                rec.size() > wal_t::max_record()))
+      return {false, string(RES_ERR_SERVER), {}};
+    // NB: The change is logged while the entry is locked, so that the log
+    //     has each user's changes in order, and the ticket is held until the
+    //     new entry is installed, after with_user() returns
+    wal_t::ticket_t ticket;
+    bool ok = false;
+    with_user(user, [&](AuthRecord &e) {
+      if ((ok = check_pass(e, pass))) {
+        if (wal)
+          ticket = wal->append(rec);
+        e.content = move(buf);
+      }
+      return ok;
+    });
+    // NB: The user is marked dirty before the ticket is released, so a save
+    //     that starts a new generation of the log after this change also
+    //     finds it in the dirty set
+    if (ok)
+      mark_dirty(user);
+    ticket.release();
+    if (!ok)
+      return {false, string(RES_ERR_LOGIN), {}};
+    if (wal && !wal->sync(ticket))
+      return {false, string(RES_ERR_SERVER), {}};
+    return {true, string(RES_OK), {}};
   }
 
   /// Return a copy of the user data for a user, but do so only if the password
@@ -87,14 +1930,43 @@ public:
   ///
   /// @return A result tuple, as described in storage.h.  Note that "no data" is
   ///         an error
-  virtual result_t get_user_data(const string &user, const string &pass,
-                                 const string &who) {
-    cout << "my_storage.cc::get_user_data() is not implemented\n";
-    // NB: These asserts are to prevent compiler warnings
-    assert(user.length() > 0);
-    assert(pass.length() > 0);
-    assert(who.length() > 0);
-    return {false, RES_ERR_UNIMPLEMENTED, {}};
+  virtual result_t get_user_data_view(string_view user, string_view pass,
+                                      string_view who) {
+    bytes_ptr bytes;
+    auto res = get_user_content(user, pass, who, bytes);
+    if (res.succeeded)
+      res.data = *bytes;
+    return res;
+  }
+
+  /// Return the user data for a user, but do so only if the password matches.
+  /// The data is returned by reference, rather than being copied (unless it
+  /// has to be decompressed).
+  ///
+  /// @param user    The name of the user who made the request
+  /// @param pass    The password for the user, used to authenticate
+  /// @param who     The name of the user whose content is being fetched
+  /// @param content Set to the user's data, if the result is a success
+  ///
+  /// @return A result tuple, as described in storage.h.  Note that "no data" is
+  ///         an error
+  virtual result_t get_user_content(string_view user, string_view pass,
+                                    string_view who, bytes_ptr &content) {
+    auto res = auth_view(user, pass);
+    if (!res.succeeded)
+      return res;
+    content_ptr data;
+    if (!with_user_readonly(
+            who, [&](const AuthRecord &e) { data = e.content; }))
+      return {false, string(RES_ERR_NO_USER), {}};
+    if (!data)
+      return {false, string(RES_ERR_NO_DATA), {}};
+    // NB: If the content is spilled or compressed, it is read back or
+    //     decompressed here, after the user's entry has been unlocked
+    content = blobs.read(data);
+    if (!content)
+      return {false, string(RES_ERR_SERVER), {}};
+    return {true, string(RES_OK), {}};
   }
 
   /// Return a newline-delimited string containing all of the usernames in the
@@ -104,12 +1976,49 @@ public:
   /// @param pass The password for the user, used to authenticate
   ///
   /// @return A result tuple, as described in storage.h
-  virtual result_t get_all_users(const string &user, const string &pass) {
-    cout << "my_storage.cc::get_all_users() is not implemented\n";
-    // NB: These asserts are to prevent compiler warnings
-    assert(user.length() > 0);
-    assert(pass.length() > 0);
-    return {false, RES_ERR_UNIMPLEMENTED, {}};
+  virtual result_t get_all_users_view(string_view user, string_view pass) {
+    auto res = auth_view(user, pass);
+    if (!res.succeeded)
+      return res;
+    // NB: In shard-per-core mode, each shard's part of the list comes from its
+    //     own snapshot
+    auto names = gather([&](size_t t, vector<uint8_t> &out) {
+      with_all_users(t, [&](const string &name, const AuthRecord &) {
+        out.insert(out.end(), name.begin(), name.end());
+        out.push_back('\n');
+      });
+    });
+    if (!names.empty())
+      names.pop_back();
+    return {true, string(RES_OK), move(names)};
+  }
+
+  /// Return a newline-delimited, sorted string containing the usernames that
+  /// are not less than `from` and are less than `to`.  An empty `to` means that
+  /// there is no upper bound.
+  ///
+  /// @param user The name of the user who made the request
+  /// @param pass The password for the user, used to authenticate
+  /// @param from The smallest username to return
+  /// @param to   The first username past the end of the range, or empty
+  ///
+  /// @return A result tuple, as described in storage.h
+  virtual result_t get_user_range(string_view user, string_view pass,
+                                  string_view from, string_view to) {
+    auto res = auth_view(user, pass);
+    if (!res.succeeded)
+      return res;
+    vector<uint8_t> names;
+    user_index.visit_from(from, [&](const string &name) {
+      if (!to.empty() && name >= to)
+        return false;
+      names.insert(names.end(), name.begin(), name.end());
+      names.push_back('\n');
+      return true;
+    });
+    if (!names.empty())
+      names.pop_back();
+    return {true, string(RES_OK), move(names)};
   }
 
   /// Authenticate a user
@@ -118,12 +2027,44 @@ public:
   /// @param pass The password for the user, used to authenticate
   ///
   /// @return A result tuple, as described in storage.h
+  virtual result_t auth_view(string_view user, string_view pass) {
+    bool ok = false;
+    with_user_readonly(
+        user, [&](const AuthRecord &e) { ok = check_pass(e, pass); });
+    if (!ok)
+      return {false, string(RES_ERR_LOGIN), {}};
+    return {true, string(RES_OK), {}};
+  }
+
+  // NB: The methods below implement the original interface of Storage, which
+  //     takes std::strings, by forwarding to the *_view methods above
+
+  /// Create a new entry in the Auth table (see above)
+  virtual result_t add_user(const string &user, const string &pass) {
+    return add_user_view(user, pass);
+  }
+
+  /// Set the data bytes for a user (see above)
+  virtual result_t set_user_data(const string &user, const string &pass,
+                                 const vector<uint8_t> &content) {
+    return set_user_data_view(user, pass, content);
+  }
+
+  /// Return the user data for a user (see above)
+  virtual result_t get_user_data(const string &user, const string &pass,
+                                 const string &who) {
+    return get_user_data_view(user, pass, who);
+  }
+
+  /// Return a newline-delimited string containing all of the usernames in the
+  /// auth table (see above)
+  virtual result_t get_all_users(const string &user, const string &pass) {
+    return get_all_users_view(user, pass);
+  }
+
+  /// Authenticate a user (see above)
   virtual result_t auth(const string &user, const string &pass) {
-    cout << "my_storage.cc::auth() is not implemented\n";
-    // NB: These asserts are to prevent compiler warnings
-    assert(user.length() > 0);
-    assert(pass.length() > 0);
-    return {false, RES_ERR_UNIMPLEMENTED, {}};
+    return auth_view(user, pass);
   }
 
   /// Shut down the storage when the server stops.  This method needs to close
@@ -131,7 +2072,10 @@ public:
   /// up any state related to .so files.  This is only called when all threads
   /// have stopped accessing the Storage object.
   virtual void shutdown() {
-    cout << "my_storage.cc::shutdown() is not implemented\n";
+    checkpoints.stop();
+    compactor.stop();
+    if (wal)
+      wal->close_log();
   }
 
   /// Write the entire Storage object to the file specified by this.filename. To
@@ -141,27 +2085,225 @@ public:
   ///
   /// @return A result tuple, as described in storage.h
   virtual result_t save_file() {
-    cout << "my_storage.cc::save_file() is not implemented\n";
-    return {false, RES_ERR_UNIMPLEMENTED, {}};
+    if (!save(false, false))
+      return {false, string(RES_ERR_SERVER), {}};
+    return {true, string(RES_OK), {}};
+  }
+
+  /// Start writing the entire Storage object to this.filename in the
+  /// background, but only if the user authenticates
+  ///
+  /// @param user The name of the user who made the request
+  /// @param pass The password for the user, used to authenticate
+  ///
+  /// @return A result tuple, as described in storage.h
+  virtual result_t checkpoint(string_view user, string_view pass) {
+    auto res = auth_view(user, pass);
+    if (!res.succeeded)
+      return res;
+    uint64_t n = checkpoints.request();
+    return {true, string(RES_OK),
+            vector<uint8_t>((uint8_t *)&n, (uint8_t *)&n + sizeof(n))};
+  }
+
+  /// Report the progress of the background checkpoints, but only if the user
+  /// authenticates
+  ///
+  /// @param user The name of the user who made the request
+  /// @param pass The password for the user, used to authenticate
+  ///
+  /// @return A result tuple, as described in storage.h
+  virtual result_t checkpoint_status(string_view user, string_view pass) {
+    auto res = auth_view(user, pass);
+    if (!res.succeeded)
+      return res;
+    auto st = checkpoints.status();
+    uint64_t out[] = {st.requested, st.durable, st.failed, st.running};
+    return {true, string(RES_OK),
+            vector<uint8_t>((uint8_t *)out, (uint8_t *)out + sizeof(out))};
   }
 
   /// Populate the Storage object by loading this.filename.  Note that load()
   /// begins by clearing the maps, so that when the call is complete, exactly
   /// and only the contents of the file are in the Storage object.
   ///
+  /// The file (or, if it is a manifest, each of its segments) is mapped into
+  /// memory, and the files are parsed in parallel.  An indexed segment is
+  /// parsed from its index (see parse_indexed()), and the entries of delta
+  /// segments then replace the older ones (see merge()).  Other files are split
+  /// into ranges.  Since every record is 8-byte aligned and starts with a code,
+  /// each thread starts at the first aligned code in its range.  That is only a
+  /// guess, so the ranges of a file are then checked in order: a range is kept
+  /// if it starts where the one before it ended, and is parsed again from there
+  /// if not.  A wrong guess (a code in a profile file) thus only costs time.
+  ///
   /// @return A result tuple, as described in storage.h.  Note that a
   ///         non-existent file is not an error.
   virtual result_t load_file() {
-    FILE *storage_file = fopen(filename.c_str(), "r");
-    if (storage_file == nullptr) {
-      return {true, "File not found: " + filename, {}};
+    auto start = chrono::steady_clock::now();
+    auto gens = wal_t::generations(filename);
+    bool found = file_exists(filename);
+    if (!found && gens.empty())
+      return start_log(gens) ? result_t{true, "File not found: " + filename, {}}
+                             : result_t{false, "Could not open log", {}};
+    deque<mapped_file> files(found ? 1 : 0);
+    vector<string> names;
+    vector<segment_t> segs;
+    if (found && !files[0].open(filename))
+      return {false, "Could not read file: " + filename, {}};
+    if (found && has_code(files[0].bytes(), 0, MANIFESTENTRY)) {
+      if (!read_manifest(files[0].bytes(), save_id, segs))
+        return {false, "Corrupt file: " + filename, {}};
+      files.pop_front();
+      for (auto &seg : segs) {
+        files.emplace_back();
+        names.push_back(in_data_dir(seg.name));
+        if (!files.back().open(names.back()) ||
+            files.back().bytes().size() != seg.size)
+          return {false, "Could not read segment: " + seg.name, {}};
+      }
+    } else if (found) {
+      names.push_back(filename);
     }
-
-    cout << "my_storage.cc::load_file() is not implemented\n";
-    return {false, RES_ERR_UNIMPLEMENTED, {}};
+    // Parse every file before touching the tables, so that a corrupt file
+    // leaves them as they were.  An entry may refer to a blob that comes later
+    // in the file (or in another segment), so references are resolved after
+    // parsing.  An indexed segment is parsed as a whole, from its index.
+    size_t n = max(thread::hardware_concurrency(), 1u), size = 0;
+    struct range_t {
+      byte_view buf;         // The file
+      size_t from, to;       // The range
+      const string *indexed; // The file's name, if it is indexed, or nullptr
+    };
+    vector<range_t> ranges;
+    size_t delta_size = 0, delta_count = 0;
+    for (size_t i = 0; i < files.size(); ++i) {
+      byte_view buf = files[i].bytes();
+      size += buf.size();
+      if (has_code(buf, 0, DELTAHEADER)) {
+        delta_size += buf.size();
+        ++delta_count;
+      }
+      if (has_code(buf, 0, INDEXEDHEADER) || has_code(buf, 0, DELTAHEADER)) {
+        ranges.push_back({buf, 0, buf.size(), &names[i]});
+        continue;
+      }
+      will_need(buf, 0);
+      size_t k = min(n, max<size_t>(buf.size() / MIN_LOAD_RANGE, 1));
+      size_t range = ((buf.size() / k) + 7) & ~size_t(7);
+      for (size_t j = 0; j < k; ++j)
+        ranges.push_back({buf, min(buf.size(), j * range),
+                          min(buf.size(), (j + 1) * range), nullptr});
+    }
+    vector<load_part_t> parts(ranges.size());
+    n = min(n, max<size_t>(ranges.size(), 1));
+    {
+      atomic<size_t> next(0);
+      auto work = [&]() {
+        for (size_t i; (i = next++) < ranges.size();)
+          if (ranges[i].indexed)
+            parse_indexed(ranges[i].buf, *ranges[i].indexed, parts[i]);
+          else
+            parse_range(ranges[i].buf, ranges[i].from, ranges[i].to,
+                        ranges[i].from > 0, parts[i]);
+      };
+      vector<thread> workers;
+      for (size_t i = 1; i < n; ++i)
+        workers.emplace_back(work);
+      work();
+      for (auto &w : workers)
+        w.join();
+    }
+    for (size_t i = 0, next = 0; i < ranges.size(); ++i) {
+      auto &r = ranges[i];
+      if (r.from == 0)
+        next = 0;
+      if (r.indexed && !parts[i].ok)
+        return {false, "Corrupt file: " + *r.indexed, {}};
+      if (r.indexed)
+        continue;
+      if (next >= r.to && r.to > 0) {
+        // The range is inside a record that started in an earlier range
+        parts[i] = load_part_t();
+        parts[i].users.resize(tables.size());
+        continue;
+      }
+      if (parts[i].start != next)
+        parse_range(r.buf, next, r.to, false, parts[i]);
+      if (!parts[i].ok)
+        return {false, "Corrupt file: " + filename, {}};
+      next = parts[i].end;
+    }
+    unordered_map<blob_store::digest_t, content_ptr, blob_store::digest_hash>
+        loaded;
+    for (auto &p : parts)
+      for (auto &[d, c] : p.blobs)
+        loaded[d] = move(c);
+    for (auto &p : parts)
+      for (auto &[t, i, d] : p.refs) {
+        auto it = loaded.find(d);
+        if (it == loaded.end())
+          return {false, "Corrupt file: " + filename, {}};
+        p.users[t][i].second.content = it->second;
+      }
+    if (delta_count > 0)
+      merge(parts);
+    size_t changes = replay(gens, parts);
+    // NB: load_file() runs before the server accepts requests, so it is safe to
+    //     clear the index.  In shard-per-core mode, each table is filled on its
+    //     own thread.  Otherwise, the parts are inserted into the one table one
+    //     after another: insert_batch() holds the table's resize lock while it
+    //     installs a batch, so inserting from several threads would only make
+    //     them wait for each other.
+    user_index.clear();
+    auto index = [&](const string &name) { user_index.insert(name); };
+    atomic<size_t> users(0);
+    auto insert = [&](size_t t, batch_t &b) {
+      users += tables[t]->insert_batch(move(b), index);
+    };
+    if (shards) {
+      on_all_tables([&](size_t t) {
+        tables[t]->clear();
+        for (auto &p : parts)
+          insert(t, p.users[t]);
+      });
+    } else {
+      tables[0]->clear();
+      for (auto &p : parts)
+        insert(0, p.users[0]);
+    }
+    if (!start_log(gens))
+      return {false, "Could not open log", {}};
+    saved = move(segs);
+    base_bytes = saved.empty() ? 0 : size - delta_size;
+    delta_bytes = delta_size;
+    deltas = delta_count;
+    double secs = chrono::duration<double>(chrono::steady_clock::now() - start)
+                      .count();
+    // NB: The first line must be exactly "Loaded: " and the file's name, as
+    //     clients of the server (and its tests) expect, so the statistics of
+    //     the load go on a line of their own
+    ostringstream msg;
+    msg << "Loaded: " << filename << "\n"
+        << "(" << users.load() << " users, " << size / 1048576.0 << " MB, "
+        << n << " threads, " << secs << " s";
+    if (files.size() > 1)
+      msg << ", " << files.size() << " segments";
+    if (delta_count > 0)
+      msg << ", " << delta_count << " deltas";
+    if (lazy)
+      msg << ", lazy";
+    if (changes > 0)
+      msg << ", " << changes << " logged changes";
+    msg << ")";
+    return {true, msg.str(), {}};
   }
 };
 
+/// MyStorage has every method of Storage, including those that the original
+/// interface did not (see storage.h)
+const bool storage_extended = true;
+
 /// Create an empty Storage object and specify the file from which it should be
 /// loaded.  To avoid exceptions and errors in the constructor, the act of
 /// loading data is separate from construction.
@@ -177,5 +2319,38 @@ public:
 Storage *storage_factory(const std::string &fname, size_t buckets, size_t upq,
                          size_t dnq, size_t rqq, double qd, size_t top,
                          const std::string &admin) {
-  return new MyStorage(fname, buckets, upq, dnq, rqq, qd, top, admin);
+  return new MyStorage(fname, buckets, upq, dnq, rqq, qd, top, admin, 0, 0, 0,
+                       0, 0, -2, false, false);
+}
+
+/// Create an empty Storage object, in shard-per-core mode if shards > 0, and
+/// specify the file from which it should be loaded.
+///
+/// @param fname   The name of the file to use for persistence
+/// @param buckets The number of buckets in the hash table
+/// @param upq     The upload quota
+/// @param dnq     The download quota
+/// @param rqq     The request quota
+/// @param qd      The quota duration
+/// @param top     The size of the "top keys" cache
+/// @param admin   The administrator's username
+/// @param shards  The number of shards, or 0 to share one table between all
+///                threads
+/// @param workers The number of threads that will call into the storage
+/// @param zmin    The smallest profile file to store compressed, or 0 to never
+///                compress
+/// @param budget  The most bytes of profile files to keep in memory, or 0 for
+///                no limit
+/// @param window  The seconds after which an unread profile file is spilled to
+///                disk, or 0 for no limit
+/// @param wal     The fsync policy of the log (see wal.h), or -2 to keep no log
+/// @param lazy    true to read profile files when they are first needed
+/// @param seg     true to save as a manifest plus segment files
+Storage *storage_factory(const std::string &fname, size_t buckets, size_t upq,
+                         size_t dnq, size_t rqq, double qd, size_t top,
+                         const std::string &admin, size_t shards,
+                         size_t workers, size_t zmin, size_t budget,
+                         size_t window, int wal, bool lazy, bool seg) {
+  return new MyStorage(fname, buckets, upq, dnq, rqq, qd, top, admin, shards,
+                       workers, zmin, budget, window, wal, lazy, seg);
 }
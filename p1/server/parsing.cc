@@ -1,4 +1,4 @@
-#include <cassert>
+#include <algorithm>
 #include <cstring>
 #include <iostream>
 #include <string>
@@ -15,6 +15,141 @@
 
 using namespace std;
 
+/// The open sessions, or nullptr if sessions are disabled.  server.cc sets this
+/// once, before it starts accepting connections, so it is only ever read here.
+static session_cache *sessions = nullptr;
+
+/// The length of the name of a request
+static const size_t LEN_CMD = REQ_KEY.size();
+
+/// The largest @ablock that any request can have: a profile file, plus the
+/// lengths and values of the other fields, plus a block of AES padding
+static const size_t LEN_ABLOCK_MAX = LEN_CMD + LEN_PROFILE_FILE +
+                                     4 * (sizeof(uint64_t) + LEN_UNAME) +
+                                     AES_IVSIZE;
+
+/// handler_t is a function that responds to a request, once its @ablock has
+/// been decrypted
+typedef bool (*handler_t)(int sd, Storage *storage, EVP_CIPHER_CTX *ctx,
+                          const vector<uint8_t> &req);
+
+/// The requests that may be sent with an @rblock or an @sblock, and the
+/// functions that respond to them.  PUB_KEY_ and SESSION_ are handled on
+/// their own, since neither may be sent in a session.  A function that the
+/// linked-in responses.o does not define (see responses.h) is nullptr, so its
+/// request is not found.
+static const pair<string_view, handler_t> handlers[] = {
+    {REQ_REG, handle_reg}, {REQ_BYE, handle_bye}, {REQ_SAV, handle_sav},
+    {REQ_SST, handle_sst}, {REQ_SET, handle_set}, {REQ_GET, handle_get},
+    {REQ_ALL, handle_all}, {REQ_RNG, handle_rng}};
+
+/// Find the function that responds to a request
+///
+/// @param cmd The 8-byte name of the request
+///
+/// @return The function, or nullptr if cmd is not a request that has one
+static handler_t find_handler(string_view cmd) {
+  for (auto &h : handlers)
+    if (h.first == cmd)
+      return h.second;
+  return nullptr;
+}
+
+/// Check if a block of bytes starts with a request's name
+///
+/// @param block The block
+/// @param cmd   The name of the request
+///
+/// @return true if the block starts with cmd, false otherwise
+static bool starts_with(const vector<uint8_t> &block, string_view cmd) {
+  return block.size() >= cmd.size() &&
+         memcmp(block.data(), cmd.data(), cmd.size()) == 0;
+}
+
+/// Check if a request's @ablock names a user as its first field
+///
+/// @param req  The unencrypted contents of the request
+/// @param user The user's name
+///
+/// @return true if the first field of req is user, false otherwise
+static bool names_user(const vector<uint8_t> &req, const string &user) {
+  uint64_t len;
+  if (req.size() < sizeof(len))
+    return false;
+  memcpy(&len, req.data(), sizeof(len));
+  return len == user.size() && req.size() - sizeof(len) >= len &&
+         memcmp(req.data() + sizeof(len), user.data(), len) == 0;
+}
+
+/// Receive and decrypt a request's @ablock
+///
+/// @param sd  The socket on which the @ablock arrives
+/// @param ctx The AES context, configured for decryption
+/// @param len The length of the encrypted @ablock
+///
+/// @return The unencrypted @ablock, or an empty vector on any error
+static vector<uint8_t> get_ablock(int sd, EVP_CIPHER_CTX *ctx, uint64_t len) {
+  if (len == 0 || len > LEN_ABLOCK_MAX)
+    return {};
+  vector<uint8_t> ablock(len);
+  if (reliable_get_to_eof_or_n(sd, ablock.begin(), len) != (int)len)
+    return {};
+  return aes_crypt_msg(ctx, ablock);
+}
+
+/// Receive and discard a request's @ablock, so that the connection is not reset
+/// when it closes with the @ablock unread, before the client reads the response
+///
+/// @param sd  The socket on which the @ablock arrives
+/// @param len The length of the encrypted @ablock
+static void skip_ablock(int sd, uint64_t len) {
+  vector<uint8_t> ablock(min<uint64_t>(len, LEN_ABLOCK_MAX));
+  reliable_get_to_eof_or_n(sd, ablock.begin(), ablock.size());
+}
+
+/// Respond to a request that starts with an @sblock.  The session's key and the
+/// request's iv decrypt the @ablock, which holds the name of the request and
+/// then its fields.  The request is answered as if it had come with an @rblock,
+/// but only if it is from the user who opened the session.
+///
+/// @param sd      The socket on which communication with the client takes place
+/// @param storage The Storage object with which clients interact
+/// @param block   The @sblock
+///
+/// @return true if the server should halt immediately, false otherwise
+static bool parse_session(int sd, Storage *storage,
+                          const vector<uint8_t> &block) {
+  vector<uint8_t> aeskey;
+  uint64_t len = 0;
+  string user;
+  if (sessions == nullptr || !sessions->find(block, aeskey, len, user)) {
+    skip_ablock(sd, len);
+    send_reliably(sd, string(RES_ERR_SESSION));
+    return false;
+  }
+  EVP_CIPHER_CTX *ctx = create_aes_context(aeskey, false);
+  if (ctx == nullptr) {
+    send_reliably(sd, string(RES_ERR_SERVER));
+    return false;
+  }
+  ContextManager c([&]() { reclaim_aes_context(ctx); });
+  auto req = get_ablock(sd, ctx, len);
+  if (req.size() < LEN_CMD || !reset_aes_context(ctx, aeskey, true)) {
+    send_reliably(sd, string(RES_ERR_CRYPTO));
+    return false;
+  }
+  string_view cmd((const char *)req.data(), LEN_CMD);
+  handler_t handler = find_handler(cmd);
+  req.erase(req.begin(), req.begin() + LEN_CMD);
+  if (handler == nullptr)
+    send_reliably(sd, aes_crypt_msg(ctx, string(RES_ERR_INV_CMD)));
+  else if (!names_user(req, user))
+    send_reliably(sd, aes_crypt_msg(ctx, string(RES_ERR_LOGIN)));
+  else
+    return handler(sd, storage, ctx, req);
+  return false;
+}
+
 /// When a new client connection is accepted, this code will run to figure out
 /// what the client is requesting, and to dispatch to the right function for
 /// satisfying the request.
@@ -27,13 +162,58 @@ using namespace std;
 /// @return true if the server should halt immediately, false otherwise
 bool parse_request(int sd, RSA *pri, const vector<uint8_t> &pub,
                    Storage *storage) {
-  cout << "parsing.cc::parse_request() is not implemented\n";
+  vector<uint8_t> block(LEN_RKBLOCK);
+  if (reliable_get_to_eof_or_n(sd, block.begin(), LEN_RKBLOCK) != LEN_RKBLOCK)
+    return false;
 
-  // NB: These assertions are only here to prevent compiler warnings
-  assert(pri);
-  assert(storage);
-  assert(pub.size() > 0);
-  assert(sd);
+  // NB: Neither a @kblock nor an @sblock is encrypted, so there is no RSA work
+  //     to do for them
+  if (starts_with(block, REQ_KEY))
+    return handle_key(sd, pub);
+  if (starts_with(block, REQ_SRQ))
+    return parse_session(sd, storage, block);
 
-  return false;
+  // Decrypt the @rblock: the name of the request, the AES key, and the length
+  // of the @ablock
+  vector<uint8_t> rblock(LEN_RKBLOCK);
+  int rlen = RSA_private_decrypt(LEN_RKBLOCK, block.data(), rblock.data(), pri,
+                                 RSA_PKCS1_OAEP_PADDING);
+  size_t keylen = AES_KEYSIZE + AES_IVSIZE;
+  uint64_t len;
+  if (rlen < (int)(LEN_CMD + keylen + sizeof(len))) {
+    send_reliably(sd, string(RES_ERR_CRYPTO));
+    return false;
+  }
+  string cmd(rblock.begin(), rblock.begin() + LEN_CMD);
+  vector<uint8_t> aeskey(rblock.begin() + LEN_CMD,
+                         rblock.begin() + LEN_CMD + keylen);
+  memcpy(&len, rblock.data() + LEN_CMD + keylen, sizeof(len));
+
+  EVP_CIPHER_CTX *ctx = create_aes_context(aeskey, false);
+  if (ctx == nullptr) {
+    send_reliably(sd, string(RES_ERR_SERVER));
+    return false;
+  }
+  ContextManager c([&]() { reclaim_aes_context(ctx); });
+  auto req = get_ablock(sd, ctx, len);
+  if (req.empty() || !reset_aes_context(ctx, aeskey, true)) {
+    send_reliably(sd, string(RES_ERR_CRYPTO));
+    return false;
+  }
+
+  if (cmd == REQ_SES && handle_ses != nullptr)
+    return handle_ses(sd, storage, sessions, ctx, req);
+  handler_t handler = find_handler(cmd);
+  if (handler == nullptr) {
+    send_reliably(sd, aes_crypt_msg(ctx, string(RES_ERR_INV_CMD)));
+    return false;
+  }
+  return handler(sd, storage, ctx, req);
 }
+
+/// Give parse_request() the open sessions, for requests that start with an
+/// @sblock (see protocol.h).  This must be called before any request is parsed.
+/// Until it is, SESSION_ and SESSREQ_ requests get ERR_SESSION.
+///
+/// @param cache The open sessions, or nullptr if sessions are disabled
+void set_session_cache(session_cache *cache) { sessions = cache; }
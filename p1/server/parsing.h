@@ -3,6 +3,7 @@
 #include <openssl/pem.h>
 #include <vector>
 
+#include "sessions.h"
 #include "storage.h"
 
 /// When a new client connection is accepted, this code will run to figure out
@@ -17,3 +18,13 @@
 /// @return true if the server should halt immediately, false otherwise
 bool parse_request(int sd, RSA *pri, const std::vector<uint8_t> &pub,
                    Storage *storage);
+
+/// Give parse_request() the open sessions, for requests that start with an
+/// @sblock (see protocol.h).  This must be called before any request is parsed.
+/// Until it is, SESSION_ and SESSREQ_ requests get ERR_SESSION.
+///
+/// NB: This is a weak symbol, since a parsing.o that was built before sessions
+///     existed does not define it.  If it is nullptr, there are no sessions.
+///
+/// @param cache The open sessions, or nullptr if sessions are disabled
+void set_session_cache(session_cache *cache) __attribute__((weak));
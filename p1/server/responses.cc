@@ -1,6 +1,7 @@
-#include <cassert>
-#include <iostream>
+#include <algorithm>
+#include <cstring>
 #include <string>
+#include <string_view>
 
 #include "../common/crypto.h"
 #include "../common/net.h"
@@ -9,6 +10,85 @@
 
 using namespace std;
 
+/// Split the front of a request into length-prefixed fields, each of which is
+/// an 8-byte binary length followed by that many bytes.
+///
+/// @param req    The unencrypted contents of the request
+/// @param fields The views to fill with the fields, in order
+/// @param n      The number of fields to extract
+///
+/// @return true if all n fields were present and no longer than LEN_UNAME (or
+///         LEN_PASSWORD), false otherwise
+static bool extract_fields(const vector<uint8_t> &req, string_view *fields,
+                           size_t n) {
+  size_t pos = 0;
+  for (size_t i = 0; i < n; ++i) {
+    uint64_t len;
+    if (req.size() - pos < sizeof(len))
+      return false;
+    memcpy(&len, req.data() + pos, sizeof(len));
+    pos += sizeof(len);
+    if (len > (size_t)max(LEN_UNAME, LEN_PASSWORD) || req.size() - pos < len)
+      return false;
+    fields[i] = string_view((const char *)req.data() + pos, len);
+    pos += len;
+  }
+  return true;
+}
+
+/// Send an encrypted response to the client: the result message, followed by
+/// the length and bytes of some data if the result succeeded.  The data may be
+/// a buffer that Storage shares with its tables (see get_user_content()), so
+/// it is read in place rather than copied out of the table.
+///
+/// @param sd   The socket onto which the result should be written
+/// @param ctx  The AES encryption context
+/// @param res  The result to send
+/// @param data The data to send
+///
+/// @return false, to indicate that the server shouldn't stop
+static bool send_result(int sd, EVP_CIPHER_CTX *ctx,
+                        const Storage::result_t &res,
+                        const vector<uint8_t> &data) {
+  vector<uint8_t> msg;
+  msg.reserve(res.msg.size() + sizeof(uint64_t) + data.size());
+  msg.insert(msg.end(), res.msg.begin(), res.msg.end());
+  if (res.succeeded) {
+    uint64_t len = data.size();
+    msg.insert(msg.end(), (uint8_t *)&len, (uint8_t *)&len + sizeof(len));
+    msg.insert(msg.end(), data.begin(), data.end());
+  }
+  send_reliably(sd, aes_crypt_msg(ctx, msg));
+  return false;
+}
+
+/// Send an encrypted response to the client: the result message, followed by
+/// the length and bytes of the result's data if it succeeded
+///
+/// @param sd  The socket onto which the result should be written
+/// @param ctx The AES encryption context
+/// @param res The result to send
+///
+/// @return false, to indicate that the server shouldn't stop
+static bool send_result(int sd, EVP_CIPHER_CTX *ctx,
+                        const Storage::result_t &res) {
+  return send_result(sd, ctx, res, res.data);
+}
+
+/// Send an encrypted response to the client that is only the result message, as
+/// the requests whose success carries no data expect
+///
+/// @param sd  The socket onto which the result should be written
+/// @param ctx The AES encryption context
+/// @param res The result to send
+///
+/// @return false, to indicate that the server shouldn't stop
+static bool send_status(int sd, EVP_CIPHER_CTX *ctx,
+                        const Storage::result_t &res) {
+  send_reliably(sd, aes_crypt_msg(ctx, res.msg));
+  return false;
+}
+
 /// Respond to an ALL command by generating a list of all the usernames in the
 /// Auth table and returning them, one per line.
 ///
@@ -20,13 +100,32 @@ using namespace std;
 /// @return false, to indicate that the server shouldn't stop
 bool handle_all(int sd, Storage *storage, EVP_CIPHER_CTX *ctx,
                 const vector<uint8_t> &req) {
-  cout << "responses.cc::handle_all() is not implemented\n";
-  // NB: These asserts are to prevent compiler warnings
-  assert(sd);
-  assert(storage);
-  assert(ctx);
-  assert(req.size() > 0);
-  return false;
+  string_view f[2]; // user, pass
+  if (!extract_fields(req, f, 2))
+    return send_result(sd, ctx, {false, string(RES_ERR_REQ_FMT), {}});
+  if (!has_storage_extensions())
+    return send_result(sd, ctx,
+                       storage->get_all_users(string(f[0]), string(f[1])));
+  return send_result(sd, ctx, storage->get_all_users_view(f[0], f[1]));
+}
+
+/// Respond to a RNG command by returning the sorted list of usernames in the
+/// requested range, one per line.
+///
+/// @param sd      The socket onto which the result should be written
+/// @param storage The Storage object, which contains the auth table
+/// @param ctx     The AES encryption context
+/// @param req     The unencrypted contents of the request
+///
+/// @return false, to indicate that the server shouldn't stop
+bool handle_rng(int sd, Storage *storage, EVP_CIPHER_CTX *ctx,
+                const vector<uint8_t> &req) {
+  // NB: The fields are views into req, so nothing is copied until Storage
+  //     builds the list of names
+  string_view f[4]; // user, pass, from, to
+  if (!extract_fields(req, f, 4))
+    return send_result(sd, ctx, {false, string(RES_ERR_REQ_FMT), {}});
+  return send_result(sd, ctx, storage->get_user_range(f[0], f[1], f[2], f[3]));
 }
 
 /// Respond to a SET command by putting the provided data into the Auth table
@@ -39,13 +138,25 @@ bool handle_all(int sd, Storage *storage, EVP_CIPHER_CTX *ctx,
 /// @return false, to indicate that the server shouldn't stop
 bool handle_set(int sd, Storage *storage, EVP_CIPHER_CTX *ctx,
                 const vector<uint8_t> &req) {
-  cout << "responses.cc::handle_set() is not implemented\n";
-  // NB: These asserts are to prevent compiler warnings
-  assert(sd);
-  assert(storage);
-  assert(ctx);
-  assert(req.size() > 0);
-  return false;
+  string_view f[2]; // user, pass
+  if (!extract_fields(req, f, 2))
+    return send_result(sd, ctx, {false, string(RES_ERR_REQ_FMT), {}});
+  // NB: The profile file may be much longer than the other fields, so it is
+  //     extracted on its own, from just past the password
+  size_t pos = f[1].data() + f[1].size() - (const char *)req.data();
+  uint64_t len;
+  if (req.size() - pos < sizeof(len))
+    return send_result(sd, ctx, {false, string(RES_ERR_REQ_FMT), {}});
+  memcpy(&len, req.data() + pos, sizeof(len));
+  pos += sizeof(len);
+  if (len > LEN_PROFILE_FILE || req.size() - pos < len)
+    return send_result(sd, ctx, {false, string(RES_ERR_REQ_FMT), {}});
+  vector<uint8_t> content(req.begin() + pos, req.begin() + pos + len);
+  if (!has_storage_extensions())
+    return send_status(sd, ctx,
+                       storage->set_user_data(string(f[0]), string(f[1]),
+                                              content));
+  return send_status(sd, ctx, storage->set_user_data_view(f[0], f[1], content));
 }
 
 /// Respond to a GET command by getting the data for a user
@@ -58,13 +169,20 @@ bool handle_set(int sd, Storage *storage, EVP_CIPHER_CTX *ctx,
 /// @return false, to indicate that the server shouldn't stop
 bool handle_get(int sd, Storage *storage, EVP_CIPHER_CTX *ctx,
                 const vector<uint8_t> &req) {
-  cout << "responses.cc::handle_get() is not implemented\n";
-  // NB: These asserts are to prevent compiler warnings
-  assert(sd);
-  assert(storage);
-  assert(ctx);
-  assert(req.size() > 0);
-  return false;
+  string_view f[3]; // user, pass, who
+  if (!extract_fields(req, f, 3))
+    return send_result(sd, ctx, {false, string(RES_ERR_REQ_FMT), {}});
+  if (!has_storage_extensions())
+    return send_result(sd, ctx,
+                       storage->get_user_data(string(f[0]), string(f[1]),
+                                              string(f[2])));
+  // NB: The content is sent straight from the buffer that Storage shares, so a
+  //     large profile file is not copied before it is encrypted
+  bytes_ptr content;
+  auto res = storage->get_user_content(f[0], f[1], f[2], content);
+  if (!res.succeeded)
+    return send_result(sd, ctx, res);
+  return send_result(sd, ctx, res, *content);
 }
 
 /// Respond to a REG command by trying to add a new user
@@ -77,13 +195,12 @@ bool handle_get(int sd, Storage *storage, EVP_CIPHER_CTX *ctx,
 /// @return false, to indicate that the server shouldn't stop
 bool handle_reg(int sd, Storage *storage, EVP_CIPHER_CTX *ctx,
                 const vector<uint8_t> &req) {
-  cout << "responses.cc::handle_reg() is not implemented\n";
-  // NB: These asserts are to prevent compiler warnings
-  assert(sd);
-  assert(storage);
-  assert(ctx);
-  assert(req.size() > 0);
-  return false;
+  string_view f[2]; // user, pass
+  if (!extract_fields(req, f, 2))
+    return send_result(sd, ctx, {false, string(RES_ERR_REQ_FMT), {}});
+  if (!has_storage_extensions())
+    return send_status(sd, ctx, storage->add_user(string(f[0]), string(f[1])));
+  return send_status(sd, ctx, storage->add_user_view(f[0], f[1]));
 }
 
 /// In response to a request for a key, do a reliable send of the contents of
@@ -94,10 +211,7 @@ bool handle_reg(int sd, Storage *storage, EVP_CIPHER_CTX *ctx,
 ///
 /// @return false, to indicate that the server shouldn't stop
 bool handle_key(int sd, const vector<uint8_t> &pubfile) {
-  cout << "responses.cc::handle_key() is not implemented\n";
-  // NB: These asserts are to prevent compiler warnings
-  assert(sd);
-  assert(pubfile.size() > 0);
+  send_reliably(sd, pubfile);
   return false;
 }
 
@@ -112,17 +226,18 @@ bool handle_key(int sd, const vector<uint8_t> &pubfile) {
 /// @return true, to indicate that the server should stop, or false on an error
 bool handle_bye(int sd, Storage *storage, EVP_CIPHER_CTX *ctx,
                 const vector<uint8_t> &req) {
-  cout << "responses.cc::handle_bye() is not implemented\n";
-  // NB: These asserts are to prevent compiler warnings
-  assert(sd);
-  assert(storage);
-  assert(ctx);
-  assert(req.size() > 0);
-  return false;
+  string_view f[2]; // user, pass
+  if (!extract_fields(req, f, 2))
+    return send_result(sd, ctx, {false, string(RES_ERR_REQ_FMT), {}});
+  auto res = has_storage_extensions()
+                 ? storage->auth_view(f[0], f[1])
+                 : storage->auth(string(f[0]), string(f[1]));
+  send_status(sd, ctx, res);
+  return res.succeeded;
 }
 
-/// Respond to a SAV command by persisting the file, but only if the user
-/// authenticates
+/// Respond to a SAV command by starting a background checkpoint, but only if
+/// the user authenticates.  The response does not wait for the checkpoint.
 ///
 /// @param sd      The socket onto which the result should be written
 /// @param storage The Storage object, which contains the auth table
@@ -132,11 +247,59 @@ bool handle_bye(int sd, Storage *storage, EVP_CIPHER_CTX *ctx,
 /// @return false, to indicate that the server shouldn't stop
 bool handle_sav(int sd, Storage *storage, EVP_CIPHER_CTX *ctx,
                 const vector<uint8_t> &req) {
-  cout << "responses.cc::handle_sav() is not implemented\n";
-  // NB: These asserts are to prevent compiler warnings
-  assert(sd);
-  assert(storage);
-  assert(ctx);
-  assert(req.size() > 0);
-  return false;
+  string_view f[2]; // user, pass
+  if (!extract_fields(req, f, 2))
+    return send_result(sd, ctx, {false, string(RES_ERR_REQ_FMT), {}});
+  // NB: A Storage without checkpoints saves before the response is sent
+  if (!has_storage_extensions()) {
+    auto res = storage->auth(string(f[0]), string(f[1]));
+    return send_status(sd, ctx, res.succeeded ? storage->save_file() : res);
+  }
+  // NB: The reply does not carry the checkpoint's number, so that it is the
+  //     same as a blocking save's.  SAVSTAT_ reports it.
+  return send_status(sd, ctx, storage->checkpoint(f[0], f[1]));
+}
+
+/// Respond to a SST command by reporting the progress of the background
+/// checkpoints, but only if the user authenticates
+///
+/// @param sd      The socket onto which the result should be written
+/// @param storage The Storage object, which contains the auth table
+/// @param ctx     The AES encryption context
+/// @param req     The unencrypted contents of the request
+///
+/// @return false, to indicate that the server shouldn't stop
+bool handle_sst(int sd, Storage *storage, EVP_CIPHER_CTX *ctx,
+                const vector<uint8_t> &req) {
+  string_view f[2]; // user, pass
+  if (!extract_fields(req, f, 2))
+    return send_result(sd, ctx, {false, string(RES_ERR_REQ_FMT), {}});
+  return send_result(sd, ctx, storage->checkpoint_status(f[0], f[1]));
+}
+
+/// Respond to a SES command by opening a session, but only if the user
+/// authenticates
+///
+/// @param sd       The socket onto which the result should be written
+/// @param storage  The Storage object, which contains the auth table
+/// @param sessions The open sessions, or nullptr if sessions are disabled
+/// @param ctx      The AES encryption context
+/// @param req      The unencrypted contents of the request
+///
+/// @return false, to indicate that the server shouldn't stop
+bool handle_ses(int sd, Storage *storage, session_cache *sessions,
+                EVP_CIPHER_CTX *ctx, const vector<uint8_t> &req) {
+  string_view f[2]; // user, pass
+  if (!extract_fields(req, f, 2))
+    return send_result(sd, ctx, {false, string(RES_ERR_REQ_FMT), {}});
+  auto res = storage->auth_view(f[0], f[1]);
+  if (!res.succeeded)
+    return send_result(sd, ctx, res);
+  vector<uint8_t> id, key;
+  if (sessions == nullptr || !sessions->open(f[0], id, key))
+    return send_result(sd, ctx, {false, string(RES_ERR_SESSION), {}});
+  uint64_t ttl = sessions->lifetime();
+  id.insert(id.end(), key.begin(), key.end());
+  id.insert(id.end(), (uint8_t *)&ttl, (uint8_t *)&ttl + sizeof(ttl));
+  return send_result(sd, ctx, {true, string(RES_OK), id});
 }
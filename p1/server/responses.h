@@ -5,6 +5,7 @@
 
 #include "../common/protocol.h"
 
+#include "sessions.h"
 #include "storage.h"
 
 /// In response to a request for a key, do a reliable send of the contents of
@@ -28,6 +29,23 @@ bool handle_key(int sd, const std::vector<uint8_t> &pubfile);
 bool handle_all(int sd, Storage *storage, EVP_CIPHER_CTX *ctx,
                 const std::vector<uint8_t> &req);
 
+/// Respond to a RNG command by returning the sorted list of usernames in the
+/// requested range, one per line.
+///
+/// NB: This is a weak symbol, since a responses.o that was built before this
+///     request existed does not define it.  If it is nullptr, the request
+///     gets ERR_INV_CMD.
+///
+/// @param sd      The socket onto which the result should be written
+/// @param storage The Storage object, which contains the auth table
+/// @param ctx     The AES encryption context
+/// @param req     The unencrypted contents of the request
+///
+/// @return false, to indicate that the server shouldn't stop
+bool handle_rng(int sd, Storage *storage, EVP_CIPHER_CTX *ctx,
+                const std::vector<uint8_t> &req)
+    __attribute__((weak));
+
 /// Respond to a SET command by putting the provided data into the Auth table
 ///
 /// @param sd      The socket onto which the result should be written
@@ -73,8 +91,8 @@ bool handle_reg(int sd, Storage *storage, EVP_CIPHER_CTX *ctx,
 bool handle_bye(int sd, Storage *storage, EVP_CIPHER_CTX *ctx,
                 const std::vector<uint8_t> &req);
 
-/// Respond to a SAV command by persisting the file, but only if the user
-/// authenticates
+/// Respond to a SAV command by starting a background checkpoint, but only if
+/// the user authenticates.  The response does not wait for the checkpoint.
 ///
 /// @param sd      The socket onto which the result should be written
 /// @param storage The Storage object, which contains the auth table
@@ -84,3 +102,38 @@ bool handle_bye(int sd, Storage *storage, EVP_CIPHER_CTX *ctx,
 /// @return false, to indicate that the server shouldn't stop
 bool handle_sav(int sd, Storage *storage, EVP_CIPHER_CTX *ctx,
                 const std::vector<uint8_t> &req);
+
+/// Respond to a SST command by reporting the progress of the background
+/// checkpoints, but only if the user authenticates
+///
+/// NB: This is a weak symbol, since a responses.o that was built before this
+///     request existed does not define it.  If it is nullptr, the request
+///     gets ERR_INV_CMD.
+///
+/// @param sd      The socket onto which the result should be written
+/// @param storage The Storage object, which contains the auth table
+/// @param ctx     The AES encryption context
+/// @param req     The unencrypted contents of the request
+///
+/// @return false, to indicate that the server shouldn't stop
+bool handle_sst(int sd, Storage *storage, EVP_CIPHER_CTX *ctx,
+                const std::vector<uint8_t> &req)
+    __attribute__((weak));
+
+/// Respond to a SES command by opening a session, but only if the user
+/// authenticates
+///
+/// NB: This is a weak symbol, since a responses.o that was built before this
+///     request existed does not define it.  If it is nullptr, the request
+///     gets ERR_INV_CMD.
+///
+/// @param sd       The socket onto which the result should be written
+/// @param storage  The Storage object, which contains the auth table
+/// @param sessions The open sessions, or nullptr if sessions are disabled
+/// @param ctx      The AES encryption context
+/// @param req      The unencrypted contents of the request
+///
+/// @return false, to indicate that the server shouldn't stop
+bool handle_ses(int sd, Storage *storage, session_cache *sessions,
+                EVP_CIPHER_CTX *ctx, const std::vector<uint8_t> &req)
+    __attribute__((weak));
@@ -10,8 +10,10 @@
 #include "../common/file.h"
 #include "../common/net.h"
 #include "../common/pool.h"
+#include "../common/slab.h"
 
 #include "parsing.h"
+#include "sessions.h"
 #include "storage.h"
 
 using namespace std;
@@ -29,6 +31,16 @@ struct arg_t {
   size_t quota_req = 16;       // K/V request quota (requests/interval)
   size_t top_size = 4;         // Number of keys to track for TOP queries
   string admin_name = "";      // Name of the administrator
+  size_t shards = 0;           // Number of storage shards (0 for none)
+  bool huge_pages = false;     // Back the slab allocator with huge pages
+  size_t compress_min = 0;     // Smallest profile file to compress (0 for none)
+  size_t tier_budget = 0;      // Memory for profile files (MB, 0 for no limit)
+  size_t tier_window = 0;      // Seconds before unread files spill (0 for none)
+  int wal_sync = -2;           // Log fsync policy (ms, 0 = each, -2 = no log)
+  bool lazy_load = false;      // Read profile files when they are first needed
+  bool segmented = false;      // Save as a manifest plus segment files
+  size_t sessions = 65536;     // Most open sessions (0 for none)
+  size_t session_ttl = 300;    // Seconds that a session lasts
 
   /// Construct an arg_t from the command-line arguments to the program
   ///
@@ -39,7 +51,8 @@ struct arg_t {
   ///        `-h` is passed in
   arg_t(int argc, char **argv) {
     long opt;
-    while ((opt = getopt(argc, argv, "p:f:k:ht:b:i:u:d:r:o:a:")) != -1) {
+    const char *opts = "p:f:k:ht:b:i:u:d:r:o:a:s:Hz:M:W:l:LSc:e:";
+    while ((opt = getopt(argc, argv, opts)) != -1) {
       switch (opt) {
       case 'p':
         port = atoi(optarg);
@@ -74,6 +87,36 @@ struct arg_t {
       case 'a':
         admin_name = string(optarg);
         break;
+      case 's':
+        shards = atoi(optarg);
+        break;
+      case 'H':
+        huge_pages = true;
+        break;
+      case 'z':
+        compress_min = atoi(optarg);
+        break;
+      case 'M':
+        tier_budget = atoi(optarg);
+        break;
+      case 'W':
+        tier_window = atoi(optarg);
+        break;
+      case 'l':
+        wal_sync = atoi(optarg);
+        break;
+      case 'L':
+        lazy_load = true;
+        break;
+      case 'S':
+        segmented = true;
+        break;
+      case 'c':
+        sessions = atoi(optarg);
+        break;
+      case 'e':
+        session_ttl = atoi(optarg);
+        break;
       default: // on any error, print a help message.  This case subsumes `-h`
         throw 1;
         return;
@@ -98,6 +141,21 @@ struct arg_t {
          << "  -r [int]    Request quota (requests/interval)\n"
          << "  -o [int]    Size of the TOP key cache\n"
          << "  -a [string] Specify name of admin user\n"
+         << "  -s [int]    # of storage shards, each with its own thread "
+            "(0 = shared)\n"
+         << "  -H          Use huge pages for the auth table's memory\n"
+         << "  -z [int]    Compress profile files of at least this many bytes\n"
+         << "  -M [int]    Memory for profile files (MB), beyond which they "
+            "spill to disk\n"
+         << "  -W [int]    Spill profile files not read in this many seconds\n"
+         << "  -l [int]    Log changes; fsync the log before replying (0), "
+            "every N ms (N),\n"
+         << "              or never (-1)\n"
+         << "  -L          Load profile files when they are first read\n"
+         << "  -S          Save as a manifest plus segment files, written in "
+            "parallel\n"
+         << "  -c [int]    Most open sessions (0 = no sessions)\n"
+         << "  -e [int]    Seconds that a session lasts\n"
          << "  -h          Print help (this message)\n";
   }
 };
@@ -130,16 +188,29 @@ int main(int argc, char **argv) {
   if (pub.size() == 0)
     return 1;
 
+  // NB: This must happen before anything is put in the auth table
+  slab_set_huge_pages(args->huge_pages);
+
   // If the data file exists, load the data into a Storage object.  Otherwise,
   // create an empty Storage object.
+  //
+  // NB: The pool threads and the main thread may all call into the storage
   Storage *storage = storage_factory(
       args->datafile, args->num_buckets, args->quota_up, args->quota_down,
-      args->quota_req, args->quota_interval, args->top_size, args->admin_name);
+      args->quota_req, args->quota_interval, args->top_size, args->admin_name,
+      args->shards, args->threads + 1, args->compress_min,
+      args->tier_budget << 20, args->tier_window, args->wal_sync,
+      args->lazy_load, args->segmented);
   auto res = storage->load_file();
   if (!res.succeeded)
     return err(1, res.msg.c_str());
   cout << res.msg << endl;
 
+  // The sessions that clients open, to skip RSA on later requests
+  session_cache sessions(args->sessions, args->session_ttl);
+  if (set_session_cache != nullptr)
+    set_session_cache(&sessions);
+
   // Start listening for connections.
   int sd = create_server_socket(args->port);
   ContextManager csd([&]() { close(sd); });
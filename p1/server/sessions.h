@@ -0,0 +1,149 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <openssl/rand.h>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "../common/crypto.h"
+#include "../common/protocol.h"
+
+/// session_cache holds the sessions that SESSION_ requests have opened (see
+/// protocol.h), so that a client can send many requests after one RSA
+/// decryption.  A session is a random id and a random AES key, which expire
+/// after a fixed lifetime.  Each session belongs to the user who opened it, and
+/// only that user's requests may use it.
+///
+/// The cache is split into stripes, each with its own lock, so that requests
+/// on different sessions rarely contend.  Each stripe holds at most its share
+/// of the cache's capacity.  Since every session has the same lifetime, the
+/// oldest session in a stripe is also the first to expire, so each stripe
+/// keeps its sessions in the order in which they were opened, and a new
+/// session replaces the expired ones and then, if the stripe is still full,
+/// the oldest.
+class session_cache {
+  /// The number of stripes
+  static const size_t STRIPES = 16;
+
+  typedef std::chrono::steady_clock clock;
+
+  /// session_t is a session's key, expiry time, and user
+  struct session_t {
+    uint8_t key[AES_KEYSIZE];
+    clock::time_point expires;
+    std::string user;
+  };
+
+  /// stripe_t is one lock and the sessions that it protects
+  struct alignas(64) stripe_t {
+    std::mutex lock;
+    std::unordered_map<std::string, session_t> sessions;
+    std::deque<std::string> order; // The ids, oldest first
+  };
+
+  /// The stripes
+  stripe_t stripes[STRIPES];
+
+  /// The most sessions in a stripe
+  const size_t per_stripe;
+
+  /// How long a session lasts
+  const std::chrono::seconds ttl;
+
+  /// Find the stripe that holds a session
+  ///
+  /// @param id The session's id
+  ///
+  /// @return The stripe
+  stripe_t &stripe(std::string_view id) {
+    // NB: Ids are random, so any of their bytes will do as a hash
+    uint64_t h;
+    memcpy(&h, id.data(), sizeof(h));
+    return stripes[h % STRIPES];
+  }
+
+public:
+  /// Construct an empty cache
+  ///
+  /// @param capacity The most sessions to hold at once
+  /// @param lifetime How long a session lasts, in seconds
+  session_cache(size_t capacity, size_t lifetime)
+      : per_stripe((capacity + STRIPES - 1) / STRIPES), ttl(lifetime) {}
+
+  /// Report how long a session lasts, in seconds, or 0 if sessions are disabled
+  uint64_t lifetime() const { return per_stripe > 0 ? ttl.count() : 0; }
+
+  /// Open a session
+  ///
+  /// @param user The name of the user who opened the session, who must have
+  ///             authenticated
+  /// @param id   Filled with the session's id, LEN_SESSION_ID bytes
+  /// @param key  Filled with the session's key, AES_KEYSIZE bytes
+  ///
+  /// @return false if sessions are disabled or on an error, true otherwise
+  bool open(std::string_view user, std::vector<uint8_t> &id,
+            std::vector<uint8_t> &key) {
+    if (lifetime() == 0)
+      return false;
+    id.resize(LEN_SESSION_ID);
+    key.resize(AES_KEYSIZE);
+    if (!RAND_bytes(id.data(), id.size()) ||
+        !RAND_bytes(key.data(), key.size()))
+      return false;
+    std::string name(id.begin(), id.end());
+    stripe_t &s = stripe(name);
+    auto now = clock::now();
+    std::lock_guard<std::mutex> g(s.lock);
+    while (!s.order.empty() && (s.sessions.size() >= per_stripe ||
+                                s.sessions[s.order.front()].expires <= now)) {
+      s.sessions.erase(s.order.front());
+      s.order.pop_front();
+    }
+    session_t &ses = s.sessions[name];
+    memcpy(ses.key, key.data(), key.size());
+    ses.expires = now + ttl;
+    ses.user.assign(user.data(), user.size());
+    s.order.push_back(std::move(name));
+    return true;
+  }
+
+  /// Get the AES key and iv for a session request, from its @sblock (see
+  /// protocol.h).  The key and iv can be passed to create_aes_context() to
+  /// decrypt the request's @ablock, and then to encrypt the response.
+  ///
+  /// @param block The @sblock
+  /// @param aes   Filled with the session's key, followed by the request's iv
+  /// @param len   Filled with the length of the @ablock, even if the session
+  ///              does not exist, so long as the block is well-formed
+  /// @param user  Filled with the name of the user who opened the session
+  ///
+  /// @return false if the block is malformed, or the session does not exist
+  ///         or has expired, true otherwise
+  bool find(const std::vector<uint8_t> &block, std::vector<uint8_t> &aes,
+            uint64_t &len, std::string &user) {
+    size_t at = REQ_SRQ.size();
+    if (block.size() < at + LEN_SESSION_ID + AES_IVSIZE + sizeof(len) ||
+        memcmp(block.data(), REQ_SRQ.data(), at) != 0)
+      return false;
+    memcpy(&len, block.data() + at + LEN_SESSION_ID + AES_IVSIZE, sizeof(len));
+    std::string name((const char *)block.data() + at, LEN_SESSION_ID);
+    stripe_t &s = stripe(name);
+    {
+      std::lock_guard<std::mutex> g(s.lock);
+      auto it = s.sessions.find(name);
+      if (it == s.sessions.end() || it->second.expires <= clock::now())
+        return false;
+      aes.assign(it->second.key, it->second.key + AES_KEYSIZE);
+      user = it->second.user;
+    }
+    at += LEN_SESSION_ID;
+    aes.insert(aes.end(), block.data() + at, block.data() + at + AES_IVSIZE);
+    return true;
+  }
+};
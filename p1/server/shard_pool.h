@@ -0,0 +1,330 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include "../common/spsc_queue.h"
+
+/// shard_pool runs a set of shard threads, each of which owns one partition of
+/// the server's data.  Requests do not touch a shard's data directly: they hand
+/// the shard's thread a task and wait for it to finish, so a shard's data
+/// mostly lives in one core's cache, and its locks are rarely contended.
+///
+/// NB: The pool does not make a shard's data private to its thread.  Other
+///     threads still read it (e.g., a background save or a compaction scans
+///     every shard's table from its own thread), so each shard's data must
+///     still be safe to share.  MyStorage keeps each shard in a lock-striped
+///     map, whose bucket locks are taken as usual.
+///
+/// Tasks travel over lock-free SPSC queues.  Each shard has one queue per
+/// producer thread, so no two threads ever write the same queue.  A thread
+/// claims a producer slot the first time it submits a task.  If more threads
+/// submit tasks than there are slots, the extra ones share a mutex-protected
+/// overflow list per shard, which is slower but still correct.
+///
+/// An idle shard thread spins briefly, and then sleeps until a producer wakes
+/// it.  A producer only touches the shard's condition variable when the shard
+/// is actually asleep.  A producer that waits for its task does not sleep: it
+/// yields in a loop until the task is done, so tasks should be short.
+class shard_pool {
+  /// shard_task_t is one unit of work for a shard.  It lives on the stack of
+  /// the thread that submitted it, which waits for it to finish.
+  struct shard_task_t {
+    void (*fn)(void *);            // The code to run
+    void *arg;                     // The argument to pass to fn
+    std::atomic<bool> done{false}; // Set when fn has returned
+  };
+
+  /// The capacity of each SPSC queue.  Producers wait for their tasks, so a
+  /// producer never has more than one task queued per shard.
+  static const size_t QUEUE_SIZE = 4;
+
+  /// The number of empty polls before an idle shard thread goes to sleep
+  static const int SPIN_POLLS = 256;
+
+  /// shard_t is the state of one shard thread
+  struct alignas(64) shard_t {
+    /// One queue per producer slot
+    std::vector<std::unique_ptr<spsc_queue<shard_task_t *, QUEUE_SIZE>>> in;
+
+    /// Tasks from threads that did not get a producer slot
+    std::vector<shard_task_t *> overflow;
+
+    /// A lock protecting overflow
+    std::mutex overflow_lock;
+
+    /// true if overflow might be non-empty (checked without the lock)
+    std::atomic<bool> has_overflow{false};
+
+    /// true while the shard thread is (about to be) asleep
+    std::atomic<bool> sleeping{false};
+
+    /// The lock and condition variable for sleeping and waking
+    std::mutex sleep_lock;
+    std::condition_variable wake;
+
+    /// The shard thread
+    std::thread thread;
+  };
+
+  /// The shards
+  std::vector<std::unique_ptr<shard_t>> shards;
+
+  /// The number of producer slots per shard
+  const size_t producers;
+
+  /// The number of threads that have claimed a producer slot so far
+  std::atomic<size_t> next_producer{0};
+
+  /// A number that identifies this pool, so that thread-local state that
+  /// refers to a pool can tell when the pool has been replaced
+  const size_t pool_id;
+
+  /// Set when the pool is being destroyed
+  std::atomic<bool> stopping{false};
+
+  /// Get a new pool id
+  ///
+  /// @return A number no other pool has had
+  static size_t new_pool_id() {
+    static std::atomic<size_t> ids{1};
+    return ids.fetch_add(1);
+  }
+
+  /// thread_state_t is the per-thread state of the calling thread: the pool
+  /// whose producer slot it holds, its slot, and, if it is a shard thread, the
+  /// pool and index of its shard
+  struct thread_state_t {
+    size_t pool = 0;        // The pool in which slot is valid
+    size_t slot = 0;        // The producer slot in that pool
+    size_t owner_pool = 0;  // The pool this thread is a shard of, or 0
+    size_t owner_shard = 0; // The shard this thread owns, if owner_pool != 0
+  };
+
+  /// Get the calling thread's state
+  ///
+  /// @return A reference to the thread-local state
+  static thread_state_t &self() {
+    static thread_local thread_state_t state;
+    return state;
+  }
+
+  /// Check if the calling thread is the thread of a shard of this pool
+  ///
+  /// @param s The shard
+  ///
+  /// @return true if the calling thread owns shard s
+  bool is_owner(size_t s) const {
+    return self().owner_pool == pool_id && self().owner_shard == s;
+  }
+
+  /// Hand a task to a shard, and wake the shard if it is asleep
+  ///
+  /// @param s The shard
+  /// @param t The task
+  void submit(size_t s, shard_task_t *t) {
+    thread_state_t &me = self();
+    if (me.pool != pool_id) {
+      me.pool = pool_id;
+      me.slot = next_producer.fetch_add(1);
+    }
+    shard_t &sh = *shards[s];
+    if (me.slot < producers) {
+      while (!sh.in[me.slot]->push(t))
+        std::this_thread::yield();
+    } else {
+      std::lock_guard<std::mutex> g(sh.overflow_lock);
+      sh.overflow.push_back(t);
+      sh.has_overflow.store(true, std::memory_order_release);
+    }
+    // NB: The shard sets sleeping before its final check of the queues, and we
+    //     check sleeping after our push, so one of us will see the other
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sh.sleeping.load(std::memory_order_relaxed)) {
+      std::lock_guard<std::mutex> g(sh.sleep_lock);
+      sh.sleeping.store(false, std::memory_order_relaxed);
+      sh.wake.notify_one();
+    }
+  }
+
+  /// Wait for a task to finish
+  ///
+  /// @param t The task
+  static void await(shard_task_t &t) {
+    while (!t.done.load(std::memory_order_acquire))
+      std::this_thread::yield();
+  }
+
+  /// Run every task that is waiting for a shard
+  ///
+  /// @param sh The shard
+  ///
+  /// @return true if any task ran
+  static bool drain(shard_t &sh) {
+    bool ran = false;
+    shard_task_t *t;
+    for (auto &q : sh.in)
+      while (q->pop(t)) {
+        t->fn(t->arg);
+        t->done.store(true, std::memory_order_release);
+        ran = true;
+      }
+    if (sh.has_overflow.load(std::memory_order_acquire)) {
+      std::vector<shard_task_t *> batch;
+      {
+        std::lock_guard<std::mutex> g(sh.overflow_lock);
+        batch.swap(sh.overflow);
+        sh.has_overflow.store(false, std::memory_order_relaxed);
+      }
+      for (auto *o : batch) {
+        o->fn(o->arg);
+        o->done.store(true, std::memory_order_release);
+        ran = true;
+      }
+    }
+    return ran;
+  }
+
+  /// Check if any task is waiting for a shard
+  ///
+  /// @param sh The shard
+  ///
+  /// @return true if a queue is non-empty
+  static bool pending(const shard_t &sh) {
+    for (auto &q : sh.in)
+      if (!q->empty())
+        return true;
+    return sh.has_overflow.load(std::memory_order_acquire);
+  }
+
+  /// The main loop of a shard thread
+  ///
+  /// @param s The index of the shard
+  void run_shard(size_t s) {
+    self().owner_pool = pool_id;
+    self().owner_shard = s;
+    shard_t &sh = *shards[s];
+    int idle = 0;
+    while (true) {
+      if (drain(sh)) {
+        idle = 0;
+        continue;
+      }
+      if (stopping.load(std::memory_order_acquire))
+        return;
+      if (++idle < SPIN_POLLS) {
+        std::this_thread::yield();
+        continue;
+      }
+      idle = 0;
+      sh.sleeping.store(true, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (pending(sh) || stopping.load(std::memory_order_acquire)) {
+        sh.sleeping.store(false, std::memory_order_relaxed);
+        continue;
+      }
+      std::unique_lock<std::mutex> g(sh.sleep_lock);
+      sh.wake.wait(g, [&]() {
+        return !sh.sleeping.load(std::memory_order_relaxed) ||
+               stopping.load(std::memory_order_acquire);
+      });
+      sh.sleeping.store(false, std::memory_order_relaxed);
+    }
+  }
+
+  /// Adapt a callable object to the type of shard_task_t::fn
+  ///
+  /// @param arg A pointer to the callable object
+  template <typename F> static void call(void *arg) {
+    (*static_cast<F *>(arg))();
+  }
+
+public:
+  /// Construct a pool and start its threads
+  ///
+  /// @param num_shards The number of shards (and threads)
+  /// @param _producers The number of threads that will get their own queue to
+  ///                   each shard (i.e., the number of worker threads)
+  shard_pool(size_t num_shards, size_t _producers)
+      : producers(_producers), pool_id(new_pool_id()) {
+    for (size_t s = 0; s < num_shards; ++s) {
+      shards.emplace_back(new shard_t());
+      for (size_t p = 0; p < producers; ++p)
+        shards[s]->in.emplace_back(
+            new spsc_queue<shard_task_t *, QUEUE_SIZE>());
+    }
+    for (size_t s = 0; s < num_shards; ++s)
+      shards[s]->thread = std::thread([this, s]() { run_shard(s); });
+  }
+
+  /// Stop the shard threads, once they have run every submitted task
+  ~shard_pool() {
+    stopping.store(true, std::memory_order_seq_cst);
+    for (auto &sh : shards) {
+      std::lock_guard<std::mutex> g(sh->sleep_lock);
+      sh->wake.notify_one();
+    }
+    for (auto &sh : shards)
+      sh->thread.join();
+  }
+
+  /// Get the number of shards
+  ///
+  /// @return The number of shards
+  size_t size() const { return shards.size(); }
+
+  /// Run a function on a shard's thread, and wait for it to finish.  If the
+  /// caller is that shard's thread, the function runs right away.
+  ///
+  /// @param s The shard
+  /// @param f The function to run
+  template <typename F> void run(size_t s, F &&f) {
+    if (is_owner(s)) {
+      f();
+      return;
+    }
+    typedef typename std::remove_reference<F>::type fn_t;
+    shard_task_t t;
+    t.fn = &call<fn_t>;
+    t.arg = const_cast<void *>(static_cast<const void *>(&f));
+    submit(s, &t);
+    await(t);
+  }
+
+  /// Run a function on every shard's thread at once (scatter), and wait for
+  /// all of them to finish (gather)
+  ///
+  /// @param f The function to run.  It receives the index of the shard.
+  template <typename F> void run_all(F &&f) {
+    typedef typename std::remove_reference<F>::type fn_t;
+    size_t n = shards.size();
+    struct part_t {
+      fn_t *f;
+      size_t s;
+      void operator()() { (*f)(s); }
+    };
+    std::vector<part_t> parts(n);
+    std::vector<shard_task_t> tasks(n);
+    size_t mine = n;
+    for (size_t s = 0; s < n; ++s) {
+      parts[s] = {&f, s};
+      if (is_owner(s)) {
+        mine = s;
+        continue;
+      }
+      tasks[s].fn = &call<part_t>;
+      tasks[s].arg = &parts[s];
+      submit(s, &tasks[s]);
+    }
+    if (mine < n)
+      f(mine);
+    for (size_t s = 0; s < n; ++s)
+      if (s != mine)
+        await(tasks[s]);
+  }
+};
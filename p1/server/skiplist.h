@@ -0,0 +1,227 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <new>
+#include <utility>
+
+#include "../common/slab.h"
+
+/// SkipList is a concurrent ordered set of keys.  It is used as a secondary
+/// index over a Map, so that the keys of the map can be listed in order, or
+/// from a starting point, without scanning the whole map.
+///
+/// The list only supports insertion, lookup, and ordered traversal, which is
+/// all that the auth table needs (users are never removed).  Without removal,
+/// insertion can be lock-free: a node is first linked into the bottom level
+/// with a CAS, which is the point at which it becomes part of the set, and then
+/// into each higher level with its own CAS.  Readers take no locks and never
+/// write to shared memory.  Because nodes are never unlinked while the list is
+/// in use, no reclamation scheme is needed.
+///
+/// Each node has a random height with P(height > h) = 4^-h, so a search from
+/// the top level visits O(log n) nodes, and an ordered traversal of k keys
+/// from a starting point costs O(log n + k).
+///
+/// @param K    The type of the keys in this list
+/// @param Less The ordering of keys.  The default is transparent, so lookups
+///             can use any type that can be compared to K (e.g.,
+///             std::string_view when K is std::string).
+template <typename K, typename Less = std::less<>> class SkipList {
+  /// The most levels a node can have
+  static const int MAX_LEVEL = 16;
+
+  /// node_t is a key and its array of forward links.  Nodes are allocated
+  /// with just enough room for their own height.
+  struct node_t {
+    /// The key
+    const K key;
+
+    /// The number of levels this node is linked into
+    const int height;
+
+    /// The forward links, one per level (the array really has `height` entries)
+    std::atomic<node_t *> next[1];
+
+    /// Construct a node whose links are all null
+    ///
+    /// @param k The key
+    /// @param h The height
+    node_t(K k, int h) : key(std::move(k)), height(h) {
+      for (int i = 0; i < h; ++i)
+        new (&next[i]) std::atomic<node_t *>(nullptr);
+    }
+  };
+
+  /// The links out of the head of the list, one per level
+  std::atomic<node_t *> head[MAX_LEVEL];
+
+  /// The ordering of keys
+  Less less;
+
+  /// Get the size of a node
+  ///
+  /// @param height The node's height
+  ///
+  /// @return The number of bytes to allocate for the node
+  static size_t node_size(int height) {
+    return sizeof(node_t) + (height - 1) * sizeof(std::atomic<node_t *>);
+  }
+
+  /// Allocate a node from the slab allocator
+  ///
+  /// @param key    The key
+  /// @param height The node's height
+  ///
+  /// @return The new node
+  static node_t *make_node(K key, int height) {
+    return new (slab_alloc(node_size(height))) node_t(std::move(key), height);
+  }
+
+  /// Free a node that was allocated by make_node
+  ///
+  /// @param n The node to free
+  static void free_node(node_t *n) {
+    int height = n->height;
+    n->~node_t();
+    slab_free(n, node_size(height));
+  }
+
+  /// Pick a height for a new node
+  ///
+  /// @return A height between 1 and MAX_LEVEL
+  static int random_height() {
+    // NB: A per-thread xorshift generator keeps this off of shared cache lines
+    static thread_local uint64_t seed =
+        0x9e3779b97f4a7c15ull ^ reinterpret_cast<uintptr_t>(&seed);
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    int h = 1 + __builtin_ctzll(seed | (uint64_t(1) << 62)) / 2;
+    return h < MAX_LEVEL ? h : MAX_LEVEL;
+  }
+
+  /// Find the position of a key at every level
+  ///
+  /// @param key   The key to find
+  /// @param preds Set to the link, at each level, that points to the first
+  ///              node not less than key
+  /// @param succs Set to the first node not less than key, at each level
+  ///
+  /// @return true if the key is in the list
+  template <typename Q>
+  bool find(const Q &key, std::atomic<node_t *> **preds, node_t **succs) {
+    std::atomic<node_t *> *links = head;
+    for (int l = MAX_LEVEL - 1; l >= 0; --l) {
+      node_t *curr = links[l].load(std::memory_order_acquire);
+      while (curr != nullptr && less(curr->key, key)) {
+        links = curr->next;
+        curr = links[l].load(std::memory_order_acquire);
+      }
+      preds[l] = &links[l];
+      succs[l] = curr;
+    }
+    return succs[0] != nullptr && !less(key, succs[0]->key);
+  }
+
+  /// Find the first node whose key is not less than a given key
+  ///
+  /// @param key The key to find
+  ///
+  /// @return The node, or nullptr if every key is less than key
+  template <typename Q> node_t *lower_bound(const Q &key) const {
+    const std::atomic<node_t *> *links = head;
+    node_t *curr = nullptr;
+    for (int l = MAX_LEVEL - 1; l >= 0; --l) {
+      curr = links[l].load(std::memory_order_acquire);
+      while (curr != nullptr && less(curr->key, key)) {
+        links = curr->next;
+        curr = links[l].load(std::memory_order_acquire);
+      }
+    }
+    return curr;
+  }
+
+public:
+  /// Construct an empty list
+  SkipList() {
+    for (auto &h : head)
+      h.store(nullptr, std::memory_order_relaxed);
+  }
+
+  /// Destruct the list, freeing every node
+  ~SkipList() { clear(); }
+
+  /// Remove every key.  This is not safe to call while other threads are using
+  /// the list.
+  void clear() {
+    for (node_t *n = head[0].load(std::memory_order_relaxed); n != nullptr;) {
+      node_t *next = n->next[0].load(std::memory_order_relaxed);
+      free_node(n);
+      n = next;
+    }
+    for (auto &h : head)
+      h.store(nullptr, std::memory_order_relaxed);
+  }
+
+  /// Insert a key, if it is not already present
+  ///
+  /// @param key The key to insert
+  ///
+  /// @return true if the key was inserted, false if it was already present
+  bool insert(K key) {
+    std::atomic<node_t *> *preds[MAX_LEVEL];
+    node_t *succs[MAX_LEVEL];
+    node_t *n = make_node(std::move(key), random_height());
+    while (true) {
+      if (find(n->key, preds, succs)) {
+        free_node(n);
+        return false;
+      }
+      n->next[0].store(succs[0], std::memory_order_relaxed);
+      if (preds[0]->compare_exchange_strong(succs[0], n,
+                                            std::memory_order_release,
+                                            std::memory_order_relaxed))
+        break;
+    }
+    // The key is in the set now.  The higher levels are only shortcuts, so it
+    // is fine for readers to see them linked one at a time.
+    for (int l = 1; l < n->height; ++l) {
+      while (true) {
+        n->next[l].store(succs[l], std::memory_order_relaxed);
+        if (preds[l]->compare_exchange_strong(succs[l], n,
+                                              std::memory_order_release,
+                                              std::memory_order_relaxed))
+          break;
+        find(n->key, preds, succs);
+      }
+    }
+    return true;
+  }
+
+  /// Check if a key is in the list
+  ///
+  /// @param key The key to find
+  ///
+  /// @return true if the key is present
+  template <typename Q> bool contains(const Q &key) const {
+    node_t *n = lower_bound(key);
+    return n != nullptr && !less(key, n->key);
+  }
+
+  /// Apply a function to each key that is not less than a given key, in
+  /// order, until the function returns false or the list ends.  Keys that are
+  /// inserted during the traversal may or may not be visited.
+  ///
+  /// @param from The first key to consider
+  /// @param f    The function to apply to each key.  It returns false to stop
+  ///             the traversal.
+  template <typename Q, typename F>
+  void visit_from(const Q &from, F &&f) const {
+    for (node_t *n = lower_bound(from); n != nullptr;
+         n = n->next[0].load(std::memory_order_acquire))
+      if (!f(static_cast<const K &>(n->key)))
+        return;
+  }
+};
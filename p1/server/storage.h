@@ -2,9 +2,12 @@
 
 #include <memory>
 #include <string>
+#include <string_view>
 #include <utility>
 #include <vector>
 
+#include "content.h"
+
 /// Storage is an interface that describes the main object that our server will
 /// use.  In general, it is not good to use polymorphism (virtual methods) in
 /// C++.  Furthermore, our program really doesn't need polymorphism.  The reason
@@ -33,7 +36,17 @@
 /// error message that can be sent to the client.  When the bool is *true*, it
 /// means that the operation succeeded.  In this case the string is mostlikely
 /// RES_OK, and the vector, if not empty, is additional data to send to the
-/// client.
+/// client.  User data can also be fetched with get_user_content(), which
+/// returns a reference to a buffer that Storage shares with its tables (see
+/// content.h), so that large data can be returned without copying it.
+///
+/// Each method that takes user names and passwords also has a *_view form that
+/// takes them as std::string_views, so that the server can hand Storage the
+/// bytes of a decrypted request without copying them into new strings.  The
+/// *_view methods, and the methods for requests that the original interface did
+/// not have, come after the original methods, so that code that was compiled
+/// against the original interface still finds each method at the same place in
+/// the vtable.
 class Storage {
 public:
   /// Result_t is the tuple that is sent to the caller after any operation
@@ -125,6 +138,135 @@ public:
   /// up any state related to .so files.  This is only called when all threads
   /// have stopped accessing the Storage object.
   virtual void shutdown() = 0;
+
+  // NB: The *_view methods below take std::string_views.  By default they copy
+  //     their arguments into strings and call the methods above, so an
+  //     implementation should override them, and have the methods above call
+  //     them instead.
+
+  /// Create a new entry in the Auth table, as add_user() does
+  ///
+  /// @param user The user name to register
+  /// @param pass The password to associate with that user name
+  ///
+  /// @return A result tuple, as described above
+  virtual result_t add_user_view(std::string_view user,
+                                 std::string_view pass) {
+    return add_user(std::string(user), std::string(pass));
+  }
+
+  /// Set the data bytes for a user, as set_user_data() does
+  ///
+  /// @param user    The name of the user whose content is being set
+  /// @param pass    The password for the user, used to authenticate
+  /// @param content The data to set for this user
+  ///
+  /// @return A result tuple, as described above
+  virtual result_t set_user_data_view(std::string_view user,
+                                      std::string_view pass,
+                                      const std::vector<uint8_t> &content) {
+    return set_user_data(std::string(user), std::string(pass), content);
+  }
+
+  /// Return a copy of the user data for a user, as get_user_data() does
+  ///
+  /// @param user The name of the user who made the request
+  /// @param pass The password for the user, used to authenticate
+  /// @param who  The name of the user whose content is being fetched
+  ///
+  /// @return A result tuple, as described above
+  virtual result_t get_user_data_view(std::string_view user,
+                                      std::string_view pass,
+                                      std::string_view who) {
+    return get_user_data(std::string(user), std::string(pass),
+                         std::string(who));
+  }
+
+  /// Return a newline-delimited string containing all of the usernames in the
+  /// auth table, as get_all_users() does
+  ///
+  /// @param user The name of the user who made the request
+  /// @param pass The password for the user, used to authenticate
+  ///
+  /// @return A result tuple, as described above
+  virtual result_t get_all_users_view(std::string_view user,
+                                      std::string_view pass) {
+    return get_all_users(std::string(user), std::string(pass));
+  }
+
+  /// Authenticate a user, as auth() does
+  ///
+  /// @param user The name of the user who made the request
+  /// @param pass The password for the user, used to authenticate
+  ///
+  /// @return A result tuple, as described above
+  virtual result_t auth_view(std::string_view user, std::string_view pass) {
+    return auth(std::string(user), std::string(pass));
+  }
+
+  // NB: The methods below are not part of the original interface, so they go
+  //     at the end of the vtable, too.
+
+  /// Return a newline-delimited, sorted string containing the usernames that
+  /// are not less than `from` and are less than `to`.  An empty `to` means that
+  /// there is no upper bound.
+  ///
+  /// @param user The name of the user who made the request
+  /// @param pass The password for the user, used to authenticate
+  /// @param from The smallest username to return
+  /// @param to   The first username past the end of the range, or empty
+  ///
+  /// @return A result tuple, as described above
+  virtual result_t get_user_range(std::string_view user, std::string_view pass,
+                                  std::string_view from,
+                                  std::string_view to) = 0;
+
+  /// Return a reference to the user data for a user, as get_user_data() does,
+  /// but without copying it.  The caller may read the data after Storage has
+  /// unlocked the user's entry, since the buffer never changes.
+  ///
+  /// @param user    The name of the user who made the request
+  /// @param pass    The password for the user, used to authenticate
+  /// @param who     The name of the user whose content is being fetched
+  /// @param content Set to the user's data, if the result is a success
+  ///
+  /// @return A result tuple, as described above, with no data
+  virtual result_t get_user_content(std::string_view user,
+                                    std::string_view pass, std::string_view who,
+                                    bytes_ptr &content) {
+    auto res = get_user_data_view(user, pass, who);
+    auto bytes = std::make_shared<std::vector<uint8_t>>();
+    bytes->swap(res.data);
+    if (res.succeeded)
+      content = std::move(bytes);
+    return res;
+  }
+
+  /// Start saving the Storage object, as save_file() does, on a background
+  /// thread, from a point-in-time snapshot, but only if the user authenticates.
+  /// This returns as soon as the save has been scheduled.
+  ///
+  /// @param user The name of the user who made the request
+  /// @param pass The password for the user, used to authenticate
+  ///
+  /// @return A result tuple, as described above.  On success, the data is the
+  ///         8-byte number of the checkpoint, which is durable once
+  ///         checkpoint_status() reports it as such.
+  virtual result_t checkpoint(std::string_view user,
+                              std::string_view pass) = 0;
+
+  /// Report the progress of the background checkpoints, but only if the user
+  /// authenticates
+  ///
+  /// @param user The name of the user who made the request
+  /// @param pass The password for the user, used to authenticate
+  ///
+  /// @return A result tuple, as described above.  On success, the data is four
+  ///         8-byte numbers: the last checkpoint requested, the last one that
+  ///         is durable, the number of saves that failed, and 1 if a save is
+  ///         running (or 0 if not).
+  virtual result_t checkpoint_status(std::string_view user,
+                                     std::string_view pass) = 0;
 };
 
 /// Create an empty Storage object and specify the file from which it should be
@@ -142,3 +284,65 @@ public:
 Storage *storage_factory(const std::string &fname, size_t buckets, size_t upq,
                          size_t dnq, size_t rqq, double qd, size_t top,
                          const std::string &admin);
+
+/// Create an empty Storage object, as above.  If shards > 0, the object runs in
+/// shard-per-core mode: users are partitioned by hash into that many tables,
+/// each owned by one thread, and each request is forwarded to the thread that
+/// owns the user's table.  If zmin > 0, profile files of at least zmin bytes
+/// are compressed in memory and on disk, when that saves enough space.  If
+/// budget or window is set, profile files are kept in memory only while they
+/// fit in the budget and have been read within the window; the rest are
+/// spilled to fname + ".tier" and read back in when they are needed.  If wal
+/// is not -2, every REG and SET is logged to fname + ".log.N", so that it is
+/// not lost if the server stops before the next SAV (see wal.h).  If seg is
+/// set, a SAV writes a manifest plus segment files instead of a single file
+/// (see format.h).  If lazy is set, load_file() only reads the users from the
+/// segments of such a save, and each profile file is read from them when it is
+/// first needed.
+///
+/// @param fname   The name of the file to use for persistence
+/// @param buckets The number of buckets in the hash table (across all shards)
+/// @param upq     The upload quota
+/// @param dnq     The download quota
+/// @param rqq     The request quota
+/// @param qd      The quota duration
+/// @param top     The size of the "top keys" cache
+/// @param admin   The administrator's username
+/// @param shards  The number of shards, or 0 to share one table between all
+///                threads
+/// @param workers The number of threads that will call into the storage
+/// @param zmin    The smallest profile file to store compressed, or 0 to never
+///                compress
+/// @param budget  The most bytes of profile files to keep in memory, or 0 for
+///                no limit
+/// @param window  The seconds after which an unread profile file is spilled to
+///                disk, or 0 for no limit
+/// @param wal     The fsync policy of the log: 0 to fsync before a change is
+///                acknowledged, N > 0 to fsync every N ms, -1 to never fsync,
+///                or -2 to keep no log
+/// @param lazy    true to read profile files when they are first needed,
+///                instead of when the file is loaded
+/// @param seg     true to save as a manifest plus segment files, instead of as
+///                a single file
+Storage *storage_factory(const std::string &fname, size_t buckets, size_t upq,
+                         size_t dnq, size_t rqq, double qd, size_t top,
+                         const std::string &admin, size_t shards,
+                         size_t workers, size_t zmin = 0, size_t budget = 0,
+                         size_t window = 0, int wal = -2, bool lazy = false,
+                         bool seg = false);
+
+/// storage_extended is defined by a Storage implementation whose vtable has
+/// the methods that the original interface did not (the *_view methods and
+/// everything after them).  One that was compiled against the original
+/// storage.h (e.g., a prebuilt my_storage.o) does not define it, and calling
+/// one of those methods on it would read past the end of its vtable.
+///
+/// NB: This is a weak symbol, so that the server links either way
+extern const bool storage_extended __attribute__((weak));
+
+/// Check if the Storage implementation that is linked in has the methods that
+/// the original interface did not.  Callers must check this before they call
+/// any of them.
+///
+/// @return true if those methods may be called, false otherwise
+inline bool has_storage_extensions() { return &storage_extended != nullptr; }
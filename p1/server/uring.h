@@ -0,0 +1,213 @@
+#pragma once
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/// uring_t is a minimal io_uring instance, which lets one thread keep many
+/// reads and writes in flight without a thread per operation.  It talks to the
+/// kernel with raw system calls, so the build does not depend on liburing.
+///
+/// io_uring may be missing (before Linux 5.1), or disabled by a sandbox or by
+/// the kernel.io_uring_disabled sysctl, so ok() must be checked, and
+/// callers fall back to ordinary system calls when it is false.  An operation
+/// that this kernel does not support completes with -EINVAL.
+///
+/// A uring_t is used by one thread at a time.
+class uring_t {
+  int fd = -1;                  // The instance, or -1
+  void *sq_map = MAP_FAILED;    // The submission ring
+  void *cq_map = MAP_FAILED;    // The completion ring, which may be sq_map
+  size_t sq_len = 0;            // The size of sq_map
+  size_t cq_len = 0;            // The size of cq_map
+  io_uring_sqe *sqes = nullptr; // The submission queue entries
+  size_t sqes_len = 0;          // The size of sqes
+
+  /// The fields of the rings that are shared with the kernel
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  io_uring_cqe *cqes;
+
+  unsigned entries = 0;  // The size of the submission queue
+  unsigned queued = 0;   // Entries prepared, but not submitted yet
+  unsigned inflight = 0; // Entries submitted, whose completions are not reaped
+
+  /// Unmap the rings and close the instance
+  void release() {
+    if (sqes)
+      munmap(sqes, sqes_len);
+    if (cq_map != MAP_FAILED && cq_map != sq_map)
+      munmap(cq_map, cq_len);
+    if (sq_map != MAP_FAILED)
+      munmap(sq_map, sq_len);
+    if (fd >= 0)
+      close(fd);
+    fd = -1;
+  }
+
+  /// Map one of the instance's regions
+  void *map(size_t len, off_t what) {
+    return mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                fd, what);
+  }
+
+  /// Get a field of a ring
+  template <typename T> static T *at(void *ring, unsigned off) {
+    return reinterpret_cast<T *>(static_cast<char *>(ring) + off);
+  }
+
+  /// Call io_uring_enter, retrying if interrupted
+  ///
+  /// @return false on an error, true otherwise
+  bool enter(unsigned submit, unsigned wait, unsigned flags) {
+    while (true) {
+      long r =
+          syscall(__NR_io_uring_enter, fd, submit, wait, flags, nullptr, 0);
+      if (r >= 0 || errno != EINTR)
+        return r >= 0;
+    }
+  }
+
+public:
+  /// Create an instance
+  ///
+  /// @param depth The most operations that may be in flight at once
+  explicit uring_t(unsigned depth) {
+    io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    fd = syscall(__NR_io_uring_setup, depth, &p);
+    if (fd < 0)
+      return;
+    sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_len = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single)
+      sq_len = cq_len = sq_len > cq_len ? sq_len : cq_len;
+    sq_map = map(sq_len, IORING_OFF_SQ_RING);
+    if (sq_map == MAP_FAILED) {
+      release();
+      return;
+    }
+    cq_map = single ? sq_map : map(cq_len, IORING_OFF_CQ_RING);
+    sqes_len = p.sq_entries * sizeof(io_uring_sqe);
+    void *s = map(sqes_len, IORING_OFF_SQES);
+    if (cq_map == MAP_FAILED || s == MAP_FAILED) {
+      if (s != MAP_FAILED)
+        munmap(s, sqes_len);
+      release();
+      return;
+    }
+    sqes = static_cast<io_uring_sqe *>(s);
+    sq_head = at<unsigned>(sq_map, p.sq_off.head);
+    sq_tail = at<unsigned>(sq_map, p.sq_off.tail);
+    sq_mask = at<unsigned>(sq_map, p.sq_off.ring_mask);
+    sq_array = at<unsigned>(sq_map, p.sq_off.array);
+    cq_head = at<unsigned>(cq_map, p.cq_off.head);
+    cq_tail = at<unsigned>(cq_map, p.cq_off.tail);
+    cq_mask = at<unsigned>(cq_map, p.cq_off.ring_mask);
+    cqes = at<io_uring_cqe>(cq_map, p.cq_off.cqes);
+    entries = p.sq_entries;
+  }
+
+  uring_t(const uring_t &) = delete;
+
+  /// Wait for the operations in flight, and close the instance
+  ~uring_t() {
+    io_uring_cqe c;
+    submit();
+    while (inflight > 0 && wait(c)) {
+    }
+    release();
+  }
+
+  /// Report if the instance can be used
+  bool ok() const { return fd >= 0; }
+
+  /// Report the number of operations that are prepared or in flight
+  unsigned busy() const { return queued + inflight; }
+
+  /// Report the most operations that may be prepared or in flight at once
+  unsigned depth() const { return entries; }
+
+  /// Register buffers, so that the kernel does not map them for every
+  /// IORING_OP_READ_FIXED or IORING_OP_WRITE_FIXED.  Registered memory is
+  /// pinned, and counts against RLIMIT_MEMLOCK, so this may fail, in which
+  /// case the unregistered operations must be used instead.
+  ///
+  /// @param bufs The buffers
+  /// @param n    The number of buffers
+  ///
+  /// @return false on an error, true otherwise
+  bool register_buffers(const iovec *bufs, unsigned n) {
+    return ok() && syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS,
+                           bufs, n) == 0;
+  }
+
+  /// Prepare an operation.  It is not started until submit() is called.
+  ///
+  /// @param op   The IORING_OP_ code of the operation
+  /// @param file The file descriptor
+  /// @param addr The buffer (or, for IORING_OP_RENAMEAT, the old path)
+  /// @param len  The size of the buffer (or the new directory descriptor)
+  /// @param off  The offset in the file (or the new path)
+  /// @param data A value that the completion reports
+  ///
+  /// @return The entry, so that its flags may be set, or nullptr if depth()
+  ///         operations are already prepared or in flight
+  io_uring_sqe *prepare(uint8_t op, int file, const void *addr, unsigned len,
+                        uint64_t off, uint64_t data) {
+    if (!ok() || busy() >= entries)
+      return nullptr;
+    unsigned tail = *sq_tail + queued;
+    unsigned i = tail & *sq_mask;
+    io_uring_sqe *e = &sqes[i];
+    memset(e, 0, sizeof(*e));
+    e->opcode = op;
+    e->fd = file;
+    e->addr = reinterpret_cast<uint64_t>(addr);
+    e->len = len;
+    e->off = off;
+    e->user_data = data;
+    sq_array[i] = i;
+    ++queued;
+    return e;
+  }
+
+  /// Start the prepared operations
+  ///
+  /// @return false on an error, true otherwise
+  bool submit() {
+    if (queued == 0)
+      return true;
+    // NB: The kernel must see the entries before it sees the new tail
+    __atomic_store_n(sq_tail, *sq_tail + queued, __ATOMIC_RELEASE);
+    unsigned n = queued;
+    queued = 0;
+    inflight += n;
+    return enter(n, 0, 0);
+  }
+
+  /// Wait for an operation to complete
+  ///
+  /// @param out The completion, whose res is the operation's result, or
+  ///            -errno
+  ///
+  /// @return false if nothing is in flight, or on an error, true otherwise
+  bool wait(io_uring_cqe &out) {
+    if (!ok() || inflight == 0)
+      return false;
+    unsigned head = *cq_head;
+    while (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+      if (!enter(0, 1, IORING_ENTER_GETEVENTS))
+        return false;
+    out = cqes[head & *cq_mask];
+    __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+    --inflight;
+    return true;
+  }
+};
@@ -0,0 +1,400 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+/// wal_t is a write-ahead log of the changes to a Storage object, so that a
+/// change survives a crash without rewriting the whole data file.  The log is a
+/// series of files, <base>.log.<gen>.  A SAV starts a new generation, and once
+/// the data file has been replaced, the older generations can be removed.  On
+/// load, the data file is read first, and then every log generation is
+/// replayed, in order, on top of it.
+///
+/// Records are appended by many threads at once, through a lock-free buffer: a
+/// thread reserves space in the active chunk with one fetch_add, copies its
+/// record in, and is done.  One flusher thread swaps the active chunk for a
+/// spare, waits for the threads that are still copying into the old one, and
+/// writes the whole chunk with one write().  Records that arrive while a chunk
+/// is being written go into the spare, so under load, many records share each
+/// write() and fsync() (group commit).
+///
+/// The fsync policy is set by sync_ms:
+/// - 0: a change is not acknowledged until the chunk that holds it has been
+///   written and fsync()ed (see sync())
+/// - N > 0: the log is written promptly, and fsync()ed at most every N ms
+/// - -1: the log is written promptly, but only fsync()ed when a generation
+///   ends, so a change is durable if the server crashes, but not if the
+///   machine does
+///
+/// A record must be appended while the entry it changes is still locked, so
+/// that the log has the changes to each user in the order in which they were
+/// made.  The returned ticket must be held until the change is visible in the
+/// table: the flusher does not write a chunk while any of its tickets is held,
+/// which is what lets rotate() promise that every change in the old
+/// generations has been made, and thus is in any later snapshot.
+class wal_t {
+  /// The size of a chunk.  A record must fit in one chunk.
+  static constexpr size_t CHUNK_SIZE = 4 << 20;
+
+  /// How often (in ms) the log is written if no fsync period is set
+  static constexpr int FLUSH_MS = 10;
+
+  /// chunk_t is one buffer of records
+  struct chunk_t {
+    /// The number of threads that are using the chunk
+    std::atomic<size_t> writers{0};
+
+    /// The number of bytes reserved.  It may run past the end of the chunk.
+    std::atomic<size_t> reserved{0};
+
+    /// The offset of the first record that did not fit, if one did not
+    std::atomic<size_t> end{CHUNK_SIZE};
+
+    /// The chunk's sequence number, and the generation to which it belongs.
+    /// They are set before the chunk becomes active.
+    uint64_t seq = 0;
+    uint64_t gen = 0;
+
+    /// The records
+    std::vector<uint8_t> data = std::vector<uint8_t>(CHUNK_SIZE);
+  };
+
+  /// The two chunks, and the one to which records are appended.  Chunks are
+  /// never freed, so a thread that reads a stale active pointer can still use
+  /// it to find out that it is stale.
+  chunk_t chunks[2];
+  std::atomic<chunk_t *> active{&chunks[0]};
+
+  /// The name of the data file, the fsync policy, and the open log file
+  const std::string base;
+  const int sync_ms;
+  int fd = -1;
+
+  /// The oldest generation that has not been removed
+  uint64_t oldest;
+
+  /// The flusher thread
+  std::thread flusher;
+
+  /// The state shared with the flusher, which is protected by lock.  gen is
+  /// the generation of the open file, and done is the sequence number of the
+  /// last chunk that was written (and, if sync_ms == 0, fsync()ed).
+  std::mutex lock;
+  std::condition_variable wake;
+  std::condition_variable flushed;
+  uint64_t gen;
+  uint64_t done = 0;
+  bool rotating = false;
+  bool stopping = false;
+  bool failed = false;
+
+  /// true while the flusher is waiting for work, and true if a thread needs
+  /// the active chunk to be swapped because its record did not fit
+  std::atomic<bool> sleeping{false};
+  std::atomic<bool> full{false};
+
+  /// Wake the flusher, if it is waiting
+  void kick() {
+    if (sleeping.load()) {
+      std::lock_guard<std::mutex> g(lock);
+      wake.notify_one();
+    }
+  }
+
+  /// Write a buffer to the log file, even if write() is interrupted
+  ///
+  /// @param data The bytes to write
+  /// @param len  The number of bytes
+  ///
+  /// @return false on an error, true otherwise
+  bool write_all(const uint8_t *data, size_t len) {
+    while (len > 0) {
+      ssize_t n = write(fd, data, len);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        return false;
+      data += n;
+      len -= n;
+    }
+    return true;
+  }
+
+  /// The main loop of the flusher thread
+  void run() {
+    using clock = std::chrono::steady_clock;
+    auto period = std::chrono::milliseconds(sync_ms > 0 ? sync_ms : FLUSH_MS);
+    auto last_sync = clock::now();
+    bool unsynced = false;
+    std::unique_lock<std::mutex> g(lock);
+    while (true) {
+      // NB: With sync_ms == 0, a change is not acknowledged until it is
+      //     written, so the flusher starts as soon as there is a record.
+      //     Otherwise it writes the records that have built up every period.
+      auto ready = [&]() {
+        return stopping || rotating || full ||
+               (sync_ms == 0 && active.load()->reserved.load() > 0);
+      };
+      if (!ready()) {
+        sleeping = true;
+        wake.wait_for(g, period, ready);
+        sleeping = false;
+      }
+      bool rotate = rotating, stop = stopping;
+      chunk_t *c = active.load();
+      bool due = sync_ms > 0 && clock::now() - last_sync >= period;
+      if (c->reserved.load() == 0 && !rotate && !(unsynced && (due || stop))) {
+        if (stop)
+          return;
+        continue;
+      }
+      // Swap in the spare chunk, so that appends can continue while this one
+      // is written
+      chunk_t *next = c == &chunks[0] ? &chunks[1] : &chunks[0];
+      next->reserved = 0;
+      next->end = CHUNK_SIZE;
+      next->seq = c->seq + 1;
+      next->gen = c->gen + (rotate ? 1 : 0);
+      active = next;
+      full = false;
+      rotating = false;
+      g.unlock();
+      while (c->writers.load() > 0)
+        std::this_thread::yield();
+      size_t len = std::min({c->reserved.load(), c->end.load(), CHUNK_SIZE});
+      bool ok = write_all(c->data.data(), len);
+      unsynced = unsynced || len > 0;
+      if (unsynced && (sync_ms == 0 || due || rotate || stop)) {
+        ok = fdatasync(fd) == 0 && ok;
+        unsynced = false;
+        last_sync = clock::now();
+      }
+      if (rotate) {
+        close(fd);
+        fd = open(name(base, next->gen).c_str(), O_WRONLY | O_CREAT | O_TRUNC,
+                  0600);
+        ok = fd >= 0 && ok;
+      }
+      g.lock();
+      if (!ok && !failed) {
+        std::cout << "Could not write log for " << base << ": "
+                  << strerror(errno) << "\n";
+        failed = true;
+      }
+      done = c->seq;
+      gen = next->gen;
+      flushed.notify_all();
+    }
+  }
+
+public:
+  /// ticket_t is a reservation of space in the log.  While it is held, the
+  /// chunk that holds its record will not be written.
+  class ticket_t {
+    friend class wal_t;
+    chunk_t *chunk = nullptr;
+    uint64_t seq = 0;
+
+  public:
+    ticket_t() = default;
+    ticket_t(const ticket_t &) = delete;
+    ticket_t(ticket_t &&o) : chunk(o.chunk), seq(o.seq) { o.chunk = nullptr; }
+    ticket_t &operator=(const ticket_t &) = delete;
+    ticket_t &operator=(ticket_t &&o) {
+      release();
+      chunk = o.chunk;
+      seq = o.seq;
+      o.chunk = nullptr;
+      return *this;
+    }
+    ~ticket_t() { release(); }
+
+    /// Let the chunk that holds the record be written
+    void release() {
+      if (chunk)
+        chunk->writers.fetch_sub(1);
+      chunk = nullptr;
+    }
+  };
+
+  /// Get the name of a generation of the log
+  ///
+  /// @param base The name of the data file
+  /// @param gen  The generation
+  ///
+  /// @return The name of the log file
+  static std::string name(const std::string &base, uint64_t gen) {
+    return base + ".log." + std::to_string(gen);
+  }
+
+  /// Find the generations of the log that exist for a data file
+  ///
+  /// @param base The name of the data file
+  ///
+  /// @return The generations, in order
+  static std::vector<uint64_t> generations(const std::string &base) {
+    size_t slash = base.rfind('/');
+    std::string dir = slash == std::string::npos ? "." : base.substr(0, slash);
+    std::string prefix =
+        (slash == std::string::npos ? base : base.substr(slash + 1)) + ".log.";
+    std::vector<uint64_t> gens;
+    DIR *d = opendir(dir.empty() ? "/" : dir.c_str());
+    if (!d)
+      return gens;
+    while (dirent *ent = readdir(d)) {
+      std::string n = ent->d_name;
+      size_t p = prefix.size();
+      if (n.size() > p && n.compare(0, p, prefix) == 0 &&
+          n.find_first_not_of("0123456789", p) == std::string::npos)
+        gens.push_back(std::stoull(n.substr(p)));
+    }
+    closedir(d);
+    std::sort(gens.begin(), gens.end());
+    return gens;
+  }
+
+  /// Flush a file that has been written (e.g., a new data file) to disk
+  ///
+  /// @param file The name of the file
+  ///
+  /// @return false on an error, true otherwise
+  static bool sync_file(const std::string &file) {
+    int f = open(file.c_str(), O_RDONLY);
+    if (f < 0)
+      return false;
+    bool ok = fsync(f) == 0;
+    close(f);
+    return ok;
+  }
+
+  /// Start a log.  The caller must have replayed the older generations first.
+  ///
+  /// @param base    The name of the data file
+  /// @param gen     The generation to start.  Its file is truncated.
+  /// @param oldest  The oldest generation that exists, which is removed by the
+  ///                first remove_through() that covers it
+  /// @param sync_ms The fsync policy, as described above
+  wal_t(const std::string &base, uint64_t gen, uint64_t oldest, int sync_ms)
+      : base(base), sync_ms(sync_ms), oldest(oldest), gen(gen) {
+    // NB: done starts at 0, which means that no chunk has been written yet, so
+    //     the first chunk must be numbered after it, or sync() would not wait
+    //     for it
+    chunks[0].seq = 1;
+    chunks[0].gen = gen;
+    fd = open(name(base, gen).c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd >= 0)
+      flusher = std::thread([this]() { run(); });
+  }
+
+  /// Write and close the log
+  ~wal_t() { close_log(); }
+
+  /// Check if the log file could be opened
+  bool ok() const { return fd >= 0; }
+
+  /// Get the size of the largest record that can be appended
+  static size_t max_record() { return CHUNK_SIZE; }
+
+  /// Append a record to the log.  This does not block, unless the active chunk
+  /// is full.
+  ///
+  /// @param rec The record, which must be at most max_record() bytes
+  ///
+  /// @return A ticket for the record
+  ticket_t append(const std::vector<uint8_t> &rec) {
+    ticket_t t;
+    while (true) {
+      chunk_t *c = active.load();
+      c->writers.fetch_add(1);
+      // NB: If the chunk was swapped out before we registered as a writer, the
+      //     flusher may not have waited for us, so we must not touch it
+      if (active.load() != c) {
+        c->writers.fetch_sub(1);
+        continue;
+      }
+      size_t off = c->reserved.fetch_add(rec.size());
+      if (off + rec.size() <= CHUNK_SIZE) {
+        memcpy(c->data.data() + off, rec.data(), rec.size());
+        t.chunk = c;
+        t.seq = c->seq;
+        if (sync_ms == 0)
+          kick();
+        return t;
+      }
+      // The chunk is full.  Only the first record that did not fit can start
+      // inside it, and it marks where the chunk ends.
+      if (off < CHUNK_SIZE)
+        c->end = off;
+      c->writers.fetch_sub(1);
+      full = true;
+      kick();
+      while (active.load() == c)
+        std::this_thread::yield();
+    }
+  }
+
+  /// Wait until a record is durable, according to the fsync policy.  With
+  /// sync_ms == 0, this waits for the record's chunk to be written and
+  /// fsync()ed; otherwise it returns immediately.  The ticket must have been
+  /// released.
+  ///
+  /// @param t The ticket for the record
+  ///
+  /// @return false if the log could not be written, true otherwise
+  bool sync(const ticket_t &t) {
+    std::unique_lock<std::mutex> g(lock);
+    if (sync_ms == 0)
+      flushed.wait(g, [&]() { return done >= t.seq || failed; });
+    return !failed;
+  }
+
+  /// Start a new generation of the log, and wait until every record in the old
+  /// one has been written and its change has been made
+  ///
+  /// @return The generation that ended
+  uint64_t rotate() {
+    std::unique_lock<std::mutex> g(lock);
+    uint64_t old = gen;
+    rotating = true;
+    wake.notify_one();
+    flushed.wait(g, [&]() { return gen > old || !flusher.joinable(); });
+    return old;
+  }
+
+  /// Remove the generations of the log up to and including gen, which must
+  /// have ended (e.g., because a snapshot that covers them was saved)
+  ///
+  /// @param gen The newest generation to remove
+  void remove_through(uint64_t gen) {
+    std::lock_guard<std::mutex> g(lock);
+    for (; oldest <= gen; ++oldest)
+      unlink(name(base, oldest).c_str());
+  }
+
+  /// Write any records that remain, and close the log.  No records may be
+  /// appended while this runs, or after.
+  void close_log() {
+    if (!flusher.joinable())
+      return;
+    {
+      std::lock_guard<std::mutex> g(lock);
+      stopping = true;
+    }
+    wake.notify_one();
+    flusher.join();
+    close(fd);
+  }
+};
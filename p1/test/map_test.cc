@@ -0,0 +1,250 @@
+// Check that ConcurrentHashMap stays correct while it resizes under concurrent
+// use.  The map starts with a single bucket, so that the writers below force
+// it to split many times while they insert (one key at a time, and in
+// batches), and while other threads read keys that are already in it without
+// taking any locks.  Removing every key then forces it to merge again.  The
+// snapshots of the map are also checked: a scan of a snapshot, even one that
+// is split between threads, must see every key as of one point in time, while
+// a writer keeps changing them.
+
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../server/concurrenthashmap.h"
+
+using namespace std;
+
+/// The map that the checks use
+typedef ConcurrentHashMap<string, uint64_t> map_t;
+
+/// The number of checks that failed
+static int failures = 0;
+
+/// Report the outcome of one check
+///
+/// @param what A description of the check
+/// @param ok   true if the check passed
+static void check(const string &what, bool ok) {
+  cout << (ok ? "PASS " : "FAIL ") << what << endl;
+  failures += ok ? 0 : 1;
+}
+
+/// Make the name of the i-th key of a writer thread
+///
+/// @param t The writer
+/// @param i The index of the key
+///
+/// @return The key
+static string key_of(size_t t, uint64_t i) {
+  return to_string(t) + "." + to_string(i);
+}
+
+/// Count the live keys in a map, and the ones whose value is not the index
+/// in their name
+///
+/// @param m   The map
+/// @param bad Set to the number of keys with the wrong value
+///
+/// @return The number of keys
+static size_t count_keys(map_t &m, size_t &bad) {
+  size_t n = 0;
+  bad = 0;
+  m.do_all_readonly(
+      [&](const string &k, const uint64_t &v) {
+        ++n;
+        bad += k.substr(k.find('.') + 1) == to_string(v) ? 0 : 1;
+      },
+      []() {});
+  return n;
+}
+
+/// Check that concurrent inserts and removes resize the map without losing a
+/// key, and that lock-free reads find every key while the map resizes
+static void check_resize() {
+  const size_t WRITERS = 8, READERS = 2, KEYS = 20000, BATCH = 256;
+  map_t m(1);
+  // Each writer publishes how many of its keys are in the map, so that the
+  // readers know which keys they must find
+  vector<atomic<uint64_t>> published(WRITERS);
+  // The number of published keys that a lookup missed, that a lookup found
+  // with the wrong value, and that an insert found already in the map
+  atomic<size_t> misses(0), wrong(0), refused(0);
+  atomic<bool> done(false);
+
+  // Writers with an even index insert one key at a time, and the others insert
+  // in batches, which grow the table up front.  Every writer reads back its own
+  // older keys as it goes.
+  auto write = [&](size_t t) {
+    vector<pair<string, uint64_t>> batch;
+    for (uint64_t i = 0; i < KEYS; ++i) {
+      if (t % 2 == 0) {
+        if (!m.insert(key_of(t, i), i, []() {}))
+          ++refused;
+        published[t].store(i + 1, memory_order_release);
+      } else {
+        batch.emplace_back(key_of(t, i), i);
+        if (batch.size() == BATCH || i + 1 == KEYS) {
+          if (m.insert_batch(move(batch), [](const string &) {}) != BATCH &&
+              i + 1 != KEYS)
+            ++refused;
+          batch.clear();
+          published[t].store(i + 1, memory_order_release);
+        }
+      }
+      uint64_t n = published[t].load();
+      uint64_t j = n == 0 ? 0 : (i * 7919) % n;
+      if (n > 0 && !m.do_with_readonly(key_of(t, j), [&](const uint64_t &v) {
+            wrong += v != j;
+          }))
+        ++misses;
+    }
+  };
+  // The readers look up random published keys of every writer.  While keys are
+  // being removed, a reader may miss one, so then only the values count.
+  auto read = [&](size_t r, bool must_find) {
+    for (uint64_t x = r; !done.load(); x = x * 6364136223846793005 + 1) {
+      size_t t = (x >> 33) % WRITERS;
+      uint64_t n = published[t].load(memory_order_acquire);
+      if (n == 0)
+        continue;
+      uint64_t j = (x >> 17) % n;
+      bool found = m.do_with_readonly_view(
+          key_of(t, j), [&](const uint64_t &v) { wrong += v != j; });
+      misses += found || !must_find ? 0 : 1;
+    }
+  };
+  // Run some writers and some readers, until the writers are done
+  auto run = [&](auto &&writer, bool must_find) {
+    done = false;
+    vector<thread> readers, writers;
+    for (size_t r = 0; r < READERS; ++r)
+      readers.emplace_back(read, r + 1, must_find);
+    for (size_t t = 0; t < WRITERS; ++t)
+      writers.emplace_back(writer, t);
+    for (auto &w : writers)
+      w.join();
+    done = true;
+    for (auto &r : readers)
+      r.join();
+  };
+
+  run(write, true);
+  size_t grown = m.snapshot().buckets(), bad;
+  check("concurrent inserts insert every key once",
+        refused == 0 && count_keys(m, bad) == WRITERS * KEYS && bad == 0);
+  check("reads during the inserts find every published key",
+        misses == 0 && wrong == 0);
+  check("the map grows from one bucket as it fills", grown >= KEYS);
+
+  // Remove every key, while the readers keep going
+  atomic<size_t> kept(0);
+  run(
+      [&](size_t t) {
+        for (uint64_t i = 0; i < KEYS; ++i)
+          kept += m.remove(key_of(t, i), []() {}) ? 0 : 1;
+      },
+      false);
+  check("concurrent removes remove every key",
+        kept == 0 && wrong == 0 && count_keys(m, bad) == 0);
+  check("the map shrinks as it empties", m.snapshot().buckets() < grown);
+}
+
+/// Check that a snapshot sees the map as of one point in time, while a writer
+/// keeps changing it.  The writer runs in rounds.  Round x inserts key 1.x and
+/// then sets every key 0.i to x, in order of i.  So at any point in time, the
+/// keys 1.1 to 1.m are in the map for some m, and the values of the keys 0.i
+/// are m for a prefix of them and m - 1 for the rest.  Some snapshots are
+/// scanned with do_all_snapshot(), and some are split into ranges that several
+/// threads scan at once.
+static void check_snapshots() {
+  const size_t KEYS = 3000, SNAPSHOTS = 200, SCANNERS = 4;
+  map_t m(4);
+  for (uint64_t i = 0; i < KEYS; ++i)
+    m.insert(key_of(0, i), 0, []() {});
+  atomic<bool> done(false);
+  thread writer([&]() {
+    for (uint64_t x = 1; !done.load(); ++x) {
+      m.insert(key_of(1, x), x, []() {});
+      for (uint64_t i = 0; i < KEYS; ++i)
+        if (i % 2 == 0)
+          m.do_with(key_of(0, i), [&](uint64_t &v) { v = x; });
+        else
+          m.upsert(key_of(0, i), x, []() {}, []() {});
+    }
+  });
+
+  // Check what one snapshot saw: the values of the keys 0.i, and which keys
+  // 1.x were in it
+  auto consistent = [&](const vector<uint64_t> &vals,
+                        const vector<uint64_t> &rounds) {
+    if (find(vals.begin(), vals.end(), UINT64_MAX) != vals.end())
+      return false;
+    for (size_t i = 1; i < rounds.size(); ++i)
+      if (rounds[i] != rounds[i - 1] + 1)
+        return false;
+    if (!rounds.empty() && rounds[0] != 1)
+      return false;
+    uint64_t r = rounds.empty() ? 0 : rounds.back();
+    for (size_t i = 0; i < KEYS; ++i) {
+      if (vals[i] != r && (r == 0 || vals[i] != r - 1))
+        return false;
+      if (i > 0 && vals[i] > vals[i - 1])
+        return false;
+    }
+    return true;
+  };
+  // Record one key/value pair that a scan found
+  auto found = [](const string &k, uint64_t v, vector<uint64_t> &vals,
+                  vector<uint64_t> &rounds) {
+    if (k[0] == '0')
+      vals[stoull(k.substr(2))] = v;
+    else
+      rounds.push_back(v);
+  };
+  size_t whole = 0, split = 0;
+  for (size_t s = 0; s < SNAPSHOTS; ++s) {
+    vector<uint64_t> vals(KEYS, UINT64_MAX), rounds;
+    if (s % 2 == 0) {
+      m.do_all_snapshot([&](const string &k, const uint64_t &v) {
+        found(k, v, vals, rounds);
+      });
+      sort(rounds.begin(), rounds.end());
+      whole += consistent(vals, rounds) ? 0 : 1;
+      continue;
+    }
+    auto snap = m.take_snapshot();
+    size_t range = (snap->parts() + SCANNERS - 1) / SCANNERS;
+    vector<vector<uint64_t>> parts(SCANNERS);
+    vector<thread> scanners;
+    for (size_t t = 0; t < SCANNERS; ++t)
+      scanners.emplace_back([&, t]() {
+        snap->scan(t * range, (t + 1) * range,
+                   [&](string_view k, const uint64_t &v) {
+                     // NB: Each scanner only writes the values of its own
+                     //     keys, so they do not race
+                     found(string(k), v, vals, parts[t]);
+                   });
+      });
+    for (auto &t : scanners)
+      t.join();
+    for (auto &p : parts)
+      rounds.insert(rounds.end(), p.begin(), p.end());
+    sort(rounds.begin(), rounds.end());
+    split += consistent(vals, rounds) ? 0 : 1;
+  }
+  done = true;
+  writer.join();
+  check("do_all_snapshot sees the map at one point in time", whole == 0);
+  check("a snapshot scanned by several threads sees one point in time",
+        split == 0);
+}
+
+int main() {
+  check_resize();
+  check_snapshots();
+  return failures == 0 ? 0 : 1;
+}
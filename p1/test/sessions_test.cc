@@ -0,0 +1,319 @@
+// Check that sessions work from end to end: a client opens a session with an
+// RSA-encrypted SESSION_ request, and then fetches a profile file with a GET
+// that starts with an @sblock instead of an @rblock.  The server side is the
+// real parse_request(), talking over a socketpair, so the test covers the
+// dispatch, the session cache, and the handlers together.  It also checks the
+// other requests that a session may carry (REGISTER, SETPFILE, ALLUSERS and
+// EXIT____).
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <openssl/rand.h>
+#include <sstream>
+#include <string>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+#include "../common/contextmanager.h"
+#include "../common/crypto.h"
+#include "../common/file.h"
+#include "../common/net.h"
+#include "../common/protocol.h"
+#include "../server/parsing.h"
+#include "../server/sessions.h"
+#include "../server/storage.h"
+
+using namespace std;
+
+/// The number of checks that failed
+static int failures = 0;
+
+/// Report the outcome of one check
+///
+/// @param what A description of the check
+/// @param ok   true if the check passed
+static void check(const string &what, bool ok) {
+  cout << (ok ? "PASS " : "FAIL ") << what << endl;
+  failures += ok ? 0 : 1;
+}
+
+/// Append a length-prefixed field to a request
+///
+/// @param req The request
+/// @param f   The field
+static void add_field(vector<uint8_t> &req, const string &f) {
+  uint64_t len = f.size();
+  req.insert(req.end(), (uint8_t *)&len, (uint8_t *)&len + sizeof(len));
+  req.insert(req.end(), f.begin(), f.end());
+}
+
+/// Send a request to parse_request() over a socketpair, and get the response
+///
+/// @param pri     The server's private key
+/// @param pub     The server's public key file contents
+/// @param storage The Storage object that the server uses
+/// @param req     The request
+///
+/// @return The response, up to EOF
+static vector<uint8_t> exchange(RSA *pri, const vector<uint8_t> &pub,
+                                Storage *storage, const vector<uint8_t> &req) {
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0)
+    return {};
+  // NB: The requests and responses are small enough to fit in the socket's
+  //     buffers, so one thread can play both parts
+  send_reliably(sv[0], req);
+  shutdown(sv[0], SHUT_WR);
+  parse_request(sv[1], pri, pub, storage);
+  close(sv[1]);
+  auto res = reliable_get_to_eof(sv[0]);
+  close(sv[0]);
+  return res;
+}
+
+/// Encrypt an @ablock and send it after a header block, then decrypt the
+/// response
+///
+/// @param pri     The server's private key
+/// @param pub     The server's public key file contents
+/// @param storage The Storage object that the server uses
+/// @param aeskey  The AES key and iv for the @ablock and the response
+/// @param header  Makes the header block, given the length of the @ablock
+/// @param ablock  The unencrypted @ablock
+///
+/// @return The decrypted response, or the raw response if it is not encrypted
+template <typename F>
+static string send_ablock(RSA *pri, const vector<uint8_t> &pub,
+                          Storage *storage, vector<uint8_t> aeskey, F header,
+                          const vector<uint8_t> &ablock) {
+  EVP_CIPHER_CTX *ctx = create_aes_context(aeskey, true);
+  ContextManager c([&]() { reclaim_aes_context(ctx); });
+  auto enc = aes_crypt_msg(ctx, ablock);
+  auto req = header(enc.size());
+  req.insert(req.end(), enc.begin(), enc.end());
+  auto res = exchange(pri, pub, storage, req);
+  // NB: An encrypted response is a whole number of AES blocks, and none of the
+  //     unencrypted errors is
+  if (res.size() % AES_IVSIZE != 0)
+    return string(res.begin(), res.end());
+  reset_aes_context(ctx, aeskey, false);
+  auto dec = aes_crypt_msg(ctx, res);
+  return string(dec.begin(), dec.end());
+}
+
+/// Send a request with an @rblock
+///
+/// @param pri     The server's private key
+/// @param pub     The server's public key file contents
+/// @param storage The Storage object that the server uses
+/// @param cmd     The name of the request
+/// @param ablock  The unencrypted @ablock
+///
+/// @return The decrypted response
+static string rsa_request(RSA *pri, const vector<uint8_t> &pub,
+                          Storage *storage, string_view cmd,
+                          const vector<uint8_t> &ablock) {
+  auto aeskey = create_aes_key();
+  return send_ablock(
+      pri, pub, storage, aeskey,
+      [&](uint64_t len) {
+        vector<uint8_t> rblock(LEN_RBLOCK_CONTENT);
+        RAND_bytes(rblock.data(), rblock.size());
+        memcpy(rblock.data(), cmd.data(), cmd.size());
+        memcpy(rblock.data() + cmd.size(), aeskey.data(), aeskey.size());
+        memcpy(rblock.data() + cmd.size() + aeskey.size(), &len, sizeof(len));
+        vector<uint8_t> block(RSA_size(pri));
+        RSA_public_encrypt(rblock.size(), rblock.data(), block.data(), pri,
+                           RSA_PKCS1_OAEP_PADDING);
+        return block;
+      },
+      ablock);
+}
+
+/// Send a request with an @sblock
+///
+/// @param pri     The server's private key
+/// @param pub     The server's public key file contents
+/// @param storage The Storage object that the server uses
+/// @param sid     The session's id
+/// @param key     The session's key
+/// @param cmd     The name of the request
+/// @param fields  The request's fields
+///
+/// @return The decrypted response
+static string ses_request(RSA *pri, const vector<uint8_t> &pub,
+                          Storage *storage, const string &sid,
+                          const string &key, string_view cmd,
+                          const vector<uint8_t> &fields) {
+  vector<uint8_t> aeskey(key.begin(), key.end()), iv(AES_IVSIZE);
+  RAND_bytes(iv.data(), iv.size());
+  aeskey.insert(aeskey.end(), iv.begin(), iv.end());
+  vector<uint8_t> ablock(cmd.begin(), cmd.end());
+  ablock.insert(ablock.end(), fields.begin(), fields.end());
+  return send_ablock(
+      pri, pub, storage, aeskey,
+      [&](uint64_t len) {
+        vector<uint8_t> block(LEN_RKBLOCK, 0);
+        size_t at = 0;
+        for (string_view part : {REQ_SRQ, string_view(sid),
+                                 string_view((char *)iv.data(), iv.size()),
+                                 string_view((char *)&len, sizeof(len))}) {
+          memcpy(block.data() + at, part.data(), part.size());
+          at += part.size();
+        }
+        return block;
+      },
+      ablock);
+}
+
+/// Make the fields of a GET request
+///
+/// @param user The user making the request
+/// @param pass The user's password
+/// @param who  The user whose profile file to get
+///
+/// @return The fields
+static vector<uint8_t> get_fields(const string &user, const string &pass,
+                                  const string &who) {
+  vector<uint8_t> req;
+  add_field(req, user);
+  add_field(req, pass);
+  add_field(req, who);
+  return req;
+}
+
+int main() {
+  char dir[] = "/tmp/sessions_test.XXXXXX";
+  if (mkdtemp(dir) == nullptr)
+    return 1;
+  ContextManager rmdir([&]() {
+    if (system(("rm -rf " + string(dir)).c_str()) != 0)
+      cout << "could not remove " << dir << endl;
+  });
+
+  RSA *pri = init_RSA(string(dir) + "/rsa");
+  if (pri == nullptr)
+    return 1;
+  ContextManager r([&]() { RSA_free(pri); });
+  auto pub = load_entire_file(string(dir) + "/rsa.pub");
+
+  Storage *storage = storage_factory(string(dir) + "/company.dir", 16, 1048576,
+                                     1048576, 128, 60, 4, "alice");
+  ContextManager s([&]() { delete storage; });
+  storage->load_file();
+  string profile = "alice's profile file";
+  storage->add_user("alice", "alice_is_awesome");
+  storage->add_user("bob", "bob_is_the_best");
+  storage->set_user_data("alice", "alice_is_awesome",
+                         vector<uint8_t>(profile.begin(), profile.end()));
+
+  session_cache sessions(16, 60);
+  set_session_cache(&sessions);
+
+  // Open a session for alice
+  vector<uint8_t> login;
+  add_field(login, "alice");
+  add_field(login, "alice_is_awesome");
+  auto res = rsa_request(pri, pub, storage, REQ_SES, login);
+  size_t at = RES_OK.size() + sizeof(uint64_t);
+  bool opened = res.compare(0, RES_OK.size(), RES_OK) == 0 &&
+                res.size() == at + LEN_SESSION_ID + AES_KEYSIZE + 8;
+  check("SESSION_ opens a session", opened);
+  if (!opened)
+    return 1;
+  string sid = res.substr(at, LEN_SESSION_ID);
+  string key = res.substr(at + LEN_SESSION_ID, AES_KEYSIZE);
+
+  // GET over the session
+  res = ses_request(pri, pub, storage, sid, key, REQ_GET,
+                    get_fields("alice", "alice_is_awesome", "alice"));
+  uint64_t len = profile.size();
+  check("GETPFILE over the session returns the profile file",
+        res == string(RES_OK) + string((char *)&len, sizeof(len)) + profile);
+
+  // The session belongs to alice, so bob may not use it, even with his own
+  // password
+  res = ses_request(pri, pub, storage, sid, key, REQ_GET,
+                    get_fields("bob", "bob_is_the_best", "alice"));
+  check("another user's request over the session is refused",
+        res == RES_ERR_LOGIN);
+
+  // The password is still checked on every request
+  res = ses_request(pri, pub, storage, sid, key, REQ_GET,
+                    get_fields("alice", "not_alice_password", "alice"));
+  check("a bad password over the session is refused", res == RES_ERR_LOGIN);
+
+  // SESSION_ can't be sent in a session
+  res = ses_request(pri, pub, storage, sid, key, REQ_SES, login);
+  check("SESSION_ over the session is refused", res == RES_ERR_INV_CMD);
+
+  // A session that does not exist
+  string bad(LEN_SESSION_ID, 'x');
+  res = ses_request(pri, pub, storage, bad, key, REQ_GET,
+                    get_fields("alice", "alice_is_awesome", "alice"));
+  check("an unknown session is refused", res == RES_ERR_SESSION);
+
+  // The same GET still works with an @rblock
+  res = rsa_request(pri, pub, storage, REQ_GET,
+                    get_fields("alice", "alice_is_awesome", "alice"));
+  check("GETPFILE with an rblock returns the profile file",
+        res == string(RES_OK) + string((char *)&len, sizeof(len)) + profile);
+
+  // REGISTER, with an rblock, since a new user has no session
+  vector<uint8_t> reg;
+  add_field(reg, "carol");
+  add_field(reg, "carol_pass");
+  res = rsa_request(pri, pub, storage, REQ_REG, reg);
+  check("REGISTER adds a user", res == RES_OK);
+  res = rsa_request(pri, pub, storage, REQ_REG, reg);
+  check("REGISTER of an existing user is refused",
+        res == RES_ERR_USER_EXISTS);
+
+  // SETPFILE over the session, and then GET the new profile file
+  string next = "alice's new profile file";
+  vector<uint8_t> set = login;
+  add_field(set, next);
+  res = ses_request(pri, pub, storage, sid, key, REQ_SET, set);
+  check("SETPFILE over the session succeeds", res == RES_OK);
+  res = rsa_request(pri, pub, storage, REQ_GET,
+                    get_fields("bob", "bob_is_the_best", "alice"));
+  len = next.size();
+  check("GETPFILE returns the profile file that was set",
+        res == string(RES_OK) + string((char *)&len, sizeof(len)) + next);
+
+  // ALLUSERS over the session lists every user, in any order
+  res = ses_request(pri, pub, storage, sid, key, REQ_ALL, login);
+  vector<string> names;
+  if (res.compare(0, RES_OK.size(), RES_OK) == 0 && res.size() >= at) {
+    stringstream list(res.substr(at));
+    for (string name; getline(list, name);)
+      names.push_back(name);
+  }
+  sort(names.begin(), names.end());
+  check("ALLUSERS over the session lists every user",
+        names == vector<string>{"alice", "bob", "carol"});
+
+  // PERSIST_ replies with a bare OK, and SAVSTAT_ reports the checkpoint that
+  // it started
+  res = rsa_request(pri, pub, storage, REQ_SAV, login);
+  check("PERSIST_ replies with a bare OK", res == RES_OK);
+  res = rsa_request(pri, pub, storage, REQ_SST, login);
+  uint64_t requested = 0;
+  if (res.size() == at + 4 * sizeof(uint64_t))
+    memcpy(&requested, res.data() + at, sizeof(requested));
+  check("SAVSTAT_ reports the checkpoint that PERSIST_ started",
+        requested == 1);
+
+  // EXIT____ only stops the server if the user authenticates
+  vector<uint8_t> bye;
+  add_field(bye, "alice");
+  add_field(bye, "not_alice_password");
+  res = rsa_request(pri, pub, storage, REQ_BYE, bye);
+  check("EXIT____ with a bad password is refused", res == RES_ERR_LOGIN);
+
+  storage->shutdown();
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,541 @@
+// Check MyStorage through the Storage interface, without a network: the order
+// of the usernames that USRRANGE returns, with one shared table and with
+// shards, and after the users are saved and loaded again; that the log brings
+// back every acknowledged change after a crash; and that every layout of the
+// data file (see format.h) loads back what was saved.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <dirent.h>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "../common/contextmanager.h"
+#include "../common/file.h"
+#include "../common/protocol.h"
+#include "../server/format.h"
+#include "../server/storage.h"
+#include "../server/wal.h"
+
+using namespace std;
+
+/// The number of checks that failed
+static int failures = 0;
+
+/// Report the outcome of one check
+///
+/// @param what A description of the check
+/// @param ok   true if the check passed
+static void check(const string &what, bool ok) {
+  cout << (ok ? "PASS " : "FAIL ") << what << endl;
+  failures += ok ? 0 : 1;
+}
+
+/// The number of threads that call into a Storage object at once
+static const size_t THREADS = 4;
+
+/// Create a Storage object, and load its file
+///
+/// @param file   The name of the file to use for persistence
+/// @param shards The number of shards, or 0 for one shared table
+/// @param wal    The fsync policy of the log, or -2 to keep no log
+/// @param seg    true to save as a manifest plus segment files
+/// @param lazy   true to read profile files when they are first needed
+///
+/// @return The Storage object, or nullptr if its file could not be loaded
+static Storage *open_storage(const string &file, size_t shards, int wal = -2,
+                             bool seg = false, bool lazy = false) {
+  Storage *s =
+      storage_factory(file, 64, 1048576, 1048576, 1024, 60, 4, "admin", shards,
+                      THREADS + 1, 0, 0, 0, wal, lazy, seg);
+  if (!s->load_file().succeeded) {
+    delete s;
+    return nullptr;
+  }
+  return s;
+}
+
+/// Make the name and password of the i-th user
+///
+/// @param i The index of the user
+///
+/// @return The name of the user, which is also the user's password
+static string user_of(size_t i) {
+  char name[32];
+  snprintf(name, sizeof(name), "user%04zu", i);
+  return name;
+}
+
+/// Join some usernames into the form that get_user_range() returns
+///
+/// @param from The index of the first user
+/// @param to   The index after the last user
+///
+/// @return The names, separated by newlines
+static string user_list(size_t from, size_t to) {
+  string out;
+  for (size_t i = from; i < to; ++i)
+    out += (i == from ? "" : "\n") + user_of(i);
+  return out;
+}
+
+/// Get a range of usernames from a Storage object
+///
+/// @param s    The Storage object
+/// @param from The smallest username to return
+/// @param to   The first username past the end of the range, or empty
+///
+/// @return The names, separated by newlines, or "ERR" and the error
+static string get_range(Storage *s, const string &from, const string &to) {
+  auto res = s->get_user_range(user_of(0), user_of(0), from, to);
+  if (!res.succeeded)
+    return "ERR " + res.msg;
+  return string(res.data.begin(), res.data.end());
+}
+
+/// Check that USRRANGE returns usernames in sorted order, no matter what order
+/// they were registered in, or which shard holds them
+///
+/// @param dir    The directory in which to keep the data file
+/// @param shards The number of shards, or 0 for one shared table
+static void check_range(const string &dir, size_t shards) {
+  const size_t USERS = 1000;
+  string file = dir + "/range" + to_string(shards) + ".dir";
+  string mode = shards ? " (with shards)" : "";
+  Storage *s = open_storage(file, shards);
+  if (s == nullptr) {
+    check("load a new data file" + mode, false);
+    return;
+  }
+  // Register the users in a scrambled order, from several threads at once
+  vector<thread> workers;
+  for (size_t t = 0; t < THREADS; ++t)
+    workers.emplace_back([&, t]() {
+      for (size_t i = t; i < USERS; i += THREADS) {
+        string u = user_of((i * 7919) % USERS);
+        s->add_user(u, u);
+      }
+    });
+  for (auto &w : workers)
+    w.join();
+
+  check("USRRANGE with no bounds lists every user in order" + mode,
+        get_range(s, "", "") == user_list(0, USERS));
+  check("USRRANGE includes its lower bound and excludes its upper one" + mode,
+        get_range(s, user_of(100), user_of(200)) == user_list(100, 200));
+  check("USRRANGE bounds need not be users" + mode,
+        get_range(s, user_of(100) + "a", user_of(102) + "a") ==
+            user_list(101, 103));
+  check("USRRANGE past the last user is empty" + mode,
+        get_range(s, "z", "").empty());
+  auto res = s->get_user_range(user_of(0), "wrong", "", "");
+  check("USRRANGE with a bad password is refused" + mode,
+        !res.succeeded && res.msg == RES_ERR_LOGIN);
+
+  // The index is rebuilt when the file is loaded again
+  bool saved = s->save_file().succeeded;
+  delete s;
+  s = saved ? open_storage(file, shards) : nullptr;
+  check("USRRANGE lists every user in order after a reload" + mode,
+        s != nullptr && get_range(s, "", "") == user_list(0, USERS));
+  delete s;
+}
+
+/// Make the profile file that a user has after some number of SETs
+///
+/// @param i    The index of the user
+/// @param sets The number of SETs, which must be at least 1
+///
+/// @return The profile file
+static vector<uint8_t> profile_of(size_t i, size_t sets) {
+  string p = user_of(i) + " set " + to_string(sets) + string(i % 300, '.');
+  return vector<uint8_t>(p.begin(), p.end());
+}
+
+/// Register some users and set their profile files, from several threads
+///
+/// @param s    The Storage object
+/// @param from The index of the first user
+/// @param to   The index after the last user
+/// @param sets The number of times to set each user's profile file
+static void add_users(Storage *s, size_t from, size_t to, size_t sets) {
+  vector<thread> workers;
+  for (size_t t = 0; t < THREADS; ++t)
+    workers.emplace_back([=]() {
+      for (size_t i = from + t; i < to; i += THREADS) {
+        s->add_user(user_of(i), user_of(i));
+        for (size_t k = 1; k <= sets; ++k)
+          s->set_user_data(user_of(i), user_of(i), profile_of(i, k));
+      }
+    });
+  for (auto &w : workers)
+    w.join();
+}
+
+/// Count the users who do not have the profile file that they should have
+///
+/// @param s    The Storage object
+/// @param from The index of the first user
+/// @param to   The index after the last user
+/// @param sets The number of times that each user's profile file was set
+///
+/// @return The number of users who are missing or have the wrong file
+static size_t count_wrong(Storage *s, size_t from, size_t to, size_t sets) {
+  size_t wrong = 0;
+  for (size_t i = from; i < to; ++i) {
+    auto res = s->get_user_data(user_of(i), user_of(i), user_of(i));
+    wrong += res.succeeded && res.data == profile_of(i, sets) ? 0 : 1;
+  }
+  return wrong;
+}
+
+/// Run some code in a child process, which then exits without shutting down
+/// or saving anything, as if the server had crashed
+///
+/// @param f The code to run
+///
+/// @return true if the child exited normally
+static bool crash_after(function<void()> f) {
+  pid_t pid = fork();
+  if (pid == 0) {
+    f();
+    _exit(0);
+  }
+  int status;
+  return waitpid(pid, &status, 0) == pid && WIFEXITED(status) &&
+         WEXITSTATUS(status) == 0;
+}
+
+/// Check that the log brings back every change that was acknowledged before a
+/// crash, whether or not there was a save before it, and that a record that
+/// was cut short by the crash is ignored
+///
+/// @param dir The directory in which to keep the data file
+static void check_wal(const string &dir) {
+  // NB: With an fsync policy of 0, a change is only acknowledged once it is on
+  //     disk, so every change must survive
+  string file = dir + "/wal.dir";
+  bool ran = crash_after([&]() {
+    Storage *s = open_storage(file, 0, 0);
+    if (s != nullptr)
+      add_users(s, 0, 200, 2);
+  });
+  Storage *s = ran ? open_storage(file, 0, 0) : nullptr;
+  check("REG and SET are replayed from the log after a crash",
+        s != nullptr && count_wrong(s, 0, 200, 2) == 0);
+  if (s == nullptr)
+    return;
+
+  // A save starts a new generation of the log, and removes the older ones
+  bool saved = s->save_file().succeeded;
+  check("a save removes the log generations that it covers",
+        saved && wal_t::generations(file).size() == 1);
+  delete s;
+  ran = crash_after([&]() {
+    Storage *s = open_storage(file, 0, 0);
+    if (s != nullptr)
+      add_users(s, 200, 400, 1);
+  });
+  s = ran ? open_storage(file, 0, 0) : nullptr;
+  check("the log is replayed on top of the data file after a crash",
+        s != nullptr && count_wrong(s, 0, 200, 2) == 0 &&
+            count_wrong(s, 200, 400, 1) == 0);
+  delete s;
+
+  // Cut the last record of the log short, as a crash in the middle of a write
+  // would
+  file = dir + "/torn.dir";
+  ran = crash_after([&]() {
+    Storage *s = open_storage(file, 0, 0);
+    for (size_t i = 0; s != nullptr && i < 10; ++i)
+      s->add_user(user_of(i), user_of(i));
+  });
+  auto gens = wal_t::generations(file);
+  string log = gens.empty() ? "" : wal_t::name(file, gens.back());
+  size_t size = log.empty() ? 0 : load_entire_file(log).size();
+  ran = ran && size > sizeof(uint64_t) &&
+        truncate(log.c_str(), size - sizeof(uint64_t)) == 0;
+  s = ran ? open_storage(file, 0, 0) : nullptr;
+  size_t found = 0;
+  for (size_t i = 0; s != nullptr && i < 10; ++i)
+    found += s->auth(user_of(i), user_of(i)).succeeded ? 1 << i : 0;
+  check("a torn record at the end of the log is ignored",
+        s != nullptr && found == (1 << 9) - 1);
+  delete s;
+}
+
+/// Set the profile files of some users
+///
+/// @param s    The Storage object
+/// @param from The index of the first user
+/// @param to   The index after the last user
+/// @param sets The number of the SET, which picks each user's new profile file
+static void set_users(Storage *s, size_t from, size_t to, size_t sets) {
+  for (size_t i = from; i < to; ++i)
+    s->set_user_data(user_of(i), user_of(i), profile_of(i, sets));
+}
+
+/// Find the segment files of a data file
+///
+/// @param file The name of the data file
+///
+/// @return The names of the segment files, relative to the data file's
+///         directory
+static vector<string> segments_of(const string &file) {
+  size_t slash = file.rfind('/');
+  string prefix = file.substr(slash + 1) + ".seg.";
+  vector<string> segs;
+  DIR *d = opendir(file.substr(0, slash).c_str());
+  for (dirent *ent; d != nullptr && (ent = readdir(d)) != nullptr;)
+    if (string(ent->d_name).compare(0, prefix.size(), prefix) == 0)
+      segs.push_back(ent->d_name);
+  if (d != nullptr)
+    closedir(d);
+  sort(segs.begin(), segs.end());
+  return segs;
+}
+
+/// Check if a file starts with an 8-byte code
+///
+/// @param file The name of the file
+/// @param code The code
+///
+/// @return true if the file starts with code
+static bool starts_with(const string &file, const string &code) {
+  auto bytes = load_entire_file(file);
+  return bytes.size() >= code.size() &&
+         string(bytes.begin(), bytes.begin() + code.size()) == code;
+}
+
+/// Check that a save writes a single file by default, and a manifest plus
+/// segment files when segmented saves are on, and that either loads back every
+/// user, no matter which kind of save the loading storage would write
+///
+/// @param dir The directory in which to keep the data files
+static void check_segments(const string &dir) {
+  const size_t USERS = 300, SHARED = 20;
+  // Fill a storage, in which the last few users share one profile file, and
+  // save it
+  auto fill = [&](const string &file, bool seg) {
+    Storage *s = open_storage(file, 0, -2, seg);
+    if (s == nullptr)
+      return false;
+    add_users(s, 0, USERS, 2);
+    for (size_t i = USERS - SHARED; i < USERS; ++i)
+      s->set_user_data(user_of(i), user_of(i), profile_of(0, 3));
+    bool ok = s->save_file().succeeded;
+    delete s;
+    return ok;
+  };
+  // Check that a storage has every user that fill() made
+  auto complete = [&](Storage *s) {
+    size_t wrong = count_wrong(s, 0, USERS - SHARED, 2);
+    for (size_t i = USERS - SHARED; i < USERS; ++i) {
+      auto res = s->get_user_data(user_of(i), user_of(i), user_of(i));
+      wrong += res.succeeded && res.data == profile_of(0, 3) ? 0 : 1;
+    }
+    return wrong == 0;
+  };
+  // Load a data file, and check that it has every user
+  auto reload = [&](const string &file, bool seg) {
+    Storage *s = open_storage(file, 0, -2, seg);
+    bool ok = s != nullptr && complete(s);
+    delete s;
+    return ok;
+  };
+
+  string single = dir + "/single.dir";
+  bool ok = fill(single, false);
+  check("a save writes a single file of entries by default",
+        ok && !starts_with(single, MANIFESTENTRY) &&
+            segments_of(single).empty());
+  check("a single-file save loads back every user", reload(single, false));
+
+  string seg = dir + "/seg.dir";
+  ok = fill(seg, true);
+  auto segs = segments_of(seg);
+  check("a segmented save writes a manifest and segment files",
+        ok && starts_with(seg, MANIFESTENTRY) && !segs.empty());
+  check("a segmented save loads back every user", reload(seg, true));
+  check("a manifest loads without segmented saves", reload(seg, false));
+
+  // A single-file save replaces the manifest, and removes its segments
+  Storage *s = open_storage(seg, 0, -2, false);
+  ok = s != nullptr && s->save_file().succeeded;
+  delete s;
+  check("a single-file save removes the segments of a manifest",
+        ok && !starts_with(seg, MANIFESTENTRY) && segments_of(seg).empty() &&
+            reload(seg, true));
+}
+
+/// Check that the CRC32C checksums of an indexed segment catch a corrupt
+/// profile file or index entry, when the segment is loaded, or (if profile
+/// files are loaded lazily) when the profile file is first read
+///
+/// @param dir The directory in which to keep the data file
+static void check_checksums(const string &dir) {
+  const size_t USERS = 50;
+  string file = dir + "/crc.dir";
+  Storage *s = open_storage(file, 0, -2, true);
+  bool ok = s != nullptr;
+  if (ok) {
+    add_users(s, 0, USERS, 2);
+    ok = s->save_file().succeeded;
+  }
+  delete s;
+  auto segs = segments_of(file);
+  string seg = segs.empty() ? "" : dir + "/" + segs[0];
+  check("a segmented save writes indexed segments",
+        ok && segs.size() == 1 && starts_with(seg, INDEXEDHEADER));
+  if (!ok || segs.size() != 1)
+    return;
+
+  // Flip one bit of a segment at some offset, load it, and put the bit back
+  auto good = load_entire_file(seg);
+  auto corrupt = [&](size_t at, auto &&f) {
+    auto bad = good;
+    bad[at] ^= 1;
+    write_file(seg, bad, 0);
+    f();
+    write_file(seg, good, 0);
+  };
+  // Find where some bytes are in the segment
+  auto find_bytes = [&](const string &what) {
+    auto it = search(good.begin(), good.end(), what.begin(), what.end());
+    return it == good.end() ? 0 : it - good.begin();
+  };
+  auto profile = profile_of(7, 2);
+  size_t content = find_bytes(string(profile.begin(), profile.end()));
+  size_t entry = find_bytes(INDEXENTRY);
+  if (content == 0 || entry == 0) {
+    check("find a profile file and an index entry in the segment", false);
+    return;
+  }
+
+  corrupt(content + 3, [&]() {
+    s = open_storage(file, 0, -2, true);
+    check("a corrupt profile file fails the load", s == nullptr);
+    delete s;
+    s = open_storage(file, 0, -2, true, true);
+    check("a corrupt profile file fails its first read, if it is lazy",
+          s != nullptr &&
+              !s->get_user_data(user_of(0), user_of(0), user_of(7)).succeeded &&
+              count_wrong(s, 8, USERS, 2) == 0);
+    delete s;
+  });
+  // NB: This changes a byte of the first user's name, which only the index
+  //     entry's checksum can catch
+  corrupt(entry + INDEXENTRY.size() + sizeof(uint64_t) + 2, [&]() {
+    s = open_storage(file, 0, -2, true);
+    check("a corrupt index entry fails the load", s == nullptr);
+    delete s;
+  });
+  corrupt(good.size() - INDEXEDFOOTER.size() - 20, [&]() {
+    s = open_storage(file, 0, -2, true);
+    check("a corrupt footer fails the load", s == nullptr);
+    delete s;
+  });
+  s = open_storage(file, 0, -2, true);
+  check("the segment loads once it is intact again",
+        s != nullptr && count_wrong(s, 0, USERS, 2) == 0);
+  delete s;
+}
+
+/// Check that a segmented save writes only the users who changed, as delta
+/// segments, that the newest change to each user is the one that loads, and
+/// that the deltas are compacted into a new base once there are enough of them.
+/// Without segmented saves, no deltas are written.
+///
+/// @param dir The directory in which to keep the data files
+static void check_deltas(const string &dir) {
+  // NB: MyStorage compacts once there are more than 16 deltas
+  const size_t USERS = 100, MAX_DELTAS = 16;
+  string file = dir + "/delta.dir";
+  Storage *s = open_storage(file, 0, -2, true);
+  if (s == nullptr) {
+    check("load a new data file", false);
+    return;
+  }
+  // Count the delta segments of the data file
+  auto deltas = [&]() {
+    size_t n = 0;
+    for (auto &seg : segments_of(file))
+      n += starts_with(dir + "/" + seg, DELTAHEADER) ? 1 : 0;
+    return n;
+  };
+  add_users(s, 0, USERS, 1);
+  bool ok = s->save_file().succeeded;
+  size_t base = segments_of(file).size();
+  set_users(s, 0, 10, 2);
+  add_users(s, USERS, USERS + 20, 1);
+  ok = ok && s->save_file().succeeded;
+  check("a segmented save writes the changed users as a delta",
+        ok && deltas() == 1 && segments_of(file).size() == base + 1);
+  set_users(s, 0, 5, 3);
+  ok = ok && s->save_file().succeeded && s->save_file().succeeded;
+  check("a save with no changes writes no delta", ok && deltas() == 2);
+  delete s;
+  s = open_storage(file, 0, -2, true);
+  check("the newest delta wins when the data file is loaded",
+        s != nullptr && count_wrong(s, 0, 5, 3) == 0 &&
+            count_wrong(s, 5, 10, 2) == 0 &&
+            count_wrong(s, 10, USERS + 20, 1) == 0);
+
+  // Enough deltas schedule a compaction in the background, which leaves one
+  // new base.  No more changes are made once it is scheduled, so that no new
+  // deltas follow it.
+  size_t changed = 0;
+  for (; s != nullptr && changed < USERS && deltas() <= MAX_DELTAS; ++changed) {
+    set_users(s, changed, changed + 1, 4);
+    s->save_file();
+  }
+  for (size_t ms = 0; ms < 5000 && deltas() > 0; ms += 10)
+    this_thread::sleep_for(chrono::milliseconds(10));
+  check("the deltas are compacted into a new base",
+        s != nullptr && deltas() == 0 && !segments_of(file).empty());
+  delete s;
+  s = open_storage(file, 0, -2, true);
+  check("a compacted base loads back every user",
+        s != nullptr && count_wrong(s, 0, changed, 4) == 0 &&
+            count_wrong(s, changed, USERS + 20, 1) == 0);
+  delete s;
+
+  // Without segmented saves, every save writes the whole file
+  file = dir + "/nodelta.dir";
+  s = open_storage(file, 0, -2, false);
+  ok = s != nullptr;
+  if (ok) {
+    add_users(s, 0, USERS, 1);
+    ok = s->save_file().succeeded;
+    set_users(s, 0, 10, 2);
+    ok = ok && s->save_file().succeeded;
+  }
+  delete s;
+  check("a single-file save writes no deltas",
+        ok && segments_of(file).empty() && !starts_with(file, MANIFESTENTRY));
+}
+
+int main() {
+  char dir[] = "/tmp/storage_test.XXXXXX";
+  if (mkdtemp(dir) == nullptr)
+    return 1;
+  ContextManager rmdir([&]() {
+    if (system(("rm -rf " + string(dir)).c_str()) != 0)
+      cout << "could not remove " << dir << endl;
+  });
+
+  check_range(dir, 0);
+  check_range(dir, 3);
+  check_wal(dir);
+  check_segments(dir);
+  check_checksums(dir);
+  check_deltas(dir);
+  return failures == 0 ? 0 : 1;
+}